@@ -1889,6 +1889,13 @@ void draw_imgui() {
         } else {
             // Editable text field for room name
             ImGui::InputText("##name", g_new_room_set_through_gui.name, sizeof(g_new_room_set_through_gui.name), ImGuiInputTextFlags_None);
+
+            int64_t delay_buffer_size = ulnet_room_delay_buffer_size(&g_new_room_set_through_gui);
+            int64_t min_delay_buffer_size = ULNET_DELAY_BUFFER_SIZE;
+            int64_t max_delay_buffer_size = ULNET_DELAY_BUFFER_SIZE_MAX;
+            if (ImGui::SliderScalar("Delay Buffer Frames", ImGuiDataType_S64, &delay_buffer_size, &min_delay_buffer_size, &max_delay_buffer_size, "%lld", ImGuiSliderFlags_None)) {
+                ulnet_room_set_delay_buffer_size(&g_new_room_set_through_gui, delay_buffer_size);
+            }
         }
     }
 
@@ -1951,10 +1958,10 @@ void draw_imgui() {
                     }
                 }
 
-                char buffer_depth[ULNET_DELAY_BUFFER_SIZE] = {0};
+                char buffer_depth[ULNET_DELAY_BUFFER_SIZE_MAX] = {0};
 
                 int64_t peer_num_frames_ahead = g_ulnet_session.state[p].frame - g_ulnet_session.frame_counter;
-                for (int f = 0; f < sizeof(buffer_depth)-1; f++) {
+                for (int f = 0; f < ulnet_delay_buffer_size(&g_ulnet_session)-1; f++) {
                     buffer_depth[f] = f < peer_num_frames_ahead ? 'X' : 'O';
                 }
 
@@ -2047,6 +2054,8 @@ void draw_imgui() {
             sam2_room_make_message_t request = { SAM2_MAKE_HEADER };
             request.room = g_new_room_set_through_gui;
             request.room.flags |= SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+            ulnet_room_set_protocol_version(&request.room, SAM2_VERSION_MINOR);
+            ulnet_room_set_save_state_hash_algorithm(&request.room, ULNET_SAVE_STATE_HASH_XXH3);
             g_libretro_context.SAM2Send((char *) &request);
         }
         if (ImGui::Button(g_is_refreshing_rooms ? "Stop" : "Refresh")) {
@@ -2292,10 +2301,11 @@ finished_drawing_sam2_interface:
 
         {
             int64_t min_delay_frames = 0;
-            int64_t max_delay_frames = ULNET_DELAY_BUFFER_SIZE/2-1;
+            int64_t max_delay_frames = ulnet_delay_frames_max(&g_ulnet_session);
             if (ImGui::SliderScalar("Network Buffered Frames", ImGuiDataType_S64, &g_ulnet_session.delay_frames, &min_delay_frames, &max_delay_frames, "%lld", ImGuiSliderFlags_None)) {
+                g_ulnet_session.flags &= ~ULNET_SESSION_FLAG_ADAPTIVE_DELAY; // Picking a delay by hand overrides the automatic one
                 strcpy(g_ulnet_session.next_core_option.key, "netplay_delay_frames");
-                snprintf(g_ulnet_session.next_core_option.value, sizeof(g_ulnet_session.next_core_option.value), "%" PRIx64, g_ulnet_session.delay_frames);
+                snprintf(g_ulnet_session.next_core_option.value, sizeof(g_ulnet_session.next_core_option.value), "%" PRId64, g_ulnet_session.delay_frames);
             }
         }
 
@@ -3628,12 +3638,23 @@ int main(int argc, char *argv[]) {
             g_headless = true;
         } else if (0 == strcmp("--no-netimgui", argv[i])) {
             no_netimgui = true;
+        } else if (0 == strcmp("--rollback", argv[i])) {
+            if (i + 1 >= argc) {
+                SAM2_LOG_FATAL("Usage: --rollback <frames>");
+            }
+            g_ulnet_session.rollback_frames_max = atoi(argv[++i]);
+        } else if (0 == strcmp("--delay-buffer", argv[i])) {
+            if (i + 1 >= argc) {
+                SAM2_LOG_FATAL("Usage: --delay-buffer <frames>");
+            }
+            ulnet_room_set_delay_buffer_size(&g_new_room_set_through_gui, atoi(argv[++i]));
         } else if (0 == strcmp("--test", argv[i])) {
             int num_failed_tests = 0;
 
             SAM2_LOG_INFO("Running tests...");
             num_failed_tests += sam2_test_all();
             num_failed_tests += ulnet_test_inproc(NULL, NULL);
+            num_failed_tests += ulnet_test_rollback();
             if (num_failed_tests > 0) {
                 SAM2_LOG_ERROR("Failed to run all inproc tests, please fix them before running the core");
             } else {
@@ -3764,6 +3785,8 @@ int main(int argc, char *argv[]) {
     }
 
     g_ulnet_session.flags |= ULNET_SESSION_FLAG_DRAW_IMGUI;
+    g_ulnet_session.flags |= ULNET_SESSION_FLAG_DELAY_BASED_PACING;
+    g_ulnet_session.flags |= ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC;
 
     if (!g_headless) {
         // Setup Platform/Renderer backends
@@ -3852,7 +3875,7 @@ int main(int argc, char *argv[]) {
         clock_gettime(CLOCK_MONOTONIC, &start_time);
 #endif
 
-        g_core_wants_tick_in_milliseconds[g_main_loop_cyclic_offset] = core_wants_tick_in_seconds(g_ulnet_session.core_wants_tick_at_unix_usec) * 1000.0;
+        g_core_wants_tick_in_milliseconds[g_main_loop_cyclic_offset] = core_wants_tick_in_seconds(g_ulnet_session.frame_pacer.tick_at_usec) * 1000.0;
 
         if (!g_headless && !NetImgui::IsConnected()) {
             ImGui_ImplOpenGL3_NewFrame();
@@ -161,6 +161,7 @@ int ulnet_test_ice(ulnet_session_t **session_1_out, ulnet_session_t **session_2_
         goto _10;
     }
 
+    uint16_t hello_sequence = sessions[1]->reliable_tx_next_seq[SAM2_AUTHORITY_INDEX]; // The spectator may have already sent its baseline advert
     sessions[0]->debug_udp_recv_drop_rate = 1.0f;
     ulnet_reliable_send(sessions[1], SAM2_AUTHORITY_INDEX, (const uint8_t*) "HELLO", sizeof("HELLO") - 1); // DROP
     sessions[0]->debug_udp_recv_drop_rate = 0.0f;
@@ -178,8 +179,8 @@ int ulnet_test_ice(ulnet_session_t **session_1_out, ulnet_session_t **session_2_
         ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3);
     }
 #endif
-    ulnet_reliable_packet_t *msg1 = (ulnet_reliable_packet_t *) arena_deref(&sessions[0]->arena, sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][0]);
-    ulnet_reliable_packet_t *msg2 = (ulnet_reliable_packet_t *) arena_deref(&sessions[0]->arena, sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][1]);
+    ulnet_reliable_packet_t *msg1 = (ulnet_reliable_packet_t *) arena_deref(&sessions[0]->arena, sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][(hello_sequence + 0) % ULNET_RELIABLE_ACK_BUFFER_SIZE]);
+    ulnet_reliable_packet_t *msg2 = (ulnet_reliable_packet_t *) arena_deref(&sessions[0]->arena, sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][(hello_sequence + 1) % ULNET_RELIABLE_ACK_BUFFER_SIZE]);
 
     if (!(   msg1 && memcmp(msg1->payload, "HELLO", sizeof("HELLO") - 1) == 0
           && msg2 && memcmp(msg2->payload, "WORLD", sizeof("WORLD") - 1) == 0)) {
@@ -192,9 +193,11 @@ _10:sam2_server_destroy(server);
 
     if (sessions[0]) {
         ulnet_session_tear_down(sessions[0]);
+        ulnet_session_release_save_state_buffers(sessions[0]);
     }
     if (sessions[1]) {
         ulnet_session_tear_down(sessions[1]);
+        ulnet_session_release_save_state_buffers(sessions[1]);
     }
     if (!session_1_out) free(sessions[0]);
     else *session_1_out = sessions[0];
@@ -248,12 +251,12 @@ int ulnet_test_inproc(ulnet_session_t **session_1_out, ulnet_session_t **session
     sessions[0]->debug_udp_recv_drop_rate = 1.0f;
     ulnet_reliable_send(sessions[1], SAM2_AUTHORITY_INDEX, (const uint8_t*) "HELLO", sizeof("HELLO") - 1); // DROP
     sessions[0]->debug_udp_recv_drop_rate = 0.0f;
-    ulnet_reliable_send(sessions[1], SAM2_AUTHORITY_INDEX, (const uint8_t*) "WORLD", sizeof("WORLD") - 1); // (NOT SENT) added to reliable_tx_packet_history
-    ulnet_poll_session(sessions[1], 0, 0, 0, 60.0, 16e-3); // RETRANSMIT "HELLO"
-    ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3); // RECEIVE "HELLO"
-    ulnet_reliable_send_with_acks_only(sessions[0], SAM2_SPECTATOR_START, (const uint8_t*) "ACK CARRIER", sizeof("ACK CARRIER") - 1); // ACK "HELLO"
-    ulnet_poll_session(sessions[1], 0, 0, 0, 60.0, 16e-3); // RETRANSMIT "WORLD"
-    ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3); // RECEIVE "WORLD"
+    ulnet_reliable_send(sessions[1], SAM2_AUTHORITY_INDEX, (const uint8_t*) "WORLD", sizeof("WORLD") - 1); // SENT without waiting on "HELLO" to be acked
+    ulnet_poll_session(sessions[1], 0, 0, 0, 60.0, 16e-3); // RETRANSMIT "HELLO" and "WORLD"
+    ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3); // RECEIVE "HELLO" and "WORLD"
+    ulnet_reliable_send_with_acks_only(sessions[0], SAM2_SPECTATOR_START, (const uint8_t*) "ACK CARRIER", sizeof("ACK CARRIER") - 1); // ACK both
+    ulnet_poll_session(sessions[1], 0, 0, 0, 60.0, 16e-3); // Nothing left to retransmit
+    ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3);
 
     ulnet_reliable_packet_t *msg1 = (ulnet_reliable_packet_t *) arena_deref(&sessions[0]->arena, sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][0]);
     ulnet_reliable_packet_t *msg2 = (ulnet_reliable_packet_t *) arena_deref(&sessions[0]->arena, sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][1]);
@@ -268,6 +271,8 @@ int ulnet_test_inproc(ulnet_session_t **session_1_out, ulnet_session_t **session
     sessions[1]->inproc[SAM2_AUTHORITY_INDEX] = NULL;
     ulnet_session_tear_down(sessions[0]);
     ulnet_session_tear_down(sessions[1]);
+    ulnet_session_release_save_state_buffers(sessions[0]);
+    ulnet_session_release_save_state_buffers(sessions[1]);
     if (!session_1_out) free(sessions[0]);
     else *session_1_out = sessions[0];
 
@@ -277,78 +282,2844 @@ int ulnet_test_inproc(ulnet_session_t **session_1_out, ulnet_session_t **session
     return status;
 }
 
-void ulnet__bench_xxh32() {
-    const size_t test_size = 64 * 1024 * 1024;
-    const int iterations = 30;
+#define ULNET__TEST_ROLLBACK_FRAMES 240
 
-    uint8_t* test_data = malloc(test_size);
-    if (!test_data) {
-        printf("Failed to allocate test buffer\n");
-        return;
+// Minimal deterministic core whose state depends on every input it has ever seen
+typedef struct ulnet__test_core {
+    ulnet_session_t *session;
+    uint32_t state;
+    uint32_t state_history[ULNET__TEST_ROLLBACK_FRAMES + ULNET_DELAY_BUFFER_SIZE_MAX * 4];
+} ulnet__test_core_t;
+
+void ulnet__test_core_retro_run(void *user_ptr) {
+    ulnet__test_core_t *core = (ulnet__test_core_t *) user_ptr;
+    ulnet_input_state_t input_state[ULNET_PORT_COUNT] = {0};
+    ulnet_input_poll(core->session, &input_state);
+
+    core->state = ulnet_xxh32(input_state, sizeof(input_state), core->state);
+    if (core->session->frame_counter < SAM2_ARRAY_LENGTH(core->state_history)) {
+        core->state_history[core->session->frame_counter] = core->state;
     }
+}
 
-    for (size_t i = 0; i < test_size; i++) {
-        test_data[i] = (uint8_t)(i * 0x9E3779B1);
+size_t ulnet__test_core_retro_serialize_size(void *user_ptr) {
+    return sizeof(uint32_t);
+}
+
+bool ulnet__test_core_retro_serialize(void *user_ptr, void *data, size_t size) {
+    ulnet__test_core_t *core = (ulnet__test_core_t *) user_ptr;
+    memcpy(data, &core->state, sizeof(core->state));
+    return true;
+}
+
+bool ulnet__test_core_retro_unserialize(void *user_ptr, const void *data, size_t size) {
+    ulnet__test_core_t *core = (ulnet__test_core_t *) user_ptr;
+    memcpy(&core->state, data, sizeof(core->state));
+    return true;
+}
+
+// Runs an authority and a player over the inproc transport and checks their cores stayed in lockstep
+static int ulnet__test_lockstep(sam2_room_t room, int64_t delay_frames, int64_t rollback_frames_max, int64_t *rollback_count) {
+    ulnet_session_t *sessions[2] = {0};
+    ulnet__test_core_t cores[2] = {0};
+    ulnet_transport_inproc_t transport = {0};
+    int status = 0;
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i] = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+        ulnet_session_init_defaulted(sessions[i]);
+        sessions[i]->reliable_retransmit_delay_microseconds = 0;
+        sessions[i]->use_inproc_transport = true;
+        sessions[i]->delay_frames = delay_frames;
+        sessions[i]->rollback_frames_max = rollback_frames_max;
+        sessions[i]->user_ptr = &cores[i];
+        sessions[i]->retro_run = ulnet__test_core_retro_run;
+        sessions[i]->retro_serialize_size = ulnet__test_core_retro_serialize_size;
+        sessions[i]->retro_serialize = ulnet__test_core_retro_serialize;
+        sessions[i]->retro_unserialize = ulnet__test_core_retro_unserialize;
+        sessions[i]->room_we_are_in = room;
+        cores[i].session = sessions[i];
     }
 
-    // Warm up
-    volatile uint32_t dummy = 0;
-    for (int i = 0; i < 5; i++) {
-        dummy ^= ulnet_xxh32(test_data, test_size, 0);
+    sessions[0]->our_peer_id = room.peer_ids[SAM2_AUTHORITY_INDEX];
+    sessions[1]->our_peer_id = room.peer_ids[0];
+    sessions[0]->inproc[0] = &transport;
+    sessions[1]->inproc[SAM2_AUTHORITY_INDEX] = &transport;
+    sessions[0]->agent_peer_ids[0] = room.peer_ids[0];
+    sessions[1]->agent_peer_ids[SAM2_AUTHORITY_INDEX] = room.peer_ids[SAM2_AUTHORITY_INDEX];
+
+    // The player polls a third as often so the authority keeps running ahead on predicted input and has to rollback
+    uint8_t save_state[2][64]; // A worker may still be hashing what the other session serialized
+    for (int iteration = 0; iteration < 16 * ULNET__TEST_ROLLBACK_FRAMES; iteration++) {
+        if (   sessions[0]->frame_counter >= ULNET__TEST_ROLLBACK_FRAMES
+            && sessions[1]->frame_counter >= ULNET__TEST_ROLLBACK_FRAMES) {
+            break;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (i == 1 && iteration % 3 != 0) continue;
+
+            sessions[i]->next_input_state[0][0] = i == 0 ? (iteration / 5) % 2 : ((iteration / 7) % 2) << 1;
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], true, save_state[i], sizeof(save_state[i]), 60.0, 0.0);
+        }
     }
 
-    uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
-    uint32_t result = 0;
+    int64_t delay_buffer_size = ulnet_room_delay_buffer_size(&room);
+    int64_t frames_to_compare = SAM2_MIN(sessions[0]->frame_counter, sessions[1]->frame_counter) - delay_buffer_size;
+    if (frames_to_compare < ULNET__TEST_ROLLBACK_FRAMES - delay_buffer_size) {
+        SAM2_LOG_ERROR("Sessions stalled on frames %" PRId64 " and %" PRId64, sessions[0]->frame_counter, sessions[1]->frame_counter);
+        status = 1;
+    }
+
+    for (int64_t frame = 0; frame < frames_to_compare; frame++) {
+        if (cores[0].state_history[frame] != cores[1].state_history[frame]) {
+            SAM2_LOG_ERROR("Core state diverged on frame %" PRId64 " %08" PRIx32 " != %08" PRIx32,
+                frame, cores[0].state_history[frame], cores[1].state_history[frame]);
+            status = 1;
+            break;
+        }
+    }
 
-    for (int i = 0; i < iterations; i++) {
-        test_data[0] = (uint8_t)i; // Prevent compiler optimization
-        result ^= ulnet_xxh32(test_data, test_size, 0);
+    if (sessions[0]->peer_desynced_frame[SAM2_AUTHORITY_INDEX] || sessions[1]->peer_desynced_frame[0]) {
+        SAM2_LOG_ERROR("A desync was reported");
+        status = 1;
     }
 
-    double total_bytes = (double)test_size * iterations;
-    uint64_t elapsed_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+    *rollback_count = sessions[0]->rollback_count;
+    SAM2_LOG_INFO("Lockstep test resimulated %" PRId64 " frames over %" PRId64 " rollbacks",
+        sessions[0]->rollback_resimulated_frames + sessions[1]->rollback_resimulated_frames,
+        sessions[0]->rollback_count + sessions[1]->rollback_count);
+
+    sessions[0]->inproc[0] = NULL;
+    sessions[1]->inproc[SAM2_AUTHORITY_INDEX] = NULL;
+    ulnet_session_tear_down(sessions[0]);
+    ulnet_session_tear_down(sessions[1]);
+    ulnet_session_release_save_state_buffers(sessions[0]);
+    ulnet_session_release_save_state_buffers(sessions[1]);
+    free(sessions[0]);
+    free(sessions[1]);
 
-    double elapsed_seconds = elapsed_us / 1e6;
+    return status;
+}
 
-    double bytes_per_second = total_bytes / elapsed_seconds;
-    double gigabytes_per_second = bytes_per_second / (1024.0 * 1024.0 * 1024.0);
+int ulnet_test_rollback() {
+    sam2_room_t room = {0};
+    room.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    room.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    room.peer_ids[0] = 20002;
 
-    printf("xxh32 Throughput: %.3f GB/s\n", gigabytes_per_second);
+    int64_t rollback_count = 0;
+    int status = ulnet__test_lockstep(room, 1, ULNET_ROLLBACK_FRAMES_MAX, &rollback_count);
+    if (rollback_count == 0) {
+        SAM2_LOG_ERROR("Expected the authority to rollback at least once");
+        status = 1;
+    }
 
-    free(test_data);
+    return status;
 }
 
+int ulnet_test_delay_buffer() {
+    sam2_room_t room = {0};
+    room.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    room.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    room.peer_ids[0] = 20002;
+    int status = 0;
 
-#include <zstd.h>
+    if (ulnet_room_delay_buffer_size(&room) != ULNET_DELAY_BUFFER_SIZE) {
+        SAM2_LOG_ERROR("Rooms that don't specify a delay buffer size should get the default");
+        status = 1;
+    }
 
-#if defined(ULNET_TEST_MAIN)
-void sam2_log_write(int level, const char *file, int line, const char *format, ...) {
-    if (level == 2) {
-        printf("WARN %s:%d | ", file, line);
-    } else if (level > 2) {
-        printf("ERROR %s:%d | ", file, line);
+    ulnet_room_set_delay_buffer_size(&room, 20);
+    if (ulnet_room_delay_buffer_size(&room) != 32) {
+        SAM2_LOG_ERROR("Expected the delay buffer size to round up to 32 got %" PRId64, ulnet_room_delay_buffer_size(&room));
+        status = 1;
     }
 
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    printf("\n");
-    if (level == 4) {
-        printf("Fatal error in %s:%d\n", file, line);
-        abort();
+    // More delay than the default buffer could ever hold
+    int64_t rollback_count = 0;
+    status |= ulnet__test_lockstep(room, 10, 0, &rollback_count);
+
+    return status;
+}
+
+int ulnet_test_adaptive_delay() {
+    ulnet_session_t *session = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+    ulnet_transport_inproc_t *transport = (ulnet_transport_inproc_t *)calloc(1, sizeof(ulnet_transport_inproc_t));
+    int status = 0;
+
+    ulnet_session_init_defaulted(session);
+    session->use_inproc_transport = true;
+    session->our_peer_id = 10001;
+    session->room_we_are_in.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    session->room_we_are_in.peer_ids[0] = 20002;
+    session->inproc[0] = transport;
+
+    struct { int64_t rtt_usec; int64_t expected_delay_frames; } cases[] = {
+        {  1000, 1 }, // LAN
+        { 45000, 2 },
+        { 90000, 3 }, // Capped by the default delay buffer size
+    };
+
+    for (int i = 0; i < SAM2_ARRAY_LENGTH(cases); i++) {
+        for (int j = 0; j < 64; j++) {
+            ulnet__rtt_update(session, 0, cases[i].rtt_usec);
+        }
+
+        int64_t delay_frames = ulnet__adaptive_delay_frames(session, 60.0);
+        if (delay_frames != cases[i].expected_delay_frames) {
+            SAM2_LOG_ERROR("Expected %" PRId64 " frames of delay for a %" PRId64 " us RTT got %" PRId64,
+                cases[i].expected_delay_frames, cases[i].rtt_usec, delay_frames);
+            status = 1;
+        }
+    }
+
+    // Raising the delay is immediate, lowering it waits to see if the link stays fast
+    ulnet_core_option_t core_option = {0};
+    session->delay_frames = 1;
+    if (!ulnet__adaptive_delay_core_option(session, 60.0, &core_option) || strcmp(core_option.value, "3") != 0) {
+        SAM2_LOG_ERROR("Expected the authority to raise the delay to 3 frames");
+        status = 1;
+    }
+
+    for (int j = 0; j < 64; j++) {
+        ulnet__rtt_update(session, 0, 1000);
+    }
+
+    session->delay_frames = 3;
+    if (ulnet__adaptive_delay_core_option(session, 60.0, &core_option)) {
+        SAM2_LOG_ERROR("Delay was lowered without waiting");
+        status = 1;
+    }
+
+    // Send times follow the peer to its new port and are forgotten with it, otherwise the next ack would be a bogus RTT sample
+    session->reliable_tx_send_time_usec[0][5] = 1234;
+    ulnet_swap_agent(session, 0, 1);
+    if (session->reliable_tx_send_time_usec[1][5] != 1234 || session->reliable_tx_send_time_usec[0][5] != 0) {
+        SAM2_LOG_ERROR("Reliable send times weren't swapped along with the peer");
+        status = 1;
     }
+
+    ulnet_peer_init_defaulted(session, 1);
+    if (session->reliable_tx_send_time_usec[1][5] != 0) {
+        SAM2_LOG_ERROR("Reliable send times outlived the peer");
+        status = 1;
+    }
+
+    session->inproc[0] = NULL;
+    free(transport);
+    ulnet_session_release_save_state_buffers(session);
+    free(session);
+    return status;
 }
 
-int main () {
-    ulnet_session_t *session_1 = NULL;
-    ulnet_session_t *session_2 = NULL;
+// Two peers tick on their own synthetic clocks, one starting 6 ms behind the other, over a link with some jitter.
+// Input packets are delivered straight into the sessions instead of going through a transport
+int ulnet_test_frame_advantage() {
+    const double frame_rate = 60.0;
+    const int frames = 1200, start_offset_usec = 6000;
+    const int64_t one_way_usec = 20000;
+    const uint16_t peer_ids[2] = {10001, 20002};
+    const int ports[2] = {SAM2_AUTHORITY_INDEX, 0};
+    ulnet_transport_inproc_t *transport = (ulnet_transport_inproc_t *)calloc(1, sizeof(ulnet_transport_inproc_t));
+    ulnet_session_t *sessions[2];
+    struct { int64_t arrive_usec; int64_t frame; int32_t frame_advantage_usec; } in_flight[2][64];
+    int in_flight_head[2] = {0}, in_flight_tail[2] = {0};
+    static int64_t tick_usec[2][1200];
+    int status = 0;
 
-    juice_set_log_level(JUICE_LOG_LEVEL_DEBUG);
+    for (int i = 0; i < 2; i++) {
+        sessions[i] = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+        ulnet_session_init_defaulted(sessions[i]);
+        sessions[i]->use_inproc_transport = true;
+        sessions[i]->flags |= ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC;
+        sessions[i]->our_peer_id = peer_ids[i];
+        sessions[i]->room_we_are_in.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+        sessions[i]->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = peer_ids[0];
+        sessions[i]->room_we_are_in.peer_ids[0] = peer_ids[1];
+        sessions[i]->inproc[ports[!i]] = transport;
+        sessions[i]->rtt_smoothed_usec[ports[!i]] = 2 * one_way_usec;
+        sessions[i]->delay_frames = 2;
+    }
+
+    for (;;) {
+        int64_t next_tick_usec[2];
+        for (int i = 0; i < 2; i++) {
+            next_tick_usec[i] = sessions[i]->frame_counter >= frames ? INT64_MAX
+                              : sessions[i]->frame_pacer.tick_count == 0 ? 1000000 + i * start_offset_usec
+                              : sessions[i]->frame_pacer.tick_at_usec;
+        }
+        if (next_tick_usec[0] == INT64_MAX && next_tick_usec[1] == INT64_MAX) break;
+
+        int i = next_tick_usec[0] <= next_tick_usec[1] ? 0 : 1;
+        ulnet_session_t *session = sessions[i];
+        int peer = ports[!i];
+
+        while (in_flight_head[!i] != in_flight_tail[!i] && in_flight[!i][in_flight_head[!i] % 64].arrive_usec <= next_tick_usec[i]) {
+            int j = in_flight_head[!i]++ % 64;
+            if (in_flight[!i][j].frame > session->state[peer].frame) {
+                session->state[peer].frame = in_flight[!i][j].frame;
+                session->input_last_arrival_usec[peer] = in_flight[!i][j].arrive_usec;
+            }
+            session->peer_frame_advantage_usec[peer] = in_flight[!i][j].frame_advantage_usec;
+            session->peer_frame_advantage_bitfield |= 1ULL << peer;
+        }
+
+        tick_usec[i][session->frame_counter] = next_tick_usec[i];
+        ulnet_frame_pacer_tick(&session->frame_pacer, next_tick_usec[i], frame_rate);
+        ulnet__frame_advantage_sync(session, ports[i], frame_rate);
+        session->frame_counter++;
+        session->state[ports[i]].frame = session->frame_counter - 1 + session->delay_frames;
+
+        int j = in_flight_tail[i]++ % 64;
+        in_flight[i][j].arrive_usec = next_tick_usec[i] + one_way_usec + ulnet_xxh32(&in_flight_tail[i], sizeof(in_flight_tail[i]), i) % 2000;
+        in_flight[i][j].frame = session->state[ports[i]].frame;
+        in_flight[i][j].frame_advantage_usec = ulnet__frame_advantage_usec(session, peer, session->frame_counter - 1, frame_rate);
+    }
+
+    double offset_usec_sum = 0.0;
+    for (int frame = frames - 100; frame < frames; frame++) {
+        offset_usec_sum += tick_usec[1][frame] - tick_usec[0][frame];
+    }
+    double offset_usec = offset_usec_sum / 100;
+
+    if (SAM2_ABS(offset_usec) > 500.0) {
+        SAM2_LOG_ERROR("Peers still reach frames %.0f us apart", offset_usec);
+        status = 1;
+    } else if (   SAM2_ABS(sessions[0]->frame_advantage_slewed_usec - start_offset_usec / 2) > 1000
+               || SAM2_ABS(sessions[1]->frame_advantage_slewed_usec + start_offset_usec / 2) > 1000) {
+        // Both correcting the whole offset would overshoot
+        SAM2_LOG_ERROR("Expected each side to slew half of the offset got %" PRId64 " us and %" PRId64 " us",
+            sessions[0]->frame_advantage_slewed_usec, sessions[1]->frame_advantage_slewed_usec);
+        status = 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->inproc[ports[!i]] = NULL;
+        ulnet_session_release_save_state_buffers(sessions[i]);
+        free(sessions[i]);
+    }
+    free(transport);
+    return status;
+}
+
+// A copy of an input packet that shows up after one for a newer frame must not roll back the advantage the peer reported
+int ulnet_test_frame_advantage_packets() {
+    ulnet_session_t *session = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+    ulnet_state_t *state = (ulnet_state_t *)calloc(1, sizeof(ulnet_state_t));
+    ulnet_transport_inproc_t *transport = (ulnet_transport_inproc_t *)calloc(1, sizeof(ulnet_transport_inproc_t));
+    const struct { int64_t frame; int32_t frame_advantage_usec; int32_t expected_usec; } deliveries[] = {
+        {10, 1000, 1000},
+        {10, 5000, 1000}, // Redundant copy of frame 10 sent earlier
+        {12, 2000, 2000},
+        {11, 7000, 2000}, // Reordered
+    };
+    int status = 0;
+
+    ulnet_session_init_defaulted(session);
+    session->use_inproc_transport = true;
+    session->our_peer_id = 20002;
+    session->room_we_are_in.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    session->room_we_are_in.peer_ids[0] = session->our_peer_id;
+    ulnet_room_set_protocol_version(&session->room_we_are_in, SAM2_VERSION_MINOR);
+    session->inproc[SAM2_AUTHORITY_INDEX] = transport;
+    session->agent_peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+
+    for (int i = 0; status == 0 && i < SAM2_ARRAY_LENGTH(deliveries); i++) {
+        uint8_t packet[ULNET_PACKET_SIZE_BYTES_MAX];
+        packet[0] = ULNET_CHANNEL_INPUT | SAM2_AUTHORITY_INDEX;
+        state->frame = deliveries[i].frame;
+        int64_t packet_size = sizeof(ulnet_state_packet_t) + ulnet__encode_state(
+            session, state, ULNET_INPUT_FORMAT_COMPACT_TIMED, &packet[sizeof(ulnet_state_packet_t)], sizeof(packet) - sizeof(ulnet_state_packet_t));
+        ulnet__set_frame_advantage_in_packet(packet, deliveries[i].frame_advantage_usec);
+        ulnet_receive_packet_callback((juice_agent_t *) transport, (const char *) packet, packet_size, session);
+
+        if (session->peer_frame_advantage_usec[SAM2_AUTHORITY_INDEX] != deliveries[i].expected_usec) {
+            SAM2_LOG_ERROR("After delivering frame %" PRId64 " the peer's advantage was %" PRId32 " us expected %" PRId32 " us",
+                deliveries[i].frame, session->peer_frame_advantage_usec[SAM2_AUTHORITY_INDEX], deliveries[i].expected_usec);
+            status = 1;
+        }
+    }
+
+    session->inproc[SAM2_AUTHORITY_INDEX] = NULL;
+    ulnet_session_release_save_state_buffers(session);
+    free(transport);
+    free(state);
+    free(session);
+    return status;
+}
+
+// Input every frame with some scheduling jitter on the sender, then checks we block until about when the next one is due
+int ulnet_test_input_wait() {
+    ulnet_session_t *session = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+    ulnet_transport_inproc_t *transport = (ulnet_transport_inproc_t *)calloc(1, sizeof(ulnet_transport_inproc_t));
+    const int64_t frame_time_usec = 16667;
+    int64_t arrival_usec = 1000000;
+    int status = 0;
+
+    ulnet_session_init_defaulted(session);
+    session->use_inproc_transport = true;
+    session->our_peer_id = 10001;
+    session->room_we_are_in.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    session->room_we_are_in.peer_ids[0] = 20002;
+    session->inproc[0] = transport;
+    session->frame_counter = 100;
+    session->state[0].frame = 99;
+    int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+
+    for (int frame = 0; frame < 600; frame++) {
+        arrival_usec += frame_time_usec;
+        ulnet__input_arrival_update(session, 0, arrival_usec + ulnet_xxh32(&frame, sizeof(frame), 0) % 2000);
+    }
+
+    // A stall is forgotten rather than treated as a huge amount of jitter
+    arrival_usec += 2000000;
+    ulnet__input_arrival_update(session, 0, arrival_usec);
+
+    int64_t wait_usec = ulnet__input_wait_usec(session, our_port, arrival_usec + 1000);
+    if (SAM2_ABS(session->input_interarrival_usec[0] - frame_time_usec) > 500) {
+        SAM2_LOG_ERROR("Inter-arrival estimate %" PRId64 " us is off from the %" PRId64 " us frame time", session->input_interarrival_usec[0], frame_time_usec);
+        status = 1;
+    } else if (session->input_jitter_usec[0] <= 0 || session->input_jitter_usec[0] > 2000) {
+        SAM2_LOG_ERROR("Jitter estimate %" PRId64 " us for at most 2000 us of jitter", session->input_jitter_usec[0]);
+        status = 1;
+    } else if (wait_usec < frame_time_usec - 1000 || wait_usec > frame_time_usec - 1000 + 2 * 2000) {
+        SAM2_LOG_ERROR("Waited %" PRId64 " us for input due in about %" PRId64 " us", wait_usec, frame_time_usec - 1000);
+        status = 1;
+    } else if (ulnet__input_wait_usec(session, our_port, arrival_usec + 5 * frame_time_usec) != ULNET_INPUT_WAIT_FALLBACK_USEC) {
+        SAM2_LOG_ERROR("Overdue input should fall back to a short wait");
+        status = 1;
+    }
+
+    // Once the input we need is here there's nothing to predict
+    session->state[0].frame = 100;
+    if (ulnet__input_wait_usec(session, our_port, arrival_usec + 1000) != ULNET_INPUT_WAIT_FALLBACK_USEC) {
+        SAM2_LOG_ERROR("Waited on input from a peer we aren't missing any from");
+        status = 1;
+    }
+
+    session->inproc[0] = NULL;
+    ulnet_session_release_save_state_buffers(session);
+    free(transport);
+    free(session);
+    return status;
+}
+
+// Drives the pacer with a synthetic clock that wakes up late like the poll loop does, in whole milliseconds plus some scheduling jitter
+int ulnet_test_frame_pacer() {
+    const double frame_rate = 60.0988; // NES, the frame time isn't a whole number of microseconds
+    const double frame_time_usec = 1e6 / frame_rate;
+    const int frames = 12000, warmup_frames = 600, stall_frame = 10000;
+    ulnet_frame_pacer_t pacer = {0};
+    int64_t current_time_usec = 1000000;
+    int64_t window_start_usec = 0;
+    double phase_error_sum_usec = 0.0, drift_max_usec = 0.0;
+    int status = 0;
+
+    for (int frame = 0; frame < frames; frame++) {
+        int64_t wait_usec = pacer.tick_at_usec - current_time_usec;
+        if (wait_usec > 0) {
+            current_time_usec += (wait_usec + 999) / 1000 * 1000;
+        }
+        current_time_usec += ulnet_xxh32(&frame, sizeof(frame), 0) % 500;
+        if (frame == stall_frame) {
+            current_time_usec += 100000; // Something like a hitch loading a savestate
+        }
+
+        int64_t last_tick_usec = pacer.last_tick_usec;
+        ulnet_frame_pacer_tick(&pacer, current_time_usec, frame_rate);
+
+        if (frame > warmup_frames && current_time_usec - last_tick_usec < frame_time_usec / 2) {
+            SAM2_LOG_ERROR("Ticked twice within %" PRId64 " us on frame %d", current_time_usec - last_tick_usec, frame);
+            status = 1;
+            break;
+        }
+
+        if (frame == warmup_frames) {
+            window_start_usec = current_time_usec;
+        } else if (frame > warmup_frames && frame < stall_frame) {
+            phase_error_sum_usec += pacer.phase_error_usec;
+            double drift_usec = current_time_usec - window_start_usec - (frame - warmup_frames) * frame_time_usec;
+            drift_max_usec = SAM2_MAX(drift_max_usec, SAM2_ABS(drift_usec));
+        }
+
+        current_time_usec += 2000; // retro_run
+    }
+
+    double phase_error_mean_usec = phase_error_sum_usec / (stall_frame - warmup_frames - 1);
+    double frame_time_mean_usec, frame_time_variance_usec2;
+    ulnet_frame_pacer_frame_time_stats(&pacer, &frame_time_mean_usec, &frame_time_variance_usec2);
 
-    int status = ulnet_test_inproc(NULL, NULL);
     if (status != 0) {
-        printf("Inproc test failed with status: %d\n", status);
+    } else if (drift_max_usec > 1500.0) {
+        SAM2_LOG_ERROR("Ticks drifted %.0f us from the core's frame rate", drift_max_usec);
+        status = 1;
+    } else if (SAM2_ABS(phase_error_mean_usec) > 100.0) {
+        SAM2_LOG_ERROR("Ticks were %.0f us late on average, the wake up bias wasn't corrected", phase_error_mean_usec);
+        status = 1;
+    } else if (pacer.resync_count != 1) {
+        SAM2_LOG_ERROR("Pacer resynced %" PRId64 " times for one stall", pacer.resync_count);
+        status = 1;
+    } else if (SAM2_ABS(frame_time_mean_usec - frame_time_usec) > 50.0 || frame_time_variance_usec2 > 1000.0 * 1000.0) {
+        SAM2_LOG_ERROR("Frame time %.1f us with variance %.0f us^2", frame_time_mean_usec, frame_time_variance_usec2);
+        status = 1;
+    }
+
+    return status;
+}
+
+#define ULNET__TEST_RAM_SIZE (64 * 1024)
+
+// Core with a large mostly static memory image, like the work RAM of a real console
+typedef struct ulnet__test_ram_core {
+    ulnet_session_t *session;
+    uint8_t ram[ULNET__TEST_RAM_SIZE];
+} ulnet__test_ram_core_t;
+
+void ulnet__test_ram_core_retro_run(void *user_ptr) {
+    ulnet__test_ram_core_t *core = (ulnet__test_ram_core_t *) user_ptr;
+    for (int i = 0; i < 4; i++) {
+        uint32_t x = ulnet_xxh32(&core->session->frame_counter, sizeof(core->session->frame_counter), i);
+        core->ram[x % ULNET__TEST_RAM_SIZE] ^= (uint8_t) (x >> 24);
+    }
+}
+
+size_t ulnet__test_ram_core_retro_serialize_size(void *user_ptr) {
+    return ULNET__TEST_RAM_SIZE;
+}
+
+bool ulnet__test_ram_core_retro_serialize(void *user_ptr, void *data, size_t size) {
+    ulnet__test_ram_core_t *core = (ulnet__test_ram_core_t *) user_ptr;
+    memcpy(data, core->ram, ULNET__TEST_RAM_SIZE);
+    return true;
+}
+
+bool ulnet__test_ram_core_retro_unserialize(void *user_ptr, const void *data, size_t size) {
+    ulnet__test_ram_core_t *core = (ulnet__test_ram_core_t *) user_ptr;
+    memcpy(core->ram, data, ULNET__TEST_RAM_SIZE);
+    return true;
+}
+
+// Polls both sessions until the spectator loads a savestate, returns the compressed size the authority sent
+static int64_t ulnet__test_sync_spectator(ulnet_session_t *sessions[2], uint8_t *save_state) {
+    for (int iteration = 0; iteration < 256; iteration++) {
+        for (int i = 0; i < 2; i++) {
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+
+        if (sessions[1]->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+            return sessions[0]->save_state_sent_size;
+        }
+    }
+
+    return -1;
+}
+
+// Session for a ram core that's already in the room, retransmits aren't held back so tests don't wait on timers
+static ulnet_session_t *ulnet__test_ram_core_session(ulnet__test_ram_core_t *core, const sam2_room_t *room, int port) {
+    ulnet_session_t *session = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+    ulnet_session_init_defaulted(session);
+    session->reliable_retransmit_delay_microseconds = 0;
+    session->bulk_send_bytes_per_second = 0;
+    session->use_inproc_transport = true;
+    session->user_ptr = core;
+    session->retro_run = ulnet__test_ram_core_retro_run;
+    session->retro_serialize_size = ulnet__test_ram_core_retro_serialize_size;
+    session->retro_serialize = ulnet__test_ram_core_retro_serialize;
+    session->retro_unserialize = ulnet__test_ram_core_retro_unserialize;
+    session->room_we_are_in = *room;
+    session->our_peer_id = room->peer_ids[port];
+    core->session = session;
+    return session;
+}
+
+static void ulnet__test_inproc_connect(ulnet_session_t *authority, ulnet_session_t *peer, int port, ulnet_transport_inproc_t *transport) {
+    authority->inproc[port] = transport;
+    peer->inproc[SAM2_AUTHORITY_INDEX] = transport;
+    authority->agent_peer_ids[port] = peer->our_peer_id;
+    peer->agent_peer_ids[SAM2_AUTHORITY_INDEX] = authority->our_peer_id;
+}
+
+static void ulnet__test_session_free(ulnet_session_t *session) {
+    memset(session->inproc, 0, sizeof(session->inproc));
+    ulnet_session_tear_down(session);
+    ulnet_session_release_save_state_buffers(session);
+    free(session);
+}
+
+// The authority in sessions[0] and a player on port 0 or a spectator on SAM2_SPECTATOR_START in sessions[1]
+typedef struct ulnet__test_pair {
+    ulnet_session_t *sessions[2];
+    ulnet__test_ram_core_t *cores;
+    ulnet_transport_inproc_t *transport;
+} ulnet__test_pair_t;
+
+static ulnet__test_pair_t ulnet__test_pair_set_up(int port) {
+    ulnet__test_pair_t pair = {0};
+    pair.cores = (ulnet__test_ram_core_t *)calloc(2, sizeof(ulnet__test_ram_core_t));
+    pair.transport = (ulnet_transport_inproc_t *)calloc(1, sizeof(ulnet_transport_inproc_t));
+
+    sam2_room_t room = {0};
+    room.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    room.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    room.peer_ids[port] = port < SAM2_SPECTATOR_START ? 20002 : 30002;
+
+    pair.sessions[0] = ulnet__test_ram_core_session(&pair.cores[0], &room, SAM2_AUTHORITY_INDEX);
+    pair.sessions[1] = ulnet__test_ram_core_session(&pair.cores[1], &room, port);
+    ulnet__test_inproc_connect(pair.sessions[0], pair.sessions[1], port, pair.transport);
+    return pair;
+}
+
+static void ulnet__test_pair_tear_down(ulnet__test_pair_t *pair) {
+    for (int i = 0; i < 2; i++) {
+        ulnet__test_session_free(pair->sessions[i]);
+    }
+    free(pair->transport);
+    free(pair->cores);
+}
+
+// Losing a burst of reliable packets should cost one retransmission each once later packets are SACKed, without waiting on the timeout
+int ulnet_test_reliable_sack() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    const int message_count = 8, lost_start = 2, lost_count = 3;
+    int status = 0;
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->reliable_retransmit_delay_microseconds = 1000000; // Way past the test so only SACKs can trigger retransmission
+        ulnet_room_set_protocol_version(&sessions[i]->room_we_are_in, ULNET_PROTOCOL_VERSION_SACK);
+    }
+
+    // The spectator has the greater peer id so it sends on buf2
+    for (int i = 0; i < message_count; i++) {
+        char message[8];
+        snprintf(message, sizeof(message), "MSG%d", i);
+        ulnet_reliable_send(sessions[1], SAM2_AUTHORITY_INDEX, (const uint8_t *) message, (int) strlen(message));
+    }
+
+    if (transport->buf2.count != message_count) {
+        SAM2_LOG_ERROR("Only %d of %d reliable packets went out without waiting on acks", transport->buf2.count, message_count);
+        status = 1;
+        goto cleanup;
+    }
+
+    transport->buf2.count -= lost_count;
+    memmove(transport->buf2.msg[lost_start], transport->buf2.msg[lost_start + lost_count], (message_count - lost_start - lost_count) * sizeof(transport->buf2.msg[0]));
+    memmove(&transport->buf2.msg_size[lost_start], &transport->buf2.msg_size[lost_start + lost_count], (message_count - lost_start - lost_count) * sizeof(transport->buf2.msg_size[0]));
+    memmove(&transport->buf2.deliver_at_usec[lost_start], &transport->buf2.deliver_at_usec[lost_start + lost_count], (message_count - lost_start - lost_count) * sizeof(transport->buf2.deliver_at_usec[0]));
+
+    for (int round = 0; round < 8 && sessions[1]->reliable_tx_head[SAM2_AUTHORITY_INDEX] != message_count; round++) {
+        ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3);
+        ulnet_reliable_send_with_acks_only(sessions[0], SAM2_SPECTATOR_START, (const uint8_t*) "ACK CARRIER", sizeof("ACK CARRIER") - 1);
+        ulnet__sleep(1); // Past the reordering window
+        ulnet_poll_session(sessions[1], 0, 0, 0, 60.0, 16e-3);
+    }
+
+    if (sessions[0]->reliable_rx_head[SAM2_SPECTATOR_START] != message_count) {
+        SAM2_LOG_ERROR("Only %d reliable packets were delivered", sessions[0]->reliable_rx_head[SAM2_SPECTATOR_START]);
+        status = 1;
+    } else if (sessions[1]->reliable_tx_head[SAM2_AUTHORITY_INDEX] != message_count) {
+        SAM2_LOG_ERROR("Only %d reliable packets were acked", sessions[1]->reliable_tx_head[SAM2_AUTHORITY_INDEX]);
+        status = 1;
+    } else if (sessions[1]->reliable_retransmit_count != lost_count) {
+        SAM2_LOG_ERROR("Retransmitted %" PRId64 " reliable packets to recover %d", sessions[1]->reliable_retransmit_count, lost_count);
+        status = 1;
+    }
+
+    for (int i = 0; status == 0 && i < message_count; i++) {
+        char message[8];
+        snprintf(message, sizeof(message), "MSG%d", i);
+        arena_ref_t packet_ref = sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][i];
+        uint8_t *packet = (uint8_t *) arena_deref(&sessions[0]->arena, packet_ref);
+        if (!packet || memcmp(packet + ulnet__reliable_header_size(packet[0]), message, strlen(message)) != 0) {
+            SAM2_LOG_ERROR("Reliable packet %d has the wrong payload", i);
+            status = 1;
+        }
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    return status;
+}
+
+// A peer that joined a room hosted by an older version has to stick to what the authority can parse. The authority reads a
+// SACK as the start of the payload so neither side may send one, the losses get recovered by the timeout instead
+int ulnet_test_reliable_sack_old_room() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    const int message_count = 8, lost_start = 2, lost_count = 3;
+    int status = 0;
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->reliable_retransmit_delay_microseconds = 1000;
+        ulnet_room_set_protocol_version(&sessions[i]->room_we_are_in, ULNET_PROTOCOL_VERSION_SACK - 1);
+    }
+
+    for (int i = 0; i < message_count; i++) {
+        char message[8];
+        snprintf(message, sizeof(message), "MSG%d", i);
+        ulnet_reliable_send(sessions[1], SAM2_AUTHORITY_INDEX, (const uint8_t *) message, (int) strlen(message));
+    }
+
+    transport->buf2.count -= lost_count;
+    memmove(transport->buf2.msg[lost_start], transport->buf2.msg[lost_start + lost_count], (message_count - lost_start - lost_count) * sizeof(transport->buf2.msg[0]));
+    memmove(&transport->buf2.msg_size[lost_start], &transport->buf2.msg_size[lost_start + lost_count], (message_count - lost_start - lost_count) * sizeof(transport->buf2.msg_size[0]));
+    memmove(&transport->buf2.deliver_at_usec[lost_start], &transport->buf2.deliver_at_usec[lost_start + lost_count], (message_count - lost_start - lost_count) * sizeof(transport->buf2.deliver_at_usec[0]));
+
+    int64_t deadline_usec = ulnet__get_unix_time_microseconds() + 2000000;
+    while (status == 0 && sessions[1]->reliable_tx_head[SAM2_AUTHORITY_INDEX] != message_count) {
+        if (ulnet__get_unix_time_microseconds() > deadline_usec) {
+            SAM2_LOG_ERROR("Only %d reliable packets were acked", sessions[1]->reliable_tx_head[SAM2_AUTHORITY_INDEX]);
+            status = 1;
+            break;
+        }
+
+        for (int i = 0; i < transport->buf2.count; i++) {
+            if (transport->buf2.msg[i][0] & ULNET_RELIABLE_FLAG_SACK) {
+                SAM2_LOG_ERROR("Spectator sent a SACK the authority's version can't parse");
+                status = 1;
+            }
+        }
+
+        ulnet_poll_session(sessions[0], 0, 0, 0, 60.0, 16e-3);
+        ulnet_reliable_send_with_acks_only(sessions[0], SAM2_SPECTATOR_START, (const uint8_t*) "ACK CARRIER", sizeof("ACK CARRIER") - 1);
+        for (int i = 0; i < transport->buf1.count; i++) {
+            if (transport->buf1.msg[i][0] & ULNET_RELIABLE_FLAG_SACK) {
+                SAM2_LOG_ERROR("Authority sent a SACK in a room that predates them");
+                status = 1;
+            }
+        }
+
+        ulnet__sleep(1);
+        ulnet_poll_session(sessions[1], 0, 0, 0, 60.0, 16e-3);
+    }
+
+    for (int i = 0; status == 0 && i < message_count; i++) {
+        char message[8];
+        snprintf(message, sizeof(message), "MSG%d", i);
+        arena_ref_t packet_ref = sessions[0]->reliable_rx_packet_history[SAM2_SPECTATOR_START][i];
+        uint8_t *packet = (uint8_t *) arena_deref(&sessions[0]->arena, packet_ref);
+        if (!packet || memcmp(packet + sizeof(ulnet_reliable_packet_t), message, strlen(message)) != 0) {
+            SAM2_LOG_ERROR("Reliable packet %d has the wrong payload", i);
+            status = 1;
+        }
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    return status;
+}
+
+int ulnet_test_delta_savestate() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        pair.cores[0].ram[i] = (uint8_t) (ulnet_xxh32(&i, sizeof(i), 0) >> (i % 24));
+    }
+
+    // The spectator joins twice, the second time it already has the first savestate to diff against
+    int64_t sent_size[2] = {0};
+    int64_t sent_baseline_frame[2] = {0};
+    for (int join = 0; join < 2; join++) {
+        sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+        sessions[1]->flags &= ~ULNET_SESSION_FLAG_BASELINE_ADVERTISED;
+        sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+        sessions[0]->peer_baseline_advertised_bitfield &= ~(1ULL << SAM2_SPECTATOR_START);
+        sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+        sent_size[join] = ulnet__test_sync_spectator(sessions, save_state);
+        sent_baseline_frame[join] = sessions[0]->save_state_sent_baseline_frame;
+        if (sent_size[join] < 0) {
+            SAM2_LOG_ERROR("Spectator never loaded a savestate on join %d", join);
+            status = 1;
+            goto cleanup;
+        }
+
+        // Both sides keep the savestate that was transferred as the next baseline so they have to agree on it
+        int loaded = ulnet__baseline_most_recent(sessions[1]);
+        if (   ulnet_xxh32(sessions[1]->baseline_save_state[loaded], sessions[1]->baseline_save_state_size[loaded], 0) != sessions[1]->baseline_save_state_xxhash[loaded]
+            || ulnet__baseline_find(sessions[0], sessions[1]->baseline_save_state_frame[loaded], sessions[1]->baseline_save_state_xxhash[loaded]) == -1) {
+            SAM2_LOG_ERROR("Spectator loaded a savestate for frame %" PRId64 " the authority never sent", sessions[1]->baseline_save_state_frame[loaded]);
+            status = 1;
+        }
+
+        for (int frame = 0; frame < 30; frame++) {
+            sessions[0]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[0], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+    }
+
+    SAM2_LOG_INFO("Savestate transfer took %" PRId64 " bytes in full and %" PRId64 " bytes as a delta", sent_size[0], sent_size[1]);
+    if (sent_baseline_frame[0] != -1 || sent_baseline_frame[1] == -1) {
+        SAM2_LOG_ERROR("Expected a full savestate followed by a delta got baselines %" PRId64 " and %" PRId64,
+            sent_baseline_frame[0], sent_baseline_frame[1]);
+        status = 1;
+    } else if (sent_size[1] * 8 > sent_size[0]) {
+        SAM2_LOG_ERROR("Delta savestate was not meaningfully smaller than the full one");
+        status = 1;
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Savestates both sides hashed the same during play should become baselines on both so a resync can be a delta
+int ulnet_test_confirmed_baseline() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(0);
+    ulnet_session_t **sessions = pair.sessions;
+    uint8_t *save_state = (uint8_t *)malloc(2 * ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        pair.cores[0].ram[i] = pair.cores[1].ram[i] = (uint8_t) (ulnet_xxh32(&i, sizeof(i), 0) >> (i % 24));
+    }
+
+    int64_t frames = 2 * ULNET_SAVE_STATE_BASELINE_INTERVAL_FRAMES + 2 * ULNET_DELAY_BUFFER_SIZE_MAX;
+    for (int iteration = 0; iteration < 4 * frames; iteration++) {
+        if (sessions[0]->frame_counter >= frames && sessions[1]->frame_counter >= frames) break;
+
+        for (int i = 0; i < 2; i++) {
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], true, save_state + i * ULNET__TEST_RAM_SIZE, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+    }
+
+    int player = ulnet__baseline_most_recent(sessions[1]);
+    int authority = player == -1 ? -1 : ulnet__baseline_find(sessions[0],
+        sessions[1]->baseline_save_state_frame[player], sessions[1]->baseline_save_state_xxhash[player]);
+    if (   sessions[0]->baseline_confirmed_count < 2
+        || sessions[1]->baseline_confirmed_count < 2
+        || player == -1
+        || authority == -1) {
+        SAM2_LOG_ERROR("Expected both sides to keep the savestates they agreed on, confirmed %" PRId64 " and %" PRId64,
+            sessions[0]->baseline_confirmed_count, sessions[1]->baseline_confirmed_count);
+        status = 1;
+    } else if (   sessions[1]->baseline_save_state_frame[player] % ULNET_SAVE_STATE_BASELINE_INTERVAL_FRAMES != 0
+               || ulnet_xxh32(sessions[1]->baseline_save_state[player], sessions[1]->baseline_save_state_size[player], 0) != sessions[1]->baseline_save_state_xxhash[player]
+               || memcmp(sessions[0]->baseline_save_state[authority], sessions[1]->baseline_save_state[player], ULNET__TEST_RAM_SIZE) != 0) {
+        SAM2_LOG_ERROR("Baseline for frame %" PRId64 " doesn't match between the sides", sessions[1]->baseline_save_state_frame[player]);
+        status = 1;
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Authorities from before payloads were versioned send version 0 fragments with the old payload layout, we still have to load those
+int ulnet_test_chunked_compression() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) (ulnet_xxh32(&i, sizeof(i), 0) >> (i % 24));
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->room_we_are_in.rom_hash_xxh64 = 0xFEDCBA9876543210ULL;
+        sessions[i]->save_state_repair_delay_microseconds = 0;
+    }
+    sessions[0]->save_state_compress_chunk_size = ULNET__TEST_RAM_SIZE / 8;
+
+    // Nothing is lost on the first join so every chunk can be decompressed as it arrives
+    // The second loses fragments and carries the dictionary trained after the first so the chunks left over are decompressed in parallel at the end
+    for (int join = 0; join < 2; join++) {
+        for (int i = 0; i < ULNET_SAVE_STATE_BASELINES_MAX; i++) {
+            sessions[1]->baseline_save_state_size[i] = 0;
+        }
+        sessions[1]->debug_udp_recv_drop_rate = join == 0 ? 0.0f : 0.1f;
+        sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+        sessions[1]->flags &= ~ULNET_SESSION_FLAG_BASELINE_ADVERTISED;
+        sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+        sessions[0]->peer_baseline_advertised_bitfield &= ~(1ULL << SAM2_SPECTATOR_START);
+        sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+        if (ulnet__test_sync_spectator(sessions, save_state) < 0) {
+            SAM2_LOG_ERROR("Spectator never loaded the chunked savestate on join %d", join);
+            status = 1;
+            goto cleanup;
+        }
+
+        savestate_transfer_payload_t *payload = sessions[0]->save_state_encoding[sessions[0]->peer_save_state_encoding[SAM2_SPECTATOR_START]].payload;
+        int loaded = ulnet__baseline_most_recent(sessions[1]);
+        int frames = 0;
+        for (size_t offset = 0; offset < (size_t) payload->compressed_savestate_size; frames++) {
+            size_t frame_size = ZSTD_findFrameCompressedSize(payload->compressed_data + offset, payload->compressed_savestate_size - offset);
+            if (ZSTD_isError(frame_size)) break;
+            offset += frame_size;
+        }
+
+        // A peer that doesn't know about chunks decompresses the frames in one go
+        size_t legacy_size = join == 0
+            ? ZSTD_decompress(save_state, ULNET__TEST_RAM_SIZE, payload->compressed_data, payload->compressed_savestate_size)
+            : ULNET__TEST_RAM_SIZE;
+
+        if (frames != 8) {
+            SAM2_LOG_ERROR("Savestate was split into %d zstd frames instead of 8 on join %d", frames, join);
+            status = 1;
+        } else if (legacy_size != ULNET__TEST_RAM_SIZE || (join == 0 && ulnet_xxh32(save_state, legacy_size, 0) != payload->save_state_xxhash)) {
+            SAM2_LOG_ERROR("Chunks didn't decompress as a single stream");
+            status = 1;
+        } else if (   ulnet_xxh32(sessions[1]->baseline_save_state[loaded], sessions[1]->baseline_save_state_size[loaded], 0) != payload->save_state_xxhash
+                   || sessions[1]->baseline_save_state_frame[loaded] != payload->frame_counter) {
+            SAM2_LOG_ERROR("Spectator loaded a savestate for frame %" PRId64 " that isn't the one the authority sent", sessions[1]->baseline_save_state_frame[loaded]);
+            status = 1;
+        } else if (join == 0 && sessions[1]->save_state_received_streamed_chunks != 8) {
+            SAM2_LOG_ERROR("Only %d of 8 chunks were decompressed while the savestate was arriving", sessions[1]->save_state_received_streamed_chunks);
+            status = 1;
+        } else if (join == 1 && payload->dictionary_id == 0) {
+            SAM2_LOG_ERROR("Second chunked savestate didn't use the dictionary");
+            status = 1;
+        }
+
+        ulnet__pool_wait(&sessions[0]->zstd_dictionary_training.pending);
+        for (int frame = 0; frame < 30; frame++) {
+            sessions[0]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[0], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+int ulnet_test_save_state_payload_v0() {
+    const int block_size = 1024;
+    ulnet__test_ram_core_t *core = (ulnet__test_ram_core_t *)calloc(1, sizeof(ulnet__test_ram_core_t));
+    ulnet_transport_inproc_t *transport = (ulnet_transport_inproc_t *)calloc(1, sizeof(ulnet_transport_inproc_t));
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        save_state[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 3);
+    }
+
+    sam2_room_t room = {0};
+    room.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    room.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    room.peer_ids[SAM2_SPECTATOR_START] = 30002;
+
+    ulnet_session_t *session = ulnet__test_ram_core_session(core, &room, SAM2_SPECTATOR_START);
+    session->inproc[SAM2_AUTHORITY_INDEX] = transport;
+    session->agent_peer_ids[SAM2_AUTHORITY_INDEX] = room.peer_ids[SAM2_AUTHORITY_INDEX];
+    session->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+
+    // Version 0 ends where version 1 added baseline_frame
+    const size_t v0_header_size = offsetof(savestate_transfer_payload_t, baseline_frame);
+    size_t compressed_bound = ZSTD_compressBound(ULNET__TEST_RAM_SIZE) + ZSTD_compressBound(sizeof(session->core_options));
+    uint8_t *transfer = (uint8_t *)calloc(1, v0_header_size + compressed_bound + block_size);
+    savestate_transfer_payload_t *payload = (savestate_transfer_payload_t *) transfer;
+    uint8_t *compressed_data = transfer + v0_header_size;
+    payload->frame_counter = 100;
+    payload->room = room;
+    payload->decompressed_savestate_size = ULNET__TEST_RAM_SIZE;
+    payload->compressed_savestate_size = (int32_t) ZSTD_compress(compressed_data, compressed_bound, save_state, ULNET__TEST_RAM_SIZE, 1);
+    payload->compressed_options_size = (int32_t) ZSTD_compress(compressed_data + payload->compressed_savestate_size,
+        compressed_bound - payload->compressed_savestate_size, session->core_options, sizeof(session->core_options), 1);
+    payload->total_size_bytes = v0_header_size + payload->compressed_savestate_size + payload->compressed_options_size;
+    payload->xxhash = ulnet_xxh32(payload, payload->total_size_bytes, 0);
+
+    // Without ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_MAX it's a single packet group, only its data blocks are sent
+    int k = (int) ((payload->total_size_bytes + block_size - 1) / block_size);
+    for (int i = 0; i < k; i++) {
+        uint8_t packet[ULNET_PACKET_SIZE_BYTES_MAX];
+        packet[0] = ULNET_CHANNEL_SAVESTATE_TRANSFER;
+        packet[1] = (uint8_t) k;
+        packet[2] = (uint8_t) i;
+        memcpy(packet + ULNET_SAVESTATE_TRANSFER_V0_HEADER_SIZE, transfer + (size_t) i * block_size, block_size);
+        ulnet_receive_packet_callback((juice_agent_t *) transport, (const char *) packet, ULNET_SAVESTATE_TRANSFER_V0_HEADER_SIZE + block_size, session);
+    }
+
+    if (session->frame_counter != 100 || memcmp(core->ram, save_state, ULNET__TEST_RAM_SIZE) != 0) {
+        SAM2_LOG_ERROR("Spectator didn't load the version 0 savestate");
+        status = 1;
+    } else if (ulnet__baseline_find(session, 100, ulnet_xxh32(save_state, ULNET__TEST_RAM_SIZE, 0)) == -1) {
+        SAM2_LOG_ERROR("Version 0 savestate wasn't kept as a baseline under its hash");
+        status = 1;
+    }
+
+    ulnet__test_session_free(session);
+    free(transfer);
+    free(save_state);
+    free(transport);
+    free(core);
+    return status;
+}
+
+int ulnet_test_save_state_dictionary() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) (ulnet_xxh32(&i, sizeof(i), 0) >> (i % 24));
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->room_we_are_in.rom_hash_xxh64 = 0x0123456789ABCDEFULL;
+    }
+
+    // The spectator forgets its baselines between joins so every transfer is a full savestate
+    // The first trains the dictionary, the second carries it along and the third can just use it
+    int64_t sent_size[3] = {0};
+    ulnet_save_state_encoding_t sent[3];
+    for (int join = 0; join < 3; join++) {
+        for (int i = 0; i < ULNET_SAVE_STATE_BASELINES_MAX; i++) {
+            sessions[1]->baseline_save_state_size[i] = 0;
+        }
+        sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+        sessions[1]->flags &= ~ULNET_SESSION_FLAG_BASELINE_ADVERTISED;
+        sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+        sessions[0]->peer_baseline_advertised_bitfield &= ~(1ULL << SAM2_SPECTATOR_START);
+        sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+        sent_size[join] = ulnet__test_sync_spectator(sessions, save_state);
+        sent[join] = sessions[0]->save_state_encoding[sessions[0]->peer_save_state_encoding[SAM2_SPECTATOR_START]];
+        if (sent_size[join] < 0) {
+            SAM2_LOG_ERROR("Spectator never loaded a savestate on join %d", join);
+            status = 1;
+            goto cleanup;
+        }
+
+        if (sessions[0]->save_state_sent_compress_cycles <= 0 || sessions[1]->save_state_received_decompress_cycles <= 0) {
+            SAM2_LOG_ERROR("Compression cycles weren't reported for join %d", join);
+            status = 1;
+        }
+
+        ulnet__pool_wait(&sessions[0]->zstd_dictionary_training.pending);
+        for (int frame = 0; frame < 30; frame++) {
+            sessions[0]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[0], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+    }
+
+    SAM2_LOG_INFO("Full savestates took %" PRId64 " bytes without a dictionary and %" PRId64 " bytes with one", sent_size[0], sent_size[2]);
+    if (sent[0].dictionary_id != 0 || sessions[0]->zstd_dictionary_id == 0 || sessions[0]->zstd_dictionary_rom_hash != sessions[0]->room_we_are_in.rom_hash_xxh64) {
+        SAM2_LOG_ERROR("Authority didn't train a dictionary for the room's game after the first savestate");
+        status = 1;
+    } else if (sent[1].dictionary_id != sessions[0]->zstd_dictionary_id || !sent[1].dictionary_embedded) {
+        SAM2_LOG_ERROR("Second savestate didn't carry the dictionary");
+        status = 1;
+    } else if (sessions[1]->zstd_dictionary_id != sessions[0]->zstd_dictionary_id || sessions[0]->peer_dictionary_id[SAM2_SPECTATOR_START] != sessions[0]->zstd_dictionary_id) {
+        SAM2_LOG_ERROR("Spectator ended up with dictionary %08" PRIx32 " instead of %08" PRIx32, sessions[1]->zstd_dictionary_id, sessions[0]->zstd_dictionary_id);
+        status = 1;
+    } else if (sent[2].dictionary_id != sessions[0]->zstd_dictionary_id || sent[2].dictionary_embedded) {
+        SAM2_LOG_ERROR("Third savestate sent the dictionary again or didn't use it");
+        status = 1;
+    } else if (sent_size[2] >= sent_size[0]) {
+        SAM2_LOG_ERROR("Dictionary didn't make the savestate any smaller");
+        status = 1;
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Only the first few bytes change every frame so after a desync the corrupted chunk is all that's left to patch
+void ulnet__test_ram_core_retro_run_counter(void *user_ptr) {
+    ulnet__test_ram_core_t *core = (ulnet__test_ram_core_t *) user_ptr;
+    memcpy(core->ram, &core->session->frame_counter, sizeof(core->session->frame_counter));
+}
+
+int ulnet_test_chunked_resync() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(0);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    uint8_t *save_state = (uint8_t *)malloc(2 * ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) (ulnet_xxh32(&i, sizeof(i), 0) >> (i % 24));
+    }
+    memcpy(cores[1].ram, cores[0].ram, ULNET__TEST_RAM_SIZE);
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->retro_run = ulnet__test_ram_core_retro_run_counter;
+    }
+
+    // The player flips a byte in the middle of its memory, it should notice from the hashes and get back just that chunk and the counter
+    bool corrupted = false, waited_on_save_state = false;
+    for (int iteration = 0; iteration < 4096; iteration++) {
+        if (   sessions[1]->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+            && sessions[1]->frame_counter >= 120) {
+            break;
+        }
+
+        if (!corrupted && sessions[1]->frame_counter >= 30) {
+            cores[1].ram[ULNET__TEST_RAM_SIZE / 2] ^= 0xFF;
+            corrupted = true;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            sessions[i]->next_input_state[0][0] = (iteration / 5) % 2;
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], true, save_state + i * ULNET__TEST_RAM_SIZE, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+
+        waited_on_save_state |= sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    }
+
+    SAM2_LOG_INFO("Resynced with a %" PRId64 " byte patch of %" PRId64 " chunks", sessions[0]->save_state_sent_size, sessions[0]->save_state_patch_chunks_sent);
+    if (!waited_on_save_state || sessions[1]->save_state_resync_count != 1) {
+        SAM2_LOG_ERROR("Player asked for %" PRId64 " resyncs instead of 1", sessions[1]->save_state_resync_count);
+        status = 1;
+    } else if (sessions[0]->save_state_sent_baseline_frame == -1 || sessions[0]->save_state_patch_chunks_sent > 2) {
+        SAM2_LOG_ERROR("Authority sent a full savestate or more chunks than were touched");
+        status = 1;
+    } else if (sessions[0]->save_state_sent_size * 4 > ULNET__TEST_RAM_SIZE) {
+        SAM2_LOG_ERROR("Patch was not meaningfully smaller than the savestate");
+        status = 1;
+    }
+
+    if (sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL || sessions[1]->frame_counter < 120) {
+        SAM2_LOG_ERROR("Player stalled on frame %" PRId64 " after resyncing", sessions[1]->frame_counter);
+        status = 1;
+    }
+
+    // Past the counter nothing changes so the memory has to match exactly even though the sessions are on different frames
+    if (memcmp(cores[0].ram + sizeof(int64_t), cores[1].ram + sizeof(int64_t), ULNET__TEST_RAM_SIZE - sizeof(int64_t)) != 0) {
+        SAM2_LOG_ERROR("Player memory still differs from the authority's after resyncing");
+        status = 1;
+    }
+
+    if (sessions[0]->peer_desynced_frame[SAM2_AUTHORITY_INDEX] || sessions[1]->peer_desynced_frame[0]) {
+        SAM2_LOG_ERROR("A desync was still reported after resyncing");
+        status = 1;
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+#define ULNET__TEST_FAN_OUT_SPECTATORS 3
+
+int ulnet_test_async_save_state_hash() {
+    ulnet__test_ram_core_t *core = (ulnet__test_ram_core_t *)calloc(1, sizeof(ulnet__test_ram_core_t));
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int64_t expected_frame[ULNET_DELAY_BUFFER_SIZE_MAX];
+    uint32_t expected_hash[ULNET_DELAY_BUFFER_SIZE_MAX];
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        core->ram[i] = (uint8_t) (ulnet_xxh32(&i, sizeof(i), 0) >> (i % 24));
+    }
+
+    sam2_room_t room = {0};
+    room.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    room.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    ulnet_room_set_protocol_version(&room, ULNET_PROTOCOL_VERSION_SAVE_STATE_HASH);
+    ulnet_room_set_save_state_hash_algorithm(&room, ULNET_SAVE_STATE_HASH_XXH3);
+    ulnet_session_t *session = ulnet__test_ram_core_session(core, &room, SAM2_AUTHORITY_INDEX);
+    session->retro_run = ulnet__test_ram_core_retro_run_counter;
+
+    for (int i = 0; i < ULNET_DELAY_BUFFER_SIZE_MAX; i++) {
+        expected_frame[i] = -1;
+    }
+
+    // The hash of a frame isn't there right after serializing it, but two ticks later a worker has to have delivered it
+    int64_t delay_buffer_size = ulnet_delay_buffer_size(session);
+    int64_t frames_checked = 0;
+    for (int iteration = 0; iteration < 256 && session->frame_counter < 60; iteration++) {
+        session->frame_pacer.tick_at_usec = 0;
+        int poll_status = ulnet_poll_session(session, true, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        if (poll_status & ULNET_POLL_SESSION_SAVED_STATE) {
+            int64_t frame = session->state[SAM2_AUTHORITY_INDEX].save_state_frame;
+            expected_frame[frame % delay_buffer_size] = frame;
+            expected_hash[frame % delay_buffer_size] = ulnet_save_state_hash(ULNET_SAVE_STATE_HASH_XXH3, save_state, ULNET__TEST_RAM_SIZE);
+        }
+
+        for (int i = 0; i < delay_buffer_size; i++) {
+            int64_t frame = expected_frame[i];
+            if (frame == -1 || session->frame_counter - frame < 3) continue;
+
+            if (session->state[SAM2_AUTHORITY_INDEX].save_state_hash[i] != expected_hash[i]) {
+                SAM2_LOG_ERROR("Hash for frame %" PRId64 " was %08" PRIx32 " on frame %" PRId64 " expected %08" PRIx32,
+                    frame, session->state[SAM2_AUTHORITY_INDEX].save_state_hash[i], session->frame_counter, expected_hash[i]);
+                status = 1;
+            }
+            expected_frame[i] = -1;
+            frames_checked++;
+        }
+    }
+
+    if (frames_checked < 50) {
+        SAM2_LOG_ERROR("Only checked the hashes of %" PRId64 " frames", frames_checked);
+        status = 1;
+    }
+
+    ulnet__test_session_free(session);
+    free(save_state);
+    free(core);
+    return status;
+}
+
+int ulnet_test_save_state_fan_out() {
+    ulnet_session_t *sessions[1 + ULNET__TEST_FAN_OUT_SPECTATORS] = {0};
+    ulnet__test_ram_core_t *cores = (ulnet__test_ram_core_t *)calloc(SAM2_ARRAY_LENGTH(sessions), sizeof(ulnet__test_ram_core_t));
+    ulnet_transport_inproc_t *transports = (ulnet_transport_inproc_t *)calloc(ULNET__TEST_FAN_OUT_SPECTATORS, sizeof(ulnet_transport_inproc_t));
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 0);
+    }
+
+    sam2_room_t room = {0};
+    room.flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    room.peer_ids[SAM2_AUTHORITY_INDEX] = 10001;
+    for (int i = 0; i < ULNET__TEST_FAN_OUT_SPECTATORS; i++) {
+        room.peer_ids[SAM2_SPECTATOR_START + i] = 30002 + i;
+    }
+
+    sessions[0] = ulnet__test_ram_core_session(&cores[0], &room, SAM2_AUTHORITY_INDEX);
+    for (int i = 0; i < ULNET__TEST_FAN_OUT_SPECTATORS; i++) {
+        sessions[1 + i] = ulnet__test_ram_core_session(&cores[1 + i], &room, SAM2_SPECTATOR_START + i);
+        ulnet__test_inproc_connect(sessions[0], sessions[1 + i], SAM2_SPECTATOR_START + i, &transports[i]);
+    }
+
+    // The first wave joins all at once and the last spectator rejoins a frame later without a baseline, neither should need a second encode
+    for (int wave = 0; wave < 2; wave++) {
+        for (int i = wave == 0 ? 0 : ULNET__TEST_FAN_OUT_SPECTATORS - 1; i < ULNET__TEST_FAN_OUT_SPECTATORS; i++) {
+            int p = SAM2_SPECTATOR_START + i;
+            ulnet_session_release_save_state_buffers(sessions[1 + i]);
+            sessions[1 + i]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+            sessions[1 + i]->flags &= ~ULNET_SESSION_FLAG_BASELINE_ADVERTISED;
+            sessions[0]->peer_needs_sync_bitfield |= 1ULL << p;
+            sessions[0]->peer_baseline_advertised_bitfield &= ~(1ULL << p);
+            sessions[0]->peer_needs_sync_since_usec[p] = ulnet__get_unix_time_microseconds();
+        }
+
+        bool all_loaded = false;
+        for (int iteration = 0; iteration < 256 && !all_loaded; iteration++) {
+            all_loaded = true;
+            for (int i = SAM2_ARRAY_LENGTH(sessions) - 1; i >= 0; i--) {
+                sessions[i]->frame_pacer.tick_at_usec = 0;
+                ulnet_poll_session(sessions[i], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+                if (i == 0) {
+                    // However long compressing takes on the workers the rejoin has to land within the frames an encoding is reused for
+                    ulnet__save_state_encode_flush(sessions[0]);
+                }
+                all_loaded &= sessions[i]->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+            }
+        }
+
+        if (!all_loaded) {
+            SAM2_LOG_ERROR("Spectators never loaded a savestate in wave %d", wave);
+            status = 1;
+            goto cleanup;
+        }
+    }
+
+    if (sessions[0]->save_state_encode_count != 1) {
+        SAM2_LOG_ERROR("Expected one savestate encode for every sync got %" PRId64, sessions[0]->save_state_encode_count);
+        status = 1;
+    }
+
+    for (int i = 1; i < SAM2_ARRAY_LENGTH(sessions); i++) {
+        int loaded = ulnet__baseline_most_recent(sessions[i]);
+        if (ulnet__baseline_find(sessions[0], sessions[i]->baseline_save_state_frame[loaded], sessions[i]->baseline_save_state_xxhash[loaded]) == -1) {
+            SAM2_LOG_ERROR("Spectator %d loaded a savestate the authority never sent", i);
+            status = 1;
+        }
+    }
+
+cleanup:
+    for (int i = 0; i < SAM2_ARRAY_LENGTH(sessions); i++) {
+        ulnet__test_session_free(sessions[i]);
+    }
+    free(save_state);
+    free(transports);
+    free(cores);
+    return status;
+}
+
+// Drops the last few savestate fragments in flight and delivers the rest in reverse so reassembly has to lean on parity
+// and hold on to fragments from later packet groups until one from the first group tells it the layout
+static int ulnet__test_mangle_save_state_fragments(ulnet_inproc_buf_t *buf, int drop_count) {
+    static ulnet_inproc_buf_t mangled;
+    int fragments[SAM2_ARRAY_LENGTH(buf->msg)];
+    int fragment_count = 0;
+
+    mangled.count = 0;
+    for (int i = 0; i < buf->count; i++) {
+        if ((buf->msg[i][0] & ULNET_CHANNEL_MASK) == ULNET_CHANNEL_SAVESTATE_TRANSFER) {
+            fragments[fragment_count++] = i;
+        } else {
+            memcpy(mangled.msg[mangled.count], buf->msg[i], buf->msg_size[i]);
+            mangled.msg_size[mangled.count++] = buf->msg_size[i];
+        }
+    }
+
+    for (int i = fragment_count - 1; i >= drop_count; i--) {
+        memcpy(mangled.msg[mangled.count], buf->msg[fragments[i - drop_count]], buf->msg_size[fragments[i - drop_count]]);
+        mangled.msg_size[mangled.count++] = buf->msg_size[fragments[i - drop_count]];
+    }
+
+    if (fragment_count > 0) {
+        memcpy(buf, &mangled, sizeof(mangled));
+    }
+
+    return fragment_count;
+}
+
+int ulnet_test_save_state_reassembly() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 1);
+    }
+
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+    sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+    // The authority has the smaller peer id so it sends on buf1
+    bool mangled = false;
+    for (int iteration = 0; iteration < 256 && sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL; iteration++) {
+        for (int i = 1; i >= 0; i--) {
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+
+        if (!mangled) {
+            mangled = ulnet__test_mangle_save_state_fragments(&transport->buf1, 3) > 0;
+        }
+    }
+
+    int loaded = ulnet__baseline_most_recent(sessions[1]);
+    if (sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL || loaded == -1) {
+        SAM2_LOG_ERROR("Spectator never reassembled the savestate");
+        status = 1;
+    } else if (ulnet__baseline_find(sessions[0], sessions[1]->baseline_save_state_frame[loaded], sessions[1]->baseline_save_state_xxhash[loaded]) == -1) {
+        SAM2_LOG_ERROR("Spectator reassembled a savestate the authority never sent");
+        status = 1;
+    } else if (sessions[1]->transfer_buffer_in_use_bitfield || sessions[0]->transfer_buffer_in_use_bitfield) {
+        SAM2_LOG_ERROR("A pooled transfer buffer was never returned");
+        status = 1;
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+static uint32_t ulnet__test_loaded_xxhash;
+static bool ulnet__test_hash_retro_unserialize(void *user_ptr, const void *data, size_t size) {
+    ulnet__test_loaded_xxhash = ulnet_xxh32(data, size, 0);
+    return true;
+}
+
+static void ulnet__test_deliver_save_state_block(ulnet_session_t *sessions[2], ulnet_transport_inproc_t *transport,
+                                                 ulnet_save_state_encoding_t *encoding, int group, int index) {
+    ulnet__save_state_send_block(sessions[0], SAM2_SPECTATOR_START, encoding, group, index);
+    ulnet__receive_save_state_fragment(sessions[1], SAM2_AUTHORITY_INDEX, transport->buf1.msg[0], transport->buf1.msg_size[0], false);
+    transport->buf1.count = 0;
+}
+
+// Fragments from later packet groups that show up before any from the first group have nowhere to go yet so they're held until one does
+int ulnet_test_save_state_held_fragments() {
+    const size_t save_state_size = 512 * 1024;
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(save_state_size);
+    int status = 0;
+
+    for (size_t i = 0; i < save_state_size; i++) {
+        save_state[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 2);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->retro_unserialize = ulnet__test_hash_retro_unserialize;
+    }
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+
+    ulnet_save_state_encoding_t *encoding = &sessions[0]->save_state_encoding[
+        ulnet__save_state_encode(sessions[0], -1, NULL, false, 0.0f, save_state, save_state_size, 100)];
+    if (encoding->packet_groups < 2) {
+        SAM2_LOG_ERROR("Savestate fit in %d packet group", encoding->packet_groups);
+        status = 1;
+        goto cleanup;
+    }
+
+    // Only data blocks are sent so every held fragment is needed to decode
+    int late = 3;
+    for (int i = 0; i < encoding->k; i++) {
+        for (int group = 0; group < encoding->packet_groups; group++) {
+            if (group != 0 || i >= late) {
+                ulnet__test_deliver_save_state_block(sessions, transport, encoding, group, i);
+            }
+        }
+
+        if (i == late - 1) {
+            if (sessions[1]->remote_savestate_held_count != late * (encoding->packet_groups - 1)) {
+                SAM2_LOG_ERROR("Held %d fragments instead of %d", sessions[1]->remote_savestate_held_count, late * (encoding->packet_groups - 1));
+                status = 1;
+            }
+
+            for (int late_index = 0; late_index < late; late_index++) {
+                ulnet__test_deliver_save_state_block(sessions, transport, encoding, 0, late_index);
+            }
+        }
+    }
+
+    if (sessions[1]->frame_counter != 100 || ulnet__test_loaded_xxhash != ulnet_xxh32(save_state, save_state_size, 0)) {
+        SAM2_LOG_ERROR("Spectator didn't load the savestate after the fragments it held were placed");
+        status = 1;
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Leftover parity of a savestate we loaded is dropped, but a new savestate is loaded even while we're running
+int ulnet_test_save_state_transfer_id() {
+    const size_t save_state_size = 64 * 1024;
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(save_state_size);
+    int status = 0;
+
+    for (size_t i = 0; i < save_state_size; i++) {
+        save_state[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 3);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->retro_unserialize = ulnet__test_hash_retro_unserialize;
+    }
+    sessions[1]->frame_counter = 50;
+
+    for (int transfer = 0; transfer < 2; transfer++) {
+        ulnet_save_state_encoding_t *encoding = &sessions[0]->save_state_encoding[
+            ulnet__save_state_encode(sessions[0], -1, NULL, false, 0.0f, save_state, save_state_size, 100 + transfer)];
+        sessions[0]->peer_save_state_transfer_id[SAM2_SPECTATOR_START]++;
+
+        for (int i = 0; i < encoding->k; i++) {
+            for (int group = 0; group < encoding->packet_groups; group++) {
+                ulnet__test_deliver_save_state_block(sessions, transport, encoding, group, i);
+            }
+        }
+
+        if (sessions[1]->frame_counter != 100 + transfer) {
+            SAM2_LOG_ERROR("Savestate %d wasn't loaded by a peer that was already running", transfer);
+            status = 1;
+            break;
+        }
+
+        ulnet__test_deliver_save_state_block(sessions, transport, encoding, 0, encoding->n - 1);
+        if (sessions[1]->remote_savestate_transfer || sessions[1]->remote_savestate_held_count) {
+            SAM2_LOG_ERROR("Parity left over from savestate %d started a new transfer", transfer);
+            status = 1;
+            break;
+        }
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Hands the authority whatever the spectator sent it, lets it tick so its acks go out and hands the spectator everything it sent back
+static void ulnet__test_exchange_save_state_messages(ulnet_session_t *sessions[2], ulnet_transport_inproc_t *transport,
+                                                     uint8_t *save_state, bool repairs_lost) {
+    sessions[0]->debug_udp_send_drop_rate = repairs_lost ? 1.0f : 0.0f;
+    for (int i = 0; i < transport->buf2.count; i++) {
+        ulnet_receive_packet_callback((juice_agent_t *) transport, (const char *) transport->buf2.msg[i], transport->buf2.msg_size[i], sessions[0]);
+    }
+    transport->buf2.count = 0;
+    sessions[0]->debug_udp_send_drop_rate = 0.0f;
+
+    sessions[0]->frame_pacer.tick_at_usec = 0;
+    ulnet_poll_session(sessions[0], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+
+    for (int i = 0; i < transport->buf1.count; i++) {
+        ulnet_receive_packet_callback((juice_agent_t *) transport, (const char *) transport->buf1.msg[i], transport->buf1.msg_size[i], sessions[1]);
+    }
+    transport->buf1.count = 0;
+}
+
+// Losing the whole first packet group leaves every other fragment held, so the spectator has to ask for it
+// and a transfer that repairs can't finish is given up on for a new savestate instead of stalling forever
+int ulnet_test_save_state_repair_fallback() {
+    const size_t save_state_size = 512 * 1024;
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(save_state_size);
+    int status = 0;
+
+    for (size_t i = 0; i < save_state_size; i++) {
+        save_state[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 4);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->save_state_repair_delay_microseconds = 0;
+        sessions[i]->retro_unserialize = ulnet__test_hash_retro_unserialize;
+    }
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+
+    // Everything sent to the spectator is lost except a few blocks from the later groups we hand it ourselves
+    ulnet_save_state_encoding_t *encoding = &sessions[0]->save_state_encoding[
+        ulnet__save_state_encode(sessions[0], -1, NULL, false, 0.0f, save_state, save_state_size, 100)];
+    sessions[0]->debug_udp_send_drop_rate = 1.0f;
+    ulnet__save_state_send_encoding(sessions[0], SAM2_SPECTATOR_START, encoding);
+    sessions[0]->debug_udp_send_drop_rate = 0.0f;
+
+    for (int group = 1; group < encoding->packet_groups; group++) {
+        ulnet__test_deliver_save_state_block(sessions, transport, encoding, group, 0);
+    }
+
+    ulnet__save_state_request_repair(sessions[1]);
+    ulnet__test_exchange_save_state_messages(sessions, transport, save_state, false);
+    if (!sessions[1]->remote_savestate_transfer || sessions[1]->remote_savestate_held_count != 0) {
+        SAM2_LOG_ERROR("Spectator still didn't know the layout after asking for the first packet group");
+        status = 1;
+        goto cleanup;
+    }
+
+    // None of the repairs make it, the spectator waits out a round trip between each of them
+    int64_t give_up_usec = ulnet__get_unix_time_microseconds() + 5000000;
+    while (sessions[1]->remote_savestate_transfer && ulnet__get_unix_time_microseconds() < give_up_usec) {
+        int repair_requests = sessions[1]->remote_savestate_repair_requests;
+        ulnet__save_state_request_repair(sessions[1]);
+        if (sessions[1]->remote_savestate_repair_requests != repair_requests) {
+            ulnet__test_exchange_save_state_messages(sessions, transport, save_state, true);
+        }
+    }
+
+    if (sessions[1]->remote_savestate_transfer) {
+        SAM2_LOG_ERROR("Spectator kept repairing after %d requests", sessions[1]->remote_savestate_repair_requests);
+        status = 1;
+        goto cleanup;
+    }
+
+    // Stragglers from the transfer it gave up on can't start it over
+    ulnet__test_deliver_save_state_block(sessions, transport, encoding, 0, 1);
+    if (sessions[1]->remote_savestate_transfer) {
+        SAM2_LOG_ERROR("A fragment of the abandoned transfer started it again");
+        status = 1;
+        goto cleanup;
+    }
+
+    ulnet__test_exchange_save_state_messages(sessions, transport, save_state, false);
+    if (sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        SAM2_LOG_ERROR("Spectator didn't get a new savestate after it gave up repairing");
+        status = 1;
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// A packet group that loses more blocks than it has parity gets repaired from the same encoding instead of a new transfer
+int ulnet_test_save_state_repair() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 3);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->save_state_repair_delay_microseconds = 0;
+    }
+
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+    sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+    // Lose every parity block and a few data blocks on top so the group can't decode from the first burst
+    bool mangled = false;
+    for (int iteration = 0; iteration < 256 && sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL; iteration++) {
+        for (int i = 1; i >= 0; i--) {
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+
+        if (!mangled) {
+            mangled = ulnet__test_mangle_save_state_fragments(&transport->buf1, sessions[0]->save_state_sent_redundant_blocks + 3) > 0;
+        }
+    }
+
+    if (sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        SAM2_LOG_ERROR("Spectator never loaded the savestate after losing more blocks than there was parity");
+        status = 1;
+    } else if (sessions[0]->save_state_repair_blocks_sent < 3) {
+        SAM2_LOG_ERROR("Authority only resent %" PRId64 " blocks", sessions[0]->save_state_repair_blocks_sent);
+        status = 1;
+    } else if (sessions[0]->save_state_encode_count != 1) {
+        SAM2_LOG_ERROR("Authority encoded %" PRId64 " savestates instead of repairing the first", sessions[0]->save_state_encode_count);
+        status = 1;
+    } else if (sessions[1]->transfer_buffer_in_use_bitfield || sessions[0]->transfer_buffer_in_use_bitfield) {
+        SAM2_LOG_ERROR("A pooled transfer buffer was never returned");
+        status = 1;
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Savestate fragments go out a bucket at a time while the authority's input keeps going out on every poll
+int ulnet_test_bulk_pacing() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 4);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->bulk_send_bytes_per_second = 1000000;
+    }
+
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+    sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+    // The authority has the smaller peer id so it sends on buf1, over a link twice as fast as the pacer so only the bursts queue
+    transport->buf1.bottleneck_bytes_per_second = 2 * sessions[0]->bulk_send_bytes_per_second;
+    transport->buf1.bottleneck_queue_usec_max = 150000;
+
+    int polls_with_fragments = 0;
+    int64_t input_queue_usec_max = 0;
+    for (int iteration = 0; iteration < 2000 && sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL; iteration++) {
+        sessions[1]->frame_pacer.tick_at_usec = 0;
+        ulnet_poll_session(sessions[1], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+
+        // What one poll of the authority put on the link. Delays are counted from the end of the poll where its input is queued,
+        // without workers the same poll also compresses the savestate
+        int32_t count_before = transport->buf1.count;
+        sessions[0]->frame_pacer.tick_at_usec = 0;
+        ulnet_poll_session(sessions[0], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+
+        int fragment_bytes = 0, input_packets = 0;
+        for (int i = count_before; i < transport->buf1.count; i++) {
+            uint8_t channel = transport->buf1.msg[i][0] & ULNET_CHANNEL_MASK;
+            if (channel == ULNET_CHANNEL_SAVESTATE_TRANSFER) fragment_bytes += transport->buf1.msg_size[i];
+            if (channel == ULNET_CHANNEL_RELIABLE && (transport->buf1.msg[i][0] & ULNET_RELIABLE_FLAG_ACK_ONLY)) {
+                input_queue_usec_max = SAM2_MAX(input_queue_usec_max, transport->buf1.deliver_at_usec[i] - current_time_usec);
+                input_packets++;
+            }
+        }
+
+        if (fragment_bytes > ulnet__bulk_burst_bytes((double) sessions[0]->bulk_send_bytes_per_second)) {
+            SAM2_LOG_ERROR("Authority sent %d bytes of savestate in one poll, more than a burst", fragment_bytes);
+            status = 1;
+            break;
+        }
+
+        if (fragment_bytes > 0) {
+            polls_with_fragments++;
+            if (input_packets == 0) {
+                SAM2_LOG_ERROR("Authority held back its input while sending savestate fragments");
+                status = 1;
+                break;
+            }
+        }
+
+        ulnet__sleep(1);
+    }
+
+    // The input went out after the burst of its poll and the link takes half as long to drain it as the pacer takes to send it
+    if (status == 0 && input_queue_usec_max > ULNET_BULK_BURST_USEC) {
+        SAM2_LOG_ERROR("Input waited up to %" PRId64 " us behind savestate fragments", input_queue_usec_max);
+        status = 1;
+    }
+
+    if (status == 0 && sessions[1]->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        SAM2_LOG_ERROR("Spectator never loaded the paced savestate");
+        status = 1;
+    } else if (status == 0 && polls_with_fragments < 2) {
+        SAM2_LOG_ERROR("Savestate went out in %d polls, it wasn't paced", polls_with_fragments);
+        status = 1;
+    }
+
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Sends a 512 KB savestate over a simulated 1 MB/s link with a 150 ms buffer and 20 ms of propagation delay each way, measures how long
+// the spectator waited for it and how long the authority's 60 Hz input sat in the link's queue behind it. The link and the spectator's
+// delay feedback are simulated here on a synthetic clock like ulnet_test_frame_pacer so scheduling hiccups don't show up in the numbers
+static int ulnet__test_bottleneck_transfer(bool delay_based, int64_t *sync_usec, int64_t *input_queue_usec_max, int64_t *input_queue_usec_mean, int64_t *dropped) {
+    const int save_state_size = 512 * 1024;
+    const int64_t link_bytes_per_second = 1000000, link_queue_usec_max = 150000, propagation_usec = 20000;
+    const int64_t frame_usec = 16667, step_usec = 50, input_packet_bytes = 64;
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *big_save_state = (uint8_t *)malloc(save_state_size);
+    int status = 0;
+
+    for (int i = 0; i < save_state_size; i++) {
+        big_save_state[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 5); // Incompressible so the whole thing crosses the link
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i]->flags |= delay_based ? ULNET_SESSION_FLAG_DELAY_BASED_PACING : 0;
+        sessions[i]->bulk_send_bytes_per_second = 4 * link_bytes_per_second; // Configured well past what the link can take
+    }
+    sessions[0]->rtt_smoothed_usec[SAM2_SPECTATOR_START] = 2 * propagation_usec;
+
+    // Fragments and feedback in flight, both are FIFOs so they arrive in the order they were sent
+    int64_t fragment_sent_usec[1024], fragment_arrive_usec[1024];
+    int64_t feedback_arrive_usec[64];
+    int32_t feedback_queuing_delay_usec[64];
+    int fragment_head = 0, fragment_tail = 0, feedback_head = 0, feedback_tail = 0;
+
+    // It's compressed on a worker, the transfer is timed from when the first fragments go out
+    ulnet_send_save_state(sessions[0], SAM2_SPECTATOR_START, big_save_state, save_state_size, sessions[0]->frame_counter);
+    ulnet__save_state_encode_flush(sessions[0]);
+    if (!(sessions[0]->bulk_pending_bitfield & (1ULL << SAM2_SPECTATOR_START))) {
+        SAM2_LOG_ERROR("Savestate wasn't queued once its encode finished");
+        status = 1;
+    }
+
+    int64_t start_usec = ulnet__get_monotonic_time_microseconds();
+    int64_t link_free_usec = start_usec, last_arrival_usec = start_usec;
+    int64_t input_packets = 0, input_queue_usec_total = 0;
+    sessions[0]->frame_pacer.tick_at_usec = start_usec + frame_usec;
+    *input_queue_usec_max = 0;
+    *dropped = 0;
+
+    for (int64_t t = start_usec; status == 0; t += step_usec) {
+        if (t - start_usec > 10000000) {
+            SAM2_LOG_ERROR("Savestate never made it across the bottleneck");
+            status = 1;
+            break;
+        }
+
+        // The authority ticks and sends its input, it only waits behind what's already on the link
+        if (t >= sessions[0]->frame_pacer.tick_at_usec) {
+            int64_t queue_usec = SAM2_MAX(link_free_usec - t, (int64_t) 0);
+            link_free_usec = SAM2_MAX(link_free_usec, t) + input_packet_bytes * 1000000 / link_bytes_per_second;
+            *input_queue_usec_max = SAM2_MAX(*input_queue_usec_max, queue_usec);
+            input_queue_usec_total += queue_usec;
+            input_packets++;
+            sessions[0]->frame_pacer.tick_at_usec += frame_usec;
+        }
+
+        ulnet__bulk_send(sessions[0], t);
+        for (int i = 0; i < transport->buf1.count; i++) {
+            int64_t link_start_usec = SAM2_MAX(link_free_usec, t);
+            if (link_start_usec - t > link_queue_usec_max) {
+                (*dropped)++; // Tail drop like a router with a full buffer
+                continue;
+            }
+
+            link_free_usec = link_start_usec + transport->buf1.msg_size[i] * 1000000 / link_bytes_per_second;
+            if ((transport->buf1.msg[i][0] & ULNET_CHANNEL_MASK) == ULNET_CHANNEL_SAVESTATE_TRANSFER) {
+                fragment_sent_usec[fragment_tail % 1024] = t;
+                fragment_arrive_usec[fragment_tail % 1024] = link_free_usec + propagation_usec;
+                fragment_tail++;
+            }
+        }
+        transport->buf1.count = 0;
+
+        // The spectator measures the fragments' one-way delay, its reports to the authority are delivered below instead of through buf2
+        for (; fragment_head < fragment_tail && fragment_arrive_usec[fragment_head % 1024] <= t; fragment_head++) {
+            last_arrival_usec = fragment_arrive_usec[fragment_head % 1024];
+            ulnet__ledbat_sample(sessions[1], (uint32_t) fragment_sent_usec[fragment_head % 1024], last_arrival_usec);
+            if (sessions[1]->ledbat_feedback_sent_usec == last_arrival_usec) {
+                feedback_arrive_usec[feedback_tail % 64] = last_arrival_usec + propagation_usec;
+                feedback_queuing_delay_usec[feedback_tail % 64] = sessions[1]->ledbat_queuing_delay_usec;
+                feedback_tail++;
+            }
+        }
+        transport->buf2.count = 0;
+
+        for (; feedback_head < feedback_tail && feedback_arrive_usec[feedback_head % 64] <= t; feedback_head++) {
+            ulnet__bulk_delay_feedback(sessions[0], SAM2_SPECTATOR_START, feedback_queuing_delay_usec[feedback_head % 64], t);
+        }
+
+        if (!(sessions[0]->bulk_pending_bitfield & (1ULL << SAM2_SPECTATOR_START)) && fragment_head == fragment_tail) {
+            break;
+        }
+    }
+
+    *sync_usec = last_arrival_usec - start_usec;
+    *input_queue_usec_mean = input_packets ? input_queue_usec_total / input_packets : 0;
+    ulnet__test_pair_tear_down(&pair);
+    free(big_save_state);
+    return status;
+}
+
+// Over a link slower than the configured rate, delay-based pacing should keep input within a millisecond of not queuing at all
+int ulnet_test_delay_based_pacing() {
+    int64_t sync_usec, input_queue_usec_max, input_queue_usec_mean, dropped;
+    if (ulnet__test_bottleneck_transfer(true, &sync_usec, &input_queue_usec_max, &input_queue_usec_mean, &dropped) != 0) {
+        return 1;
+    }
+
+    if (dropped > 0) {
+        SAM2_LOG_ERROR("Delay-based pacing overflowed the bottleneck, %" PRId64 " packets were dropped", dropped);
+        return 1;
+    }
+
+    // Half the budget since the simulated link has none of the jitter a real one does
+    if (input_queue_usec_mean > 500) {
+        SAM2_LOG_ERROR("Input waited %" PRId64 " us on average behind savestate fragments", input_queue_usec_mean);
+        return 1;
+    }
+
+    // Slow start overshoots for a few frames before the queue shows up in the feedback, it shouldn't get anywhere near the 150 ms buffer
+    if (input_queue_usec_max > 20000) {
+        SAM2_LOG_ERROR("Input waited up to %" PRId64 " us behind savestate fragments", input_queue_usec_max);
+        return 1;
+    }
+
+    // 512 KB at 1 MB/s is half a second, it shouldn't back off so far it takes several times that
+    if (sync_usec > 2000000) {
+        SAM2_LOG_ERROR("Delay-based pacing took %" PRId64 " us to send the savestate", sync_usec);
+        return 1;
+    }
+
+    return 0;
+}
+
+// A spectator that starts dropping packets should get its next savestate with more parity than the first
+int ulnet_test_adaptive_fec() {
+    ulnet__test_pair_t pair = ulnet__test_pair_set_up(SAM2_SPECTATOR_START);
+    ulnet_session_t **sessions = pair.sessions;
+    ulnet__test_ram_core_t *cores = pair.cores;
+    ulnet_transport_inproc_t *transport = pair.transport;
+    uint8_t *save_state = (uint8_t *)malloc(ULNET__TEST_RAM_SIZE);
+    int status = 0;
+
+    // Heavy loss gives up parity before a savestate as big as version 0 could send stops fitting in a transfer
+    int n, k, packet_groups, packet_size = ULNET_PACKET_SIZE_BYTES_MAX - (int) sizeof(ulnet_save_state_packet_header_t);
+    ulnet__save_state_partition(FEC_PACKET_GROUPS_MAX * (GF_SIZE - FEC_REDUNDANT_BLOCKS) * packet_size, 0.3f, &n, &k, &packet_size, &packet_groups);
+    if (packet_groups > FEC_PACKET_GROUPS_MAX || n - k < 1) {
+        SAM2_LOG_ERROR("Largest savestate took %d packet groups with %d redundant blocks each", packet_groups, n - k);
+        status = 1;
+    }
+
+    for (int i = 0; i < ULNET__TEST_RAM_SIZE; i++) {
+        cores[0].ram[i] = (uint8_t) ulnet_xxh32(&i, sizeof(i), 2);
+    }
+
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    sessions[0]->peer_needs_sync_bitfield |= 1ULL << SAM2_SPECTATOR_START;
+    sessions[0]->peer_needs_sync_since_usec[SAM2_SPECTATOR_START] = ulnet__get_unix_time_microseconds();
+
+    int lossless_redundant_blocks = -1;
+    if (ulnet__test_sync_spectator(sessions, save_state) == -1) {
+        SAM2_LOG_ERROR("Spectator never loaded the first savestate");
+        status = 1;
+        goto cleanup;
+    }
+    lossless_redundant_blocks = sessions[0]->save_state_sent_redundant_blocks;
+
+    sessions[1]->debug_udp_recv_drop_rate = 0.15f;
+    for (int iteration = 0; iteration < 4096; iteration++) {
+        if (   sessions[1]->packet_loss_measured_bitfield & (1ULL << SAM2_AUTHORITY_INDEX)
+            && sessions[1]->packet_loss[SAM2_AUTHORITY_INDEX] > 0.05f) {
+            break;
+        }
+
+        for (int i = 1; i >= 0; i--) {
+            sessions[i]->frame_pacer.tick_at_usec = 0;
+            ulnet_poll_session(sessions[i], false, save_state, ULNET__TEST_RAM_SIZE, 60.0, 0.0);
+        }
+    }
+
+    if (!(sessions[1]->packet_loss_measured_bitfield & (1ULL << SAM2_AUTHORITY_INDEX))
+        || sessions[1]->packet_loss[SAM2_AUTHORITY_INDEX] <= 0.05f) {
+        SAM2_LOG_ERROR("Spectator never measured the packet loss it induced");
+        status = 1;
+        goto cleanup;
+    }
+
+    sessions[1]->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    ulnet__baseline_advertise(sessions[1], ULNET_BASELINE_FLAG_RESYNC);
+    if (ulnet__test_sync_spectator(sessions, save_state) == -1) {
+        SAM2_LOG_ERROR("Spectator never loaded a savestate while dropping packets");
+        status = 1;
+    } else if (sessions[0]->save_state_sent_redundant_blocks <= lossless_redundant_blocks) {
+        SAM2_LOG_ERROR("Savestate sent with %d redundant blocks per group after packet loss was reported, %d before",
+            sessions[0]->save_state_sent_redundant_blocks, lossless_redundant_blocks);
+        status = 1;
+    }
+
+cleanup:
+    ulnet__test_pair_tear_down(&pair);
+    free(save_state);
+    return status;
+}
+
+// Two players mashing digital buttons with an analog stick on port 1, the common case for the input channel
+static void ulnet__test_fill_state(ulnet_state_t *state, int64_t frame, int64_t delay_buffer_size) {
+    memset(state, 0, sizeof(*state));
+    state->frame = frame;
+    state->save_state_frame = frame - 2;
+    for (int64_t f = SAM2_MAX(frame - delay_buffer_size + 1, 0); f <= frame; f++) {
+        int64_t i = f % delay_buffer_size;
+        state->input_state[i][0][f / 5 % 12] = 1;
+        state->input_state[i][1][(f / 7) % 2] = 1;
+        state->input_state[i][1][16] = (int16_t) (-1234 * (f / 3 % 2));
+        state->save_state_hash[i] = (uint32_t) f * 0x9E3779B1;
+    }
+}
+
+int ulnet_test_input_format() {
+    ulnet_session_t *session = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+    ulnet_state_t *state = (ulnet_state_t *)malloc(sizeof(ulnet_state_t));
+    ulnet_state_t *decoded = (ulnet_state_t *)malloc(sizeof(ulnet_state_t));
+    uint8_t packet[ULNET_PACKET_SIZE_BYTES_MAX];
+    uint8_t *coded = &packet[sizeof(ulnet_state_packet_t)];
+    int status = 0;
+
+    ulnet_session_init_defaulted(session);
+    int64_t delay_buffer_size = ulnet_delay_buffer_size(session);
+    ulnet__test_fill_state(state, 21, delay_buffer_size);
+    state->room_xor_delta[3].flags = SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    strcpy(state->core_option[5].key, "netplay_delay_frames");
+    strcpy(state->core_option[5].value, "2");
+
+    // Rooms from before input formats were versioned get the format byte left off
+    uint8_t formats[] = { ULNET_INPUT_FORMAT_LEGACY, ULNET_INPUT_FORMAT_RLE8, ULNET_INPUT_FORMAT_COMPACT };
+    for (int f = 0; f < SAM2_ARRAY_LENGTH(formats); f++) {
+        ulnet_room_set_protocol_version(&session->room_we_are_in, formats[f] == ULNET_INPUT_FORMAT_LEGACY ? 0 : SAM2_VERSION_MINOR);
+        int64_t coded_size = ulnet__encode_state(session, state, formats[f], coded, sizeof(packet) - sizeof(ulnet_state_packet_t));
+        memset(decoded, 0xCD, sizeof(ulnet_state_t));
+
+        if (coded_size < 0 || ulnet__decode_state(session, coded, coded_size, decoded) < 0) {
+            SAM2_LOG_ERROR("Failed to round trip input format %d", formats[f]);
+            status = 1;
+            continue;
+        }
+
+        if (   decoded->frame != state->frame
+            || decoded->save_state_frame != state->save_state_frame
+            || memcmp(decoded->input_state, state->input_state, delay_buffer_size * sizeof(state->input_state[0]))
+            || memcmp(decoded->room_xor_delta, state->room_xor_delta, delay_buffer_size * sizeof(state->room_xor_delta[0]))
+            || memcmp(decoded->core_option, state->core_option, delay_buffer_size * sizeof(state->core_option[0]))
+            || memcmp(decoded->save_state_hash, state->save_state_hash, delay_buffer_size * sizeof(state->save_state_hash[0]))
+            || memcmp(decoded->input_state_hash, state->input_state_hash, delay_buffer_size * sizeof(state->input_state_hash[0]))) {
+            SAM2_LOG_ERROR("Input format %d did not round trip", formats[f]);
+            status = 1;
+        }
+
+        // A truncated packet must be rejected without touching the destination
+        memset(decoded, 0xCD, sizeof(ulnet_state_t));
+        if (ulnet__decode_state(session, coded, coded_size - 1, decoded) >= 0 || decoded->frame != (int64_t) 0xCDCDCDCDCDCDCDCDULL) {
+            SAM2_LOG_ERROR("Input format %d accepted a truncated packet", formats[f]);
+            status = 1;
+        }
+
+        int64_t frame = -1;
+        if (ulnet__get_frame_from_packet(session, packet, sizeof(ulnet_state_packet_t) + coded_size, &frame) < 0 || frame != state->frame) {
+            SAM2_LOG_ERROR("Input format %d gave the wrong frame without a full decode", formats[f]);
+            status = 1;
+        }
+    }
+
+    free(decoded);
+    free(state);
+    ulnet_session_release_save_state_buffers(session);
+    free(session);
+    return status;
+}
+
+// Byte at a time versions of the rle8 routines the way they were written before they were vectorized
+static int64_t ulnet__test_rle8_encode_scalar(const uint8_t *input, int64_t input_size, uint8_t *output, int64_t output_capacity) {
+    int64_t output_size = 0;
+    for (int64_t i = 0; i < input_size; ++i) {
+        if (input[i] == 0) {
+            uint16_t count = 1;
+            while (i + 1 < input_size && input[i + 1] == 0 && count < 0xFFFF) {
+                count++;
+                i++;
+            }
+
+            if (output_size >= output_capacity-2) return -1;
+            output[output_size++] = 0;
+            output[output_size++] = (uint8_t)(count & 0xFF);
+            output[output_size++] = (uint8_t)((count >> 8) & 0xFF);
+        } else {
+            if (output_size >= output_capacity) return -1;
+            output[output_size++] = input[i];
+        }
+    }
+
+    return output_size;
+}
+
+static int64_t ulnet__test_rle8_decode_scalar(const uint8_t* input, int64_t input_size, uint8_t* output, int64_t output_capacity) {
+    int64_t output_index = 0;
+    int64_t input_consumed = 0;
+    while (input_consumed < input_size) {
+        if (output_index >= output_capacity) return output_index;
+        if (input[input_consumed] == 0) {
+            if (input_size - input_consumed < 3) return output_index;
+            uint16_t count = input[input_consumed + 1] | (input[input_consumed + 2] << 8);
+            input_consumed += 3;
+
+            while (count-- > 0) {
+                if (output_index >= output_capacity) return output_index;
+                output[output_index++] = 0;
+            }
+        } else {
+            output[output_index++] = input[input_consumed++];
+        }
+    }
+    return output_index;
+}
+
+// A ulnet_state_t for two players the way it sits in memory, which is what the RLE8 input format and spectator channel encode
+static void ulnet__test_rle8_payload(uint8_t *payload, int64_t payload_size, uint32_t seed) {
+    ulnet_state_t *state = (ulnet_state_t *)malloc(sizeof(ulnet_state_t));
+    ulnet__test_fill_state(state, 1000 + seed, ULNET_DELAY_BUFFER_SIZE_MAX);
+    for (int64_t i = 0; i < payload_size; i++) {
+        payload[i] = ((uint8_t *) state)[i % sizeof(ulnet_state_t)];
+    }
+    free(state);
+}
+
+int ulnet_test_rle8() {
+    const int64_t payload_size = sizeof(ulnet_state_t) + 70000; // Long enough to have a zero run that has to be split
+    uint8_t *payload = (uint8_t *)malloc(payload_size);
+    uint8_t *expected = (uint8_t *)malloc(RLE8_ENCODE_UPPER_BOUND(payload_size));
+    uint8_t *actual = (uint8_t *)malloc(RLE8_ENCODE_UPPER_BOUND(payload_size));
+    uint8_t *decoded = (uint8_t *)malloc(payload_size);
+    int status = 0;
+
+    ulnet__test_rle8_payload(payload, payload_size, 0);
+    memset(&payload[sizeof(ulnet_state_t)], 0, 70000);
+    for (int64_t i = 0; i < 4096; i++) payload[i] = (uint8_t) (i * 0x9E3779B1 >> 7); // Some stretches with isolated zeros too
+
+    // Every prefix size exercises the scalar tails, sizes around the SIMD block width matter most
+    for (int64_t size = 0; size < payload_size; size = size < 256 ? size + 1 : size * 3 / 2) {
+        int64_t expected_size = ulnet__test_rle8_encode_scalar(payload, size, expected, RLE8_ENCODE_UPPER_BOUND(payload_size));
+        int64_t actual_size = rle8_encode_capped(payload, size, actual, RLE8_ENCODE_UPPER_BOUND(payload_size));
+        if (expected_size != actual_size || memcmp(expected, actual, expected_size) != 0) {
+            SAM2_LOG_ERROR("rle8_encode_capped output differs from the scalar encoder for %" PRId64 " bytes", size);
+            status = 1;
+            break;
+        }
+
+        if (rle8_decode_size(actual, actual_size) != size) {
+            SAM2_LOG_ERROR("rle8_decode_size disagrees for %" PRId64 " bytes", size);
+            status = 1;
+            break;
+        }
+
+        // Capacities that cut off in the middle of literals and zero runs have to stop at the same place
+        for (int64_t capacity = size; capacity >= 0; capacity -= 1 + capacity / 3) {
+            int64_t expected_decoded = ulnet__test_rle8_decode_scalar(actual, actual_size, expected, capacity);
+            int64_t actual_decoded = rle8_decode(actual, actual_size, decoded, capacity);
+            if (expected_decoded != actual_decoded || memcmp(expected, decoded, actual_decoded) != 0) {
+                SAM2_LOG_ERROR("rle8_decode differs from the scalar decoder for %" PRId64 " bytes into %" PRId64, size, capacity);
+                status = 1;
+                break;
+            }
+            if (capacity == 0) break;
+        }
+
+        if (rle8_encode_capped(payload, size, actual, actual_size - 1) != (size ? -1 : 0)) {
+            SAM2_LOG_ERROR("rle8_encode_capped overran a buffer one byte too small for %" PRId64 " bytes", size);
+            status = 1;
+            break;
+        }
+    }
+
+    free(decoded);
+    free(actual);
+    free(expected);
+    free(payload);
+    return status;
+}
+
+void ulnet__bench_rle8() {
+    const int iterations = 2000;
+    const int64_t payload_size = sizeof(ulnet_state_t);
+    uint8_t *payload = (uint8_t *)malloc(payload_size);
+    uint8_t *coded = (uint8_t *)malloc(RLE8_ENCODE_UPPER_BOUND(payload_size));
+    volatile int64_t sink = 0;
+
+    ulnet__test_rle8_payload(payload, payload_size, 0);
+    int64_t coded_size = rle8_encode_capped(payload, payload_size, coded, RLE8_ENCODE_UPPER_BOUND(payload_size));
+
+    for (int simd = 0; simd < 2; simd++) {
+        uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int i = 0; i < iterations; i++) {
+            sink += simd ? rle8_encode_capped(payload, payload_size, coded, RLE8_ENCODE_UPPER_BOUND(payload_size))
+                         : ulnet__test_rle8_encode_scalar(payload, payload_size, coded, RLE8_ENCODE_UPPER_BOUND(payload_size));
+        }
+        uint64_t encode_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int i = 0; i < iterations; i++) {
+            sink += simd ? rle8_decode(coded, coded_size, payload, payload_size)
+                         : ulnet__test_rle8_decode_scalar(coded, coded_size, payload, payload_size);
+        }
+        uint64_t decode_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        double megabytes = (double) payload_size * iterations / (1024.0 * 1024.0);
+        printf("rle8 %s: encode %.0f MB/s, decode %.0f MB/s on a %" PRId64 " byte ulnet_state_t\n", simd ? "simd" : "scalar",
+            megabytes / SAM2_MAX(encode_us / 1e6, 1e-6), megabytes / SAM2_MAX(decode_us / 1e6, 1e-6), payload_size);
+    }
+
+    free(coded);
+    free(payload);
+}
+
+// Parity blocks from the SIMD kernels have to match the scalar tables byte for byte
+int ulnet_test_fec_simd() {
+    const int k = 239, n = 255, block_size = ULNET_PACKET_SIZE_BYTES_MAX - 3; // Odd size leaves a scalar tail
+    void *rs_code = fec_new(k, n);
+    uint8_t *data = (uint8_t *)malloc((size_t) n * block_size);
+    uint8_t *expected = (uint8_t *)malloc((size_t) (n - k) * block_size);
+    uint8_t *original = (uint8_t *)malloc((size_t) k * block_size);
+    void *packets[255];
+    int indices[255];
+    int status = 0;
+
+    for (int i = 0; i < k * block_size; i++) data[i] = (uint8_t) (i * 0x9E3779B1 >> 13);
+    memcpy(original, data, (size_t) k * block_size);
+    for (int i = 0; i < k; i++) packets[i] = data + i * block_size;
+
+    printf("FEC kernel: %s\n", fec_use_simd(1));
+    for (int simd = 0; simd < 2; simd++) {
+        fec_use_simd(simd);
+        for (int i = k; i < n; i++) {
+            fec_encode(rs_code, packets, data + i * block_size, i, block_size);
+        }
+        if (!simd) memcpy(expected, data + k * block_size, (size_t) (n - k) * block_size);
+    }
+
+    if (memcmp(expected, data + k * block_size, (size_t) (n - k) * block_size) != 0) {
+        SAM2_LOG_ERROR("SIMD parity differs from scalar parity");
+        status = 1;
+    }
+
+    // Lose the first n - k data blocks and rebuild them from parity
+    for (int i = 0; i < k; i++) {
+        packets[i] = data + (i < n - k ? k + i : i) * block_size;
+        indices[i] = i < n - k ? k + i : i;
+    }
+    memset(data, 0, (size_t) (n - k) * block_size);
+
+    if (status == 0 && fec_decode(rs_code, packets, indices, block_size) != 0) {
+        SAM2_LOG_ERROR("fec_decode failed");
+        status = 1;
+    }
+
+    for (int i = 0; status == 0 && i < k; i++) {
+        if (memcmp(packets[i], original + i * block_size, block_size) != 0) {
+            SAM2_LOG_ERROR("fec_decode recovered block %d incorrectly", i);
+            status = 1;
+        }
+    }
+
+    fec_use_simd(1);
+    fec_free(rs_code);
+    free(original);
+    free(expected);
+    free(data);
+    return status;
+}
+
+int ulnet_test_fec_cache() {
+    const int k = 239, n = 255, block_size = 64;
+    uint8_t *data = (uint8_t *)malloc((size_t) n * block_size);
+    uint8_t *original = (uint8_t *)malloc((size_t) k * block_size);
+    void *packets[255];
+    int indices[255];
+    int status = 0;
+
+    void *rs_code = fec_get(k, n);
+    if (rs_code == NULL || fec_get(k, n) != rs_code) {
+        SAM2_LOG_ERROR("fec_get did not share the code for identical parameters");
+        return 1;
+    }
+    fec_free(rs_code);
+
+    for (int i = 0; i < k * block_size; i++) data[i] = (uint8_t) (i * 0x9E3779B1 >> 11);
+    memcpy(original, data, (size_t) k * block_size);
+    for (int i = 0; i < k; i++) packets[i] = data + i * block_size;
+    for (int i = k; i < n; i++) fec_encode(rs_code, packets, data + i * block_size, i, block_size);
+
+    // Churn through enough codes to evict the one we hold, it has to stay usable until released
+    for (int i = 1; i <= 20; i++) {
+        fec_free(fec_get(k - i, n - i));
+    }
+
+    // Repeated patterns come from the decode cache and have to give the same answer as the first decode
+    for (int attempt = 0; status == 0 && attempt < 3 * (n - k); attempt++) {
+        int lost = attempt % (n - k) + 1;
+        for (int i = 0; i < k; i++) {
+            indices[i] = i < lost ? k + (i + attempt) % (n - k) : i;
+            packets[i] = data + indices[i] * block_size;
+        }
+        for (int i = 0; i < lost; i++) memset(data + i * block_size, 0, block_size);
+
+        // The decoder overwrites the parity blocks it used so keep copies
+        uint8_t parity[16 * 64];
+        memcpy(parity, data + k * block_size, sizeof(parity));
+        if (fec_decode(rs_code, packets, indices, block_size) != 0) {
+            SAM2_LOG_ERROR("fec_decode failed with %d blocks lost", lost);
+            status = 1;
+        }
+        for (int i = 0; status == 0 && i < k; i++) {
+            if (memcmp(packets[i], original + i * block_size, block_size) != 0) {
+                SAM2_LOG_ERROR("fec_decode recovered block %d incorrectly with %d blocks lost", i, lost);
+                status = 1;
+            }
+            if (packets[i] != data + i * block_size) memcpy(data + i * block_size, packets[i], block_size);
+        }
+        memcpy(data + k * block_size, parity, sizeof(parity));
+    }
+
+    fec_free(rs_code);
+    free(original);
+    free(data);
+    return status;
+}
+
+static int ulnet__test_fec_index[FEC_PACKET_GROUPS_MAX][GF_SIZE];
+static uint64_t ulnet__test_fec_received[FEC_PACKET_GROUPS_MAX][4];
+
+static void ulnet__test_fec_groups_payload(ulnet__fec_job_t *job) {
+    const int block_size = ULNET_PACKET_SIZE_BYTES_MAX - (int) sizeof(ulnet_save_state_packet_header_t);
+    int size = 4 * 1024 * 1024, n, k, packet_size = block_size, packet_groups;
+
+    ulnet__logical_partition(size, FEC_REDUNDANT_BLOCKS, &n, &k, &packet_size, &packet_groups);
+    assert(packet_size <= block_size);
+    ulnet__fec_job_t fec_job = {
+        fec_get(k, n), (uint8_t *)malloc((size_t) packet_groups * n * packet_size), ulnet__test_fec_index, ulnet__test_fec_received,
+        k, n, packet_size, packet_groups
+    };
+    for (int64_t i = 0; i < (int64_t) packet_groups * n * packet_size; i++) fec_job.payload[i] = (uint8_t) (i * 0x9E3779B1 >> 13);
+    *job = fec_job;
+}
+
+// Delivers a group the way the receiver sees it, each group loses a different set of data blocks and group 0 loses none
+// Some parity blocks arrive before the data blocks and some after so folding runs both ways
+static void ulnet__test_fec_receive_group(ulnet__fec_job_t *job, int group) {
+    int order[GF_SIZE], count = 0;
+
+    for (int i = 0; i < job->k; i++) if (i < group && i % 2 == group % 2 && i % 4 < 2) order[count++] = job->k + i / 2;
+    for (int i = 0; i < job->k; i++) if (!(i < group && i % 2 == group % 2)) order[count++] = i;
+    for (int i = 0; i < job->k; i++) if (i < group && i % 2 == group % 2 && i % 4 >= 2) order[count++] = job->k + i / 2;
+
+    memset(job->received[group], 0, sizeof(job->received[group]));
+    for (int i = 0; i < job->k; i++) {
+        if (order[i] < job->k) continue;
+        int lost = 2 * (order[i] - job->k) + group % 2;
+        memset(job->payload + ulnet__logical_partition_offset_bytes(group, lost, job->block_size, job->packet_groups), 0, job->block_size);
+    }
+
+    for (int i = 0; i < count; i++) {
+        job->fec_index[group][i] = order[i];
+        job->received[group][order[i] / 64] |= 1ULL << (order[i] % 64);
+        ulnet__fec_fold_block(job, group, order[i], i + 1);
+    }
+}
+
+// Packet groups coded on the worker pool have to match coding them one after another on this thread
+int ulnet_test_parallel_fec() {
+    ulnet__fec_job_t job;
+    int status = 0;
+
+    ulnet__test_fec_groups_payload(&job);
+    size_t payload_size = (size_t) job.packet_groups * job.n * job.block_size;
+    uint8_t *expected = (uint8_t *)malloc(payload_size);
+
+    for (int group = 0; group < job.packet_groups; group++) ulnet__fec_encode_group(&job, group);
+    memcpy(expected, job.payload, payload_size);
+    ulnet__parallel_for(ulnet__fec_encode_group, &job, job.packet_groups);
+
+    if (memcmp(expected, job.payload, payload_size) != 0) {
+        SAM2_LOG_ERROR("Parallel Reed-Solomon encode differs from the serial encode");
+        status = 1;
+    }
+
+    for (int group = 0; group < job.packet_groups; group++) ulnet__test_fec_receive_group(&job, group);
+    ulnet__parallel_for(ulnet__fec_decode_group, &job, job.packet_groups);
+
+    for (int group = 0; status == 0 && group < job.packet_groups; group++) {
+        for (int i = 0; i < job.k; i++) {
+            int64_t offset = ulnet__logical_partition_offset_bytes(group, i, job.block_size, job.packet_groups);
+            if (memcmp(expected + offset, job.payload + offset, job.block_size) != 0) {
+                SAM2_LOG_ERROR("Parallel Reed-Solomon decode recovered group %d block %d incorrectly", group, i);
+                status = 1;
+                break;
+            }
+        }
+    }
+
+    // The same erasure pattern again is solved from the decode cache and has to give the same answer
+    for (int attempt = 0; status == 0 && attempt < 2; attempt++) {
+        int group = job.packet_groups - 1;
+        memcpy(job.payload, expected, payload_size);
+        ulnet__test_fec_receive_group(&job, group);
+        ulnet__fec_decode_group(&job, group);
+        for (int i = 0; i < job.k; i++) {
+            int64_t offset = ulnet__logical_partition_offset_bytes(group, i, job.block_size, job.packet_groups);
+            if (memcmp(expected + offset, job.payload + offset, job.block_size) != 0) {
+                SAM2_LOG_ERROR("Cached Reed-Solomon decode recovered group %d block %d incorrectly", group, i);
+                status = 1;
+                break;
+            }
+        }
+    }
+
+    fec_free(job.rs_code);
+    free(expected);
+    free(job.payload);
+    return status;
+}
+
+static void ulnet__test_mark_task(void *context, int index) {
+    ((int *) context)[index] = 1;
+}
+
+// The worker threads are joined once the last session is released so the library can be unloaded without them still running
+int ulnet_test_worker_pool_shutdown() {
+    ulnet_session_t *sessions[2];
+    int marked[8] = {0};
+    int status = 0;
+
+    for (int i = 0; i < 2; i++) {
+        sessions[i] = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+        ulnet_session_init_defaulted(sessions[i]);
+        ulnet_session_init_defaulted(sessions[i]); // Sessions are reinitialized every time they leave a room
+    }
+    ulnet__parallel_for(ulnet__test_mark_task, marked, SAM2_ARRAY_LENGTH(marked));
+
+    ulnet_session_release_save_state_buffers(sessions[0]);
+    if (ulnet__pool_thread_count == -1) {
+        SAM2_LOG_ERROR("Worker pool stopped while a session was still around");
+        status = 1;
+    }
+
+    ulnet_session_release_save_state_buffers(sessions[1]);
+    if (ulnet__pool_thread_count != -1) {
+        SAM2_LOG_ERROR("Worker pool was still running after the last session was released");
+        status = 1;
+    }
+
+    // The next session starts it back up
+    memset(marked, 0, sizeof(marked));
+    ulnet_session_init_defaulted(sessions[0]);
+    ulnet__parallel_for(ulnet__test_mark_task, marked, SAM2_ARRAY_LENGTH(marked));
+    for (int i = 0; i < SAM2_ARRAY_LENGTH(marked); i++) {
+        if (!marked[i]) {
+            SAM2_LOG_ERROR("Task %d never ran after the worker pool was restarted", i);
+            status = 1;
+        }
+    }
+    ulnet_session_release_save_state_buffers(sessions[0]);
+
+    for (int i = 0; i < 2; i++) {
+        free(sessions[i]);
+    }
+    return status;
+}
+
+void ulnet__bench_parallel_fec() {
+    const int iterations = 5;
+    ulnet__fec_job_t job;
+
+    ulnet__test_fec_groups_payload(&job);
+
+    for (int parallel = 0; parallel < 2; parallel++) {
+        uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            if (parallel) {
+                ulnet__parallel_for(ulnet__fec_encode_group, &job, job.packet_groups);
+            } else {
+                for (int group = 0; group < job.packet_groups; group++) ulnet__fec_encode_group(&job, group);
+            }
+        }
+        uint64_t encode_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        printf("fec %s: %.2f ms to encode %d packet groups of a 4 MB payload\n", parallel ? "worker pool" : "serial",
+            encode_us / 1e3 / iterations, job.packet_groups);
+    }
+
+    // What matters for a receiver is the stall after the last block shows up, folding happens as blocks arrive
+    int lossy_group = job.packet_groups - 1;
+    uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+    ulnet__test_fec_receive_group(&job, lossy_group);
+    uint64_t fold_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+    start_unix_us = ulnet__get_unix_time_microseconds();
+    ulnet__fec_decode_group(&job, lossy_group);
+    uint64_t finish_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+    printf("fec progressive decode: %.1f us per arriving block, %" PRIu64 " us to finish a group missing %d blocks\n",
+        (double) fold_us / job.k, finish_us, lossy_group / 2);
+
+    fec_free(job.rs_code);
+    free(job.payload);
+}
+
+void ulnet__bench_bulk_congestion() {
+    for (int delay_based = 0; delay_based < 2; delay_based++) {
+        int64_t sync_usec, input_queue_usec_max, input_queue_usec_mean, dropped;
+        if (ulnet__test_bottleneck_transfer(delay_based, &sync_usec, &input_queue_usec_max, &input_queue_usec_mean, &dropped) != 0) {
+            printf("bulk %s: transfer failed\n", delay_based ? "delay-based" : "fixed rate");
+            continue;
+        }
+
+        printf("bulk %s: 512 KB over a 1 MB/s link in %.1f ms with %" PRId64 " packets dropped, input queued %.1f ms mean %.1f ms max\n",
+            delay_based ? "delay-based" : "fixed rate", sync_usec / 1e3, dropped, input_queue_usec_mean / 1e3, input_queue_usec_max / 1e3);
+    }
+}
+
+void ulnet__bench_fec() {
+    const int iterations = 20;
+    const int k = 239, n = 255, block_size = ULNET_PACKET_SIZE_BYTES_MAX - (int) sizeof(ulnet_save_state_packet_header_t);
+    void *rs_code = fec_get(k, n);
+    uint8_t *data = (uint8_t *)malloc((size_t) n * block_size);
+    void *packets[255];
+    int indices[255];
+
+    for (int i = 0; i < n * block_size; i++) data[i] = (uint8_t) (i * 0x9E3779B1 >> 13);
+
+    for (int simd = 0; simd < 2; simd++) {
+        const char *kernel = fec_use_simd(simd);
+
+        uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            for (int i = 0; i < k; i++) packets[i] = data + i * block_size;
+            for (int i = k; i < n; i++) fec_encode(rs_code, packets, data + i * block_size, i, block_size);
+        }
+        uint64_t encode_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            for (int i = 0; i < k; i++) {
+                indices[i] = i < n - k ? k + i : i;
+                packets[i] = data + indices[i] * block_size;
+            }
+            fec_decode(rs_code, packets, indices, block_size);
+        }
+        uint64_t decode_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        double megabytes = (double) k * block_size * iterations / (1024.0 * 1024.0);
+        printf("fec %s: encode %.0f MB/s, decode %.0f MB/s (%d lost) for k=%d n=%d with %d byte blocks\n", kernel,
+            megabytes / SAM2_MAX(encode_us / 1e6, 1e-6), megabytes / SAM2_MAX(decode_us / 1e6, 1e-6), n - k, k, n, block_size);
+    }
+
+    uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+    for (int iteration = 0; iteration < iterations; iteration++) fec_free(fec_new(k, n));
+    uint64_t new_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+    start_unix_us = ulnet__get_unix_time_microseconds();
+    for (int iteration = 0; iteration < iterations; iteration++) fec_free(fec_get(k, n));
+    uint64_t get_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+    printf("fec setup: fec_new %.1f us, fec_get %.1f us for k=%d n=%d\n", (double) new_us / iterations, (double) get_us / iterations, k, n);
+
+    fec_use_simd(1);
+    fec_free(rs_code);
+    free(data);
+}
+
+void ulnet__bench_input_packet() {
+    const int iterations = 100000;
+    ulnet_session_t *session = (ulnet_session_t *)calloc(1, sizeof(ulnet_session_t));
+    ulnet_state_t *state = (ulnet_state_t *)malloc(sizeof(ulnet_state_t));
+    ulnet_state_t *decoded = (ulnet_state_t *)malloc(sizeof(ulnet_state_t));
+    uint8_t coded[ULNET_PACKET_SIZE_BYTES_MAX];
+
+    ulnet_session_init_defaulted(session);
+    ulnet_room_set_protocol_version(&session->room_we_are_in, SAM2_VERSION_MINOR);
+    uint8_t formats[] = { ULNET_INPUT_FORMAT_RLE8, ULNET_INPUT_FORMAT_COMPACT };
+    for (int f = 0; f < SAM2_ARRAY_LENGTH(formats); f++) {
+        int64_t total_bytes = 0;
+        for (int i = 0; i < 600; i++) {
+            ulnet__test_fill_state(state, i, ulnet_delay_buffer_size(session));
+            total_bytes += sizeof(ulnet_state_packet_t) + ulnet__encode_state(session, state, formats[f], coded, sizeof(coded));
+        }
+
+        int64_t coded_size = ulnet__encode_state(session, state, formats[f], coded, sizeof(coded));
+        uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int i = 0; i < iterations; i++) {
+            ulnet__decode_state(session, coded, coded_size, decoded);
+        }
+        uint64_t elapsed_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        printf("Input format %d: %.1f bytes/packet, %.1f ns/decode\n",
+            formats[f], total_bytes / 600.0, 1000.0 * elapsed_us / iterations);
+    }
+
+    free(decoded);
+    free(state);
+    ulnet_session_release_save_state_buffers(session);
+    free(session);
+}
+
+int ulnet_test_save_state_hash() {
+    const size_t size = 3 * ULNET_SAVE_STATE_HASH_SEGMENT_SIZE + ULNET_SAVE_STATE_HASH_SEGMENT_SIZE / 2;
+    uint8_t *data = (uint8_t *) malloc(size);
+    int status = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t) (i * 0x9E3779B1);
+    }
+
+    // Reference value from the xxHash test suite so we know the inlined copy really is XXH3
+    if (XXH3_64bits(NULL, 0) != 0x2D06800538D394C2ULL) {
+        SAM2_LOG_ERROR("XXH3 of nothing was %016" PRIx64, (uint64_t) XXH3_64bits(NULL, 0));
+        status = 1;
+    }
+
+    if (ulnet_save_state_hash(ULNET_SAVE_STATE_HASH_XXH32, data, 1000) != ulnet_xxh32(data, 1000, 0)) {
+        SAM2_LOG_ERROR("Rooms without a hash algorithm set no longer agree with older peers");
+        status = 1;
+    }
+
+    // However many threads hashed the segments the result has to be what hashing them one after another gives
+    uint64_t segment_hash[4];
+    for (int i = 0; i < 4; i++) {
+        size_t offset = (size_t) i * ULNET_SAVE_STATE_HASH_SEGMENT_SIZE;
+        segment_hash[i] = XXH3_64bits(data + offset, SAM2_MIN(size - offset, (size_t) ULNET_SAVE_STATE_HASH_SEGMENT_SIZE));
+    }
+    uint64_t expected = XXH3_64bits_withSeed(segment_hash, sizeof(segment_hash), size);
+    uint32_t hash = ulnet_save_state_hash(ULNET_SAVE_STATE_HASH_XXH3, data, size);
+    if (hash != ((uint32_t) expected ^ (uint32_t) (expected >> 32))) {
+        SAM2_LOG_ERROR("Segmented XXH3 gave %08" PRIx32 " expected %016" PRIx64, hash, expected);
+        status = 1;
+    }
+
+    data[size - 1] ^= 1;
+    if (ulnet_save_state_hash(ULNET_SAVE_STATE_HASH_XXH3, data, size) == hash) {
+        SAM2_LOG_ERROR("Flipping a bit in the last segment didn't change the hash");
+        status = 1;
+    }
+
+    sam2_room_t room = {0};
+    ulnet_room_set_delay_buffer_size(&room, 16);
+    ulnet_room_set_save_state_hash_algorithm(&room, ULNET_SAVE_STATE_HASH_XXH3);
+    if (ulnet_room_save_state_hash_algorithm(&room) != ULNET_SAVE_STATE_HASH_XXH32) {
+        SAM2_LOG_ERROR("Room hosted by a version that predates the hash flag didn't stick to xxh32");
+        status = 1;
+    }
+
+    ulnet_room_set_protocol_version(&room, ULNET_PROTOCOL_VERSION_SAVE_STATE_HASH);
+    if (ulnet_room_save_state_hash_algorithm(&room) != ULNET_SAVE_STATE_HASH_XXH3 || ulnet_room_delay_buffer_size(&room) != 16) {
+        SAM2_LOG_ERROR("Hash algorithm room flag clobbered the delay buffer size or didn't stick");
+        status = 1;
+    }
+
+    free(data);
+    return status;
+}
+
+// Compares the savestate hashes over a state about the size of an N64 or PS2 one
+void ulnet__bench_save_state_hash() {
+    const size_t test_size = 64 * 1024 * 1024;
+    const int iterations = 30;
+
+    uint8_t* test_data = malloc(test_size);
+    if (!test_data) {
+        printf("Failed to allocate test buffer\n");
+        return;
+    }
+
+    for (size_t i = 0; i < test_size; i++) {
+        test_data[i] = (uint8_t)(i * 0x9E3779B1);
+    }
+
+    static const char *vector_names[] = { "scalar", "SSE2", "AVX2", "AVX512", "NEON", "VSX", "SVE" };
+    const char *names[] = { "xxh32", "XXH3 single-threaded", "XXH3 segmented" };
+    for (int h = 0; h < SAM2_ARRAY_LENGTH(names); h++) {
+        volatile uint32_t result = 0; // Keeps the hashes from being optimized out
+
+        // Warm up
+        for (int i = 0; i < 3; i++) {
+            result ^= h == 1 ? (uint32_t) XXH3_64bits(test_data, test_size) : ulnet_save_state_hash(h == 0 ? ULNET_SAVE_STATE_HASH_XXH32 : ULNET_SAVE_STATE_HASH_XXH3, test_data, test_size);
+        }
+
+        uint64_t start_unix_us = ulnet__get_unix_time_microseconds();
+        for (int i = 0; i < iterations; i++) {
+            test_data[0] = (uint8_t)i; // Prevent compiler optimization
+            result ^= h == 1 ? (uint32_t) XXH3_64bits(test_data, test_size) : ulnet_save_state_hash(h == 0 ? ULNET_SAVE_STATE_HASH_XXH32 : ULNET_SAVE_STATE_HASH_XXH3, test_data, test_size);
+        }
+        uint64_t elapsed_us = ulnet__get_unix_time_microseconds() - start_unix_us;
+
+        double gigabytes_per_second = (double) test_size * iterations / (elapsed_us / 1e6) / (1024.0 * 1024.0 * 1024.0);
+        printf("%s Throughput: %.3f GB/s\n", names[h], gigabytes_per_second);
+    }
+    printf("XXH3 is using its %s code path\n", vector_names[XXH_VECTOR]);
+
+    free(test_data);
+}
+
+
+#include <zstd.h>
+
+#if defined(ULNET_TEST_MAIN)
+int g_log_level = 1; // Info, the per-packet debug logging of the longer tests buries the results
+
+void sam2_log_write(int level, const char *file, int line, const char *format, ...) {
+    if (level < g_log_level) {
+        return;
+    }
+
+    if (level == 2) {
+        printf("WARN %s:%d | ", file, line);
+    } else if (level > 2) {
+        printf("ERROR %s:%d | ", file, line);
+    }
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    if (level == 4) {
+        printf("Fatal error in %s:%d\n", file, line);
+        abort();
+    }
+}
+
+int main () {
+    ulnet_session_t *session_1 = NULL;
+    ulnet_session_t *session_2 = NULL;
+
+    juice_set_log_level(JUICE_LOG_LEVEL_DEBUG);
+
+    int status = ulnet_test_inproc(NULL, NULL);
+    if (status != 0) {
+        printf("Inproc test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_reliable_sack();
+    if (status != 0) {
+        printf("Reliable SACK test failed with status: %d\n", status);
+        return status;
+    }
+    status = ulnet_test_reliable_sack_old_room();
+    if (status != 0) {
+        printf("Reliable SACK old room test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_rollback();
+    if (status != 0) {
+        printf("Rollback test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_delay_buffer();
+    if (status != 0) {
+        printf("Delay buffer test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_adaptive_delay();
+    if (status != 0) {
+        printf("Adaptive delay test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_frame_pacer();
+    if (status != 0) {
+        printf("Frame pacer test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_input_wait();
+    if (status != 0) {
+        printf("Input wait test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_frame_advantage();
+    if (status != 0) {
+        printf("Frame advantage test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_frame_advantage_packets();
+    if (status != 0) {
+        printf("Frame advantage packets test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_rle8();
+    if (status != 0) {
+        printf("RLE8 test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_hash();
+    if (status != 0) {
+        printf("Savestate hash test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_fec_simd();
+    if (status != 0) {
+        printf("FEC SIMD test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_fec_cache();
+    if (status != 0) {
+        printf("FEC cache test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_parallel_fec();
+    if (status != 0) {
+        printf("Parallel FEC test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_worker_pool_shutdown();
+    if (status != 0) {
+        printf("Worker pool shutdown test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_input_format();
+    if (status != 0) {
+        printf("Input format test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_delta_savestate();
+    if (status != 0) {
+        printf("Delta savestate test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_confirmed_baseline();
+    if (status != 0) {
+        printf("Confirmed baseline test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_dictionary();
+    if (status != 0) {
+        printf("Savestate dictionary test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_chunked_compression();
+    if (status != 0) {
+        printf("Chunked compression test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_payload_v0();
+    if (status != 0) {
+        printf("Savestate payload version 0 test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_async_save_state_hash();
+    if (status != 0) {
+        printf("Async savestate hash test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_chunked_resync();
+    if (status != 0) {
+        printf("Chunked resync test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_fan_out();
+    if (status != 0) {
+        printf("Savestate fan-out test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_reassembly();
+    if (status != 0) {
+        printf("Savestate reassembly test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_held_fragments();
+    if (status != 0) {
+        printf("Held savestate fragments test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_transfer_id();
+    if (status != 0) {
+        printf("Savestate transfer id test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_repair_fallback();
+    if (status != 0) {
+        printf("Savestate repair fallback test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_save_state_repair();
+    if (status != 0) {
+        printf("Savestate repair test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_bulk_pacing();
+    if (status != 0) {
+        printf("Bulk pacing test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_delay_based_pacing();
+    if (status != 0) {
+        printf("Delay-based pacing test failed with status: %d\n", status);
+        return status;
+    }
+
+    status = ulnet_test_adaptive_fec();
+    if (status != 0) {
+        printf("Adaptive FEC test failed with status: %d\n", status);
         return status;
     }
 
@@ -374,7 +3145,12 @@ int main () {
         return 1;
     }
 
-    ulnet__bench_xxh32();
+    ulnet__bench_save_state_hash();
+    ulnet__bench_input_packet();
+    ulnet__bench_rle8();
+    ulnet__bench_fec();
+    ulnet__bench_parallel_fec();
+    ulnet__bench_bulk_congestion();
 
     printf("All tests passed successfully!\n");
     return 0;
@@ -11,7 +11,8 @@
 
 /* Local adaptations for Zstandard */
 
-#ifndef XXH_NO_XXH3
+/* UnrealLibretro: ZSTD_XXH_ENABLE_XXH3 lets users who inline their own copy keep XXH3, see LOCAL_CHANGES.md */
+#if !defined(XXH_NO_XXH3) && !defined(ZSTD_XXH_ENABLE_XXH3)
 # define XXH_NO_XXH3
 #endif
 
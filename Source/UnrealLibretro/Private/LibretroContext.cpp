@@ -1294,7 +1294,10 @@ FLibretroContext* FLibretroContext::Launch(ULibretroCoreInstance* LibretroCoreIn
 
     l->netplay_session = (ulnet_session_t *) calloc(1, sizeof(ulnet_session_t));
     ulnet_session_init_defaulted(l->netplay_session);
-    l->netplay_session->delay_frames = 2; // @todo Make configurable
+    l->netplay_session->delay_frames = 2; // Starting point, the authority renegotiates this from measured RTT
+    l->netplay_session->flags |= ULNET_SESSION_FLAG_ADAPTIVE_DELAY;
+    l->netplay_session->flags |= ULNET_SESSION_FLAG_DELAY_BASED_PACING;
+    l->netplay_session->flags |= ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC;
 
     auto LibretroSettings = GetDefault<ULibretroSettings>();
 
@@ -1645,6 +1648,7 @@ cleanup:
                 }
             }
 
+            ulnet_session_release_save_state_buffers(l->netplay_session);
             free(l->netplay_session);
 
 
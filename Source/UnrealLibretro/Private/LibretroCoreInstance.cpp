@@ -111,6 +111,8 @@ void ULibretroCoreInstance::NetplayHost(int PeerId)
     FMemory::Memcpy(HostRoomRequest.room.name, RoomNameUTF8.Get(), EndOfRoomNameIndex);
     HostRoomRequest.room.name[EndOfRoomNameIndex] = '\0';
     HostRoomRequest.room.flags |= SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
+    ulnet_room_set_protocol_version(&HostRoomRequest.room, SAM2_VERSION_MINOR);
+    ulnet_room_set_save_state_hash_algorithm(&HostRoomRequest.room, ULNET_SAVE_STATE_HASH_XXH3);
     CoreInstance.GetValue()->NetplayTasks.Enqueue([CoreInstance = this->CoreInstance.GetValue(), HostRoomRequest, PeerId](libretro_api_t& libretro_api)
         mutable {
             HostRoomRequest.room.rom_hash_xxh64 = CoreInstance->rom_hash_xxh64;
@@ -119,15 +119,16 @@
 #include "../../ThirdParty/zstd/lib/decompress/zstd_ddict.c"
 #include "../../ThirdParty/zstd/lib/decompress/zstd_decompress.c"
 #include "../../ThirdParty/zstd/lib/decompress/zstd_decompress_block.c"
+// ulnet trains savestate dictionaries
+#include "../../ThirdParty/zstd/lib/dictBuilder/cover.c"
+#include "../../ThirdParty/zstd/lib/dictBuilder/divsufsort.c"
+#include "../../ThirdParty/zstd/lib/dictBuilder/fastcover.c"
+#include "../../ThirdParty/zstd/lib/dictBuilder/zdict.c"
 // Don't need these right now
 #if 0
 #include "../../ThirdParty/zstd/lib/deprecated/zbuff_common.c"
 #include "../../ThirdParty/zstd/lib/deprecated/zbuff_compress.c"
 #include "../../ThirdParty/zstd/lib/deprecated/zbuff_decompress.c"
-#include "../../ThirdParty/zstd/lib/dictBuilder/cover.c"
-#include "../../ThirdParty/zstd/lib/dictBuilder/divsufsort.c"
-#include "../../ThirdParty/zstd/lib/dictBuilder/fastcover.c"
-#include "../../ThirdParty/zstd/lib/dictBuilder/zdict.c"
 #endif
 #pragma pop
 
@@ -49,6 +49,28 @@
 #include <string.h>
 #include <stdint.h>
 
+/*
+ * SIMD versions of addmul1() split each byte into nibbles and look both
+ * up in 16 entry product tables with a byte shuffle (pshufb/tbl).
+ * The widest kernel the CPU supports is picked at runtime in init_fec().
+ * Define FEC_NO_SIMD to build only the scalar table code.
+ */
+#if GF_BITS == 8 && !defined(FEC_NO_SIMD) && !defined(__TINYC__)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FEC_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define FEC_TARGET(x)
+#else
+#define FEC_TARGET(x) __attribute__((target(x)))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define FEC_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 typedef unsigned long u_long;
 /*
  * compatibility stuff
@@ -63,6 +85,24 @@ typedef unsigned long u_long;
 #define bzero(d, siz)   memset((d), '\0', (siz))
 #endif
 
+/*
+ * fec_lock guards the shared code and decoding matrix caches
+ */
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+static SRWLOCK fec_lock = SRWLOCK_INIT;
+#define FEC_LOCK()	AcquireSRWLockExclusive(&fec_lock)
+#define FEC_UNLOCK()	ReleaseSRWLockExclusive(&fec_lock)
+#else
+#include <pthread.h>
+static pthread_mutex_t fec_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FEC_LOCK()	pthread_mutex_lock(&fec_lock)
+#define FEC_UNLOCK()	pthread_mutex_unlock(&fec_lock)
+#endif
+
 /*
  * stuff used for testing purposes only
  */
@@ -202,6 +242,17 @@ static gf gf_mul_table[GF_SIZE + 1][GF_SIZE + 1];
 #define GF_MULC0(c) __gf_mulc_ = gf_mul_table[c]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
 
+/*
+ * gf_nibble_table[c][0][x] = c * x and gf_nibble_table[c][1][x] = c * (x << 4)
+ * so c * y = gf_nibble_table[c][0][y & 15] ^ gf_nibble_table[c][1][y >> 4]
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+__declspec(align(16))
+#else
+__attribute__((aligned(16)))
+#endif
+static gf gf_nibble_table[GF_SIZE + 1][2][16];
+
 static void
 init_mul_table()
 {
@@ -212,6 +263,12 @@ init_mul_table()
 
     for (j=0; j< GF_SIZE+1; j++)
 	    gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
+
+    for (i=0; i< GF_SIZE+1; i++)
+	for (j=0; j< 16; j++) {
+	    gf_nibble_table[i][0][j] = gf_mul_table[i][j] ;
+	    gf_nibble_table[i][1][j] = gf_mul_table[i][j << 4] ;
+	}
 }
 #else	/* GF_BITS > 8 */
 static inline gf
@@ -337,7 +394,7 @@ generate_gf(void)
  * Note that gcc on
  */
 #define addmul(dst, src, c, sz) \
-    if (c != 0) addmul1(dst, src, c, sz)
+    if (c != 0) addmul_kernel(dst, src, c, sz)
 
 #define UNROLL 16 /* 1, 4, 8, 16 */
 static void
@@ -378,6 +435,103 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
 	GF_ADDMULC( *dst , *src );
 }
 
+#if defined(FEC_SIMD_X86)
+FEC_TARGET("ssse3") static void
+addmul1_ssse3(gf *dst, gf *src, gf c, int sz)
+{
+    const __m128i lo = _mm_load_si128((const __m128i *) gf_nibble_table[c][0]);
+    const __m128i hi = _mm_load_si128((const __m128i *) gf_nibble_table[c][1]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 16 <= sz; i += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+	__m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+				  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+	_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *) (dst + i)), p));
+    }
+    if (i < sz)
+	addmul1(dst + i, src + i, c, sz - i);
+}
+
+FEC_TARGET("avx2") static void
+addmul1_avx2(gf *dst, gf *src, gf c, int sz)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) gf_nibble_table[c][0]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) gf_nibble_table[c][1]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 32 <= sz; i += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) (src + i));
+	__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+				     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+	_mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (dst + i)), p));
+    }
+    if (i < sz)
+	addmul1(dst + i, src + i, c, sz - i);
+}
+
+static int
+cpu_has(int avx2)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    if (!avx2)
+	return (info[2] >> 9) & 1;
+    if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6) /* OS saves ymm registers */
+	return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    __builtin_cpu_init();
+    return avx2 ? __builtin_cpu_supports("avx2") : __builtin_cpu_supports("ssse3");
+#endif
+}
+#elif defined(FEC_SIMD_NEON)
+static void
+addmul1_neon(gf *dst, gf *src, gf c, int sz)
+{
+    const uint8x16_t lo = vld1q_u8(gf_nibble_table[c][0]);
+    const uint8x16_t hi = vld1q_u8(gf_nibble_table[c][1]);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    int i = 0;
+
+    for (; i + 16 <= sz; i += 16) {
+	uint8x16_t x = vld1q_u8(src + i);
+	uint8x16_t p = veorq_u8(vqtbl1q_u8(lo, vandq_u8(x, mask)), vqtbl1q_u8(hi, vshrq_n_u8(x, 4)));
+	vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+    if (i < sz)
+	addmul1(dst + i, src + i, c, sz - i);
+}
+#endif
+
+static void (*addmul_kernel)(gf *dst, gf *src, gf c, int sz) = addmul1;
+static const char *addmul_kernel_name = "scalar";
+
+static void
+select_addmul_kernel(int simd)
+{
+    addmul_kernel = addmul1;
+    addmul_kernel_name = "scalar";
+    if (!simd)
+	return;
+#if defined(FEC_SIMD_X86)
+    if (cpu_has(1)) {
+	addmul_kernel = addmul1_avx2;
+	addmul_kernel_name = "avx2";
+    } else if (cpu_has(0)) {
+	addmul_kernel = addmul1_ssse3;
+	addmul_kernel_name = "ssse3";
+    }
+#elif defined(FEC_SIMD_NEON)
+    addmul_kernel = addmul1_neon;
+    addmul_kernel_name = "neon";
+#endif
+}
+
 /*
  * computes C = AB where A is n*k, B is k*m, C is n*m
  */
@@ -631,9 +785,19 @@ init_fec()
     init_mul_table();
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
+    select_addmul_kernel(1);
     fec_initialized = 1 ;
 }
 
+const char *
+fec_use_simd(int enabled)
+{
+    if (fec_initialized == 0)
+	init_fec();
+    select_addmul_kernel(enabled);
+    return addmul_kernel_name;
+}
+
 /*
  * This section contains the proper FEC encoding/decoding routines.
  * The encoding matrix is computed starting with a Vandermonde matrix,
@@ -642,21 +806,123 @@ init_fec()
 
 #define FEC_MAGIC	0xFECC0DEC
 
+/*
+ * Building a code inverts a k*k Vandermonde matrix and every erasure
+ * pattern needs a Gauss-Jordan inversion to decode. fec_get() shares
+ * codes by (k, n) and every code keeps the decoding rows of its most
+ * recent erasure patterns, so repeated transfers skip both. Full and
+ * reduced decodes share the cache, reduced entries are keyed by their
+ * parity indexes followed by the missing data indexes.
+ */
+#define FEC_CODE_CACHE_SIZE	16
+#define FEC_DECODE_CACHE_SIZE	8
+
+struct fec_decode_rows {
+    int refs ;		/* the cache slot plus decoders using it */
+    int reduced ;	/* erasures for fec_decode_reduced(), 0 for fec_decode() */
+    int *index ;	/* index[] after shuffle(), k entries, or 2*reduced for reduced decodes */
+    gf *rows ;		/* rows of the inverse for each index[i] >= k, or the reduced inverse */
+} ;
+
 struct fec_parms {
     u_long magic ;
     int k, n ;		/* parameters of the code */
     gf *enc_matrix ;
+    int refs ;		/* 0 for codes from fec_new() */
+    u_long last_used ;
+    struct fec_decode_rows *decode_cache[FEC_DECODE_CACHE_SIZE] ;
+    int decode_cache_next ;
 } ;
 
+static struct fec_parms *fec_code_cache[FEC_CODE_CACHE_SIZE] ;
+static u_long fec_code_cache_clock ;
+
+static void
+release_decode_rows(struct fec_decode_rows *d)
+{
+    int drop ;
+
+    FEC_LOCK();
+    drop = d != NULL && --d->refs == 0 ;
+    FEC_UNLOCK();
+    if (drop)
+	free(d);
+}
+
+/*
+ * returns a referenced entry matching the key or NULL
+ */
+static struct fec_decode_rows *
+find_decode_rows(struct fec_parms *code, int reduced, int index[], int len)
+{
+    struct fec_decode_rows *d = NULL ;
+    int i ;
+
+    FEC_LOCK();
+    for (i = 0 ; i < FEC_DECODE_CACHE_SIZE ; i++) {
+	if (code->decode_cache[i] != NULL &&
+	    code->decode_cache[i]->reduced == reduced &&
+	    bcmp(code->decode_cache[i]->index, index, len*sizeof(int)) == 0) {
+	    d = code->decode_cache[i] ;
+	    d->refs++ ;
+	    break ;
+	}
+    }
+    FEC_UNLOCK();
+    return d ;
+}
+
+/*
+ * allocates an entry with room for the key and the rows, it's referenced
+ * by the caller and the cache slot once passed to insert_decode_rows()
+ */
+static struct fec_decode_rows *
+new_decode_rows(int reduced, int index[], int len, int rows)
+{
+    struct fec_decode_rows *d ;
+
+    d = (struct fec_decode_rows *)my_malloc(sizeof(*d) + len*sizeof(int) + rows*sizeof(gf), "decode rows");
+    d->refs = 2 ; /* the cache slot and us */
+    d->reduced = reduced ;
+    d->index = (int *)(d + 1) ;
+    d->rows = (gf *)(d->index + len) ;
+    bcopy(index, d->index, len*sizeof(int));
+    return d ;
+}
+
+static void
+insert_decode_rows(struct fec_parms *code, struct fec_decode_rows *d)
+{
+    struct fec_decode_rows *evicted ;
+
+    FEC_LOCK();
+    evicted = code->decode_cache[code->decode_cache_next] ;
+    code->decode_cache[code->decode_cache_next] = d ;
+    code->decode_cache_next = (code->decode_cache_next + 1) % FEC_DECODE_CACHE_SIZE ;
+    FEC_UNLOCK();
+    release_decode_rows(evicted);
+}
+
 void
 fec_free(void *p0)
 {
 	struct fec_parms *p= (struct fec_parms *) p0;
+    int i, drop ;
+
     if (p==NULL ||
        p->magic != ( ( (FEC_MAGIC ^ p->k) ^ p->n) ^ (int)((intptr_t)p->enc_matrix)) ) {
 	fprintf(stderr, "bad parameters to fec_free\n");
 	return ;
     }
+    if (p->refs) { /* shared by fec_get(), the last reference frees it */
+	FEC_LOCK();
+	drop = --p->refs == 0 ;
+	FEC_UNLOCK();
+	if (!drop)
+	    return ;
+    }
+    for (i = 0; i < FEC_DECODE_CACHE_SIZE; i++)
+	release_decode_rows(p->decode_cache[i]);
     free(p->enc_matrix);
     free(p);
 }
@@ -682,6 +948,7 @@ fec_new(int k, int n)
 	return NULL ;
     }
     retval = (struct fec_parms *)my_malloc(sizeof(struct fec_parms), "new_code");
+    bzero(retval, sizeof(struct fec_parms));
     retval->k = k ;
     retval->n = n ;
     retval->enc_matrix = NEW_GF_MATRIX(n, k);
@@ -722,6 +989,47 @@ fec_new(int k, int n)
     return retval ;
 }
 
+/*
+ * fec_get returns a code shared with every other caller asking for the
+ * same k and n. Release it with fec_free() like a code from fec_new().
+ */
+void *
+fec_get(int k, int n)
+{
+    struct fec_parms *code = NULL, *evicted = NULL ;
+    int i, slot = 0 ;
+
+    FEC_LOCK();
+    if (fec_initialized == 0)
+	init_fec();
+    for (i = 0; i < FEC_CODE_CACHE_SIZE; i++) {
+	struct fec_parms *p = fec_code_cache[i] ;
+	if (p != NULL && p->k == k && p->n == n) {
+	    code = p ;
+	    break ;
+	}
+	if (p == NULL || (fec_code_cache[slot] != NULL && p->last_used < fec_code_cache[slot]->last_used))
+	    slot = i ; /* empty or least recently used */
+    }
+    if (code == NULL) {
+	code = (struct fec_parms *)fec_new(k, n);
+	if (code != NULL) {
+	    code->refs = 1 ; /* held by the cache */
+	    evicted = fec_code_cache[slot] ;
+	    fec_code_cache[slot] = code ;
+	}
+    }
+    if (code != NULL) {
+	code->refs++ ;
+	code->last_used = ++fec_code_cache_clock ;
+    }
+    FEC_UNLOCK();
+
+    if (evicted != NULL)
+	fec_free(evicted);
+    return code ;
+}
+
 /*
  * fec_encode accepts as input pointers to n data packets of size sz,
  * and produces as output a packet pointed to by fec, computed
@@ -844,45 +1152,147 @@ fec_decode(void *code0, void *pkt0[], int index[], int sz)
 {
 	struct fec_parms * code=(struct fec_parms*)code0;
 	gf **pkt=(gf**)pkt0;
-    gf *m_dec ; 
-    gf **new_pkt ;
-    int row, col , k = code->k ;
+    gf *m_dec, *new_pkt, *p ;
+    struct fec_decode_rows *d = NULL ;
+    int i, row, col , k = code->k, erasures = 0 ;
 
     if (GF_BITS > 8)
 	sz /= 2 ;
 
     if (shuffle(pkt, index, k))	/* error if true */
 	return 1 ;
-    m_dec = build_decode_matrix(code, pkt, index);
+    for (row = 0 ; row < k ; row++ )
+	erasures += index[row] >= k ;
+    if (erasures == 0)
+	return 0 ;
 
-    if (m_dec == NULL)
-	return 1 ; /* error */
+    d = find_decode_rows(code, 0, index, k);
+    if (d == NULL) {
+	m_dec = build_decode_matrix(code, pkt, index);
+	if (m_dec == NULL)
+	    return 1 ; /* error */
+	/*
+	 * only the rows for missing packets are used, keep just those
+	 */
+	d = new_decode_rows(0, index, k, erasures*k);
+	for (p = d->rows, row = 0 ; row < k ; row++ ) {
+	    if (index[row] >= k) {
+		bcopy(&m_dec[row*k], p, k*sizeof(gf));
+		p += k ;
+	    }
+	}
+	free(m_dec);
+	insert_decode_rows(code, d);
+    }
     /*
-     * do the actual decoding
+     * do the actual decoding into one scratch buffer, the parity
+     * packets are still inputs until every row is done
      */
-    new_pkt = (gf** )my_malloc (k * sizeof (gf * ), "new pkt pointers" );
-    for (row = 0 ; row < k ; row++ ) {
+    new_pkt = (gf *)my_malloc(erasures * sz * sizeof(gf), "new pkt buffer");
+    bzero(new_pkt, erasures * sz * sizeof(gf));
+    for (i = 0, row = 0 ; row < k ; row++ ) {
 	if (index[row] >= k) {
-	    new_pkt[row] = (gf*)my_malloc (sz * sizeof (gf), "new pkt buffer" );
-	    bzero(new_pkt[row], sz * sizeof(gf) ) ;
 	    for (col = 0 ; col < k ; col++ )
-		addmul(new_pkt[row], pkt[col], m_dec[row*k + col], sz) ;
+		addmul(new_pkt + i*sz, pkt[col], d->rows[i*k + col], sz) ;
+	    i++ ;
 	}
     }
     /*
      * move pkts to their final destination
      */
-    for (row = 0 ; row < k ; row++ ) {
+    for (i = 0, row = 0 ; row < k ; row++ ) {
 	if (index[row] >= k) {
-	    bcopy(new_pkt[row], pkt[row], sz*sizeof(gf));
-	    free(new_pkt[row]);
+	    bcopy(new_pkt + i*sz, pkt[row], sz*sizeof(gf));
+	    i++ ;
 	}
     }
     free(new_pkt);
-    free(m_dec);
+    release_decode_rows(d);
 
     return 0;
 }
+/*
+ * Progressive decoding spreads the work over packet arrival. As packets
+ * come in the caller removes every data packet it has from every parity
+ * packet it has, using fec_addmul() with fec_coefficient(). Once k packets
+ * are in, the reduced parity packets only depend on the missing data, so
+ * fec_decode_reduced() just solves an erasures x erasures system.
+ */
+int
+fec_coefficient(void *code0, int index, int col)
+{
+	struct fec_parms * code= (struct fec_parms *)code0;
+    return code->enc_matrix[index*code->k + col] ;
+}
+
+void
+fec_addmul(void *dst, void *src, int c, int sz)
+{
+    if (GF_BITS > 8)
+	sz /= 2 ;
+
+    if (fec_initialized == 0)
+	init_fec();
+    addmul((gf *)dst, (gf *)src, (gf)c, sz) ;
+}
+
+/*
+ * parity[] are reduced parity packets with indexes index[], missing[] the
+ * data packets they stand for. The recovered packets are written to dst[],
+ * which must not overlap the parity packets.
+ */
+int
+fec_decode_reduced(void *code0, void *parity0[], int index[], void *dst0[], int missing[], int erasures, int sz)
+{
+	struct fec_parms * code=(struct fec_parms*)code0;
+	gf **parity=(gf**)parity0, **dst=(gf**)dst0;
+    gf *m_dec ;
+    struct fec_decode_rows *d ;
+    int key[2*GF_SIZE] ;
+    int row, col, k = code->k ;
+
+    if (GF_BITS > 8)
+	sz /= 2 ;
+
+    if (erasures == 0)
+	return 0 ;
+    if (erasures > GF_SIZE) {
+	fprintf(stderr, "decode: too many erasures %d\n", erasures);
+	return 1 ;
+    }
+    bcopy(index, key, erasures*sizeof(int));
+    bcopy(missing, key + erasures, erasures*sizeof(int));
+
+    d = find_decode_rows(code, erasures, key, 2*erasures);
+    if (d == NULL) {
+	m_dec = NEW_GF_MATRIX(erasures, erasures);
+	for (row = 0 ; row < erasures ; row++ ) {
+	    if (index[row] < k || index[row] >= code->n) {
+		fprintf(stderr, "decode: invalid parity index %d\n", index[row]);
+		free(m_dec);
+		return 1 ;
+	    }
+	    for (col = 0 ; col < erasures ; col++ )
+		m_dec[row*erasures + col] = code->enc_matrix[index[row]*k + missing[col]] ;
+	}
+	if (invert_mat(m_dec, erasures)) {
+	    free(m_dec);
+	    return 1 ;
+	}
+	d = new_decode_rows(erasures, key, 2*erasures, erasures*erasures);
+	bcopy(m_dec, d->rows, erasures*erasures*sizeof(gf));
+	free(m_dec);
+	insert_decode_rows(code, d);
+    }
+    for (row = 0 ; row < erasures ; row++ ) {
+	bzero(dst[row], sz*sizeof(gf));
+	for (col = 0 ; col < erasures ; col++ )
+	    addmul(dst[row], parity[col], d->rows[row*erasures + col], sz) ;
+    }
+    release_decode_rows(d);
+    return 0 ;
+}
+
 int get_n(void *code0)
 {
 	struct fec_parms * code= (struct fec_parms *)code0;
@@ -54,10 +54,15 @@ extern "C" {
 
 void fec_free(void *p) ;
 void * fec_new(int k, int n) ;//n>=k
+void * fec_get(int k, int n) ;//same as fec_new but shared and cached by (k, n), thread-safe, still release with fec_free
 
 void init_fec() ;  //if you never called this,it will be automatically called in fec_new()
 void fec_encode(void *code, void *src[], void *dst, int index, int sz) ;
 int fec_decode(void *code, void *pkt[], int index[], int sz) ;
+int fec_coefficient(void *code, int index, int col) ; //encoding matrix entry, see fec_decode_reduced()
+void fec_addmul(void *dst, void *src, int c, int sz) ; //dst += c * src
+int fec_decode_reduced(void *code, void *parity[], int index[], void *dst[], int missing[], int erasures, int sz) ;
+const char * fec_use_simd(int enabled) ; //SIMD kernels are on by default, returns the name of the kernel now in use
 
 int get_k(void *code);
 int get_n(void *code);
@@ -9,7 +9,7 @@
 #define _SAM2__STR(s) #s
 
 #define SAM2_VERSION_MAJOR 1
-#define SAM2_VERSION_MINOR 0
+#define SAM2_VERSION_MINOR 9
 
 #define SAM2_HEADER_TAG_SIZE 4
 #define SAM2_HEADER_SIZE 8
@@ -548,15 +548,59 @@ int sam2_socket_buffer_size_server_to_client = 8192;
 
 #define RLE8_ENCODE_UPPER_BOUND(N) (3 * ((N+1) / 2) + (N) / 2)
 
+// SSE2 and NEON are part of the x86-64 and AArch64 baselines so these don't need runtime dispatch
+#if !defined(SAM2_RLE8_NO_SIMD) && !defined(__TINYC__) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SAM2__RLE8_SSE2
+#include <emmintrin.h>
+#elif !defined(SAM2_RLE8_NO_SIMD) && !defined(__TINYC__) && (defined(__aarch64__) || defined(_M_ARM64))
+#define SAM2__RLE8_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(SAM2__RLE8_SSE2) || defined(SAM2__RLE8_NEON)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+static SAM2_FORCEINLINE int sam2__ctz64(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (int) index;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+#endif
+
+// Returns the length of the prefix of input whose bytes are all zero (or all non-zero if zeros is 0)
+static SAM2_FORCEINLINE int64_t rle8__span(const uint8_t *input, int64_t input_size, int zeros) {
+    int64_t i = 0;
+#if defined(SAM2__RLE8_SSE2)
+    for (; i + 16 <= input_size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) &input[i]);
+        uint32_t zero_mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_setzero_si128()));
+        uint32_t end_of_span_mask = zeros ? ~zero_mask & 0xFFFF : zero_mask;
+        if (end_of_span_mask) return i + sam2__ctz64(end_of_span_mask);
+    }
+#elif defined(SAM2__RLE8_NEON)
+    for (; i + 16 <= input_size; i += 16) {
+        uint8x16_t zero_lanes = vceqzq_u8(vld1q_u8(&input[i]));
+        uint8x16_t end_of_span_lanes = zeros ? vmvnq_u8(zero_lanes) : zero_lanes;
+        // Narrowing shift packs the lanes into a 64-bit mask with 4 bits per byte since NEON has no movemask
+        uint64_t end_of_span_mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(end_of_span_lanes), 4)), 0);
+        if (end_of_span_mask) return i + (sam2__ctz64(end_of_span_mask) >> 2);
+    }
+#endif
+    for (; i < input_size && (input[i] == 0) == !!zeros; i++);
+    return i;
+}
+
 int64_t rle8_encode_capped(const uint8_t *input, int64_t input_size, uint8_t *output, int64_t output_capacity) {
     int64_t output_size = 0;
-    for (int64_t i = 0; i < input_size; ++i) {
+    for (int64_t i = 0; i < input_size;) {
         if (input[i] == 0) {
-            uint16_t count = 1;
-            while (i + 1 < input_size && input[i + 1] == 0) {
-                count++;
-                i++;
-            }
+            int64_t count = rle8__span(&input[i], SAM2_MIN(input_size - i, 0xFFFF), 1); // Longer runs are split since the count is 16 bits
+            i += count;
 
             if (output_size >= output_capacity-2) goto err;
             output[output_size++] = 0; // Mark the start of a zero run
@@ -564,8 +608,11 @@ int64_t rle8_encode_capped(const uint8_t *input, int64_t input_size, uint8_t *ou
             output[output_size++] = (uint8_t)(count & 0xFF);
             output[output_size++] = (uint8_t)((count >> 8) & 0xFF);
         } else {
-            if (output_size >= output_capacity) goto err;
-            output[output_size++] = input[i]; // Copy non-zero values directly
+            int64_t count = rle8__span(&input[i], input_size - i, 0);
+            if (output_size + count > output_capacity) goto err;
+            memcpy(&output[output_size], &input[i], count); // Copy non-zero values directly
+            output_size += count;
+            i += count;
         }
     }
 
@@ -583,12 +630,15 @@ int64_t rle8_decode_extra(const uint8_t* input, int64_t input_size, int64_t *inp
             uint16_t count = input[*input_consumed] | (input[*input_consumed + 1] << 8); // Decode count as little endian
             (*input_consumed) += 2; // Move past the count bytes
 
-            while (count-- > 0) {
-                if (output_index >= output_capacity) return output_index;
-                output[output_index++] = 0;
-            }
+            int64_t zeros_written = SAM2_MIN((int64_t) count, output_capacity - output_index);
+            memset(&output[output_index], 0, zeros_written);
+            output_index += zeros_written;
+            if (zeros_written < count) return output_index;
         } else {
-            output[output_index++] = input[(*input_consumed)++];
+            int64_t count = rle8__span(&input[*input_consumed], SAM2_MIN(input_size - *input_consumed, output_capacity - output_index), 0);
+            memcpy(&output[output_index], &input[*input_consumed], count);
+            output_index += count;
+            *input_consumed += count;
         }
     }
     return output_index; // Return the size of the decoded data
@@ -618,9 +668,10 @@ int64_t rle8_decode_size(const uint8_t* input, int64_t input_size) {
 
             output_size += count; // Add zeros to output size
         } else {
-            // Regular byte - copied directly
-            output_size++;
-            input_consumed++;
+            // Regular bytes are copied directly so we only need to know how many there are
+            int64_t count = rle8__span(&input[input_consumed], input_size - input_consumed, 0);
+            output_size += count;
+            input_consumed += count;
         }
     }
 
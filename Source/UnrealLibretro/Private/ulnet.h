@@ -5,6 +5,7 @@
 
 typedef struct juice_agent juice_agent_t;
 #include "zstd.h"
+#include "zdict.h"
 #include "common/xxhash.h"
 #include "fec.h"
 
@@ -43,6 +44,7 @@ typedef struct juice_agent juice_agent_t;
 #define ULNET_CHANNEL_RELIABLE                   0b10100000
 
 #define ULNET_RELIABLE_FLAG_ACK_ONLY             0b00010000
+#define ULNET_RELIABLE_FLAG_SACK                 0b00001000 // Header is followed by a bitfield of the sequences after ack_sequence we're holding
 
 #define ULNET_PACKET_FLAG_TX                     0x1000
 #define ULNET_PACKET_FLAG_TX_RELIABLE_RETRANSMIT 0x2000
@@ -50,6 +52,14 @@ typedef struct juice_agent juice_agent_t;
 
 #define ulnet_exit_header  "E" "X" "I" "T" SAM2__STR(SAM2_VERSION_MAJOR) "." SAM2__STR(SAM2_VERSION_MINOR) "r"
 #define ULNET_EXIT_HEADER {'E','X','I','T',    '0' + SAM2_VERSION_MAJOR, '.',    '0' + SAM2_VERSION_MINOR, 'r'}
+#define ulnet_base_header  "B" "A" "S" "E" SAM2__STR(SAM2_VERSION_MAJOR) "." SAM2__STR(SAM2_VERSION_MINOR) "r"
+#define ULNET_BASE_HEADER {'B','A','S','E',    '0' + SAM2_VERSION_MAJOR, '.',    '0' + SAM2_VERSION_MINOR, 'r'}
+#define ulnet_nack_header  "N" "A" "C" "K" SAM2__STR(SAM2_VERSION_MAJOR) "." SAM2__STR(SAM2_VERSION_MINOR) "r"
+#define ULNET_NACK_HEADER {'N','A','C','K',    '0' + SAM2_VERSION_MAJOR, '.',    '0' + SAM2_VERSION_MINOR, 'r'}
+#define ulnet_dlay_header  "D" "L" "A" "Y" SAM2__STR(SAM2_VERSION_MAJOR) "." SAM2__STR(SAM2_VERSION_MINOR) "r"
+#define ULNET_DLAY_HEADER {'D','L','A','Y',    '0' + SAM2_VERSION_MAJOR, '.',    '0' + SAM2_VERSION_MINOR, 'r'}
+#define ulnet_tree_header  "T" "R" "E" "E" SAM2__STR(SAM2_VERSION_MAJOR) "." SAM2__STR(SAM2_VERSION_MINOR) "r"
+#define ULNET_TREE_HEADER {'T','R','E','E',    '0' + SAM2_VERSION_MAJOR, '.',    '0' + SAM2_VERSION_MINOR, 'r'}
 
 #define ULNET_WAITING_FOR_SAVE_STATE_SENTINEL    INT64_MAX
 
@@ -57,13 +67,101 @@ typedef struct juice_agent juice_agent_t;
 #define ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY    0b00000010ULL
 #define ULNET_SESSION_FLAG_READY_TO_TICK_SET     0b00000100ULL
 #define ULNET_SESSION_FLAG_DRAW_IMGUI            0b00001000ULL
+#define ULNET_SESSION_FLAG_MISPREDICTED          0b00010000ULL
+#define ULNET_SESSION_FLAG_ADAPTIVE_DELAY        0b00100000ULL // Authority picks delay_frames from measured RTT
+#define ULNET_SESSION_FLAG_BASELINE_ADVERTISED   0b01000000ULL // We told the authority which savestate we already have
+#define ULNET_SESSION_FLAG_DELAY_BASED_PACING    0b10000000ULL // Savestate pacing backs off when peers report the link queuing up
+#define ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC  0b100000000ULL // Frame pacing is slewed so we reach each frame when our peers do
+#define ULNET_SESSION_FLAG_RESYNC_PENDING        0b1000000000ULL // Our savestate hash disagreed with the authority's, ask it for the chunks we got wrong on the next tick
+#define ULNET_SESSION_FLAG_RESYNC_REQUESTED      0b10000000000ULL // We're waiting on the patch we asked for, hashes from before it loads still disagree
 
 // @todo Remove this define once it becomes possible through normal featureset
 #define ULNET__DEBUG_EVERYONE_ON_PORT_0
 
 #define ULNET_MAX_SAMPLE_SIZE 128
+// Frame pacing PLL gains. The integral term learns how late we consistently wake up, the proportional term trims the jitter
+#define ULNET_FRAME_PACER_KP 0.1
+#define ULNET_FRAME_PACER_KI 0.02
+// Fraction of the smoothed frame advantage we slew away each frame and the most of a frame time we slew by at once
+#define ULNET_FRAME_ADVANTAGE_GAIN 0.05
+#define ULNET_FRAME_ADVANTAGE_SLEW_MAX 0.01
 
 #define ULNET_RELIABLE_ACK_BUFFER_SIZE 128
+#define ULNET_RELIABLE_SACK_SIZE (ULNET_RELIABLE_ACK_BUFFER_SIZE / 8) // Bit i is set if we have ack_sequence + i
+#define ULNET_RELIABLE_RTO_MAX_USEC 2000000
+#define ULNET_RELIABLE_RTO_BACKOFF_MAX 6
+
+// Lowering delay_frames is deferred until the lower value has been enough for this long so we don't flap on a noisy link
+#define ULNET_ADAPTIVE_DELAY_DECREASE_AFTER_USEC 3000000
+
+// Savestates we know a peer also has so later transfers can be compressed as a delta against them
+#define ULNET_SAVE_STATE_BASELINES_MAX 4
+// How long the authority holds off syncing a newly connected peer waiting to hear which baseline it has
+#define ULNET_BASELINE_ADVERT_WAIT_USEC 250000
+// Savestates hashed on frames that are a multiple of this become baselines once a peer's hash shows they have the same one
+// Longer than the delay buffer so a candidate isn't replaced before the peer's hash for it can reach us
+#define ULNET_SAVE_STATE_BASELINE_INTERVAL_FRAMES 120
+// Encoded savestate transfers kept around so peers joining together or shortly after each other don't redo compression and parity
+#define ULNET_SAVE_STATE_ENCODINGS_MAX 4
+// Savestates are hashed in chunks this big so a peer that desynced only has to be sent the chunks that differ
+#define ULNET_SAVE_STATE_CHUNK_SIZE 4096
+// Chunks get bigger for huge savestates so the hashes stay a small fraction of the state
+#define ULNET_SAVE_STATE_CHUNKS_MAX 65536
+#define ULNET_SAVE_STATE_CHUNK_HASHES_PER_MESSAGE 256
+// Trained once per game from our recent savestates and sent along with the first full savestate each peer gets from us
+#define ULNET_ZSTD_DICTIONARY_CAPACITY (16 * 1024)
+#define ULNET_ZSTD_DICTIONARY_TRAINING_SIZE_MAX (1024 * 1024) // Training time grows with this so bigger savestates are subsampled
+// Full savestates bigger than this are compressed as independent zstd frames back to back so the sender can use every core and the receiver
+// can decompress while the rest arrives. A decoder that doesn't know about chunks reads the frames as one stream all the same
+#define ULNET_SAVE_STATE_COMPRESS_CHUNK_SIZE (1 << 20)
+#define ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX 256 // Chunks get bigger past this, it's also the most frames a receiver keeps track of
+#define ULNET_ZSTD_CHUNK_CONTEXTS 8 // Chunks compressed or decompressed at once, each needs its own context
+// Savestates serialized on the emulation thread and hashed on a worker, a new one only waits if the worker is this many behind
+#define ULNET_SAVE_STATE_SNAPSHOTS 2
+// Buffers recycled between savestate transfers so multi-megabyte states don't go through malloc and free every time
+#define ULNET_TRANSFER_BUFFERS_MAX 4
+// Fragments held until one from the first packet group tells us where they go, past this parity has to cover them
+#define ULNET_SAVE_STATE_HELD_FRAGMENTS_MAX (4 * FEC_PACKET_GROUPS_MAX)
+// NACKs sent for one savestate transfer before we give up on it and ask for a new one from scratch
+#define ULNET_SAVE_STATE_REPAIR_REQUESTS_MAX 8
+// Space in front of an encoded payload so a fragment header can be written in place right before each block we send
+#define ULNET_SAVE_STATE_PACKET_HEADROOM 16
+// Savestate parity is sized so a packet group fails to decode at most this often at the measured packet loss
+#define ULNET_FEC_FAILURE_RATE 0.001
+// Packet loss assumed for a peer before we have measured any, close to what the fixed redundancy of old versions handled
+#define ULNET_PACKET_LOSS_UNKNOWN 0.02f
+// Unreliable packets we expect from a peer between packet loss samples
+#define ULNET_PACKET_LOSS_WINDOW 64
+// Savestate fragments a peer can be sent back-to-back are what the paced rate sends in this long, at least one. Input sent after them
+// queues behind them on the link so at any rate the link can keep up with it waits at most this long
+#define ULNET_BULK_BURST_USEC 1000
+#define ULNET_BULK_RATE_MIN_BYTES_PER_SECOND 32000
+// Longest the pacer goes quiet before our next input packet so the fragments queued ahead of it on the link can drain
+#define ULNET_BULK_INPUT_QUIET_USEC_MAX 4000
+// Queuing delay a savestate transfer may add to the link. Players' input shares it so this is far under LEDBAT's usual 100 ms
+#define ULNET_LEDBAT_TARGET_USEC 1000
+// RFC 6817 caps this at 1, lower reacts more slowly to the link having room but overshoots the target by less
+#define ULNET_LEDBAT_GAIN 0.25
+// Most the window grows by in a round trip relative to itself. LEDBAT adds up to a packet which is most of the window on a slow link
+#define ULNET_LEDBAT_GROWTH_MAX 0.0625
+// Congestion window a transfer to a new peer starts from
+#define ULNET_LEDBAT_INITIAL_WINDOW_PACKETS 2
+// Slow start grows the window by this fraction of what was delivered, a quarter a round trip instead of TCP's doubling since the
+// queue only shows up in the feedback a couple of round trips after we start overfilling it. Then it backs off to this fraction
+#define ULNET_LEDBAT_SLOW_START_GAIN 0.25
+#define ULNET_LEDBAT_SLOW_START_EXIT 0.6
+// How often a receiver reports the queuing delay it sees on savestate fragments, also the fastest the sender can react
+#define ULNET_LEDBAT_FEEDBACK_USEC 10000
+// Minutes of one-way delay minimums the base delay is taken from so a route change is eventually forgotten
+#define ULNET_LEDBAT_BASE_HISTORY 10
+// Newest one-way delay samples the current delay is the minimum of to filter out jitter
+#define ULNET_LEDBAT_CURRENT_FILTER 4
+// Gaps between input packets longer than this are a stall, not jitter, and aren't fed into the inter-arrival estimate
+#define ULNET_INPUT_ARRIVAL_GAP_MAX_USEC 1000000
+// Deviations past the predicted arrival of an input packet we keep blocking on the sockets for
+#define ULNET_INPUT_WAIT_JITTER_MARGIN 2
+// How long we block for a packet we have no inter-arrival estimate for yet or one that is already overdue
+#define ULNET_INPUT_WAIT_FALLBACK_USEC 3000
 
 // This constant defines the maximum number of frames that can be buffered before blocking.
 // A value of 2 implies no delay can be accomidated.
@@ -83,11 +181,42 @@ typedef struct juice_agent juice_agent_t;
 // To handle the case where a peer immediately ticks and sends an input after receiving,
 // the input buffer needs to hold at least 2 frames.
 //
-// Setting ULNET_DELAY_BUFFER_SIZE to 2 allows for no frame delay while still handling this scenario.
-// The following constant is set to 8 which yields 3 frames of delay this corresponds to a max RTT PING of 100 ms to not stutter
+// Setting the buffer size to 2 allows for no frame delay while still handling this scenario.
+// The default is 8 which yields 3 frames of delay this corresponds to a max RTT PING of 100 ms to not stutter.
+// The size actually used is picked by whoever hosts the room and stored in the room flags see ulnet_room_set_delay_buffer_size.
+// ulnet_state_t is allocated for ULNET_DELAY_BUFFER_SIZE_MAX, but only the slots in use are ever sent so LAN packets stay small.
+// The max of 32 allows up to 15 frames of delay, enough to cover cross-continent links. See ulnet_delay_frames_max
 #define ULNET_DELAY_BUFFER_SIZE 8
-
-#define ULNET_DELAY_FRAMES_MAX (ULNET_DELAY_BUFFER_SIZE/2-1)
+#define ULNET_DELAY_BUFFER_SIZE_MAX 32
+
+// Rollback lets us simulate up to this many frames past the last frame we have every peer's input for.
+// A peer running ahead of us sees our input early by the same amount so the window also has to fit inside the delay ring
+// along with both peers delay frames. See ulnet__rollback_window
+// This doesn't grow with bigger delay buffers, those are for covering latency with delay not for deeper rollbacks
+#define ULNET_ROLLBACK_FRAMES_MAX (ULNET_DELAY_BUFFER_SIZE-2)
+#define ULNET_ROLLBACK_BUFFER_SIZE ULNET_DELAY_BUFFER_SIZE
+
+// log2 of the delay buffer size, 0 means ULNET_DELAY_BUFFER_SIZE so rooms from older versions keep working
+#define ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_SHIFT 32
+#define ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_MASK  (0xFULL << ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_SHIFT)
+// Which ULNET_SAVE_STATE_HASH_* every peer in the room hashes savestates with to check for desyncs. Rooms from before this was added use 0
+#define ULNET_ROOM_FLAG_SAVE_STATE_HASH_SHIFT 36
+#define ULNET_ROOM_FLAG_SAVE_STATE_HASH_MASK  (0x3ULL << ULNET_ROOM_FLAG_SAVE_STATE_HASH_SHIFT)
+// SAM2_VERSION_MINOR of whoever hosts the room. Everyone in the room speaks the wire formats of that version and the authority
+// turns away joins from anything older. Rooms from before this was added use 0 and get the formats from before versioning
+#define ULNET_ROOM_FLAG_PROTOCOL_VERSION_SHIFT 38
+#define ULNET_ROOM_FLAG_PROTOCOL_VERSION_MASK  (0xFULL << ULNET_ROOM_FLAG_PROTOCOL_VERSION_SHIFT)
+
+// The first protocol version with each wire format change
+#define ULNET_PROTOCOL_VERSION_INPUT_FORMAT    1 // Input packets start with a ULNET_INPUT_FORMAT_* byte
+#define ULNET_PROTOCOL_VERSION_SACK            5 // Reliable packets can carry ULNET_RELIABLE_FLAG_SACK
+#define ULNET_PROTOCOL_VERSION_TIMED_INPUT     6 // ULNET_INPUT_FORMAT_COMPACT_TIMED
+#define ULNET_PROTOCOL_VERSION_SAVE_STATE_HASH 8 // ULNET_ROOM_FLAG_SAVE_STATE_HASH_MASK picks the savestate hash
+
+#define ULNET_SAVE_STATE_HASH_XXH32 0
+#define ULNET_SAVE_STATE_HASH_XXH3  1 // 64-bit XXH3 folded to 32 bits, big savestates are hashed a segment per worker thread and the segment hashes hashed again
+// Savestates bigger than this are split into segments this big. Fixed so peers with a different number of threads agree
+#define ULNET_SAVE_STATE_HASH_SEGMENT_SIZE (1 << 20)
 
 #define ULNET_PORT_COUNT 8
 typedef int16_t ulnet_input_state_t[64]; // This must be a POD for putting into packets
@@ -117,13 +246,13 @@ typedef struct ulnet_core_option {
 // @todo This is really sparse so you should just add routines to read values from it in the serialized format
 typedef struct {
     int64_t frame; // Frame for which currently buffered input, room_xor_delta, and core_option should be applied
-    ulnet_input_state_t input_state[ULNET_DELAY_BUFFER_SIZE][ULNET_PORT_COUNT];
-    sam2_room_t room_xor_delta[ULNET_DELAY_BUFFER_SIZE];
-    ulnet_core_option_t core_option[ULNET_DELAY_BUFFER_SIZE]; // Max 1 option per frame provided by the authority
+    ulnet_input_state_t input_state[ULNET_DELAY_BUFFER_SIZE_MAX][ULNET_PORT_COUNT];
+    sam2_room_t room_xor_delta[ULNET_DELAY_BUFFER_SIZE_MAX];
+    ulnet_core_option_t core_option[ULNET_DELAY_BUFFER_SIZE_MAX]; // Max 1 option per frame provided by the authority
 
     int64_t save_state_frame; // This is the current frame the peer is on the essentially
-    uint32_t save_state_hash[ULNET_DELAY_BUFFER_SIZE];
-    uint32_t input_state_hash[ULNET_DELAY_BUFFER_SIZE];
+    uint32_t save_state_hash[ULNET_DELAY_BUFFER_SIZE_MAX];
+    uint32_t input_state_hash[ULNET_DELAY_BUFFER_SIZE_MAX];
 } ulnet_state_t;
 SAM2_STATIC_ASSERT(
     sizeof(ulnet_state_t) ==
@@ -137,9 +266,14 @@ SAM2_STATIC_ASSERT(
     "ulnet_state_t is not packed"
 );
 
+#define ULNET_INPUT_FORMAT_LEGACY  0xFF // Never on the wire, ULNET_INPUT_FORMAT_RLE8 without the format byte for rooms older than ULNET_PROTOCOL_VERSION_INPUT_FORMAT
+#define ULNET_INPUT_FORMAT_RLE8    0 // ulnet_state_t trimmed to the delay buffer size then RLE encoded
+#define ULNET_INPUT_FORMAT_COMPACT 1 // Bit-packed with only the non-zero parts of each slot, see ulnet__encode_state_compact
+#define ULNET_INPUT_FORMAT_COMPACT_TIMED 2 // Our frame advantage over the receiver as a little-endian int32 in microseconds, then the same as ULNET_INPUT_FORMAT_COMPACT
+
 typedef struct {
     uint8_t channel_and_port;
-    uint8_t coded_state[];
+    uint8_t coded_state[]; // First byte is one of ULNET_INPUT_FORMAT_* unless the room is older than ULNET_PROTOCOL_VERSION_INPUT_FORMAT
 } ulnet_state_packet_t;
 
 typedef struct {
@@ -150,10 +284,23 @@ typedef struct {
 } ulnet_reliable_packet_t;
 
 #define FEC_PACKET_GROUPS_MAX 16
-#define FEC_REDUNDANT_BLOCKS 16 // ULNET is hardcoded based on this value so it can't really be changed without breaking the protocol
+#define FEC_REDUNDANT_BLOCKS 16 // Parity blocks per full packet group in version 0 of the savestate transfer protocol
+// Most parity blocks a full packet group gets however bad the packet loss is. Savestates too big for FEC_PACKET_GROUPS_MAX groups at the
+// measured loss get less parity instead, so a transfer can carry up to FEC_PACKET_GROUPS_MAX * (GF_SIZE - 1) blocks of compressed payload
+#define ULNET_FEC_REDUNDANT_BLOCKS_MAX 96
 
-#define ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239         0b0001
+#define ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_MAX         0b0001 // k == GF_SIZE - redundant_blocks, which was always 239 in version 0
 #define ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0 0b0010
+#define ULNET_SAVESTATE_TRANSFER_VERSION_MASK          0b1100
+#define ULNET_SAVESTATE_TRANSFER_VERSION_SHIFT         2
+#define ULNET_SAVESTATE_TRANSFER_VERSION               3 // Version 0 had a 3 byte header without payload_version, version 1 a 4 byte one without redundant_blocks
+#define ULNET_SAVESTATE_TRANSFER_V0_HEADER_SIZE        3 // and version 2 an 8 byte one without send_time_usec_le
+#define ULNET_SAVESTATE_TRANSFER_V1_HEADER_SIZE        4 // Receivers can't tell how long a newer header is so this goes up with SAM2_VERSION_MINOR
+#define ULNET_SAVESTATE_TRANSFER_V2_HEADER_SIZE        8
+
+// Every version appends its fields to savestate_transfer_payload_t so older payloads are upgraded by zeroing what they lack
+// Peers that can't read a payload version have to be turned away from rooms that send it, so it goes up with SAM2_VERSION_MINOR
+#define ULNET_SAVE_STATE_PAYLOAD_VERSION               3
 
 typedef struct {
     uint8_t channel_and_flags;
@@ -164,8 +311,13 @@ typedef struct {
     };
 
     uint8_t sequence_lo;
+    uint8_t payload_version; // Layout of savestate_transfer_payload_t, version 0 headers imply payload version 0
+    uint8_t redundant_blocks; // n - k, chosen per transfer from the packet loss to the receiver
+    uint8_t transfer_id; // Counts the savestates sent to this peer so leftovers of one it already loaded aren't taken for a new one
+    uint8_t reserved[2]; // Zero, the version bits are all used up so anything new has to go here
+    uint32_t send_time_usec_le; // Low bits of the sender's clock so the receiver can track one-way delay
 
-    //uint8_t payload[]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-3
+    //uint8_t payload[]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-12
 } ulnet_save_state_packet_header_t;
 
 typedef struct {
@@ -177,10 +329,16 @@ typedef struct {
     };
 
     uint8_t sequence_lo;
+    uint8_t payload_version;
+    uint8_t redundant_blocks;
+    uint8_t transfer_id;
+    uint8_t reserved[2];
+    uint32_t send_time_usec_le;
 
-    uint8_t payload[ULNET_PACKET_SIZE_BYTES_MAX-3]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-3
+    uint8_t payload[ULNET_PACKET_SIZE_BYTES_MAX-12]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-12
 } ulnet_save_state_packet_fragment2_t;
 SAM2_STATIC_ASSERT(sizeof(ulnet_save_state_packet_fragment2_t) == ULNET_PACKET_SIZE_BYTES_MAX, "Savestate transfer is the wrong size");
+SAM2_STATIC_ASSERT(sizeof(ulnet_save_state_packet_header_t) <= ULNET_SAVE_STATE_PACKET_HEADROOM, "Savestate fragment header doesn't fit in the headroom");
 
 typedef struct {
     int64_t total_size_bytes;
@@ -191,18 +349,173 @@ typedef struct {
     int32_t compressed_options_size;
     int32_t compressed_savestate_size;
     int32_t decompressed_savestate_size;
+
+    // Payload version 1
+    int64_t baseline_frame; // -1 when the savestate isn't a delta
+    uint32_t save_state_xxhash; // Of the decompressed savestate, also how both sides identify it as a baseline later
+    uint32_t baseline_xxhash;
+
+    // Payload version 2
+    int32_t patch_size; // Decompressed size of compressed_savestate_data when it's a chunk patch of the baseline, 0 otherwise
+    int32_t patch_chunk_size;
+
+    // Payload version 3
+    uint32_t dictionary_id; // Of the dictionary a full savestate was compressed with, 0 for none
+    int32_t dictionary_size; // 0 unless we sent the dictionary along because the peer didn't have it
 #if 0
-    uint8_t compressed_savestate_data[compressed_savestate_size];
+    uint8_t compressed_savestate_data[compressed_savestate_size]; // One zstd frame or for big full savestates one per chunk back to back
     uint8_t compressed_options_data[compressed_options_size];
+    uint8_t dictionary[dictionary_size];
 #else
     uint8_t compressed_data[];
 #endif
 } savestate_transfer_payload_t;
 
+// A savestate transfer after compression and Reed-Solomon encoding, ready to be sent to any peer with a matching baseline
+typedef struct ulnet_save_state_encoding {
+    int64_t frame;
+    int64_t baseline_frame;
+    uint32_t baseline_xxhash;
+    uint32_t core_options_xxhash;
+    sam2_room_t room;
+    float packet_loss; // Level of packet loss the parity was sized for
+    uint32_t dictionary_id;
+    bool dictionary_embedded; // Any peer can decode it, otherwise only peers that already have dictionary_id
+    int64_t compress_cycles;
+    int n, k, packet_groups, packet_payload_size_bytes;
+    size_t capacity;
+    uint8_t *buffer;
+    savestate_transfer_payload_t *payload; // ULNET_SAVE_STATE_PACKET_HEADROOM bytes into buffer and followed by the parity blocks, NULL when the slot is empty
+} ulnet_save_state_encoding_t;
+SAM2_STATIC_ASSERT(sizeof(savestate_transfer_payload_t) % 8 == 0, "compressed_data would start in the padding");
+
+#define ULNET_BASELINE_FLAG_RESYNC      0b0001 // We couldn't use the savestate we were sent, send another one
+#define ULNET_BASELINE_FLAG_CHUNK_HASHES 0b0010 // We sent the chunk hashes of the baseline beforehand, patch the chunks that differ
+
+typedef struct {
+    char header[SAM2_HEADER_SIZE];
+    int64_t frame; // -1 when we have no baseline
+    uint32_t xxhash;
+    uint32_t flags;
+    float packet_loss; // Fraction of the authority's packets that never reach us, negative until measured. Missing from older versions
+    uint32_t dictionary_id; // Savestate dictionary we have for the room's game, 0 for none. Missing from older versions
+} ulnet_baseline_message_t;
+
+// Chunk hashes of a baseline, split over as many messages as it takes, hashed with the room's ULNET_SAVE_STATE_HASH_*. The root is just the xxhash of the whole savestate
+// Sending every leaf up front costs 4 bytes per chunk, walking down the tree would cost a round trip per level while we're stalled
+typedef struct {
+    char header[SAM2_HEADER_SIZE];
+    int64_t frame;
+    int64_t save_state_size;
+    uint32_t xxhash;
+    int32_t chunk_size;
+    int32_t chunk_offset; // Index of chunk_xxhash[0] among all the chunks
+    int32_t chunk_xxhash_count;
+    uint32_t chunk_xxhash[ULNET_SAVE_STATE_CHUNK_HASHES_PER_MESSAGE];
+} ulnet_save_state_tree_message_t;
+
+// What we've been sent of a peer's chunk hashes
+typedef struct {
+    int64_t frame;
+    int64_t save_state_size;
+    uint32_t xxhash;
+    int32_t chunk_size;
+    int32_t chunk_count;
+    int32_t chunks_received;
+    int32_t chunk_capacity;
+    uint32_t *chunk_xxhash;
+} ulnet_save_state_tree_t;
+
+// A savestate handed off to a worker thread so the emulation thread only pays for serializing it
+typedef struct {
+    uint8_t *buffer;
+    size_t capacity;
+    size_t size;
+    int64_t frame;
+    int port;
+    int algorithm;
+    const uint8_t *source; // What the worker hashes. When it isn't buffer it's only borrowed until the next ulnet_poll_session
+    uint32_t hash;
+    uint32_t xxhash; // Only computed for baseline candidates
+    int pending; // Nonzero until the worker is done with buffer, only read under the pool mutex
+    bool in_use; // Hash not collected into save_state_hash yet
+    bool baseline_candidate; // Frame is a multiple of ULNET_SAVE_STATE_BASELINE_INTERVAL_FRAMES
+} ulnet_save_state_snapshot_t;
+
+// A savestate compressed and encoded on a worker while we keep emulating, its encoding slot stays hidden until it's collected
+typedef struct {
+    uint8_t *buffer; // Savestates we send are serialized into this and then swapped into the baseline ring
+    size_t capacity;
+    const uint8_t *save_state; // buffer unless the encode was synchronous
+    size_t save_state_size;
+    int64_t save_state_frame;
+    uint32_t save_state_xxhash;
+    int slot;
+    savestate_transfer_payload_t *payload;
+    size_t payload_plus_parity_bound_size;
+    int64_t compressed_bound_size;
+    const uint8_t *baseline; // Delta against this when not NULL
+    size_t baseline_size;
+    ulnet_save_state_tree_t tree; // Of the peer we're sending a patch to
+    uint8_t *patch; // NULL unless we're sending a patch
+    int hash_algorithm;
+    ZSTD_CCtx *cctx;
+    ZSTD_CCtx **chunk_cctx;
+    const ZSTD_CDict *cdict;
+    const uint8_t *dictionary; // Sent along when not NULL
+    size_t dictionary_size;
+    int compress_level;
+    int32_t compress_chunk_size; // 0 unless the savestate is compressed as independent chunks
+    float packet_loss;
+    sam2_room_t room;
+    ulnet_core_option_t core_options[ULNET_CORE_OPTIONS_MAX];
+    int64_t patch_chunks_sent;
+    int64_t compress_cycles;
+    int n, k, packet_groups, packet_payload_size_bytes;
+    bool failed; // Compressed to more than a transfer can carry
+    uint64_t peers; // Sent the encoding once it's collected
+    int pending;
+    bool in_use;
+} ulnet_save_state_encode_job_t;
+
+// Dictionary training handed off to a worker, the samples are chunks of savestates from one game
+typedef struct {
+    uint8_t *samples;
+    size_t *sample_sizes;
+    unsigned sample_count;
+    uint8_t *dictionary;
+    size_t dictionary_size; // Or a ZDICT error code
+    uint64_t rom_hash;
+    int pending;
+    bool in_use;
+    bool attempted; // We don't try again for the same game if training fails
+} ulnet_zstd_dictionary_training_t;
+
+// Sent when a savestate transfer stalls because some packet group lost more blocks than it had parity
+// or every fragment we got so far is held because we lost the ones from the first packet group that tell us the layout
+typedef struct {
+    char header[SAM2_HEADER_SIZE];
+    int32_t k, n, packet_groups, block_size; // Layout of the stalled transfer so a repair is never applied to a different one, all 0 when we don't know it
+    uint64_t received[FEC_PACKET_GROUPS_MAX][4]; // Bitfield of the sequence_lo we have for each packet group
+} ulnet_save_state_nack_message_t;
+
+// Sent unreliably while savestate fragments are arriving so the sender can pace them to what the link can take
+typedef struct {
+    char header[SAM2_HEADER_SIZE];
+    int32_t queuing_delay_usec; // One-way delay of the newest fragments over the lowest we've seen
+} ulnet_delay_message_t;
+
 typedef struct ulnet_transport_inproc_buffer {
     uint8_t msg[256][ULNET_PACKET_SIZE_BYTES_MAX];
     uint16_t msg_size[256];
+    int64_t deliver_at_usec[256];
     int32_t count;  // Number of messages available
+
+    // Simulated bottleneck link for tests and benchmarks, a FIFO drained at a fixed rate that drops what would wait too long in it
+    int64_t bottleneck_bytes_per_second; // 0 delivers everything on the receiver's next poll
+    int64_t bottleneck_queue_usec_max;
+    int64_t bottleneck_free_usec; // When the link is done with everything queued
+    int64_t bottleneck_dropped;
 } ulnet_inproc_buf_t;
 
 typedef struct ulnet_transport_inproc {
@@ -211,10 +524,24 @@ typedef struct ulnet_transport_inproc {
 } ulnet_transport_inproc_t;
 
 
+// Schedules core ticks on a grid of ideal frame times and steers toward it like a PLL instead of accumulating rounded frame times
+typedef struct ulnet_frame_pacer {
+    int64_t tick_at_usec; // On the ulnet__get_monotonic_time_microseconds clock, 0 ticks right away
+    int64_t grid_start_usec; // 0 until the first tick
+    int64_t grid_frames; // Frames ticked since grid_start_usec
+    double frame_time_usec;
+    double phase_correction_usec; // PLL integrator, how early we schedule to cancel out consistently ticking late
+    double phase_error_usec; // How late the latest tick was relative to the grid
+    int64_t last_tick_usec;
+    int64_t frame_time_sample_usec[ULNET_MAX_SAMPLE_SIZE];
+    int64_t tick_count;
+    int64_t resync_count; // Times we were off by more than a frame and slipped the grid instead of ticking back-to-back to catch up
+} ulnet_frame_pacer_t;
+
 typedef struct ulnet_session {
     int64_t frame_counter;
     int64_t delay_frames;
-    int64_t core_wants_tick_at_unix_usec;
+    ulnet_frame_pacer_t frame_pacer;
     int64_t flags;
     uint16_t our_peer_id;
 
@@ -228,6 +555,23 @@ typedef struct ulnet_session {
     arena_t arena;
 
     ulnet_state_t state[SAM2_PORT_MAX+1];
+    ulnet_state_t state_scratch; // Where ulnet__encode_state and ulnet__decode_state pack and unpack so they don't need one on the stack
+    int64_t authority_next_frame_to_apply; // Next frame whose room_xor_delta and core_option from the authority have not been applied yet
+
+    // MARK: Rollback
+    int64_t rollback_frames_max; // Opt-in, 0 keeps delay-based lockstep
+    int64_t rollback_mispredicted_frame; // Earliest simulated frame that used a wrong prediction. Only valid with ULNET_SESSION_FLAG_MISPREDICTED
+    ulnet_input_state_t rollback_input[ULNET_ROLLBACK_BUFFER_SIZE][ULNET_PORT_COUNT]; // Input each frame was simulated with whether predicted or confirmed
+    uint8_t *rollback_save_state[ULNET_ROLLBACK_BUFFER_SIZE]; // Snapshot taken right before simulating rollback_save_state_frame
+    size_t rollback_save_state_size[ULNET_ROLLBACK_BUFFER_SIZE];
+    size_t rollback_save_state_capacity[ULNET_ROLLBACK_BUFFER_SIZE];
+    int64_t rollback_save_state_frame[ULNET_ROLLBACK_BUFFER_SIZE];
+    int64_t rollback_count;
+    int64_t rollback_resimulated_frames;
+    int64_t rollback_window_start_usec;
+    int64_t rollback_window_resimulated_frames;
+    double rollback_resimulated_frames_per_second;
+    int rollback_depth[ULNET_MAX_SAMPLE_SIZE];
 
     // MARK: Peer fields
     uint64_t peer_needs_sync_bitfield;
@@ -240,24 +584,162 @@ typedef struct ulnet_session {
     uint16_t       agent_peer_ids[SAM2_TOTAL_PEERS];
     int64_t peer_desynced_frame[SAM2_TOTAL_PEERS];
     ulnet_input_state_t spectator_suggested_input_state[SAM2_TOTAL_PEERS][ULNET_PORT_COUNT];
-    arena_ref_t state_packet_history[SAM2_TOTAL_PEERS][ULNET_STATE_PACKET_HISTORY_SIZE]; // Indexable by (frame / ULNET_DELAY_BUFFER_SIZE) % ULNET_STATE_PACKET_HISTORY_SIZE
+    arena_ref_t state_packet_history[SAM2_TOTAL_PEERS][ULNET_STATE_PACKET_HISTORY_SIZE]; // Indexable by (frame / ulnet_delay_buffer_size(session)) % ULNET_STATE_PACKET_HISTORY_SIZE
     arena_ref_t packet_history[SAM2_TOTAL_PEERS][256]; // All packets circular buffer in order they were sent/recv
     uint8_t packet_history_next[SAM2_TOTAL_PEERS];
-    int64_t reliable_retransmit_delay_microseconds;
-    int64_t reliable_last_transmit_time[SAM2_TOTAL_PEERS];
+    int64_t reliable_retransmit_delay_microseconds; // Floor on the retransmission timeout, which is all it is until we have an RTT sample
+    int64_t reliable_rto_started_usec[SAM2_TOTAL_PEERS]; // When the oldest unacked packet was sent or the cumulative ack last moved
+    int reliable_rto_backoff[SAM2_TOTAL_PEERS]; // Timeouts in a row, each doubles the next one
+    int64_t reliable_retransmit_count;
     arena_ref_t reliable_tx_packet_history[SAM2_TOTAL_PEERS][ULNET_RELIABLE_ACK_BUFFER_SIZE]; // Indexable by sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE
     arena_ref_t reliable_rx_packet_history[SAM2_TOTAL_PEERS][ULNET_RELIABLE_ACK_BUFFER_SIZE]; // Indexable by sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE
     uint16_t reliable_tx_next_seq[SAM2_TOTAL_PEERS]; // Greatest sequence we have sent
     uint16_t reliable_tx_head[SAM2_TOTAL_PEERS];     // Greatest sequence we have sent and received an ack for
     uint16_t reliable_rx_head[SAM2_TOTAL_PEERS];     // Next sequence we expect to receive
+    int64_t reliable_tx_send_time_usec[SAM2_TOTAL_PEERS][ULNET_RELIABLE_ACK_BUFFER_SIZE]; // 0 until first transmitted, -1 once retransmitted
+    int64_t reliable_tx_last_send_usec[SAM2_TOTAL_PEERS][ULNET_RELIABLE_ACK_BUFFER_SIZE]; // Latest transmission including retransmissions
+    int64_t reliable_tx_delivered_send_usec[SAM2_TOTAL_PEERS]; // Latest transmission of a packet the peer has acked or sacked
+    uint64_t reliable_tx_sacked[SAM2_TOTAL_PEERS][ULNET_RELIABLE_ACK_BUFFER_SIZE / 64]; // Bit sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE, the peer has it but not the ones before it
+    uint64_t reliable_rx_held[SAM2_TOTAL_PEERS][ULNET_RELIABLE_ACK_BUFFER_SIZE / 64]; // Same for packets we got ahead of reliable_rx_head
+
+    // MARK: Latency
+    int64_t rtt_sample_usec[SAM2_TOTAL_PEERS];
+    int64_t rtt_smoothed_usec[SAM2_TOTAL_PEERS]; // 0 until we have a sample
+    int64_t rtt_variance_usec[SAM2_TOTAL_PEERS];
+    int64_t adaptive_delay_decrease_pending_since_usec; // 0 when we aren't waiting to lower delay_frames
+
+    // MARK: Input arrival
+    // Input packets that moved a port forward, timed on the ulnet__get_monotonic_time_microseconds clock per peer we got them from
+    int64_t input_last_arrival_usec[SAM2_TOTAL_PEERS]; // 0 until the first one
+    int64_t input_interarrival_usec[SAM2_TOTAL_PEERS]; // Smoothed gap between them, 0 until we have a gap
+    int64_t input_jitter_usec[SAM2_TOTAL_PEERS];       // Smoothed deviation of the gap from input_interarrival_usec
+    int64_t input_wait_count; // Times we blocked on the sockets for input instead of ticking
+    int64_t input_wait_usec;  // Total time we spent blocked
+    int64_t received_packet_count;
+
+    // MARK: Frame advantage
+    int32_t frame_advantage_usec[SAM2_TOTAL_PEERS]; // How far ahead of each peer we reach frames, positive when they're the one waiting
+    int32_t peer_frame_advantage_usec[SAM2_TOTAL_PEERS]; // The same from their side, from their input packets
+    int64_t peer_frame_advantage_frame[SAM2_TOTAL_PEERS]; // Frame of the input packet peer_frame_advantage_usec came from so late packets don't overwrite it
+    uint64_t peer_frame_advantage_bitfield; // Peers that have reported one
+    double frame_advantage_sync_usec; // Smoothed half difference of the two averaged over peers, what we slew away
+    int64_t frame_advantage_slewed_usec; // Total we've slewed our frame pacing by
+    int32_t frame_advantage_sample_usec[ULNET_MAX_SAMPLE_SIZE];
+    int32_t frame_advantage_measured_sample_usec[ULNET_MAX_SAMPLE_SIZE]; // Before smoothing
+
+    // MARK: Packet loss
+    uint16_t unreliable_tx_next_seq[SAM2_TOTAL_PEERS]; // Numbers the unreliable packets we send so the receiver can count gaps, 0 is skipped
+    uint16_t unreliable_rx_seq[SAM2_TOTAL_PEERS];      // Greatest unreliable sequence received, 0 until the first one
+    int unreliable_rx_expected[SAM2_TOTAL_PEERS];
+    int unreliable_rx_received[SAM2_TOTAL_PEERS];
+    uint64_t packet_loss_measured_bitfield;
+    float packet_loss[SAM2_TOTAL_PEERS]; // Smoothed fraction of the unreliable packets from each peer that never arrived
+    uint64_t peer_packet_loss_reported_bitfield;
+    float peer_packet_loss[SAM2_TOTAL_PEERS]; // What each peer measured for our packets, from its baseline advert
+
+    // MARK: Bulk send pacing
+    // Savestate fragments are queued and paced out per peer, input and reliable packets skip the queue and go out immediately
+    int64_t bulk_send_bytes_per_second; // 0 sends queued fragments as fast as we can
+    uint64_t bulk_pending_bitfield; // Peers with blocks left in bulk_pending
+    uint64_t bulk_slow_start_bitfield; // Peers whose congestion window is still in slow start
+    uint64_t bulk_pending[SAM2_TOTAL_PEERS][FEC_PACKET_GROUPS_MAX][4]; // Blocks of the encoding in peer_save_state_encoding still to send
+    int bulk_cursor[SAM2_TOTAL_PEERS]; // Next block to consider, counting sequence_lo major so groups are interleaved
+    double bulk_tokens_bytes[SAM2_TOTAL_PEERS];
+    int64_t bulk_tokens_usec[SAM2_TOTAL_PEERS]; // When the bucket was last refilled
+    double bulk_cwnd_bytes[SAM2_TOTAL_PEERS]; // LEDBAT congestion window, the pacing rate is this over the RTT. 0 until we first send the peer something
+    int32_t bulk_queuing_delay_usec[SAM2_TOTAL_PEERS]; // Latest queuing delay the peer reported
+    int64_t bulk_feedback_usec[SAM2_TOTAL_PEERS]; // When the window was last updated from the peer's feedback. The pacer runs on the ulnet__get_monotonic_time_microseconds clock
+
+    // One-way delay of the savestate fragments we receive
+    int64_t ledbat_base_delay_minute; // 0 until the first sample
+    int32_t ledbat_base_delay_usec[ULNET_LEDBAT_BASE_HISTORY]; // Lowest one-way delay in each of the last few minutes, clock offset included
+    int32_t ledbat_current_delay_usec[ULNET_LEDBAT_CURRENT_FILTER];
+    int ledbat_current_delay_count;
+    int32_t ledbat_queuing_delay_usec;
+    int64_t ledbat_feedback_sent_usec;
 
     // MARK: Save state transfer
     int zstd_compress_level;
+    ZSTD_CCtx *zstd_cctx; // Kept between transfers instead of allocating a context every time, NULL until first used
+    ZSTD_DCtx *zstd_dctx;
+    ZSTD_CDict *zstd_cdict;
+    int zstd_cdict_compress_level;
+    ZSTD_DDict *zstd_ddict;
+    uint8_t *zstd_dictionary; // Kept across rooms like the baselines, only used while the room's rom_hash_xxh64 matches
+    size_t zstd_dictionary_size;
+    uint64_t zstd_dictionary_rom_hash;
+    uint32_t zstd_dictionary_id; // 0 when we don't have one
+    ulnet_zstd_dictionary_training_t zstd_dictionary_training;
+    uint32_t peer_dictionary_id[SAM2_TOTAL_PEERS];
+    int32_t save_state_compress_chunk_size; // 0 uses ULNET_SAVE_STATE_COMPRESS_CHUNK_SIZE, negative keeps full savestates a single zstd frame
+    ZSTD_CCtx *zstd_chunk_cctx[ULNET_ZSTD_CHUNK_CONTEXTS];
+    ZSTD_DCtx *zstd_chunk_dctx[ULNET_ZSTD_CHUNK_CONTEXTS];
     int64_t remote_savestate_transfer_offset;
     uint8_t remote_packet_groups; // This is used to bookkeep how much data we actually need to receive to reform the complete savestate
-    arena_ref_t packet_reference[FEC_PACKET_GROUPS_MAX][GF_SIZE - FEC_REDUNDANT_BLOCKS];
-    int fec_index[FEC_PACKET_GROUPS_MAX][GF_SIZE - FEC_REDUNDANT_BLOCKS];
+    int remote_savestate_payload_version;
+    uint8_t *remote_savestate_transfer; // Reassembly buffer laid out exactly like the sender's, NULL until we know the layout
+    int remote_savestate_block_size;
+    int remote_savestate_k;
+    int remote_savestate_n;
+    int remote_savestate_transfer_id; // Of the transfer in progress, -1 when there is none or the authority predates transfer ids
+    int remote_savestate_loaded_transfer_id; // Of the last transfer we finished or gave up on, its leftovers are dropped. -1 for none
+    uint64_t remote_savestate_received[FEC_PACKET_GROUPS_MAX][4]; // Bitfield of the sequence_lo we've seen for each packet group
+    uint8_t *remote_savestate_held; // Fragments that arrived before we knew the layout, ULNET_PACKET_SIZE_BYTES_MAX apart
+    uint16_t remote_savestate_held_size[ULNET_SAVE_STATE_HELD_FRAGMENTS_MAX];
+    int remote_savestate_held_count;
+    uint8_t *remote_savestate_stream; // Frames decompressed while the rest of a full savestate is still arriving, NULL until its header arrives
+    int64_t remote_savestate_stream_blocks; // Data blocks at the front of the payload that have all arrived
+    int64_t remote_savestate_stream_offset; // Of the next frame to decompress in compressed_savestate_data
+    int64_t remote_savestate_stream_size; // Bytes of the savestate those frames decompressed to
+    int remote_savestate_stream_chunks; // Frames decompressed so far
+    int64_t save_state_repair_delay_microseconds; // Silence after the last fragment before we ask for the blocks we're missing
+    int64_t remote_savestate_last_fragment_usec;
+    int remote_savestate_repair_requests; // NACKs sent for the transfer in progress
+    uint8_t *transfer_buffer[ULNET_TRANSFER_BUFFERS_MAX];
+    size_t transfer_buffer_capacity[ULNET_TRANSFER_BUFFERS_MAX];
+    uint32_t transfer_buffer_in_use_bitfield;
+    bool worker_pool_reference; // Counted in ulnet__pool_session_count until ulnet_session_release_save_state_buffers
+    int fec_index[FEC_PACKET_GROUPS_MAX][GF_SIZE];
     int fec_index_counter[FEC_PACKET_GROUPS_MAX]; // Counts packets received in each "packet group"
+    uint8_t *baseline_save_state[ULNET_SAVE_STATE_BASELINES_MAX]; // Ring of the last savestates we sent or loaded. Kept across rooms
+    size_t baseline_save_state_size[ULNET_SAVE_STATE_BASELINES_MAX]; // 0 when the slot is empty
+    size_t baseline_save_state_capacity[ULNET_SAVE_STATE_BASELINES_MAX];
+    int64_t baseline_save_state_frame[ULNET_SAVE_STATE_BASELINES_MAX];
+    uint32_t baseline_save_state_xxhash[ULNET_SAVE_STATE_BASELINES_MAX];
+    int baseline_save_state_next;
+    uint8_t *baseline_candidate; // Savestate we hashed during play, stored as a baseline once a peer's hash for its frame matches ours
+    size_t baseline_candidate_size; // 0 when there is no candidate
+    size_t baseline_candidate_capacity;
+    int64_t baseline_candidate_frame;
+    uint32_t baseline_candidate_hash; // What we put in save_state_hash for its frame, compared against the peer's
+    uint32_t baseline_candidate_xxhash;
+    int64_t baseline_confirmed_count; // Baselines stored from savestates we and a peer hashed the same during play
+    uint64_t peer_baseline_advertised_bitfield;
+    int64_t peer_baseline_frame[SAM2_TOTAL_PEERS];
+    uint32_t peer_baseline_xxhash[SAM2_TOTAL_PEERS];
+    int64_t peer_needs_sync_since_usec[SAM2_TOTAL_PEERS];
+    ulnet_save_state_tree_t peer_save_state_tree[SAM2_TOTAL_PEERS];
+    int64_t save_state_patch_chunks_sent; // Chunks in the last chunk patch we sent
+    int64_t save_state_resync_count;
+    int64_t save_state_resync_frame; // Frame of the savestate we last asked the authority to patch
+    int64_t save_state_sent_size; // Compressed size of the last savestate we sent
+    int64_t save_state_sent_compress_cycles;
+    int64_t save_state_received_decompress_cycles;
+    int save_state_received_streamed_chunks; // Chunks of the last savestate we loaded that were decompressed before all of it arrived
+    int64_t save_state_sent_baseline_frame; // -1 if it wasn't a delta
+    int save_state_sent_redundant_blocks; // Parity blocks per packet group of the last savestate we sent
+    uint8_t peer_save_state_transfer_id[SAM2_TOTAL_PEERS]; // Of the last savestate we sent each peer
+    uint64_t peer_save_state_sent_bitfield; // Peers we sent a savestate to that might still ask us to repair it
+    int peer_save_state_encoding[SAM2_TOTAL_PEERS]; // Slot of the encoding we last sent each peer
+    int64_t peer_save_state_frame[SAM2_TOTAL_PEERS]; // Frame of that encoding, the slot may have been reused since
+    int64_t save_state_repair_blocks_sent;
+    ulnet_save_state_encoding_t save_state_encoding[ULNET_SAVE_STATE_ENCODINGS_MAX];
+    int save_state_encoding_next;
+    int64_t save_state_encode_count;
+    ulnet_save_state_encode_job_t save_state_encode_job;
+    ulnet_save_state_snapshot_t save_state_snapshot[ULNET_SAVE_STATE_SNAPSHOTS];
+    int save_state_snapshot_next;
+    int64_t save_state_snapshot_stalls; // Times we had to wait on a worker that fell behind hashing
 
     void *user_ptr;
     int (*sam2_send_callback)(void *user_ptr, char *response);
@@ -284,6 +766,7 @@ static_assert(std::is_trivially_default_constructible<ulnet_session_t>::value &&
 
 ULNET_LINKAGE int ulnet_process_message(ulnet_session_t *session, const char *response);
 ULNET_LINKAGE void ulnet_send_save_state(ulnet_session_t *session, int port, void *save_state, size_t save_state_size, int64_t save_state_frame);
+ULNET_LINKAGE void ulnet_session_release_save_state_buffers(ulnet_session_t *session);
 ULNET_LINKAGE void ulnet_startup_ice_for_peer(ulnet_session_t *session, uint64_t peer_id, int p, const char *remote_description);
 ULNET_LINKAGE void ulnet_disconnect_peer(ulnet_session_t *session, int peer_port);
 ULNET_LINKAGE void ulnet_swap_agent(ulnet_session_t *session, int peer_existing_port, int peer_new_port);
@@ -296,13 +779,62 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
     double frame_rate, double max_sleeping_allowed_when_polling_network_seconds);
 ULNET_LINKAGE void ulnet_session_tear_down(ulnet_session_t *session);
 ULNET_LINKAGE int64_t ulnet__get_unix_time_microseconds();
+ULNET_LINKAGE int64_t ulnet__get_monotonic_time_microseconds();
+ULNET_LINKAGE void ulnet_frame_pacer_tick(ulnet_frame_pacer_t *pacer, int64_t current_time_usec, double frame_rate);
+ULNET_LINKAGE void ulnet_frame_pacer_frame_time_stats(const ulnet_frame_pacer_t *pacer, double *mean_usec, double *variance_usec2);
+ULNET_LINKAGE void ulnet_frame_pacer_slew(ulnet_frame_pacer_t *pacer, int64_t slew_usec);
 ULNET_LINKAGE uint32_t ulnet_xxh32(const void* data, size_t len, uint32_t seed);
+ULNET_LINKAGE uint32_t ulnet_save_state_hash(int algorithm, const void *data, size_t len);
 
 ULNET_LINKAGE void ulnet_imgui_show_session(ulnet_session_t *session);
 ULNET_LINKAGE void ulnet_imgui_show_recent_packets_table(ulnet_session_t *session, int p);
 ULNET_LINKAGE void ulnet_imgui_plot_history(ulnet_session_t *session);
 ULNET_LINKAGE int ulnet_test_ice(ulnet_session_t **session_1_out, ulnet_session_t **session_2_out);
 ULNET_LINKAGE int ulnet_test_inproc(ulnet_session_t **session_1_out, ulnet_session_t **session_2_out);
+ULNET_LINKAGE int ulnet_test_rollback();
+
+static inline int64_t ulnet_room_delay_buffer_size(const sam2_room_t *room) {
+    int log2_size = (int) ((room->flags & ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_MASK) >> ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_SHIFT);
+    return log2_size == 0 ? ULNET_DELAY_BUFFER_SIZE : SAM2_MIN(1LL << log2_size, (long long) ULNET_DELAY_BUFFER_SIZE_MAX);
+}
+
+// Only meaningful before the room is hosted. Sizes are rounded up to a power of two
+static inline void ulnet_room_set_delay_buffer_size(sam2_room_t *room, int64_t delay_buffer_size) {
+    int log2_size = 1;
+    while ((1LL << log2_size) < delay_buffer_size && (1LL << log2_size) < ULNET_DELAY_BUFFER_SIZE_MAX) log2_size++;
+
+    room->flags &= ~ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_MASK;
+    room->flags |= (uint64_t) log2_size << ULNET_ROOM_FLAG_DELAY_BUFFER_SIZE_SHIFT;
+}
+
+static inline int ulnet_room_protocol_version(const sam2_room_t *room) {
+    return (int) ((room->flags & ULNET_ROOM_FLAG_PROTOCOL_VERSION_MASK) >> ULNET_ROOM_FLAG_PROTOCOL_VERSION_SHIFT);
+}
+
+// Only meaningful before the room is hosted. Hosts should pass SAM2_VERSION_MINOR
+static inline void ulnet_room_set_protocol_version(sam2_room_t *room, int version) {
+    room->flags &= ~ULNET_ROOM_FLAG_PROTOCOL_VERSION_MASK;
+    room->flags |= ((uint64_t) version << ULNET_ROOM_FLAG_PROTOCOL_VERSION_SHIFT) & ULNET_ROOM_FLAG_PROTOCOL_VERSION_MASK;
+}
+
+static inline int ulnet_room_save_state_hash_algorithm(const sam2_room_t *room) {
+    if (ulnet_room_protocol_version(room) < ULNET_PROTOCOL_VERSION_SAVE_STATE_HASH) return ULNET_SAVE_STATE_HASH_XXH32;
+    return (int) ((room->flags & ULNET_ROOM_FLAG_SAVE_STATE_HASH_MASK) >> ULNET_ROOM_FLAG_SAVE_STATE_HASH_SHIFT);
+}
+
+// Only meaningful before the room is hosted
+static inline void ulnet_room_set_save_state_hash_algorithm(sam2_room_t *room, int algorithm) {
+    room->flags &= ~ULNET_ROOM_FLAG_SAVE_STATE_HASH_MASK;
+    room->flags |= ((uint64_t) algorithm << ULNET_ROOM_FLAG_SAVE_STATE_HASH_SHIFT) & ULNET_ROOM_FLAG_SAVE_STATE_HASH_MASK;
+}
+static inline int64_t ulnet_delay_buffer_size(ulnet_session_t *session) {
+    return ulnet_room_delay_buffer_size(&session->room_we_are_in);
+}
+
+// Largest delay_frames the delay buffer of the room we're in can accommodate
+static inline int64_t ulnet_delay_frames_max(ulnet_session_t *session) {
+    return ulnet_delay_buffer_size(session)/2-1;
+}
 
 static bool ulnet_is_authority(ulnet_session_t *session) {
     return    session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]
@@ -337,14 +869,20 @@ static inline void ulnet__xor_delta(void *dest, void *src, int size) {
 
 #include "juice/juice.h"
 #include <assert.h>
+#include <stddef.h>
+#include <math.h>
 #include <time.h>
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 
-#define XXH_PRIME32_1 2654435761u
-#define XXH_PRIME32_2 2246822519u
-#define XXH_PRIME32_3 3266489917u
-#define XXH_PRIME32_4  668265263u
-#define XXH_PRIME32_5  374761393u
+#define ULNET_XXH_PRIME32_1 2654435761u
+#define ULNET_XXH_PRIME32_2 2246822519u
+#define ULNET_XXH_PRIME32_3 3266489917u
+#define ULNET_XXH_PRIME32_4  668265263u
+#define ULNET_XXH_PRIME32_5  374761393u
 
 static inline uint32_t read_unaligned_u32(const void* p) {
     uint32_t val;
@@ -363,42 +901,42 @@ ULNET_LINKAGE uint32_t ulnet_xxh32(const void* data, size_t len, uint32_t seed)
 
     if (len >= 16) {
         const uint8_t* limit = end - 16;
-        uint32_t v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
-        uint32_t v2 = seed + XXH_PRIME32_2;
+        uint32_t v1 = seed + ULNET_XXH_PRIME32_1 + ULNET_XXH_PRIME32_2;
+        uint32_t v2 = seed + ULNET_XXH_PRIME32_2;
         uint32_t v3 = seed + 0;
-        uint32_t v4 = seed - XXH_PRIME32_1;
+        uint32_t v4 = seed - ULNET_XXH_PRIME32_1;
 
         do {
-            v1 = xxh32_rotl(v1 + read_unaligned_u32(p)      * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
-            v2 = xxh32_rotl(v2 + read_unaligned_u32(p + 4)  * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
-            v3 = xxh32_rotl(v3 + read_unaligned_u32(p + 8)  * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
-            v4 = xxh32_rotl(v4 + read_unaligned_u32(p + 12) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+            v1 = xxh32_rotl(v1 + read_unaligned_u32(p)      * ULNET_XXH_PRIME32_2, 13) * ULNET_XXH_PRIME32_1;
+            v2 = xxh32_rotl(v2 + read_unaligned_u32(p + 4)  * ULNET_XXH_PRIME32_2, 13) * ULNET_XXH_PRIME32_1;
+            v3 = xxh32_rotl(v3 + read_unaligned_u32(p + 8)  * ULNET_XXH_PRIME32_2, 13) * ULNET_XXH_PRIME32_1;
+            v4 = xxh32_rotl(v4 + read_unaligned_u32(p + 12) * ULNET_XXH_PRIME32_2, 13) * ULNET_XXH_PRIME32_1;
             p += 16;
         } while (p <= limit);
 
         h32 = xxh32_rotl(v1, 1) + xxh32_rotl(v2, 7) + xxh32_rotl(v3, 12) + xxh32_rotl(v4, 18);
     } else {
-        h32 = seed + XXH_PRIME32_5;
+        h32 = seed + ULNET_XXH_PRIME32_5;
     }
 
     h32 += (uint32_t)len;
 
     while (p + 4 <= end) {
-        h32 += read_unaligned_u32(p) * XXH_PRIME32_3;
-        h32 = xxh32_rotl(h32, 17) * XXH_PRIME32_4;
+        h32 += read_unaligned_u32(p) * ULNET_XXH_PRIME32_3;
+        h32 = xxh32_rotl(h32, 17) * ULNET_XXH_PRIME32_4;
         p += 4;
     }
 
     while (p < end) {
-        h32 += (*p) * XXH_PRIME32_5;
-        h32 = xxh32_rotl(h32, 11) * XXH_PRIME32_1;
+        h32 += (*p) * ULNET_XXH_PRIME32_5;
+        h32 = xxh32_rotl(h32, 11) * ULNET_XXH_PRIME32_1;
         p++;
     }
 
     h32 ^= h32 >> 15;
-    h32 *= XXH_PRIME32_2;
+    h32 *= ULNET_XXH_PRIME32_2;
     h32 ^= h32 >> 13;
-    h32 *= XXH_PRIME32_3;
+    h32 *= ULNET_XXH_PRIME32_3;
     h32 ^= h32 >> 16;
 
     return h32;
@@ -515,6 +1053,77 @@ ULNET_LINKAGE int64_t ulnet__get_unix_time_microseconds() {
 }
 #endif
 
+// Unlike wall clock time this never jumps when NTP adjusts the clock, only meaningful relative to itself
+#ifdef _WIN32
+ULNET_LINKAGE int64_t ulnet__get_monotonic_time_microseconds() {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+}
+#else
+ULNET_LINKAGE int64_t ulnet__get_monotonic_time_microseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+// MARK: Frame pacing
+ULNET_LINKAGE void ulnet_frame_pacer_tick(ulnet_frame_pacer_t *pacer, int64_t current_time_usec, double frame_rate) {
+    double frame_time_usec = 1e6 / frame_rate;
+
+    if (pacer->tick_count > 0) {
+        pacer->frame_time_sample_usec[pacer->tick_count % ULNET_MAX_SAMPLE_SIZE] = current_time_usec - pacer->last_tick_usec;
+    }
+    pacer->last_tick_usec = current_time_usec;
+    pacer->tick_count++;
+
+    // Frame times come from the grid instead of being added up so rounding doesn't drift us off the core's frame rate
+    double phase_error_usec = (double) (current_time_usec - pacer->grid_start_usec) - pacer->grid_frames * pacer->frame_time_usec;
+    if (   pacer->grid_start_usec == 0
+        || pacer->frame_time_usec != frame_time_usec
+        || phase_error_usec > frame_time_usec || phase_error_usec < -frame_time_usec) {
+        // A stall, a forced tick or a new frame rate. Ticking back-to-back to catch up would just be a visible hitch
+        pacer->resync_count += pacer->grid_start_usec != 0;
+        pacer->grid_start_usec = current_time_usec;
+        pacer->grid_frames = 0;
+        pacer->frame_time_usec = frame_time_usec;
+        phase_error_usec = 0.0;
+    }
+
+    pacer->phase_error_usec = phase_error_usec;
+    pacer->phase_correction_usec += ULNET_FRAME_PACER_KI * phase_error_usec;
+    pacer->phase_correction_usec = SAM2_MAX(SAM2_MIN(pacer->phase_correction_usec, frame_time_usec / 4), -frame_time_usec / 4);
+    pacer->grid_frames++;
+
+    double correction_usec = ULNET_FRAME_PACER_KP * phase_error_usec + pacer->phase_correction_usec;
+    pacer->tick_at_usec = pacer->grid_start_usec + (int64_t) (pacer->grid_frames * frame_time_usec - correction_usec);
+}
+
+// Moves the grid, positive to tick later. The PLL doesn't see this as phase error so it won't fight it
+ULNET_LINKAGE void ulnet_frame_pacer_slew(ulnet_frame_pacer_t *pacer, int64_t slew_usec) {
+    if (pacer->grid_start_usec == 0) return;
+
+    pacer->grid_start_usec += slew_usec;
+    pacer->tick_at_usec += slew_usec;
+}
+
+// Over the last ULNET_MAX_SAMPLE_SIZE frames
+ULNET_LINKAGE void ulnet_frame_pacer_frame_time_stats(const ulnet_frame_pacer_t *pacer, double *mean_usec, double *variance_usec2) {
+    int64_t count = SAM2_MIN(pacer->tick_count - 1, (int64_t) ULNET_MAX_SAMPLE_SIZE);
+    double sum = 0.0, sum_squares = 0.0;
+    for (int64_t i = 0; i < count; i++) {
+        double sample = (double) pacer->frame_time_sample_usec[(pacer->tick_count - 1 - i) % ULNET_MAX_SAMPLE_SIZE];
+        sum += sample;
+        sum_squares += sample * sample;
+    }
+
+    *mean_usec = count > 0 ? sum / count : 0.0;
+    *variance_usec2 = count > 1 ? (sum_squares - sum * *mean_usec) / (count - 1) : 0.0;
+}
+
 
 #ifdef _WIN32
 #include <intrin.h> // For __rdtsc, __cpuid
@@ -555,6 +1164,304 @@ uint64_t ulnet__rdtsc() {
     return 1000 * ulnet__get_unix_time_microseconds();
 }
 
+// MARK: Worker Pool
+// Process-wide threads for splitting heavy per-transfer work like Reed-Solomon coding of independent packet groups
+// One job runs at a time, a caller that finds the pool busy just runs its job on its own thread
+// Background tasks like hashing the savestate we just serialized are queued and picked up whenever there's no job
+#ifndef ULNET_WORKER_THREADS_MAX
+#define ULNET_WORKER_THREADS_MAX 7 // Plus the calling thread; 0 disables the pool
+#endif
+
+typedef void (*ulnet__task_fn_t)(void *context, int index);
+
+#if defined(_WIN32)
+typedef SRWLOCK ulnet__mutex_t;
+typedef CONDITION_VARIABLE ulnet__cond_t;
+#define ULNET__MUTEX_INIT SRWLOCK_INIT
+#define ULNET__COND_INIT CONDITION_VARIABLE_INIT
+#define ulnet__mutex_lock(m) AcquireSRWLockExclusive(m)
+#define ulnet__mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#define ulnet__cond_wait(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ulnet__cond_signal(c) WakeConditionVariable(c)
+#define ulnet__cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ulnet__mutex_t;
+typedef pthread_cond_t ulnet__cond_t;
+#define ULNET__MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define ULNET__COND_INIT PTHREAD_COND_INITIALIZER
+#define ulnet__mutex_lock(m) pthread_mutex_lock(m)
+#define ulnet__mutex_unlock(m) pthread_mutex_unlock(m)
+#define ulnet__cond_wait(c, m) pthread_cond_wait(c, m)
+#define ulnet__cond_signal(c) pthread_cond_signal(c)
+#define ulnet__cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+static ulnet__mutex_t ulnet__pool_mutex = ULNET__MUTEX_INIT;
+static ulnet__cond_t ulnet__pool_work = ULNET__COND_INIT;
+static ulnet__cond_t ulnet__pool_done = ULNET__COND_INIT;
+static int ulnet__pool_thread_count = -1; // -1 until the first parallel job starts the threads
+static int ulnet__pool_session_count; // The threads are joined when the last session is released so a plugin can be unloaded safely
+static bool ulnet__pool_busy;
+static bool ulnet__pool_stopping;
+static ulnet__task_fn_t ulnet__pool_fn;
+static void *ulnet__pool_context;
+static int ulnet__pool_count;
+static int ulnet__pool_next;
+static int ulnet__pool_unfinished;
+#if defined(_WIN32)
+static HANDLE ulnet__pool_threads[ULNET_WORKER_THREADS_MAX > 0 ? ULNET_WORKER_THREADS_MAX : 1];
+#else
+static pthread_t ulnet__pool_threads[ULNET_WORKER_THREADS_MAX > 0 ? ULNET_WORKER_THREADS_MAX : 1];
+#endif
+
+#define ULNET__POOL_QUEUE_SIZE 16
+static ulnet__cond_t ulnet__pool_queue_done = ULNET__COND_INIT;
+static ulnet__task_fn_t ulnet__pool_queue_fn[ULNET__POOL_QUEUE_SIZE];
+static void *ulnet__pool_queue_context[ULNET__POOL_QUEUE_SIZE];
+static int *ulnet__pool_queue_pending[ULNET__POOL_QUEUE_SIZE];
+static int ulnet__pool_queue_head; // Next queued task to run
+static int ulnet__pool_queue_tail;
+
+// Runs the next unclaimed task of the current job, must be called with the pool mutex held
+static void ulnet__pool_run_one() {
+    ulnet__task_fn_t fn = ulnet__pool_fn;
+    void *context = ulnet__pool_context;
+    int index = ulnet__pool_next++;
+
+    ulnet__mutex_unlock(&ulnet__pool_mutex);
+    fn(context, index);
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+
+    if (--ulnet__pool_unfinished == 0) {
+        ulnet__cond_signal(&ulnet__pool_done);
+    }
+}
+
+// Runs the oldest queued task, must be called with the pool mutex held
+static void ulnet__pool_run_queued() {
+    int i = ulnet__pool_queue_head++ % ULNET__POOL_QUEUE_SIZE;
+    ulnet__task_fn_t fn = ulnet__pool_queue_fn[i];
+    void *context = ulnet__pool_queue_context[i];
+    int *pending = ulnet__pool_queue_pending[i];
+
+    ulnet__mutex_unlock(&ulnet__pool_mutex);
+    fn(context, 0);
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+
+    *pending = 0;
+    ulnet__cond_broadcast(&ulnet__pool_queue_done);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI ulnet__pool_worker(LPVOID unused) {
+#else
+static void *ulnet__pool_worker(void *unused) {
+#endif
+    (void) unused;
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+    for (;;) {
+        while (ulnet__pool_next >= ulnet__pool_count && ulnet__pool_queue_head == ulnet__pool_queue_tail) {
+            if (ulnet__pool_stopping) {
+                ulnet__mutex_unlock(&ulnet__pool_mutex);
+                return 0;
+            }
+            ulnet__cond_wait(&ulnet__pool_work, &ulnet__pool_mutex);
+        }
+
+        if (ulnet__pool_next < ulnet__pool_count) {
+            ulnet__pool_run_one();
+        } else {
+            ulnet__pool_run_queued();
+        }
+    }
+}
+
+static void ulnet__pool_start() {
+#if defined(_WIN32)
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    int cpu_count = (int) system_info.dwNumberOfProcessors;
+#else
+    int cpu_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    int wanted = SAM2_MIN(cpu_count - 1, ULNET_WORKER_THREADS_MAX);
+
+    ulnet__pool_thread_count = 0;
+    for (int i = 0; i < wanted; i++) {
+#if defined(_WIN32)
+        ulnet__pool_threads[i] = CreateThread(NULL, 0, ulnet__pool_worker, NULL, 0, NULL);
+        if (ulnet__pool_threads[i] == NULL) break;
+#else
+        if (pthread_create(&ulnet__pool_threads[i], NULL, ulnet__pool_worker, NULL) != 0) break;
+#endif
+        ulnet__pool_thread_count++;
+    }
+
+    SAM2_LOG_INFO("Started %d ulnet worker threads", ulnet__pool_thread_count);
+}
+
+// Must be called with the pool mutex held, returns with it held. Workers finish whatever job is in flight or queued before they exit
+static void ulnet__pool_stop() {
+    int thread_count = ulnet__pool_thread_count;
+    if (thread_count == -1) return;
+
+    ulnet__pool_stopping = true;
+    ulnet__cond_broadcast(&ulnet__pool_work);
+    ulnet__mutex_unlock(&ulnet__pool_mutex);
+    for (int i = 0; i < thread_count; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(ulnet__pool_threads[i], INFINITE);
+        CloseHandle(ulnet__pool_threads[i]);
+#else
+        pthread_join(ulnet__pool_threads[i], NULL);
+#endif
+    }
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+
+    ulnet__pool_stopping = false;
+    ulnet__pool_thread_count = -1; // The next parallel job starts them again
+    SAM2_LOG_INFO("Stopped %d ulnet worker threads", thread_count);
+}
+
+static void ulnet__pool_session_reference(ulnet_session_t *session, bool reference) {
+    if (session->worker_pool_reference == reference) return;
+
+    session->worker_pool_reference = reference;
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+    ulnet__pool_session_count += reference ? 1 : -1;
+    if (ulnet__pool_session_count == 0) {
+        ulnet__pool_stop();
+    }
+    ulnet__mutex_unlock(&ulnet__pool_mutex);
+}
+
+// Calls fn(context, i) for every i in [0, count) spread over the worker threads and returns once all of them finish
+static void ulnet__parallel_for(ulnet__task_fn_t fn, void *context, int count) {
+    if (count > 1 && ULNET_WORKER_THREADS_MAX > 0) {
+        ulnet__mutex_lock(&ulnet__pool_mutex);
+        if (ulnet__pool_thread_count == -1) {
+            ulnet__pool_start();
+        }
+
+        if (!ulnet__pool_busy && ulnet__pool_thread_count > 0) {
+            ulnet__pool_busy = true;
+            ulnet__pool_fn = fn;
+            ulnet__pool_context = context;
+            ulnet__pool_next = 0;
+            ulnet__pool_unfinished = count;
+            ulnet__pool_count = count;
+            ulnet__cond_broadcast(&ulnet__pool_work);
+
+            // The calling thread helps instead of idling
+            while (ulnet__pool_next < ulnet__pool_count) {
+                ulnet__pool_run_one();
+            }
+
+            while (ulnet__pool_unfinished > 0) {
+                ulnet__cond_wait(&ulnet__pool_done, &ulnet__pool_mutex);
+            }
+
+            ulnet__pool_count = ulnet__pool_next = 0;
+            ulnet__pool_busy = false;
+            ulnet__mutex_unlock(&ulnet__pool_mutex);
+            return;
+        }
+        ulnet__mutex_unlock(&ulnet__pool_mutex);
+    }
+
+    for (int i = 0; i < count; i++) {
+        fn(context, i);
+    }
+}
+
+// Queues fn(context, 0) for a worker thread and clears *pending once it returns. Without workers or queue space it just runs now
+static void ulnet__pool_submit(ulnet__task_fn_t fn, void *context, int *pending) {
+    if (ULNET_WORKER_THREADS_MAX > 0) {
+        ulnet__mutex_lock(&ulnet__pool_mutex);
+        if (ulnet__pool_thread_count == -1) {
+            ulnet__pool_start();
+        }
+
+        if (ulnet__pool_thread_count > 0 && ulnet__pool_queue_tail - ulnet__pool_queue_head < ULNET__POOL_QUEUE_SIZE) {
+            int i = ulnet__pool_queue_tail++ % ULNET__POOL_QUEUE_SIZE;
+            ulnet__pool_queue_fn[i] = fn;
+            ulnet__pool_queue_context[i] = context;
+            ulnet__pool_queue_pending[i] = pending;
+            *pending = 1;
+            ulnet__cond_signal(&ulnet__pool_work);
+            ulnet__mutex_unlock(&ulnet__pool_mutex);
+            return;
+        }
+        ulnet__mutex_unlock(&ulnet__pool_mutex);
+    }
+
+    fn(context, 0);
+    *pending = 0;
+}
+
+static bool ulnet__pool_finished(int *pending) {
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+    bool finished = *pending == 0;
+    ulnet__mutex_unlock(&ulnet__pool_mutex);
+    return finished;
+}
+
+static void ulnet__pool_wait(int *pending) {
+    ulnet__mutex_lock(&ulnet__pool_mutex);
+    while (*pending) {
+        ulnet__cond_wait(&ulnet__pool_queue_done, &ulnet__pool_mutex);
+    }
+    ulnet__mutex_unlock(&ulnet__pool_mutex);
+}
+
+// XXH3 is compiled out of the copy of xxHash zstd builds so we inline our own. Its SIMD path is picked at compile time:
+// SSE2 on any x86-64, AVX2 when building with it enabled and NEON on arm64
+// This relies on a local change to zstd's copy of xxhash.h, see ThirdParty/zstd/LOCAL_CHANGES.md
+#undef XXH_NO_XXH3 // Left defined by the include at the top
+#define ZSTD_XXH_ENABLE_XXH3
+#define XXH_INLINE_ALL
+#include "common/xxhash.h"
+#undef XXH_INLINE_ALL
+#ifndef XXH3_SECRET_SIZE_MIN
+#error "zstd's xxhash.h compiled XXH3 out, reapply the change listed in ThirdParty/zstd/LOCAL_CHANGES.md"
+#endif
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    uint64_t *segment_hash;
+} ulnet__save_state_hash_job_t;
+
+static void ulnet__save_state_hash_segment(void *context, int segment) {
+    ulnet__save_state_hash_job_t *job = (ulnet__save_state_hash_job_t *) context;
+    size_t offset = (size_t) segment * ULNET_SAVE_STATE_HASH_SEGMENT_SIZE;
+    job->segment_hash[segment] = XXH3_64bits(job->data + offset, SAM2_MIN(job->len - offset, (size_t) ULNET_SAVE_STATE_HASH_SEGMENT_SIZE));
+}
+
+ULNET_LINKAGE uint32_t ulnet_save_state_hash(int algorithm, const void *data, size_t len) {
+    if (algorithm != ULNET_SAVE_STATE_HASH_XXH3) {
+        return ulnet_xxh32(data, len, 0);
+    }
+
+    uint64_t hash;
+    if (len <= ULNET_SAVE_STATE_HASH_SEGMENT_SIZE) {
+        hash = XXH3_64bits(data, len);
+    } else {
+        uint64_t segment_hash_on_stack[64];
+        int segment_count = (int) ((len + ULNET_SAVE_STATE_HASH_SEGMENT_SIZE - 1) / ULNET_SAVE_STATE_HASH_SEGMENT_SIZE);
+        uint64_t *segment_hash = segment_count <= (int) SAM2_ARRAY_LENGTH(segment_hash_on_stack)
+            ? segment_hash_on_stack : (uint64_t *) malloc(segment_count * sizeof(uint64_t));
+
+        ulnet__save_state_hash_job_t job = { (const uint8_t *) data, len, segment_hash };
+        ulnet__parallel_for(ulnet__save_state_hash_segment, &job, segment_count);
+        hash = XXH3_64bits_withSeed(segment_hash, segment_count * sizeof(uint64_t), len);
+
+        if (segment_hash != segment_hash_on_stack) free(segment_hash);
+    }
+
+    return (uint32_t) hash ^ (uint32_t) (hash >> 32);
+}
+
 static inline int ulnet__sequence_cmp(uint16_t s1, uint16_t s2) {
     if (s1 == s2) {
         return 0;
@@ -580,12 +1487,147 @@ static void ulnet__logical_partition(int sz, int redundant, int *n, int *out_k,
     *out_k = k;
 }
 
+// Whether more than m of n blocks are lost with probability at least ULNET_FEC_FAILURE_RATE
+static bool ulnet__fec_likely_to_fail(int n, int m, double packet_loss) {
+    double pmf = 1.0;
+    for (int i = 0; i < n; i++) pmf *= 1.0 - packet_loss;
+
+    double cdf = pmf;
+    for (int j = 0; j < m; j++) {
+        pmf *= (double) (n - j) / (j + 1) * packet_loss / (1.0 - packet_loss);
+        cdf += pmf;
+    }
+
+    return 1.0 - cdf >= ULNET_FEC_FAILURE_RATE;
+}
+
+// Layout of a savestate transfer with just enough parity for the packet loss. Every packet group has the same n - k
+static void ulnet__save_state_partition(int sz, float packet_loss, int *n, int *k, int *packet_size, int *packet_groups) {
+    int full_group_redundant = 1;
+    while (full_group_redundant < ULNET_FEC_REDUNDANT_BLOCKS_MAX && ulnet__fec_likely_to_fail(GF_SIZE, full_group_redundant, packet_loss)) {
+        full_group_redundant++;
+    }
+
+    // Parity goes before size so anything version 0 could send still fits in FEC_PACKET_GROUPS_MAX groups
+    int k_needed = (sz - 1) / (FEC_PACKET_GROUPS_MAX * *packet_size) + 1;
+    full_group_redundant = SAM2_MAX(SAM2_MIN(full_group_redundant, GF_SIZE - k_needed), 1);
+
+    ulnet__logical_partition(sz, full_group_redundant, n, k, packet_size, packet_groups);
+
+    if (*n < GF_SIZE) {
+        // A lone partial group needs fewer parity blocks for the same odds and the ratio above would round them away for small k
+        int redundant = 1;
+        while (redundant < full_group_redundant && ulnet__fec_likely_to_fail(*k + redundant, redundant, packet_loss)) {
+            redundant++;
+        }
+        *n = *k + redundant;
+    }
+}
+
 // This is a little confusing since the lower byte of sequence corresponds to the largest stride
 static int64_t ulnet__logical_partition_offset_bytes(uint8_t sequence_hi, uint8_t sequence_lo, int block_size_bytes, int block_stride) {
     return (int64_t) sequence_hi * block_size_bytes + sequence_lo * block_size_bytes * block_stride;
 }
 
+typedef struct ulnet__fec_job {
+    void *rs_code;
+    uint8_t *payload;
+    int (*fec_index)[GF_SIZE]; // Received block indices per packet group, only used for decoding
+    uint64_t (*received)[4]; // Received block bitfield per packet group, only used for decoding
+    int k;
+    int n;
+    int block_size;
+    int packet_groups;
+} ulnet__fec_job_t;
+
+static void ulnet__fec_encode_group(void *context, int group) {
+    ulnet__fec_job_t *job = (ulnet__fec_job_t *) context;
+    void *data[GF_SIZE];
+
+    for (int i = 0; i < job->n; i++) {
+        data[i] = job->payload + ulnet__logical_partition_offset_bytes(group, i, job->block_size, job->packet_groups);
+    }
+
+    for (int i = job->k; i < job->n; i++) {
+        fec_encode(job->rs_code, data, data[i], i, job->block_size);
+    }
+}
+
+// Folds a block that just arrived into the partially decoded group so finishing only has to solve for the missing data blocks
+// Parity blocks have every received data block subtracted out of them in place, block_count includes the new block
+static void ulnet__fec_fold_block(ulnet__fec_job_t *job, int group, int index, int block_count) {
+    uint8_t *block = job->payload + ulnet__logical_partition_offset_bytes(group, index, job->block_size, job->packet_groups);
+
+    for (int i = 0; i < block_count - 1; i++) {
+        int other = job->fec_index[group][i];
+        uint8_t *other_block = job->payload + ulnet__logical_partition_offset_bytes(group, other, job->block_size, job->packet_groups);
+
+        if (index < job->k && other >= job->k) {
+            fec_addmul(other_block, block, fec_coefficient(job->rs_code, other, index), job->block_size);
+        } else if (index >= job->k && other < job->k) {
+            fec_addmul(block, other_block, fec_coefficient(job->rs_code, index, other), job->block_size);
+        }
+    }
+}
+
+static void ulnet__fec_decode_group(void *context, int group) {
+    ulnet__fec_job_t *job = (ulnet__fec_job_t *) context;
+    void *parity[ULNET_FEC_REDUNDANT_BLOCKS_MAX], *missing_block[ULNET_FEC_REDUNDANT_BLOCKS_MAX];
+    int parity_index[ULNET_FEC_REDUNDANT_BLOCKS_MAX], missing[ULNET_FEC_REDUNDANT_BLOCKS_MAX];
+    int erasures = 0, missing_count = 0;
+
+    for (int i = 0; i < job->k; i++) {
+        int index = job->fec_index[group][i];
+        if (index >= job->k && erasures < ULNET_FEC_REDUNDANT_BLOCKS_MAX) {
+            parity_index[erasures] = index;
+            parity[erasures++] = job->payload + ulnet__logical_partition_offset_bytes(group, index, job->block_size, job->packet_groups);
+        }
+
+        if (!(job->received[group][i / 64] & (1ULL << (i % 64))) && missing_count < ULNET_FEC_REDUNDANT_BLOCKS_MAX) {
+            missing[missing_count] = i;
+            missing_block[missing_count++] = job->payload + ulnet__logical_partition_offset_bytes(group, i, job->block_size, job->packet_groups);
+        }
+    }
+
+    assert(erasures == missing_count);
+    int status = fec_decode_reduced(job->rs_code, parity, parity_index, missing_block, missing, erasures, job->block_size);
+    assert(status == 0);
+    (void) status;
+}
+
+static void ulnet__memor(void *dst, const void *src, size_t n) {
+    int16_t *d = (int16_t *)dst;
+    const int16_t *s = (const int16_t *)src;
+    size_t words = n / sizeof(int16_t);
+
+    for (size_t i = 0; i < words; i++) {
+        d[i] |= s[i];
+    }
+}
+
+static inline bool ulnet__rollback_enabled(ulnet_session_t *session, int our_port) {
+    return session->rollback_frames_max > 0 && our_port != -1 && our_port < SAM2_SPECTATOR_START;
+}
+
+// Number of frames we're allowed to simulate past the input we have from other peers
+static int64_t ulnet__rollback_window(ulnet_session_t *session, int our_port) {
+    if (!ulnet__rollback_enabled(session, our_port)) {
+        return 0;
+    }
+
+    // If we run ahead of a peer by the window they can receive our input window + delay_frames frames early on top of their own
+    // delay_frames, this all has to fit in the delay buffer otherwise we'd overwrite input neither of us has consumed
+    int64_t rollback_window_max = ulnet_delay_buffer_size(session) - 2 - 2 * session->delay_frames;
+    return SAM2_MAX(0, SAM2_MIN(SAM2_MIN(session->rollback_frames_max, (int64_t) ULNET_ROLLBACK_FRAMES_MAX), rollback_window_max));
+}
+
 ULNET_LINKAGE void ulnet_input_poll(ulnet_session_t *session, ulnet_input_state_t (*input_state)[ULNET_PORT_COUNT]) {
+    if (ulnet__rollback_enabled(session, sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id))) {
+        // Input may be predicted so it was gathered up front and saved so we can replay it exactly if we have to rollback
+        ulnet__memor(*input_state, session->rollback_input[session->frame_counter % ULNET_ROLLBACK_BUFFER_SIZE], sizeof(ulnet_input_state_t[ULNET_PORT_COUNT]));
+        return;
+    }
+
     for (int peer_idx = 0; peer_idx < SAM2_PORT_MAX+1; peer_idx++) {
         if (   session->room_we_are_in.peer_ids[peer_idx] > SAM2_PORT_SENTINELS_MAX
             && !(session->room_we_are_in.flags & (SAM2_FLAG_PORT0_PEER_IS_INACTIVE << peer_idx))) {
@@ -594,7 +1636,7 @@ ULNET_LINKAGE void ulnet_input_poll(ulnet_session_t *session, ulnet_input_state_
                 assert(peer_idx == SAM2_AUTHORITY_INDEX);
             }
 
-            assert(session->state[peer_idx].frame <= session->frame_counter + (ULNET_DELAY_BUFFER_SIZE-1));
+            assert(session->state[peer_idx].frame <= session->frame_counter + (ulnet_delay_buffer_size(session)-1));
             assert(session->state[peer_idx].frame >= session->frame_counter);
             for (int i = 0; i < SAM2_ARRAY_LENGTH((*input_state)[0]); i++) {
                 #if defined(ULNET__DEBUG_EVERYONE_ON_PORT_0)
@@ -602,77 +1644,468 @@ ULNET_LINKAGE void ulnet_input_poll(ulnet_session_t *session, ulnet_input_state_
                 #else
                 int port = peer_idx;
                 #endif
-                (*input_state)[port][i] |= session->state[peer_idx].input_state[session->frame_counter % ULNET_DELAY_BUFFER_SIZE][port][i];
+                (*input_state)[port][i] |= session->state[peer_idx].input_state[session->frame_counter % ulnet_delay_buffer_size(session)][port][i];
             }
         }
     }
 }
 
-double core_wants_tick_in_seconds(int64_t core_wants_tick_at_unix_usec) {
-    double seconds = (core_wants_tick_at_unix_usec - ulnet__get_unix_time_microseconds()) / 1000000.0;
+double core_wants_tick_in_seconds(int64_t core_wants_tick_at_usec) {
+    double seconds = (core_wants_tick_at_usec - ulnet__get_monotonic_time_microseconds()) / 1000000.0;
     return seconds;
 }
 
-static void ulnet_update_state_history(ulnet_session_t *session, arena_ref_t packet_ref) {
-    // Only store every 8th packet... frame 7, 15, 23, etc.
-    uint8_t *packet = (uint8_t *)arena_deref(&session->arena, packet_ref);
-    if ((packet[0] & ULNET_CHANNEL_MASK) != ULNET_CHANNEL_INPUT) {
-        SAM2_LOG_ERROR("Attempt to store non-input packet in state history");
+// ulnet_state_t is sent with each array trimmed to the first delay_buffer_size slots
+// With the default size this is byte for byte the same as sending the whole struct
+static int64_t ulnet__state_packed_size(int64_t delay_buffer_size) {
+    return   sizeof(((ulnet_state_t *)0)->frame)
+           + delay_buffer_size * sizeof(((ulnet_state_t *)0)->input_state[0])
+           + delay_buffer_size * sizeof(((ulnet_state_t *)0)->room_xor_delta[0])
+           + delay_buffer_size * sizeof(((ulnet_state_t *)0)->core_option[0])
+           + sizeof(((ulnet_state_t *)0)->save_state_frame)
+           + delay_buffer_size * sizeof(((ulnet_state_t *)0)->save_state_hash[0])
+           + delay_buffer_size * sizeof(((ulnet_state_t *)0)->input_state_hash[0]);
+}
+
+#define ULNET__STATE_FIELDS(X, state, delay_buffer_size) \
+    X(&(state)->frame,            sizeof((state)->frame)) \
+    X((state)->input_state,       (delay_buffer_size) * sizeof((state)->input_state[0])) \
+    X((state)->room_xor_delta,    (delay_buffer_size) * sizeof((state)->room_xor_delta[0])) \
+    X((state)->core_option,       (delay_buffer_size) * sizeof((state)->core_option[0])) \
+    X(&(state)->save_state_frame, sizeof((state)->save_state_frame)) \
+    X((state)->save_state_hash,   (delay_buffer_size) * sizeof((state)->save_state_hash[0])) \
+    X((state)->input_state_hash,  (delay_buffer_size) * sizeof((state)->input_state_hash[0]))
+
+static bool ulnet__is_zero(const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i]) return false;
     }
+    return true;
+}
 
-    int port = packet[0] & ULNET_FLAGS_MASK;
-    int64_t frame;
-    rle8_decode(&packet[sizeof(ulnet_state_packet_t)], packet_ref.size - sizeof(ulnet_state_packet_t), (uint8_t *) &frame, sizeof(frame));
-    if ((frame + 1) % ULNET_DELAY_BUFFER_SIZE == 0) {
-        int history_idx = (frame / ULNET_DELAY_BUFFER_SIZE) % ULNET_STATE_PACKET_HISTORY_SIZE;
+// LEB128 with zigzag for signed values. These return NULL if we would run off the end of the buffer
+static uint8_t *ulnet__put_varint(uint8_t *cursor, const uint8_t *end, uint64_t value) {
+    do {
+        if (cursor >= end) return NULL;
+        *cursor++ = (uint8_t) ((value & 0x7F) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while (value);
+    return cursor;
+}
 
-        SAM2_LOG_DEBUG("Storing state packet for port %d at history index %d for frame %lld", port, history_idx, (long long)frame);
-        session->state_packet_history[port][history_idx] = packet_ref;
+static const uint8_t *ulnet__get_varint(const uint8_t *cursor, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (cursor >= end) return NULL;
+        uint8_t byte = *cursor++;
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return cursor;
     }
+    return NULL;
 }
 
-// Returns a negative number on error
-ULNET_LINKAGE int ulnet_udp_send(ulnet_session_t *session, int port, const uint8_t *packet, size_t size) {
-    // Basic packet validation
-    if (size - 1 >= ULNET_PACKET_SIZE_BYTES_MAX) {
-        SAM2_LOG_ERROR("Attempt to send packet with invalid size: %zu bytes, max allowed: %d", size, ULNET_PACKET_SIZE_BYTES_MAX);
-        return -1;
-    }
+static uint64_t ulnet__zigzag(int64_t value) { return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63); }
+static int64_t ulnet__unzigzag(uint64_t value) { return (int64_t) (value >> 1) ^ -(int64_t) (value & 1); }
 
-    // Perform channel-specific packet validation
-    switch (packet[0] & ULNET_CHANNEL_MASK) {
-    case ULNET_CHANNEL_EXTRA: {
-        SAM2_LOG_ERROR("Attempt to send packet with invalid channel: %d", packet[0] & ULNET_CHANNEL_MASK);
-        return -1;
-    }
-    case ULNET_CHANNEL_INPUT: {
-        if (size < sizeof(ulnet_state_packet_t)) {
-            SAM2_LOG_ERROR("Input packet too small: %zu bytes", size);
-            return -1;
+static uint8_t *ulnet__put_string(uint8_t *cursor, const uint8_t *end, const char *string, size_t capacity) {
+    const char *nul = (const char *) memchr(string, '\0', capacity - 1);
+    size_t length = nul ? (size_t) (nul - string) : capacity - 1;
+    if (end - cursor < (int64_t) length + 1) return NULL;
+    memcpy(cursor, string, length);
+    cursor[length] = '\0';
+    return cursor + length + 1;
+}
+
+static const uint8_t *ulnet__get_string(const uint8_t *cursor, const uint8_t *end, char *string, size_t capacity) {
+    const uint8_t *nul = (const uint8_t *) memchr(cursor, '\0', SAM2_MIN((size_t) (end - cursor), capacity));
+    if (!nul) return NULL;
+    memset(string, 0, capacity);
+    memcpy(string, cursor, nul - cursor);
+    return nul + 1;
+}
+
+#define ULNET_INPUT_SLOT_FLAG_INPUT_STATE      0b00000001
+#define ULNET_INPUT_SLOT_FLAG_ROOM_XOR_DELTA   0b00000010
+#define ULNET_INPUT_SLOT_FLAG_CORE_OPTION      0b00000100
+#define ULNET_INPUT_SLOT_FLAG_SAVE_STATE_HASH  0b00001000
+#define ULNET_INPUT_SLOT_FLAG_INPUT_STATE_HASH 0b00010000
+SAM2_STATIC_ASSERT(ULNET_PORT_COUNT <= 8, "The compact input format uses a byte for the changed port mask");
+SAM2_STATIC_ASSERT(sizeof(ulnet_input_state_t) / sizeof(int16_t) <= 64, "The compact input format uses 64-bit masks per port");
+
+// Each slot is a flags byte followed only by what is non-zero. Inputs are sent as a delta against the previous slot and
+// per port as a mask of held buttons plus the values of the few entries (analog axes) that are something other than 0 or 1
+// Every packet stands alone since the authority relays them verbatim to spectators and they get replayed from history
+static int64_t ulnet__encode_state_compact(const ulnet_state_t *state, int64_t delay_buffer_size, uint8_t *coded, int64_t coded_capacity) {
+    static const ulnet_input_state_t zero_input_state[ULNET_PORT_COUNT] = {0};
+    const uint8_t *end = coded + coded_capacity;
+    uint8_t *cursor = coded;
+
+    cursor = ulnet__put_varint(cursor, end, ulnet__zigzag(state->frame));
+    if (cursor) cursor = ulnet__put_varint(cursor, end, ulnet__zigzag(state->save_state_frame));
+    if (cursor) cursor = ulnet__put_varint(cursor, end, (uint64_t) delay_buffer_size);
+
+    for (int64_t i = 0; cursor && i < delay_buffer_size; i++) {
+        const ulnet_input_state_t *previous_input_state = i == 0 ? zero_input_state : state->input_state[i-1];
+
+        uint8_t changed_ports = 0;
+        for (int port = 0; port < ULNET_PORT_COUNT; port++) {
+            if (memcmp(state->input_state[i][port], previous_input_state[port], sizeof(ulnet_input_state_t)) != 0) {
+                changed_ports |= 1 << port;
+            }
         }
 
-        ulnet_state_packet_t *state_packet = (ulnet_state_packet_t *)packet;
-        int64_t encoded_state_size = size - sizeof(ulnet_state_packet_t);
-        int64_t decoded_size = rle8_decode_size(state_packet->coded_state, encoded_state_size);
+        uint8_t slot_flags = 0;
+        slot_flags |= changed_ports                                                                  ? ULNET_INPUT_SLOT_FLAG_INPUT_STATE      : 0;
+        slot_flags |= !ulnet__is_zero(&state->room_xor_delta[i], sizeof(state->room_xor_delta[i])) ? ULNET_INPUT_SLOT_FLAG_ROOM_XOR_DELTA   : 0;
+        slot_flags |= state->core_option[i].key[0] || state->core_option[i].value[0]                ? ULNET_INPUT_SLOT_FLAG_CORE_OPTION      : 0;
+        slot_flags |= state->save_state_hash[i]                                                     ? ULNET_INPUT_SLOT_FLAG_SAVE_STATE_HASH  : 0;
+        slot_flags |= state->input_state_hash[i]                                                    ? ULNET_INPUT_SLOT_FLAG_INPUT_STATE_HASH : 0;
+
+        if (end - cursor < 2) return -1;
+        *cursor++ = slot_flags;
+
+        if (slot_flags & ULNET_INPUT_SLOT_FLAG_INPUT_STATE) {
+            *cursor++ = changed_ports;
+            for (int port = 0; cursor && port < ULNET_PORT_COUNT; port++) {
+                if (!(changed_ports & (1 << port))) continue;
+
+                uint64_t held_mask = 0, wide_mask = 0;
+                for (int j = 0; j < SAM2_ARRAY_LENGTH(state->input_state[i][port]); j++) {
+                    int16_t value = state->input_state[i][port][j];
+                    held_mask |= (uint64_t) (value != 0) << j;
+                    wide_mask |= (uint64_t) (value != 0 && value != 1) << j;
+                }
 
-        if (decoded_size < 0) {
-            SAM2_LOG_ERROR("Input packet has invalid RLE encoding");
-            return -1;
+                cursor = ulnet__put_varint(cursor, end, held_mask);
+                if (cursor) cursor = ulnet__put_varint(cursor, end, wide_mask);
+                for (int j = 0; cursor && j < SAM2_ARRAY_LENGTH(state->input_state[i][port]); j++) {
+                    if (wide_mask & ((uint64_t) 1 << j)) {
+                        cursor = ulnet__put_varint(cursor, end, ulnet__zigzag(state->input_state[i][port][j]));
+                    }
+                }
+            }
         }
 
-        if (decoded_size > sizeof(ulnet_state_t)) {
-            SAM2_LOG_ERROR("Input packet would decode to %" PRId64 " bytes, exceeding destination buffer size %zu",
-                            decoded_size, sizeof(ulnet_state_t));
-            return -1;
+        if (cursor && slot_flags & ULNET_INPUT_SLOT_FLAG_ROOM_XOR_DELTA) {
+            int64_t coded_size = rle8_encode_capped((const uint8_t *) &state->room_xor_delta[i], sizeof(state->room_xor_delta[i]), cursor, end - cursor);
+            cursor = coded_size < 0 ? NULL : cursor + coded_size;
         }
 
-        if (decoded_size < sizeof(ulnet_state_t)) {
-            SAM2_LOG_WARN("Input packet would decode to only %" PRId64 " bytes, expected %zu",
-                        decoded_size, sizeof(ulnet_state_t));
-            // Allow undersized packets as they might be partial updates
+        if (cursor && slot_flags & ULNET_INPUT_SLOT_FLAG_CORE_OPTION) {
+            cursor = ulnet__put_string(cursor, end, state->core_option[i].key, sizeof(state->core_option[i].key));
+            if (cursor) cursor = ulnet__put_string(cursor, end, state->core_option[i].value, sizeof(state->core_option[i].value));
         }
-        break;
-    }
+
+        uint32_t hashes[2] = { state->save_state_hash[i], state->input_state_hash[i] };
+        for (int h = 0; cursor && h < 2; h++) {
+            if (!(slot_flags & (ULNET_INPUT_SLOT_FLAG_SAVE_STATE_HASH << h))) continue;
+            if (end - cursor < 4) return -1;
+            for (int b = 0; b < 4; b++) *cursor++ = (uint8_t) (hashes[h] >> (8 * b));
+        }
+    }
+
+    return cursor ? cursor - coded : -1;
+}
+
+// Walks the encoding once without writing anything to check it is well formed, then again to write it straight into state
+// Staging the decode in a scratch state would touch the ~12 KB of state twice, which costs more than parsing twice. Everything
+// is cleared up front in bulk so afterwards only ports something is held on need to be written
+// Returns a negative number if the encoding is malformed. The decoded state is written to state in full or not at all
+static int ulnet__decode_state_compact(const uint8_t *coded, int64_t coded_size, int64_t delay_buffer_size, ulnet_state_t *state) {
+    for (int pass = 0; pass < 2; pass++) {
+        ulnet_state_t *decoded = pass == 0 ? NULL : state;
+        const uint8_t *end = coded + coded_size;
+        const uint8_t *cursor = coded;
+        uint64_t frame, save_state_frame, encoded_delay_buffer_size;
+
+        cursor = ulnet__get_varint(cursor, end, &frame);
+        if (cursor) cursor = ulnet__get_varint(cursor, end, &save_state_frame);
+        if (cursor) cursor = ulnet__get_varint(cursor, end, &encoded_delay_buffer_size);
+        if (!cursor) return -1;
+        if ((int64_t) encoded_delay_buffer_size != delay_buffer_size) return -2;
+
+        if (decoded) {
+            decoded->frame = ulnet__unzigzag(frame);
+            decoded->save_state_frame = ulnet__unzigzag(save_state_frame);
+            memset(decoded->input_state, 0, delay_buffer_size * sizeof(decoded->input_state[0]));
+            memset(decoded->room_xor_delta, 0, delay_buffer_size * sizeof(decoded->room_xor_delta[0]));
+            memset(decoded->core_option, 0, delay_buffer_size * sizeof(decoded->core_option[0]));
+        }
+
+        uint8_t held_ports = 0; // Ports that had something held in the previous slot
+        for (int64_t i = 0; i < delay_buffer_size; i++) {
+            if (cursor >= end) return -1;
+            uint8_t slot_flags = *cursor++;
+
+            uint8_t changed_ports = 0;
+            if (slot_flags & ULNET_INPUT_SLOT_FLAG_INPUT_STATE) {
+                if (cursor >= end) return -1;
+                changed_ports = *cursor++;
+            }
+
+            uint8_t carried_ports = decoded ? held_ports & ~changed_ports : 0;
+            for (int port = 0; carried_ports >> port; port++) {
+                if (!((carried_ports >> port) & 1)) continue;
+                memcpy(decoded->input_state[i][port], decoded->input_state[i-1][port], sizeof(decoded->input_state[i][port]));
+            }
+
+            for (int port = 0; port < ULNET_PORT_COUNT; port++) {
+                if (!(changed_ports & (1 << port))) continue;
+
+                uint64_t held_mask, wide_mask;
+                cursor = ulnet__get_varint(cursor, end, &held_mask);
+                if (cursor) cursor = ulnet__get_varint(cursor, end, &wide_mask);
+                if (!cursor || (wide_mask & ~held_mask)) return -1;
+
+                held_ports = held_mask ? held_ports | (1 << port) : held_ports & ~(1 << port);
+                for (int j = 0; decoded && j < SAM2_ARRAY_LENGTH(decoded->input_state[i][port]) && (held_mask >> j); j++) {
+                    decoded->input_state[i][port][j] = (int16_t) ((held_mask >> j) & 1);
+                }
+
+                for (int j = 0; j < SAM2_ARRAY_LENGTH(state->input_state[i][port]) && (wide_mask >> j); j++) {
+                    if (!((wide_mask >> j) & 1)) continue;
+
+                    uint64_t zigzag_value;
+                    cursor = ulnet__get_varint(cursor, end, &zigzag_value);
+                    if (!cursor) return -1;
+                    int64_t value = ulnet__unzigzag(zigzag_value);
+                    if (value < INT16_MIN || value > INT16_MAX) return -1;
+                    if (decoded) decoded->input_state[i][port][j] = (int16_t) value;
+                }
+            }
+
+            if (slot_flags & ULNET_INPUT_SLOT_FLAG_ROOM_XOR_DELTA) {
+                sam2_room_t room_xor_delta;
+                int64_t input_consumed = 0;
+                int64_t output_produced = rle8_decode_extra(cursor, end - cursor, &input_consumed, (uint8_t *) &room_xor_delta, sizeof(room_xor_delta));
+                if (output_produced != sizeof(room_xor_delta)) return -1;
+                cursor += input_consumed;
+                if (decoded) decoded->room_xor_delta[i] = room_xor_delta;
+            }
+
+            if (slot_flags & ULNET_INPUT_SLOT_FLAG_CORE_OPTION) {
+                ulnet_core_option_t core_option;
+                cursor = ulnet__get_string(cursor, end, core_option.key, sizeof(core_option.key));
+                if (cursor) cursor = ulnet__get_string(cursor, end, core_option.value, sizeof(core_option.value));
+                if (!cursor) return -1;
+                if (decoded) decoded->core_option[i] = core_option;
+            }
+
+            uint32_t hashes[2] = {0};
+            for (int h = 0; h < 2; h++) {
+                if (!(slot_flags & (ULNET_INPUT_SLOT_FLAG_SAVE_STATE_HASH << h))) continue;
+                if (end - cursor < 4) return -1;
+                for (int b = 0; b < 4; b++) hashes[h] |= (uint32_t) *cursor++ << (8 * b);
+            }
+            if (decoded) {
+                decoded->save_state_hash[i] = hashes[0];
+                decoded->input_state_hash[i] = hashes[1];
+            }
+        }
+
+        if (cursor != end) return -3;
+    }
+
+    return 0;
+}
+
+static bool ulnet__input_format_is_legacy(ulnet_session_t *session) {
+    return ulnet_room_protocol_version(&session->room_we_are_in) < ULNET_PROTOCOL_VERSION_INPUT_FORMAT;
+}
+
+// The most compact format everyone in the room understands
+static uint8_t ulnet__input_format(ulnet_session_t *session) {
+    return ulnet__input_format_is_legacy(session) ? ULNET_INPUT_FORMAT_LEGACY : ULNET_INPUT_FORMAT_COMPACT;
+}
+
+// The first byte of coded_state says which format the rest of it is in
+static int64_t ulnet__encode_state(ulnet_session_t *session, const ulnet_state_t *state, uint8_t format, uint8_t *coded, int64_t coded_capacity) {
+    int64_t coded_size = -1;
+    int64_t format_size = format == ULNET_INPUT_FORMAT_LEGACY ? 0 : 1;
+    if (coded_capacity < 1) return -1;
+    coded[0] = format;
+
+    if (format == ULNET_INPUT_FORMAT_COMPACT) {
+        coded_size = ulnet__encode_state_compact(state, ulnet_delay_buffer_size(session), &coded[1], coded_capacity - 1);
+    } else if (format == ULNET_INPUT_FORMAT_COMPACT_TIMED) {
+        if (coded_capacity < 5) return -1;
+        memset(&coded[1], 0, 4); // Filled in for each peer right before sending, see ulnet__set_frame_advantage_in_packet
+        coded_size = ulnet__encode_state_compact(state, ulnet_delay_buffer_size(session), &coded[5], coded_capacity - 5);
+        if (coded_size >= 0) coded_size += 4;
+    } else if (format == ULNET_INPUT_FORMAT_RLE8 || format == ULNET_INPUT_FORMAT_LEGACY) {
+        uint8_t *packed = (uint8_t *) &session->state_scratch;
+        uint8_t *cursor = packed;
+        #define ULNET__PACK(field, size) memcpy(cursor, (field), (size)); cursor += (size);
+        ULNET__STATE_FIELDS(ULNET__PACK, state, ulnet_delay_buffer_size(session))
+        #undef ULNET__PACK
+
+        coded_size = rle8_encode_capped(packed, cursor - packed, &coded[format_size], coded_capacity - format_size);
+    }
+
+    return coded_size < 0 ? -1 : format_size + coded_size;
+}
+
+// Returns a negative number on error, state is only written if the whole thing decoded
+static int ulnet__decode_state(ulnet_session_t *session, const uint8_t *coded, int64_t coded_size, ulnet_state_t *state) {
+    if (coded_size < 1) return -1;
+    uint8_t format = ulnet__input_format_is_legacy(session) ? ULNET_INPUT_FORMAT_LEGACY : coded[0];
+    int64_t format_size = format == ULNET_INPUT_FORMAT_LEGACY ? 0 : 1;
+
+    if (format == ULNET_INPUT_FORMAT_COMPACT) {
+        return ulnet__decode_state_compact(&coded[1], coded_size - 1, ulnet_delay_buffer_size(session), state);
+    } else if (format == ULNET_INPUT_FORMAT_COMPACT_TIMED) {
+        if (coded_size < 5) return -1;
+        return ulnet__decode_state_compact(&coded[5], coded_size - 5, ulnet_delay_buffer_size(session), state);
+    } else if (format == ULNET_INPUT_FORMAT_RLE8 || format == ULNET_INPUT_FORMAT_LEGACY) {
+        uint8_t *packed = (uint8_t *) &session->state_scratch;
+        int64_t packed_size = ulnet__state_packed_size(ulnet_delay_buffer_size(session));
+        int64_t input_consumed = 0;
+        int64_t output_produced = rle8_decode_extra(&coded[format_size], coded_size - format_size, &input_consumed, packed, packed_size);
+
+        if (output_produced != packed_size) return -2;
+        if (input_consumed != coded_size - format_size) return -3;
+
+        const uint8_t *cursor = packed;
+        #define ULNET__UNPACK(field, size) memcpy((field), cursor, (size)); cursor += (size);
+        ULNET__STATE_FIELDS(ULNET__UNPACK, state, ulnet_delay_buffer_size(session))
+        #undef ULNET__UNPACK
+        return 0;
+    }
+
+    return -4;
+}
+
+// Cheaper than ulnet__decode_state when all you want is which frame an input packet is for
+static int ulnet__get_frame_from_packet(ulnet_session_t *session, const uint8_t *packet, int64_t size, int64_t *frame) {
+    const uint8_t *coded = &packet[sizeof(ulnet_state_packet_t)];
+    int64_t coded_size = size - (int64_t) sizeof(ulnet_state_packet_t);
+    if (coded_size < 1) return -1;
+
+    if (ulnet__input_format_is_legacy(session)) {
+        return rle8_decode(coded, coded_size, (uint8_t *) frame, sizeof(*frame)) == sizeof(*frame) ? 0 : -1;
+    } else if (coded[0] == ULNET_INPUT_FORMAT_COMPACT || coded[0] == ULNET_INPUT_FORMAT_COMPACT_TIMED) {
+        int64_t offset = coded[0] == ULNET_INPUT_FORMAT_COMPACT_TIMED ? 5 : 1;
+        uint64_t zigzag_frame;
+        if (coded_size < offset || !ulnet__get_varint(&coded[offset], &coded[coded_size], &zigzag_frame)) return -1;
+        *frame = ulnet__unzigzag(zigzag_frame);
+        return 0;
+    } else if (coded[0] == ULNET_INPUT_FORMAT_RLE8) {
+        return rle8_decode(&coded[1], coded_size - 1, (uint8_t *) frame, sizeof(*frame)) == sizeof(*frame) ? 0 : -1;
+    }
+
+    return -4;
+}
+
+static int ulnet__get_frame_advantage_from_packet(ulnet_session_t *session, const uint8_t *packet, int64_t size, int32_t *frame_advantage_usec) {
+    const uint8_t *coded = &packet[sizeof(ulnet_state_packet_t)];
+    if (ulnet__input_format_is_legacy(session)) return -1;
+    if (size - (int64_t) sizeof(ulnet_state_packet_t) < 5 || coded[0] != ULNET_INPUT_FORMAT_COMPACT_TIMED) return -1;
+
+    uint32_t value = 0;
+    for (int b = 0; b < 4; b++) value |= (uint32_t) coded[1 + b] << (8 * b);
+    *frame_advantage_usec = (int32_t) value;
+    return 0;
+}
+
+static void ulnet__set_frame_advantage_in_packet(uint8_t *packet, int32_t frame_advantage_usec) {
+    uint8_t *coded = &packet[sizeof(ulnet_state_packet_t)];
+    assert(coded[0] == ULNET_INPUT_FORMAT_COMPACT_TIMED);
+
+    for (int b = 0; b < 4; b++) coded[1 + b] = (uint8_t) ((uint32_t) frame_advantage_usec >> (8 * b));
+}
+
+static void ulnet_update_state_history(ulnet_session_t *session, arena_ref_t packet_ref) {
+    // Only store one packet per delay buffer... frame 7, 15, 23, etc. with the default size
+    uint8_t *packet = (uint8_t *)arena_deref(&session->arena, packet_ref);
+    if ((packet[0] & ULNET_CHANNEL_MASK) != ULNET_CHANNEL_INPUT) {
+        SAM2_LOG_ERROR("Attempt to store non-input packet in state history");
+    }
+
+    int port = packet[0] & ULNET_FLAGS_MASK;
+    int64_t frame;
+    if (ulnet__get_frame_from_packet(session, packet, packet_ref.size, &frame) < 0) {
+        SAM2_LOG_ERROR("Attempt to store malformed input packet in state history");
+        return;
+    }
+
+    if ((frame + 1) % ulnet_delay_buffer_size(session) == 0) {
+        int history_idx = (frame / ulnet_delay_buffer_size(session)) % ULNET_STATE_PACKET_HISTORY_SIZE;
+
+        SAM2_LOG_DEBUG("Storing state packet for port %d at history index %d for frame %lld", port, history_idx, (long long)frame);
+        session->state_packet_history[port][history_idx] = packet_ref;
+    }
+}
+
+// Returns a negative number on error
+// Hands a packet to the transport without recording it anywhere
+static int ulnet__transport_send(ulnet_session_t *session, int port, const uint8_t *packet, size_t size) {
+    if (rand() / ((float) RAND_MAX) < session->debug_udp_send_drop_rate) {
+        SAM2_LOG_DEBUG("Intentionally dropped a sent UDP packet");
+        return 0;
+    }
+
+    if (session->use_inproc_transport) {
+        ulnet_inproc_buf_t *buf;
+        if (session->our_peer_id < session->agent_peer_ids[port]) {
+            buf = &session->inproc[port]->buf1;
+        } else {
+            buf = &session->inproc[port]->buf2;
+        }
+
+        int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+        int64_t deliver_at_usec = current_time_usec;
+        if (buf->bottleneck_bytes_per_second > 0) {
+            int64_t start_usec = SAM2_MAX(current_time_usec, buf->bottleneck_free_usec);
+            if (start_usec - current_time_usec > buf->bottleneck_queue_usec_max) {
+                buf->bottleneck_dropped++; // Tail drop like a router with a full buffer
+                return 0;
+            }
+
+            buf->bottleneck_free_usec = start_usec + (int64_t) size * 1000000 / buf->bottleneck_bytes_per_second;
+            deliver_at_usec = buf->bottleneck_free_usec;
+        }
+
+        if (buf->count >= sizeof(buf->msg) / sizeof(buf->msg[0])) {
+            SAM2_LOG_FATAL("Inproc transport buffer is full, cannot send packet");
+        }
+
+        buf->deliver_at_usec[buf->count] = deliver_at_usec;
+        buf->msg_size[buf->count] = size;
+        memcpy(buf->msg[buf->count], packet, size);
+        buf->count++;
+        return 0;
+    } else {
+        return juice_send(session->agent[port], (const char *)packet, size);
+    }
+}
+
+ULNET_LINKAGE int ulnet_udp_send(ulnet_session_t *session, int port, const uint8_t *packet, size_t size) {
+    // Basic packet validation
+    if (size - 1 >= ULNET_PACKET_SIZE_BYTES_MAX) {
+        SAM2_LOG_ERROR("Attempt to send packet with invalid size: %zu bytes, max allowed: %d", size, ULNET_PACKET_SIZE_BYTES_MAX);
+        return -1;
+    }
+
+    // Perform channel-specific packet validation
+    switch (packet[0] & ULNET_CHANNEL_MASK) {
+    case ULNET_CHANNEL_EXTRA: {
+        SAM2_LOG_ERROR("Attempt to send packet with invalid channel: %d", packet[0] & ULNET_CHANNEL_MASK);
+        return -1;
+    }
+    case ULNET_CHANNEL_INPUT: {
+        if (size < sizeof(ulnet_state_packet_t)) {
+            SAM2_LOG_ERROR("Input packet too small: %zu bytes", size);
+            return -1;
+        }
+
+        int64_t frame;
+        if (ulnet__get_frame_from_packet(session, packet, size, &frame) < 0) {
+            SAM2_LOG_ERROR("Input packet has an unknown format or invalid encoding");
+            return -1;
+        }
+        break;
+    }
 
     case ULNET_CHANNEL_SPECTATOR_INPUT: {
         if (size < sizeof(ulnet_state_packet_t)) {
@@ -715,43 +2148,23 @@ ULNET_LINKAGE int ulnet_udp_send(ulnet_session_t *session, int port, const uint8
         uint16_t sequence = ((uint16_t)packet[2] << 8) | packet[1];
         session->reliable_tx_packet_history[port][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE] = packet_ref;
 
-        if (memcmp(&packet[1], &session->reliable_tx_head[port], 2) != 0) {
-            SAM2_LOG_INFO("Not sending reliable packet since it is not head of queue");
-            return 0; // @todo move this to the reliable send function
-        } else {
-            session->reliable_last_transmit_time[port] = ulnet__get_unix_time_microseconds();
+        int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+        if (sequence == session->reliable_tx_head[port]) {
+            session->reliable_rto_started_usec[port] = current_time_usec;
         }
-    }
 
-    if (rand() / ((float) RAND_MAX) < session->debug_udp_send_drop_rate) {
-        SAM2_LOG_ERROR("Intentionally dropped a sent UDP packet");
-        return 0;
+        // Karn's algorithm: An ack for a retransmitted packet is ambiguous so it doesn't produce an RTT sample
+        int64_t *send_time_usec = &session->reliable_tx_send_time_usec[port][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE];
+        *send_time_usec = *send_time_usec == 0 ? current_time_usec : -1;
+        session->reliable_tx_last_send_usec[port][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE] = current_time_usec;
     }
 
-    if (session->use_inproc_transport) {
-        ulnet_inproc_buf_t *buf;
-        if (session->our_peer_id < session->agent_peer_ids[port]) {
-            buf = &session->inproc[port]->buf1;
-        } else {
-            buf = &session->inproc[port]->buf2;
-        }
-
-        if (buf->count >= sizeof(buf->msg) / sizeof(buf->msg[0])) {
-            SAM2_LOG_FATAL("Inproc transport buffer is full, cannot send packet");
-        }
-
-        buf->msg_size[buf->count] = size;
-        memcpy(buf->msg[buf->count], packet, size);
-        buf->count++;
-        return 0;
-    } else {
-        return juice_send(session->agent[port], (const char *)packet, size);
-    }
+    return ulnet__transport_send(session, port, packet, size);
 }
 
 // Simplified wrap packet function
 static int ulnet__wrap_packet(const uint8_t packet[/* size */], int size, uint16_t sequence,
-    uint16_t ack_sequence, uint8_t wrapped_packet[/* ULNET_PACKET_SIZE_BYTES_MAX */]) {
+    uint16_t ack_sequence, const uint8_t *sack /* ULNET_RELIABLE_SACK_SIZE or NULL */, uint8_t wrapped_packet[/* ULNET_PACKET_SIZE_BYTES_MAX */]) {
     if ((wrapped_packet[0] & ULNET_CHANNEL_MASK) != ULNET_CHANNEL_RELIABLE) {
         SAM2_LOG_ERROR("Expected filled out first header byte");
         return -1;
@@ -767,6 +2180,13 @@ static int ulnet__wrap_packet(const uint8_t packet[/* size */], int size, uint16
     memcpy(&wrapped_packet[offset], &ack_sequence, sizeof(ack_sequence));
     offset += sizeof(ack_sequence);
 
+    // Selective acks are only an optimization so they're left off anything they'd push over the MTU
+    if (sack && offset + ULNET_RELIABLE_SACK_SIZE + size <= ULNET_PACKET_SIZE_BYTES_MAX) {
+        wrapped_packet[0] |= ULNET_RELIABLE_FLAG_SACK;
+        memcpy(&wrapped_packet[offset], sack, ULNET_RELIABLE_SACK_SIZE);
+        offset += ULNET_RELIABLE_SACK_SIZE;
+    }
+
     if (ULNET_PACKET_SIZE_BYTES_MAX < offset + size) {
         SAM2_LOG_ERROR("Reliable packet too large: %d bytes", size);
         return -1;
@@ -777,15 +2197,44 @@ static int ulnet__wrap_packet(const uint8_t packet[/* size */], int size, uint16
     return offset + size;
 }
 
+static int ulnet__reliable_header_size(uint8_t channel_and_flags) {
+    return (int) sizeof(ulnet_reliable_packet_t) + ((channel_and_flags & ULNET_RELIABLE_FLAG_SACK) ? ULNET_RELIABLE_SACK_SIZE : 0);
+}
+
+// Fills in which packets past reliable_rx_head we're holding, returns false if there aren't any or the room is too old
+// for the peer to parse a SACK so it can be left off
+static bool ulnet__reliable_sack(ulnet_session_t *session, int port, uint8_t sack[ULNET_RELIABLE_SACK_SIZE]) {
+    if (ulnet_room_protocol_version(&session->room_we_are_in) < ULNET_PROTOCOL_VERSION_SACK) return false;
+    if (!session->reliable_rx_held[port][0] && !session->reliable_rx_held[port][1]) return false;
+
+    memset(sack, 0, ULNET_RELIABLE_SACK_SIZE);
+    for (int i = 1; i < ULNET_RELIABLE_ACK_BUFFER_SIZE; i++) {
+        uint16_t index = (uint16_t) (session->reliable_rx_head[port] + i) % ULNET_RELIABLE_ACK_BUFFER_SIZE;
+        if (session->reliable_rx_held[port][index / 64] & (1ULL << (index % 64))) {
+            sack[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    return true;
+}
+
 // Simplified reliable send
 ULNET_LINKAGE int ulnet_reliable_send(ulnet_session_t *session, int port, const uint8_t *packet, int size) {
     uint8_t tmp[ULNET_PACKET_SIZE_BYTES_MAX];
 
+    if ((uint16_t) (session->reliable_tx_next_seq[port] - session->reliable_tx_head[port]) >= ULNET_RELIABLE_ACK_BUFFER_SIZE) {
+        SAM2_LOG_ERROR("Too many unacked reliable packets to peer %05" PRIu16 ", dropping this one", session->agent_peer_ids[port]);
+        return -1;
+    }
+
     tmp[0] = ULNET_CHANNEL_RELIABLE;
     uint16_t sequence = session->reliable_tx_next_seq[port]++;
     uint16_t ack_sequence = session->reliable_rx_head[port];
+    session->reliable_tx_send_time_usec[port][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE] = 0;
 
-    int maybe_wrapped_size = ulnet__wrap_packet(packet, size, sequence, ack_sequence, tmp);
+    uint8_t sack[ULNET_RELIABLE_SACK_SIZE];
+    bool has_sack = ulnet__reliable_sack(session, port, sack);
+    int maybe_wrapped_size = ulnet__wrap_packet(packet, size, sequence, ack_sequence, has_sack ? sack : NULL, tmp);
     if (maybe_wrapped_size < 0) {
         return maybe_wrapped_size;
     } else {
@@ -793,14 +2242,55 @@ ULNET_LINKAGE int ulnet_reliable_send(ulnet_session_t *session, int port, const
     }
 }
 
+static void ulnet__packet_loss_sample(ulnet_session_t *session, int port, uint16_t sequence) {
+    if (sequence == 0) {
+        return; // The peer doesn't number its unreliable packets
+    }
+
+    uint16_t gap = sequence - session->unreliable_rx_seq[port];
+    if (session->unreliable_rx_seq[port] == 0 || gap > 16 * ULNET_PACKET_LOSS_WINDOW) {
+        // First packet or the peer restarted its numbering, nothing to compare against
+        session->unreliable_rx_seq[port] = sequence;
+        session->unreliable_rx_expected[port] = 0;
+        session->unreliable_rx_received[port] = 0;
+        return;
+    }
+
+    if (gap == 0 || !ulnet__sequence_greater_than(sequence, session->unreliable_rx_seq[port])) {
+        return; // Duplicate or reordered, the gap it left was already counted
+    }
+
+    session->unreliable_rx_seq[port] = sequence;
+    session->unreliable_rx_expected[port] += gap;
+    session->unreliable_rx_received[port]++;
+
+    if (session->unreliable_rx_expected[port] >= ULNET_PACKET_LOSS_WINDOW) {
+        float loss = 1.0f - (float) session->unreliable_rx_received[port] / session->unreliable_rx_expected[port];
+        if (session->packet_loss_measured_bitfield & (1ULL << port)) {
+            session->packet_loss[port] += (loss - session->packet_loss[port]) / 4;
+        } else {
+            session->packet_loss[port] = loss;
+            session->packet_loss_measured_bitfield |= 1ULL << port;
+        }
+
+        session->unreliable_rx_expected[port] = 0;
+        session->unreliable_rx_received[port] = 0;
+    }
+}
+
 ULNET_LINKAGE int ulnet_reliable_send_with_acks_only(ulnet_session_t *session, int port, const uint8_t *packet, int size) {
     uint8_t tmp[ULNET_PACKET_SIZE_BYTES_MAX];
 
     tmp[0] = ULNET_CHANNEL_RELIABLE | ULNET_RELIABLE_FLAG_ACK_ONLY;
-    uint16_t sequence = 0; // Ignored
+    // Not used for ordering, the receiver counts the gaps to estimate packet loss. Older versions always sent 0
+    uint16_t sequence = ++session->unreliable_tx_next_seq[port];
+    if (sequence == 0) sequence = ++session->unreliable_tx_next_seq[port];
     uint16_t ack_sequence = session->reliable_rx_head[port];
 
-    int maybe_wrapped_size = ulnet__wrap_packet(packet, size, sequence, ack_sequence, tmp);
+    // These go out every frame so they're what gets SACKs back to the sender quickly
+    uint8_t sack[ULNET_RELIABLE_SACK_SIZE];
+    bool has_sack = ulnet__reliable_sack(session, port, sack);
+    int maybe_wrapped_size = ulnet__wrap_packet(packet, size, sequence, ack_sequence, has_sack ? sack : NULL, tmp);
     if (maybe_wrapped_size < 0) {
         return maybe_wrapped_size;
     } else {
@@ -808,41 +2298,158 @@ ULNET_LINKAGE int ulnet_reliable_send_with_acks_only(ulnet_session_t *session, i
     }
 }
 
+// Same smoothing as TCP (RFC 6298). Acks piggyback on the next packet our peer sends so samples include up to a frame of their polling
+static void ulnet__rtt_update(ulnet_session_t *session, int port, int64_t rtt_usec) {
+    session->rtt_sample_usec[port] = rtt_usec;
+    if (session->rtt_smoothed_usec[port] == 0) {
+        session->rtt_smoothed_usec[port] = SAM2_MAX(rtt_usec, 1);
+        session->rtt_variance_usec[port] = rtt_usec / 2;
+    } else {
+        session->rtt_variance_usec[port] = (3 * session->rtt_variance_usec[port] + SAM2_ABS(session->rtt_smoothed_usec[port] - rtt_usec)) / 4;
+        session->rtt_smoothed_usec[port] = SAM2_MAX((7 * session->rtt_smoothed_usec[port] + rtt_usec) / 8, 1);
+    }
+}
+
+// Smallest delay that lets input cross the slowest link before the frame it's for gets ticked
+static int64_t ulnet__adaptive_delay_frames(ulnet_session_t *session, double frame_rate) {
+    int64_t worst_rtt_usec[2] = {0, 0};
+    for (int p = 0; p < SAM2_PORT_MAX; p++) {
+        if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+        if (!session->agent[p] || session->rtt_smoothed_usec[p] == 0) continue;
+
+        int64_t rtt_usec = session->rtt_smoothed_usec[p] + 2 * session->rtt_variance_usec[p];
+        if (rtt_usec > worst_rtt_usec[0]) {
+            worst_rtt_usec[1] = worst_rtt_usec[0];
+            worst_rtt_usec[0] = rtt_usec;
+        } else if (rtt_usec > worst_rtt_usec[1]) {
+            worst_rtt_usec[1] = rtt_usec;
+        }
+    }
+
+    // Players talk to each other directly, but we can only measure our own links so bound theirs through us
+    int64_t one_way_latency_usec = (worst_rtt_usec[0] + worst_rtt_usec[1]) / 2;
+    int64_t frame_time_usec = (int64_t) (1000000 / frame_rate);
+    int64_t delay_frames = (one_way_latency_usec + frame_time_usec - 1) / frame_time_usec;
+
+    return SAM2_MAX(0, SAM2_MIN(delay_frames, ulnet_delay_frames_max(session)));
+}
+
+// Fills out core_option with a netplay_delay_frames change if the authority should renegotiate the delay
+static bool ulnet__adaptive_delay_core_option(ulnet_session_t *session, double frame_rate, ulnet_core_option_t *core_option) {
+    int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+    if (session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL || our_port != SAM2_AUTHORITY_INDEX) {
+        return false;
+    }
+
+    // Wait for a change we already buffered to take effect
+    for (int64_t frame = session->frame_counter; frame < session->state[our_port].frame; frame++) {
+        if (strcmp(session->state[our_port].core_option[frame % ulnet_delay_buffer_size(session)].key, "netplay_delay_frames") == 0) {
+            return false;
+        }
+    }
+
+    int64_t delay_frames = ulnet__adaptive_delay_frames(session, frame_rate);
+    int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+    if (delay_frames < session->delay_frames) {
+        if (session->adaptive_delay_decrease_pending_since_usec == 0) {
+            session->adaptive_delay_decrease_pending_since_usec = current_time_usec;
+        }
+
+        if (current_time_usec - session->adaptive_delay_decrease_pending_since_usec < ULNET_ADAPTIVE_DELAY_DECREASE_AFTER_USEC) {
+            return false;
+        }
+    }
+
+    session->adaptive_delay_decrease_pending_since_usec = 0;
+    if (delay_frames == session->delay_frames) {
+        return false;
+    }
+
+    SAM2_LOG_INFO("Renegotiating delay from %" PRId64 " to %" PRId64 " frames", session->delay_frames, delay_frames);
+    memset(core_option, 0, sizeof(*core_option));
+    strcpy(core_option->key, "netplay_delay_frames");
+    snprintf(core_option->value, sizeof(core_option->value), "%" PRId64, delay_frames);
+    return true;
+}
+
+// Jacobson/Karels (RFC 6298) with exponential backoff. Karn's algorithm keeps the backoff until a clean RTT sample comes in
+static int64_t ulnet__reliable_rto_usec(ulnet_session_t *session, int port) {
+    int64_t rto_usec = session->reliable_retransmit_delay_microseconds;
+    if (session->rtt_smoothed_usec[port] != 0) {
+        rto_usec = SAM2_MAX(rto_usec, session->rtt_smoothed_usec[port] + 4 * session->rtt_variance_usec[port]);
+    }
+
+    return SAM2_MIN(rto_usec << session->reliable_rto_backoff[port], (int64_t) ULNET_RELIABLE_RTO_MAX_USEC);
+}
+
+static void ulnet__reliable_retransmit_sequence(ulnet_session_t *session, int port, uint16_t sequence) {
+    arena_ref_t packet_ref = session->reliable_tx_packet_history[port][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE];
+    uint8_t *packet = (uint8_t *) arena_deref(&session->arena, packet_ref);
+
+    if (!packet || memcmp(&packet[1], &sequence, sizeof(sequence)) != 0) {
+        SAM2_LOG_FATAL("Unacked reliable packet with sequence %d overwritten", sequence);
+    }
+
+    SAM2_LOG_DEBUG("Retransmitting packet with sequence %d", sequence);
+
+    // Rewrap so it carries our latest ack and SACK
+    uint8_t tmp[ULNET_PACKET_SIZE_BYTES_MAX];
+    uint8_t sack[ULNET_RELIABLE_SACK_SIZE];
+    bool has_sack = ulnet__reliable_sack(session, port, sack);
+    int header_size = ulnet__reliable_header_size(packet[0]);
+    tmp[0] = ULNET_CHANNEL_RELIABLE;
+    int size = ulnet__wrap_packet(packet + header_size, packet_ref.size - header_size, sequence,
+        session->reliable_rx_head[port], has_sack ? sack : NULL, tmp);
+
+    if (size < 0 || ulnet_udp_send(session, port, tmp, size)) {
+        SAM2_LOG_ERROR("Failed to retransmit packet with sequence %d", sequence);
+    } else {
+        session->packet_history[port][(uint8_t) (session->packet_history_next[port] - 1)].flags_and_generation |= ULNET_PACKET_FLAG_TX_RELIABLE_RETRANSMIT;
+        session->reliable_retransmit_count++;
+    }
+}
+
 static void ulnet__reliable_retransmit(ulnet_session_t *session, double current_time_seconds) {
+    int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+
     for (int port = 0; port < SAM2_TOTAL_PEERS; port++) {
         if (!session->agent[port]) continue;
-        if (ulnet__get_unix_time_microseconds() < session->reliable_last_transmit_time[port] + session->reliable_retransmit_delay_microseconds) continue;
 
-        // Only retransmit head of queue packet
         uint16_t head_sequence = session->reliable_tx_head[port];
         uint16_t next_sequence = session->reliable_tx_next_seq[port];
+        if (!ulnet__sequence_less_than(head_sequence, next_sequence)) continue;
 
-        // If we have unacknowledged packets
-        if (ulnet__sequence_less_than(head_sequence, next_sequence)) {
-            arena_ref_t packet_ref = session->reliable_tx_packet_history[port][head_sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE];
-            ulnet_reliable_packet_t *packet = (ulnet_reliable_packet_t *) arena_deref(&session->arena, packet_ref);
-            int packet_size = packet_ref.size;
+        // The timeout catches losses nothing sent afterwards could reveal, when it fires everything the peer hasn't sacked is resent
+        bool timed_out = current_time_usec >= session->reliable_rto_started_usec[port] + ulnet__reliable_rto_usec(session, port);
 
-            if (packet && memcmp(&packet->sequence_le, &head_sequence, sizeof(head_sequence)) == 0) {
-                SAM2_LOG_INFO("Retransmitting packet with sequence %d", head_sequence);
+        // RACK (RFC 8985): A packet is lost once one sent after it got through and it's been long enough it isn't just reordered
+        int64_t reorder_window_usec = session->rtt_smoothed_usec[port] + session->rtt_smoothed_usec[port] / 4;
 
-                // Update the ack sequence before retransmitting
-                memcpy(&packet->ack_sequence_le, &session->reliable_rx_head[port], sizeof(packet->ack_sequence_le));
+        for (uint16_t sequence = head_sequence; ulnet__sequence_less_than(sequence, next_sequence); sequence++) {
+            int index = sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE;
+            if (session->reliable_tx_sacked[port][index / 64] & (1ULL << (index % 64))) continue;
 
-                if (ulnet_udp_send(session, port, (uint8_t *) packet, packet_ref.size)) {
-                    SAM2_LOG_ERROR("Failed to retransmit packet with sequence %d", head_sequence);
-                } else {
-                    session->packet_history[port][session->packet_history_next[port] - 1].flags_and_generation |= ULNET_PACKET_FLAG_TX_RELIABLE_RETRANSMIT;
-                }
-            } else {
-                SAM2_LOG_FATAL("Head of queue packet overwritten");
+            int64_t last_send_usec = session->reliable_tx_last_send_usec[port][index];
+            if (   timed_out
+                || (   last_send_usec < session->reliable_tx_delivered_send_usec[port]
+                    && current_time_usec - last_send_usec >= reorder_window_usec)) {
+                ulnet__reliable_retransmit_sequence(session, port, sequence);
             }
         }
+
+        if (timed_out) {
+            session->reliable_rto_started_usec[port] = current_time_usec;
+            session->reliable_rto_backoff[port] = SAM2_MIN(session->reliable_rto_backoff[port] + 1, ULNET_RELIABLE_RTO_BACKOFF_MAX);
+        }
     }
 }
 
 static sam2_message_metadata_t ulnet__message_metadata[] = {
     {ulnet_exit_header, SAM2_HEADER_SIZE},
+    {ulnet_base_header, sizeof(ulnet_baseline_message_t)},
+    {ulnet_nack_header, sizeof(ulnet_save_state_nack_message_t)},
+    {ulnet_dlay_header, sizeof(ulnet_delay_message_t)},
+    {ulnet_tree_header, sizeof(ulnet_save_state_tree_message_t)},
 };
 
 void ulnet_message_send(ulnet_session_t *session, int port, const uint8_t *message) {
@@ -861,44 +2468,1870 @@ void ulnet_message_send(ulnet_session_t *session, int port, const uint8_t *messa
     ulnet_reliable_send(session, port, message, metadata->message_size);
 }
 
-static SAM2_FORCEINLINE int64_t ulnet__get_frame_from_packet(const uint8_t *packet) {
-    int64_t frame;
-    rle8_decode(&packet[sizeof(ulnet_state_packet_t)], sizeof(frame), (uint8_t *) &frame, sizeof(frame));
-    return frame;
+static juice_state_t ulnet__get_peer_state(ulnet_session_t *session, int p) {
+    if (session->use_inproc_transport) {
+        return JUICE_STATE_COMPLETED; // The inproc transport is always connected and the union doesn't hold a juice agent
+    }
+
+    return juice_get_state(session->agent[p]);
 }
 
+static int ulnet__baseline_find(ulnet_session_t *session, int64_t frame, uint32_t xxhash) {
+    for (int i = 0; i < ULNET_SAVE_STATE_BASELINES_MAX; i++) {
+        if (   session->baseline_save_state_size[i]
+            && session->baseline_save_state_frame[i] == frame
+            && session->baseline_save_state_xxhash[i] == xxhash) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-static void ulnet__memor(void *dst, const void *src, size_t n) {
-    int16_t *d = (int16_t *)dst;
-    const int16_t *s = (const int16_t *)src;
-    size_t words = n / sizeof(int16_t);
+static int ulnet__baseline_most_recent(ulnet_session_t *session) {
+    int i = (session->baseline_save_state_next + ULNET_SAVE_STATE_BASELINES_MAX - 1) % ULNET_SAVE_STATE_BASELINES_MAX;
+    return session->baseline_save_state_size[i] ? i : -1;
+}
 
-    for (size_t i = 0; i < words; i++) {
-        d[i] |= s[i];
+static int ulnet__baseline_slot_acquire(ulnet_session_t *session, size_t save_state_size, int64_t frame, uint32_t xxhash) {
+    int i = session->baseline_save_state_next;
+    if (session->baseline_save_state[i] && session->save_state_encode_job.baseline == session->baseline_save_state[i]) {
+        ulnet__pool_wait(&session->save_state_encode_job.pending); // A worker may still be compressing against it
     }
+    session->baseline_save_state_next = (i + 1) % ULNET_SAVE_STATE_BASELINES_MAX;
+    session->baseline_save_state_size[i] = save_state_size;
+    session->baseline_save_state_frame[i] = frame;
+    session->baseline_save_state_xxhash[i] = xxhash;
+    return i;
 }
 
-#define ULNET_POLL_SESSION_SAVED_STATE    0b00000001
-#define ULNET_POLL_SESSION_TICKED         0b00000010
-#define ULNET_POLL_SESSION_BUFFERED_INPUT 0b00000100
-ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_state_on_tick, uint8_t *save_state, size_t save_state_capacity,
-    double frame_rate, double max_sleeping_allowed_when_polling_network_seconds) {
+static void ulnet__baseline_store(ulnet_session_t *session, const void *save_state, size_t save_state_size, int64_t frame, uint32_t xxhash) {
+    if (ulnet__baseline_find(session, frame, xxhash) != -1) return;
 
-    int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+    int i = ulnet__baseline_slot_acquire(session, save_state_size, frame, xxhash);
+    if (session->baseline_save_state_capacity[i] < save_state_size) {
+        free(session->baseline_save_state[i]);
+        session->baseline_save_state[i] = (uint8_t *) malloc(save_state_size);
+        session->baseline_save_state_capacity[i] = save_state_size;
+    }
 
-    IMH(ImGui::Begin("P2P UDP Netplay", NULL, ImGuiWindowFlags_AlwaysAutoResize);)
-    int status = 0;
+    memcpy(session->baseline_save_state[i], save_state, save_state_size);
+}
+
+// Takes ownership of *save_state and hands back the buffer of the slot it replaced so nothing is copied
+static void ulnet__baseline_store_swap(ulnet_session_t *session, uint8_t **save_state, size_t *capacity, size_t save_state_size, int64_t frame, uint32_t xxhash) {
+    if (ulnet__baseline_find(session, frame, xxhash) != -1) return;
+
+    int i = ulnet__baseline_slot_acquire(session, save_state_size, frame, xxhash);
+    uint8_t *buffer = session->baseline_save_state[i];
+    size_t buffer_capacity = session->baseline_save_state_capacity[i];
+    session->baseline_save_state[i] = *save_state;
+    session->baseline_save_state_capacity[i] = *capacity;
+    *save_state = buffer;
+    *capacity = buffer_capacity;
+}
+
+// Stores our candidate as a baseline when the peer hashed the same savestate on that frame, so a later sync can be a delta against it
+static void ulnet__baseline_candidate_confirm(ulnet_session_t *session, const ulnet_state_t *their_state) {
+    int64_t frame = session->baseline_candidate_frame;
+    if (   session->baseline_candidate_size == 0
+        || their_state->save_state_frame < frame
+        || their_state->save_state_frame - frame >= ulnet_delay_buffer_size(session)
+        || their_state->save_state_hash[frame % ulnet_delay_buffer_size(session)] != session->baseline_candidate_hash) {
+        return;
+    }
+
+    ulnet__baseline_store_swap(session, &session->baseline_candidate, &session->baseline_candidate_capacity,
+        session->baseline_candidate_size, frame, session->baseline_candidate_xxhash);
+    session->baseline_candidate_size = 0;
+    session->baseline_confirmed_count++;
+    SAM2_LOG_DEBUG("Keeping the savestate from frame %" PRId64 " as a baseline, our peer hashed the same one", frame);
+}
+
+static uint8_t *ulnet__transfer_buffer_acquire(ulnet_session_t *session, size_t size) {
+    int best = -1;
+    for (int i = 0; i < ULNET_TRANSFER_BUFFERS_MAX; i++) {
+        if (session->transfer_buffer_in_use_bitfield & (1u << i)) continue;
+        if (best == -1) {
+            best = i;
+            continue;
+        }
+
+        // Take the smallest buffer that fits, otherwise grow the biggest one
+        bool fits = session->transfer_buffer_capacity[i] >= size;
+        bool best_fits = session->transfer_buffer_capacity[best] >= size;
+        if (fits != best_fits) {
+            if (fits) best = i;
+        } else if (fits ? session->transfer_buffer_capacity[i] < session->transfer_buffer_capacity[best]
+                        : session->transfer_buffer_capacity[i] > session->transfer_buffer_capacity[best]) {
+            best = i;
+        }
+    }
+
+    if (best == -1) {
+        SAM2_LOG_WARN("Ran out of pooled transfer buffers, allocating %zu bytes", size);
+        return (uint8_t *) malloc(size);
+    }
+
+    if (session->transfer_buffer_capacity[best] < size) {
+        free(session->transfer_buffer[best]);
+        session->transfer_buffer[best] = (uint8_t *) malloc(size);
+        session->transfer_buffer_capacity[best] = size;
+    }
+
+    session->transfer_buffer_in_use_bitfield |= 1u << best;
+    return session->transfer_buffer[best];
+}
+
+static void ulnet__transfer_buffer_release(ulnet_session_t *session, uint8_t *buffer) {
+    if (buffer == NULL) return;
+
+    for (int i = 0; i < ULNET_TRANSFER_BUFFERS_MAX; i++) {
+        if (session->transfer_buffer[i] == buffer) {
+            session->transfer_buffer_in_use_bitfield &= ~(1u << i);
+            return;
+        }
+    }
+
+    free(buffer);
+}
+
+static ZSTD_CCtx *ulnet__zstd_cctx_reset(ZSTD_CCtx *cctx, int compress_level) {
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, compress_level);
+    return cctx;
+}
+
+static ZSTD_DCtx *ulnet__zstd_dctx(ulnet_session_t *session) {
+    if (!session->zstd_dctx) {
+        session->zstd_dctx = ZSTD_createDCtx();
+    }
+
+    ZSTD_DCtx_reset(session->zstd_dctx, ZSTD_reset_session_and_parameters);
+    return session->zstd_dctx;
+}
+
+static bool ulnet__zstd_dictionary_usable(ulnet_session_t *session) {
+    return session->zstd_dictionary_id != 0 && session->zstd_dictionary_rom_hash == session->room_we_are_in.rom_hash_xxh64;
+}
+
+static void ulnet__zstd_dictionary_set(ulnet_session_t *session, const uint8_t *dictionary, size_t dictionary_size, uint64_t rom_hash) {
+    ulnet__pool_wait(&session->save_state_encode_job.pending); // A worker may still be compressing with the old one
+    ZSTD_freeCDict(session->zstd_cdict);
+    ZSTD_freeDDict(session->zstd_ddict);
+    session->zstd_cdict = NULL; // Digested lazily at whatever compression level we're at when we first send with it
+
+    free(session->zstd_dictionary);
+    session->zstd_dictionary = (uint8_t *) malloc(dictionary_size);
+    memcpy(session->zstd_dictionary, dictionary, dictionary_size);
+    session->zstd_dictionary_size = dictionary_size;
+    session->zstd_dictionary_rom_hash = rom_hash;
+    session->zstd_dictionary_id = SAM2_MAX(ulnet_xxh32(dictionary, dictionary_size, 0), 1u);
+    session->zstd_ddict = ZSTD_createDDict(dictionary, dictionary_size);
+}
+
+static ZSTD_CDict *ulnet__zstd_cdict(ulnet_session_t *session) {
+    if (!session->zstd_cdict || session->zstd_cdict_compress_level != session->zstd_compress_level) {
+        ZSTD_freeCDict(session->zstd_cdict);
+        session->zstd_cdict = ZSTD_createCDict(session->zstd_dictionary, session->zstd_dictionary_size, session->zstd_compress_level);
+        session->zstd_cdict_compress_level = session->zstd_compress_level;
+    }
+
+    return session->zstd_cdict;
+}
+
+static void ulnet__zstd_dictionary_train_task(void *context, int index) {
+    ulnet_zstd_dictionary_training_t *training = (ulnet_zstd_dictionary_training_t *) context;
+    (void) index;
+    training->dictionary_size = ZDICT_trainFromBuffer(training->dictionary, ULNET_ZSTD_DICTIONARY_CAPACITY,
+        training->samples, training->sample_sizes, training->sample_count);
+}
+
+// Starts training a dictionary for the room's game on a worker from a savestate we sent and the baselines that look like the same game
+static void ulnet__zstd_dictionary_train(ulnet_session_t *session, const uint8_t *save_state, size_t save_state_size, uint32_t save_state_xxhash) {
+    ulnet_zstd_dictionary_training_t *training = &session->zstd_dictionary_training;
+    const uint8_t *sources[1 + ULNET_SAVE_STATE_BASELINES_MAX];
+    uint32_t source_xxhash[1 + ULNET_SAVE_STATE_BASELINES_MAX];
+    int source_count = 0;
+
+    sources[source_count] = save_state;
+    source_xxhash[source_count++] = save_state_xxhash;
+    for (int i = 0; i < ULNET_SAVE_STATE_BASELINES_MAX; i++) {
+        if (session->baseline_save_state_size[i] != save_state_size) continue;
+
+        // Baselines already have their hash so duplicates are skipped without touching their memory
+        bool duplicate = false;
+        for (int j = 0; j < source_count; j++) {
+            duplicate |= source_xxhash[j] == session->baseline_save_state_xxhash[i];
+        }
+        if (duplicate) continue;
+
+        sources[source_count] = session->baseline_save_state[i];
+        source_xxhash[source_count++] = session->baseline_save_state_xxhash[i];
+    }
+
+    // Every chunk is a sample, past the size limit we skip over evenly spaced chunks
+    size_t chunk_count = (save_state_size + ULNET_SAVE_STATE_CHUNK_SIZE - 1) / ULNET_SAVE_STATE_CHUNK_SIZE;
+    size_t chunk_stride = 1 + source_count * save_state_size / ULNET_ZSTD_DICTIONARY_TRAINING_SIZE_MAX;
+    training->samples = (uint8_t *) malloc(ULNET_ZSTD_DICTIONARY_TRAINING_SIZE_MAX + ULNET_SAVE_STATE_CHUNK_SIZE);
+    training->sample_sizes = (size_t *) malloc(source_count * (chunk_count / chunk_stride + 1) * sizeof(size_t));
+    training->sample_count = 0;
+    size_t samples_size = 0;
+    for (int i = 0; i < source_count; i++) {
+        for (size_t offset = 0; offset < save_state_size; offset += chunk_stride * ULNET_SAVE_STATE_CHUNK_SIZE) {
+            size_t sample_size = SAM2_MIN(save_state_size - offset, (size_t) ULNET_SAVE_STATE_CHUNK_SIZE);
+            if (samples_size + sample_size > ULNET_ZSTD_DICTIONARY_TRAINING_SIZE_MAX) break;
+
+            memcpy(training->samples + samples_size, sources[i] + offset, sample_size);
+            training->sample_sizes[training->sample_count++] = sample_size;
+            samples_size += sample_size;
+        }
+    }
+
+    training->dictionary = (uint8_t *) malloc(ULNET_ZSTD_DICTIONARY_CAPACITY);
+    training->rom_hash = session->room_we_are_in.rom_hash_xxh64;
+    training->attempted = true;
+    training->in_use = true;
+    SAM2_LOG_INFO("Training a savestate dictionary on %u samples from %d savestates", training->sample_count, source_count);
+    ulnet__pool_submit(ulnet__zstd_dictionary_train_task, training, &training->pending);
+}
+
+static void ulnet__zstd_dictionary_collect(ulnet_session_t *session) {
+    ulnet_zstd_dictionary_training_t *training = &session->zstd_dictionary_training;
+    if (!training->in_use || !ulnet__pool_finished(&training->pending)) return;
+    training->in_use = false;
+
+    if (ZDICT_isError(training->dictionary_size)) {
+        SAM2_LOG_WARN("Couldn't train a savestate dictionary: %s", ZDICT_getErrorName(training->dictionary_size));
+    } else {
+        ulnet__zstd_dictionary_set(session, training->dictionary, training->dictionary_size, training->rom_hash);
+        SAM2_LOG_INFO("Trained a %zu byte savestate dictionary %08" PRIx32 " for rom %016" PRIx64,
+            training->dictionary_size, session->zstd_dictionary_id, training->rom_hash);
+    }
+
+    free(training->samples);
+    free(training->sample_sizes);
+    free(training->dictionary);
+    training->samples = NULL;
+    training->sample_sizes = NULL;
+    training->dictionary = NULL;
+}
+
+static void ulnet__zstd_free(ulnet_session_t *session) {
+    ulnet__pool_wait(&session->zstd_dictionary_training.pending);
+    ulnet__pool_wait(&session->save_state_encode_job.pending);
+    ulnet__zstd_dictionary_collect(session);
+    ZSTD_freeCCtx(session->zstd_cctx);
+    ZSTD_freeDCtx(session->zstd_dctx);
+    for (int i = 0; i < ULNET_ZSTD_CHUNK_CONTEXTS; i++) {
+        ZSTD_freeCCtx(session->zstd_chunk_cctx[i]);
+        ZSTD_freeDCtx(session->zstd_chunk_dctx[i]);
+        session->zstd_chunk_cctx[i] = NULL;
+        session->zstd_chunk_dctx[i] = NULL;
+    }
+    ZSTD_freeCDict(session->zstd_cdict);
+    ZSTD_freeDDict(session->zstd_ddict);
+    free(session->zstd_dictionary);
+    session->zstd_cctx = NULL;
+    session->zstd_dctx = NULL;
+    session->zstd_cdict = NULL;
+    session->zstd_ddict = NULL;
+    session->zstd_dictionary = NULL;
+    session->zstd_dictionary_size = 0;
+    session->zstd_dictionary_id = 0;
+    session->zstd_dictionary_training.attempted = false;
+}
+
+// Chunk size to compress a full savestate with, 0 when it fits in one chunk and goes out as a single zstd frame
+static int32_t ulnet__save_state_compress_chunk_size(ulnet_session_t *session, size_t save_state_size) {
+    if (session->save_state_compress_chunk_size < 0) return 0;
+
+    size_t chunk_size = session->save_state_compress_chunk_size ? session->save_state_compress_chunk_size : ULNET_SAVE_STATE_COMPRESS_CHUNK_SIZE;
+    while ((save_state_size + chunk_size - 1) / chunk_size > ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX) chunk_size *= 2;
+    return save_state_size > chunk_size ? (int32_t) chunk_size : 0;
+}
+
+typedef struct ulnet__zstd_chunk_job {
+    ZSTD_CCtx **cctx; // One per task
+    ZSTD_DCtx **dctx;
+    const ZSTD_CDict *cdict; // Digested dictionaries are read-only so every task shares them
+    const ZSTD_DDict *ddict;
+    int compress_level;
+    uint8_t *save_state;
+    uint8_t *compressed;
+    size_t offset[ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX]; // Of each chunk in compressed
+    size_t size[ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX]; // Compressed size of each chunk or a zstd error
+    size_t save_state_offset[ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX];
+    size_t save_state_size[ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX];
+    int chunk_count;
+    int task_count; // Task t handles every task_count-th chunk starting from t
+} ulnet__zstd_chunk_job_t;
+
+static size_t ulnet__zstd_decompress_frame(ZSTD_DCtx *dctx, const ZSTD_DDict *ddict, uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size) {
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+    if (ddict) {
+        ZSTD_DCtx_refDDict(dctx, ddict);
+    }
+
+    size_t ret = ZSTD_decompressDCtx(dctx, dst, dst_size, src, src_size);
+    return ZSTD_isError(ret) || ret == dst_size ? ret : (size_t) -ZSTD_error_corruption_detected;
+}
+
+// Where the zstd frame at the start of src ends and how much it decompresses to, false until all of it is in src
+// A frame that doesn't record its size is only accepted as the last one and gets whatever is left of the savestate
+static bool ulnet__zstd_frame_extent(const uint8_t *src, size_t src_size, bool last, size_t save_state_left, size_t *frame_size, size_t *content_size) {
+    *frame_size = ZSTD_findFrameCompressedSize(src, src_size);
+    if (ZSTD_isError(*frame_size)) return false;
+
+    unsigned long long size = ZSTD_getFrameContentSize(src, *frame_size);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN && last && *frame_size == src_size) size = save_state_left;
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > save_state_left) return false;
+
+    *content_size = (size_t) size;
+    return true;
+}
+
+static void ulnet__zstd_compress_chunks_task(void *context, int task) {
+    ulnet__zstd_chunk_job_t *job = (ulnet__zstd_chunk_job_t *) context;
+    ZSTD_CCtx *cctx = job->cctx[task];
+
+    for (int i = task; i < job->chunk_count; i += job->task_count) {
+        ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, job->compress_level);
+        if (job->cdict) {
+            ZSTD_CCtx_refCDict(cctx, job->cdict);
+        }
+
+        job->size[i] = ZSTD_compress2(cctx, job->compressed + job->offset[i], ZSTD_COMPRESSBOUND(job->save_state_size[i]),
+            job->save_state + job->save_state_offset[i], job->save_state_size[i]);
+    }
+}
+
+static void ulnet__zstd_decompress_chunks_task(void *context, int task) {
+    ulnet__zstd_chunk_job_t *job = (ulnet__zstd_chunk_job_t *) context;
+
+    for (int i = task; i < job->chunk_count; i += job->task_count) {
+        job->size[i] = ulnet__zstd_decompress_frame(job->dctx[task], job->ddict, job->save_state + job->save_state_offset[i], job->save_state_size[i],
+            job->compressed + job->offset[i], job->size[i]);
+    }
+}
+
+// Compresses every chunk into a slot big enough for the worst case in parallel then packs the frames together
+// A context for each of the first ULNET_ZSTD_CHUNK_CONTEXTS chunks has to be created already
+static size_t ulnet__save_state_compress_chunks(ZSTD_CCtx **cctx, const ZSTD_CDict *cdict, int compress_level, const uint8_t *save_state, size_t save_state_size,
+                                                int32_t chunk_size, uint8_t *compressed) {
+    ulnet__zstd_chunk_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.chunk_count = (int) ((save_state_size + chunk_size - 1) / chunk_size);
+    job.task_count = SAM2_MIN(job.chunk_count, ULNET_ZSTD_CHUNK_CONTEXTS);
+    job.cctx = cctx;
+    job.cdict = cdict;
+    job.compress_level = compress_level;
+    job.save_state = (uint8_t *) save_state;
+    job.compressed = compressed;
+    for (int i = 0; i < job.chunk_count; i++) {
+        job.offset[i] = (size_t) i * ZSTD_COMPRESSBOUND(chunk_size);
+        job.save_state_offset[i] = (size_t) i * chunk_size;
+        job.save_state_size[i] = SAM2_MIN(save_state_size - job.save_state_offset[i], (size_t) chunk_size);
+    }
+    ulnet__parallel_for(ulnet__zstd_compress_chunks_task, &job, job.task_count);
+
+    size_t compressed_size = 0;
+    for (int i = 0; i < job.chunk_count; i++) {
+        if (ZSTD_isError(job.size[i])) return job.size[i];
+
+        memmove(compressed + compressed_size, compressed + job.offset[i], job.size[i]); // Never overlaps a chunk we haven't moved yet
+        compressed_size += job.size[i];
+    }
+
+    return compressed_size;
+}
+
+// Decompresses the frames we didn't get to while the savestate was arriving, in parallel
+// Works just as well on a payload that's a single frame, it's just the one task then
+static size_t ulnet__save_state_decompress_chunks(ulnet_session_t *session, const savestate_transfer_payload_t *payload, uint8_t *save_state) {
+    ulnet__zstd_chunk_job_t job;
+    memset(&job, 0, sizeof(job));
+
+    size_t offset = (size_t) session->remote_savestate_stream_offset, end = (size_t) payload->compressed_savestate_size;
+    size_t save_state_offset = (size_t) session->remote_savestate_stream_size, save_state_size = (size_t) payload->decompressed_savestate_size;
+    while (offset < end) {
+        size_t frame_size, content_size;
+        if (   job.chunk_count == ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX
+            || !ulnet__zstd_frame_extent(payload->compressed_data + offset, end - offset, true, save_state_size - save_state_offset, &frame_size, &content_size)) {
+            return (size_t) -ZSTD_error_corruption_detected;
+        }
+
+        job.offset[job.chunk_count] = offset;
+        job.size[job.chunk_count] = frame_size;
+        job.save_state_offset[job.chunk_count] = save_state_offset;
+        job.save_state_size[job.chunk_count++] = content_size;
+        offset += frame_size;
+        save_state_offset += content_size;
+    }
+
+    if (save_state_offset != save_state_size) return (size_t) -ZSTD_error_corruption_detected;
+
+    job.task_count = SAM2_MIN(job.chunk_count, ULNET_ZSTD_CHUNK_CONTEXTS);
+    for (int t = 0; t < job.task_count; t++) {
+        if (!session->zstd_chunk_dctx[t]) {
+            session->zstd_chunk_dctx[t] = ZSTD_createDCtx();
+        }
+    }
+
+    job.dctx = session->zstd_chunk_dctx;
+    job.ddict = payload->dictionary_id ? session->zstd_ddict : NULL;
+    job.save_state = save_state;
+    job.compressed = (uint8_t *) payload->compressed_data;
+    ulnet__parallel_for(ulnet__zstd_decompress_chunks_task, &job, job.task_count);
+
+    for (int i = 0; i < job.chunk_count; i++) {
+        if (ZSTD_isError(job.size[i])) return job.size[i];
+    }
+
+    return save_state_size;
+}
+
+static inline void ulnet__reset_save_state_bookkeeping(ulnet_session_t *session) {
+    ulnet__transfer_buffer_release(session, session->remote_savestate_transfer);
+    session->remote_savestate_transfer = NULL;
+    session->remote_savestate_block_size = 0;
+    session->remote_savestate_k = 0;
+    session->remote_savestate_n = 0;
+    session->remote_packet_groups = 0;
+    session->remote_savestate_transfer_offset = 0;
+    session->remote_savestate_transfer_id = -1;
+    ulnet__transfer_buffer_release(session, session->remote_savestate_held);
+    session->remote_savestate_held = NULL;
+    session->remote_savestate_held_count = 0;
+    session->remote_savestate_last_fragment_usec = 0;
+    session->remote_savestate_repair_requests = 0;
+    ulnet__transfer_buffer_release(session, session->remote_savestate_stream);
+    session->remote_savestate_stream = NULL;
+    session->remote_savestate_stream_blocks = 0;
+    session->remote_savestate_stream_offset = 0;
+    session->remote_savestate_stream_size = 0;
+    session->remote_savestate_stream_chunks = 0;
+    memset(session->fec_index_counter, 0, sizeof(session->fec_index_counter));
+    memset(session->remote_savestate_received, 0, sizeof(session->remote_savestate_received));
+}
+
+// Tells the authority which savestate we have so it can send us a delta against it
+static void ulnet__baseline_advertise_slot(ulnet_session_t *session, int baseline, uint32_t flags) {
+    ulnet_baseline_message_t message = { ULNET_BASE_HEADER };
+    message.frame = baseline == -1 ? -1 : session->baseline_save_state_frame[baseline];
+    message.xxhash = baseline == -1 ? 0 : session->baseline_save_state_xxhash[baseline];
+    message.flags = flags;
+    message.packet_loss = session->packet_loss_measured_bitfield & (1ULL << SAM2_AUTHORITY_INDEX) ? session->packet_loss[SAM2_AUTHORITY_INDEX] : -1.0f;
+    message.dictionary_id = ulnet__zstd_dictionary_usable(session) ? session->zstd_dictionary_id : 0;
+
+    ulnet_message_send(session, SAM2_AUTHORITY_INDEX, (const uint8_t *) &message);
+    session->flags |= ULNET_SESSION_FLAG_BASELINE_ADVERTISED;
+
+    // Leftover redundant packets from the last transfer would otherwise be counted towards the next one
+    ulnet__reset_save_state_bookkeeping(session);
+}
+
+static void ulnet__baseline_advertise(ulnet_session_t *session, uint32_t flags) {
+    ulnet__baseline_advertise_slot(session, flags & ULNET_BASELINE_FLAG_RESYNC ? -1 : ulnet__baseline_most_recent(session), flags);
+}
+
+static int32_t ulnet__save_state_chunk_size(size_t save_state_size) {
+    int32_t chunk_size = ULNET_SAVE_STATE_CHUNK_SIZE;
+    while ((save_state_size + chunk_size - 1) / chunk_size > ULNET_SAVE_STATE_CHUNKS_MAX) chunk_size *= 2;
+    return chunk_size;
+}
+
+// Keeps the savestate we desynced on as a baseline and sends the authority its chunk hashes so it only has to send back the chunks we got wrong
+static void ulnet__save_state_request_patch(ulnet_session_t *session, const uint8_t *save_state, size_t save_state_size, int64_t save_state_frame) {
+    ulnet_save_state_tree_message_t message = { ULNET_TREE_HEADER };
+    message.frame = save_state_frame;
+    message.save_state_size = save_state_size;
+    message.xxhash = ulnet_xxh32(save_state, save_state_size, 0);
+    message.chunk_size = ulnet__save_state_chunk_size(save_state_size);
+
+    int32_t chunk_count = (int32_t) ((save_state_size + message.chunk_size - 1) / message.chunk_size);
+    for (message.chunk_offset = 0; message.chunk_offset < chunk_count; message.chunk_offset += message.chunk_xxhash_count) {
+        message.chunk_xxhash_count = SAM2_MIN(chunk_count - message.chunk_offset, ULNET_SAVE_STATE_CHUNK_HASHES_PER_MESSAGE);
+        for (int i = 0; i < message.chunk_xxhash_count; i++) {
+            size_t offset = (size_t) (message.chunk_offset + i) * message.chunk_size;
+            message.chunk_xxhash[i] = ulnet_save_state_hash(ulnet_room_save_state_hash_algorithm(&session->room_we_are_in),
+                save_state + offset, SAM2_MIN(save_state_size - offset, (size_t) message.chunk_size));
+        }
+
+        ulnet_message_send(session, SAM2_AUTHORITY_INDEX, (const uint8_t *) &message);
+    }
+
+    ulnet__baseline_store(session, save_state, save_state_size, save_state_frame, message.xxhash);
+    ulnet__baseline_advertise_slot(session, ulnet__baseline_find(session, save_state_frame, message.xxhash),
+        ULNET_BASELINE_FLAG_RESYNC | ULNET_BASELINE_FLAG_CHUNK_HASHES);
+    session->save_state_resync_count++;
+    session->save_state_resync_frame = save_state_frame;
+    session->flags |= ULNET_SESSION_FLAG_RESYNC_REQUESTED;
+}
+
+static void ulnet__save_state_tree_receive(ulnet_session_t *session, int port, const ulnet_save_state_tree_message_t *message) {
+    ulnet_save_state_tree_t *tree = &session->peer_save_state_tree[port];
+    int64_t chunk_count = message->chunk_size > 0 ? (message->save_state_size + message->chunk_size - 1) / message->chunk_size : 0;
+
+    if (   chunk_count <= 0
+        || chunk_count > ULNET_SAVE_STATE_CHUNKS_MAX
+        || message->chunk_offset < 0
+        || message->chunk_xxhash_count < 0
+        || message->chunk_xxhash_count > ULNET_SAVE_STATE_CHUNK_HASHES_PER_MESSAGE
+        || message->chunk_offset + message->chunk_xxhash_count > chunk_count) {
+        SAM2_LOG_WARN("Peer %05" PRIu16 " sent malformed savestate chunk hashes", session->agent_peer_ids[port]);
+        return;
+    }
+
+    if (session->save_state_encode_job.patch && session->save_state_encode_job.tree.chunk_xxhash == tree->chunk_xxhash) {
+        ulnet__pool_wait(&session->save_state_encode_job.pending); // A worker may still be reading these for a patch
+    }
+
+    if (   tree->frame != message->frame
+        || tree->xxhash != message->xxhash
+        || tree->save_state_size != message->save_state_size
+        || tree->chunk_size != message->chunk_size) {
+        if (tree->chunk_capacity < chunk_count) {
+            free(tree->chunk_xxhash);
+            tree->chunk_xxhash = (uint32_t *) malloc(chunk_count * sizeof(uint32_t));
+            tree->chunk_capacity = (int32_t) chunk_count;
+        }
+
+        tree->frame = message->frame;
+        tree->xxhash = message->xxhash;
+        tree->save_state_size = message->save_state_size;
+        tree->chunk_size = message->chunk_size;
+        tree->chunk_count = (int32_t) chunk_count;
+        tree->chunks_received = 0;
+    }
+
+    // The reliable channel never delivers a message twice so counting is enough
+    memcpy(&tree->chunk_xxhash[message->chunk_offset], message->chunk_xxhash, message->chunk_xxhash_count * sizeof(uint32_t));
+    tree->chunks_received += message->chunk_xxhash_count;
+}
+
+// Peers that need a savestate and have either told us what baseline they have or taken too long to do so
+static uint64_t ulnet__peers_ready_to_sync(ulnet_session_t *session) {
+    uint64_t ready = 0;
+    int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+    for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+        if (!(session->peer_needs_sync_bitfield & (1ULL << p))) continue;
+
+        if (   session->peer_baseline_advertised_bitfield & (1ULL << p)
+            || current_time_usec - session->peer_needs_sync_since_usec[p] >= ULNET_BASELINE_ADVERT_WAIT_USEC) {
+            ready |= 1ULL << p;
+        }
+    }
+    return ready;
+}
+
+// Index of the baseline we can send this peer a delta against, -1 if it needs a full savestate
+static int ulnet__peer_baseline(ulnet_session_t *session, int port) {
+    if (!(session->peer_baseline_advertised_bitfield & (1ULL << port))) return -1;
+    return ulnet__baseline_find(session, session->peer_baseline_frame[port], session->peer_baseline_xxhash[port]);
+}
+
+// Chunk hashes of the baseline this peer advertised when we don't have it ourselves, NULL if we haven't been sent all of them
+static ulnet_save_state_tree_t *ulnet__peer_save_state_tree(ulnet_session_t *session, int port) {
+    ulnet_save_state_tree_t *tree = &session->peer_save_state_tree[port];
+    if (   !(session->peer_baseline_advertised_bitfield & (1ULL << port))
+        || tree->chunk_count == 0
+        || tree->chunks_received < tree->chunk_count
+        || tree->frame != session->peer_baseline_frame[port]
+        || tree->xxhash != session->peer_baseline_xxhash[port]
+        || ulnet__peer_baseline(session, port) != -1) {
+        return NULL;
+    }
+
+    return tree;
+}
+
+// How many frames old a cached encoding can be while the peer loading it can still replay the input it missed
+static int64_t ulnet__save_state_reuse_frames(ulnet_session_t *session) {
+    return SAM2_MAX(ulnet_delay_buffer_size(session) - session->delay_frames - 1, (int64_t) 0);
+}
+
+// Worse of what we and the peer measured, rounded up to a few levels so peers on similar links share an encoding
+static float ulnet__save_state_packet_loss(ulnet_session_t *session, int port) {
+    static const float levels[] = { 0.002f, 0.005f, 0.01f, 0.02f, 0.05f, 0.1f, 0.15f, 0.2f };
+    float loss = -1.0f;
+
+    if (session->packet_loss_measured_bitfield & (1ULL << port)) {
+        loss = session->packet_loss[port];
+    }
+
+    if (session->peer_packet_loss_reported_bitfield & (1ULL << port)) {
+        loss = SAM2_MAX(loss, session->peer_packet_loss[port]);
+    }
+
+    if (loss < 0.0f) {
+        loss = ULNET_PACKET_LOSS_UNKNOWN;
+    }
+
+    for (int i = 0; i < (int) SAM2_ARRAY_LENGTH(levels); i++) {
+        if (loss <= levels[i]) return levels[i];
+    }
+
+    return levels[SAM2_ARRAY_LENGTH(levels) - 1];
+}
+
+// Newest cached encoding this peer could load that is no older than frame_min, -1 if there isn't one
+static int ulnet__save_state_encoding_find(ulnet_session_t *session, int port, int64_t frame_min) {
+    float packet_loss = ulnet__save_state_packet_loss(session, port);
+    int baseline = ulnet__peer_baseline(session, port);
+    ulnet_save_state_tree_t *tree = ulnet__peer_save_state_tree(session, port);
+    int64_t baseline_frame = baseline != -1 ? session->baseline_save_state_frame[baseline] : tree ? tree->frame : -1;
+    uint32_t baseline_xxhash = baseline != -1 ? session->baseline_save_state_xxhash[baseline] : tree ? tree->xxhash : 0;
+    uint32_t core_options_xxhash = ulnet_xxh32(session->core_options, sizeof(session->core_options), 0);
+
+    int found = -1;
+    for (int i = 0; i < ULNET_SAVE_STATE_ENCODINGS_MAX; i++) {
+        ulnet_save_state_encoding_t *encoding = &session->save_state_encoding[i];
+        if (   encoding->payload == NULL
+            || encoding->frame < frame_min
+            || encoding->baseline_frame != baseline_frame
+            || encoding->baseline_xxhash != baseline_xxhash
+            || encoding->core_options_xxhash != core_options_xxhash
+            || encoding->packet_loss != packet_loss
+            || (encoding->dictionary_id != 0 && !encoding->dictionary_embedded && encoding->dictionary_id != session->peer_dictionary_id[port])
+            || memcmp(&encoding->room, &session->room_we_are_in, sizeof(encoding->room)) != 0) {
+            continue;
+        }
+
+        if (found == -1 || encoding->frame > session->save_state_encoding[found].frame) {
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+// Waits out the worker and drops what it encoded, used when the encodings it writes into are going away
+static void ulnet__save_state_encode_discard(ulnet_session_t *session, bool free_buffer) {
+    ulnet_save_state_encode_job_t *job = &session->save_state_encode_job;
+    ulnet__pool_wait(&job->pending);
+    if (job->in_use) {
+        job->in_use = false;
+        ulnet__transfer_buffer_release(session, job->patch);
+        job->patch = NULL;
+        job->baseline = NULL;
+        job->peers = 0;
+    }
+
+    if (free_buffer) {
+        free(job->buffer);
+        job->buffer = NULL;
+        job->capacity = 0;
+    }
+}
+
+static void ulnet__save_state_encodings_free(ulnet_session_t *session) {
+    ulnet__save_state_encode_discard(session, true);
+    for (int i = 0; i < ULNET_SAVE_STATE_ENCODINGS_MAX; i++) {
+        free(session->save_state_encoding[i].buffer);
+        session->save_state_encoding[i].buffer = NULL;
+        session->save_state_encoding[i].payload = NULL;
+        session->save_state_encoding[i].capacity = 0;
+    }
+}
+
+static void ulnet__save_state_snapshot_hash(void *context, int index) {
+    ulnet_save_state_snapshot_t *snapshot = (ulnet_save_state_snapshot_t *) context;
+    const uint8_t *save_state = snapshot->source;
+    (void) index;
+    if (snapshot->baseline_candidate && snapshot->source != snapshot->buffer) {
+        memcpy(snapshot->buffer, snapshot->source, snapshot->size); // Candidates outlive what we borrowed
+        save_state = snapshot->buffer;
+    }
+
+    snapshot->hash = ulnet_save_state_hash(snapshot->algorithm, save_state, snapshot->size);
+    if (snapshot->baseline_candidate) {
+        // Baselines are identified by xxh32 in savestate payloads whatever the room hashes with
+        snapshot->xxhash = snapshot->algorithm == ULNET_SAVE_STATE_HASH_XXH32 ? snapshot->hash : ulnet_xxh32(save_state, snapshot->size, 0);
+    }
+}
+
+// Stores the hash a worker finished into save_state_hash as long as that frame is still in our delay buffer
+static void ulnet__save_state_snapshot_collect(ulnet_session_t *session, ulnet_save_state_snapshot_t *snapshot) {
+    if (!snapshot->in_use || !ulnet__pool_finished(&snapshot->pending)) return;
+    snapshot->in_use = false;
+
+    int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+    if (   our_port == snapshot->port
+        && snapshot->frame <= session->frame_counter
+        && session->frame_counter - snapshot->frame < ulnet_delay_buffer_size(session)
+        && session->state[our_port].save_state_frame >= snapshot->frame) {
+        session->state[our_port].save_state_hash[snapshot->frame % ulnet_delay_buffer_size(session)] = snapshot->hash;
+
+        if (snapshot->baseline_candidate && snapshot->hash != 0) {
+            // The snapshot gets the old candidate's buffer to serialize into next time
+            uint8_t *buffer = session->baseline_candidate;
+            size_t capacity = session->baseline_candidate_capacity;
+            session->baseline_candidate = snapshot->buffer;
+            session->baseline_candidate_capacity = snapshot->capacity;
+            session->baseline_candidate_size = snapshot->size;
+            session->baseline_candidate_frame = snapshot->frame;
+            session->baseline_candidate_hash = snapshot->hash;
+            session->baseline_candidate_xxhash = snapshot->xxhash;
+            snapshot->buffer = buffer;
+            snapshot->capacity = capacity;
+        }
+    }
+}
+
+// Returns the next snapshot ready to serialize into, waiting on the worker if it still hasn't hashed what we gave it last time
+static ulnet_save_state_snapshot_t *ulnet__save_state_snapshot_acquire(ulnet_session_t *session, size_t save_state_size) {
+    ulnet_save_state_snapshot_t *snapshot = &session->save_state_snapshot[session->save_state_snapshot_next];
+    session->save_state_snapshot_next = (session->save_state_snapshot_next + 1) % ULNET_SAVE_STATE_SNAPSHOTS;
+
+    if (!ulnet__pool_finished(&snapshot->pending)) {
+        session->save_state_snapshot_stalls++;
+        ulnet__pool_wait(&snapshot->pending);
+    }
+    ulnet__save_state_snapshot_collect(session, snapshot);
+
+    if (snapshot->capacity < save_state_size) {
+        free(snapshot->buffer);
+        snapshot->buffer = (uint8_t *) malloc(save_state_size);
+        snapshot->capacity = save_state_size;
+    }
+    snapshot->size = save_state_size;
+    return snapshot;
+}
+
+// Waits out the workers and drops their hashes, used when what we serialized no longer matters like after loading a savestate
+static void ulnet__save_state_snapshots_discard(ulnet_session_t *session, bool free_buffers) {
+    for (int i = 0; i < ULNET_SAVE_STATE_SNAPSHOTS; i++) {
+        ulnet_save_state_snapshot_t *snapshot = &session->save_state_snapshot[i];
+        ulnet__pool_wait(&snapshot->pending);
+        snapshot->in_use = false;
+        if (free_buffers) {
+            free(snapshot->buffer);
+            snapshot->buffer = NULL;
+            snapshot->capacity = 0;
+        }
+    }
+
+    session->baseline_candidate_size = 0;
+    if (free_buffers) {
+        free(session->baseline_candidate);
+        session->baseline_candidate = NULL;
+        session->baseline_candidate_capacity = 0;
+    }
+}
+
+// Sizes the least recently used encoding slot for a savestate and captures everything ulnet__save_state_encode_task needs from the session
+// Without a baseline of our own the savestate can still be sent as a patch of the chunks that differ from the peer's tree
+// Full savestates are compressed with the dictionary for the room's game if we have one, it's sent along unless the peer has it already
+static void ulnet__save_state_encode_prepare(ulnet_session_t *session, ulnet_save_state_encode_job_t *job, int baseline, const ulnet_save_state_tree_t *tree,
+                                             bool embed_dictionary, float packet_loss, const uint8_t *save_state, size_t save_state_size, int64_t save_state_frame) {
+    int packet_payload_size_bytes = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
+    int n, k, packet_groups;
+
+    if (baseline != -1 || (tree && tree->save_state_size != (int64_t) save_state_size)) {
+        tree = NULL;
+    }
+
+    bool use_dictionary = baseline == -1 && !tree && ulnet__zstd_dictionary_usable(session);
+    size_t dictionary_size = use_dictionary && embed_dictionary ? session->zstd_dictionary_size : 0;
+    size_t patch_bitmap_size = tree ? (tree->chunk_count + 7) / 8 : 0;
+    int32_t compress_chunk_size = baseline == -1 && !tree ? ulnet__save_state_compress_chunk_size(session, save_state_size) : 0;
+    size_t compress_chunk_count = compress_chunk_size ? (save_state_size + compress_chunk_size - 1) / compress_chunk_size : 0;
+    int64_t save_state_compressed_bound_size_bytes = compress_chunk_size
+        ? compress_chunk_count * ZSTD_COMPRESSBOUND(compress_chunk_size)
+        : ZSTD_COMPRESSBOUND(patch_bitmap_size + save_state_size);
+    int64_t save_state_transfer_payload_compressed_bound_size_bytes = save_state_compressed_bound_size_bytes + ZSTD_COMPRESSBOUND(sizeof(session->core_options)) + dictionary_size;
+    ulnet__save_state_partition(sizeof(savestate_transfer_payload_t) /* Header */ + save_state_transfer_payload_compressed_bound_size_bytes,
+                      packet_loss, &n, &k, &packet_payload_size_bytes, &packet_groups);
+
+    // Block sizes are rounded up per group so a smaller payload can take up to a byte more per block
+    // The real payload can also get more parity than its bound did when less of it had to be given up to fit, never past GF_SIZE blocks per group
+    size_t savestate_transfer_payload_plus_parity_bound_bytes = (size_t) packet_groups * (packet_groups > 1 ? GF_SIZE : n) * packet_payload_size_bytes + (size_t) packet_groups * GF_SIZE;
+
+    // Skip encodings that still have fragments queued for a peer unless they all do
+    int slot = session->save_state_encoding_next;
+    for (int tries = 0; tries < ULNET_SAVE_STATE_ENCODINGS_MAX; tries++) {
+        bool queued = false;
+        for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+            queued |= (session->bulk_pending_bitfield & (1ULL << p)) && session->peer_save_state_encoding[p] == slot;
+        }
+
+        if (!queued) break;
+        slot = (slot + 1) % ULNET_SAVE_STATE_ENCODINGS_MAX;
+    }
+    session->save_state_encoding_next = (slot + 1) % ULNET_SAVE_STATE_ENCODINGS_MAX;
+    ulnet_save_state_encoding_t *encoding = &session->save_state_encoding[slot];
+
+    // The worker writes over whatever those peers still had queued so they start over with a new savestate
+    for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+        if ((session->bulk_pending_bitfield & (1ULL << p)) && session->peer_save_state_encoding[p] == slot) {
+            SAM2_LOG_WARN("Every savestate encoding is still being sent, peer %05" PRIu16 " has to start over", session->agent_peer_ids[p]);
+            session->bulk_pending_bitfield &= ~(1ULL << p);
+            session->peer_save_state_sent_bitfield &= ~(1ULL << p);
+            session->peer_needs_sync_bitfield |= 1ULL << p;
+        }
+    }
+
+    // This points to the savestate transfer payload, but also the remaining bytes at the end hold our parity blocks
+    // Having this data in a single contiguous buffer makes indexing easier
+    if (encoding->capacity < ULNET_SAVE_STATE_PACKET_HEADROOM + savestate_transfer_payload_plus_parity_bound_bytes) {
+        free(encoding->buffer);
+        encoding->capacity = ULNET_SAVE_STATE_PACKET_HEADROOM + savestate_transfer_payload_plus_parity_bound_bytes;
+        encoding->buffer = (uint8_t *) malloc(encoding->capacity);
+    }
+    encoding->payload = NULL; // Hidden from ulnet__save_state_encoding_find until it's finished
+    savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) (encoding->buffer + ULNET_SAVE_STATE_PACKET_HEADROOM);
+
+    savestate_transfer_payload->decompressed_savestate_size = save_state_size;
+    savestate_transfer_payload->baseline_frame = baseline != -1 ? session->baseline_save_state_frame[baseline] : tree ? tree->frame : -1;
+    savestate_transfer_payload->baseline_xxhash = baseline != -1 ? session->baseline_save_state_xxhash[baseline] : tree ? tree->xxhash : 0;
+    savestate_transfer_payload->patch_size = 0;
+    savestate_transfer_payload->patch_chunk_size = 0;
+    savestate_transfer_payload->dictionary_id = use_dictionary ? session->zstd_dictionary_id : 0;
+    savestate_transfer_payload->dictionary_size = (int32_t) dictionary_size;
+
+    if (!session->zstd_cctx) {
+        session->zstd_cctx = ZSTD_createCCtx();
+    }
+    for (size_t t = 0; t < SAM2_MIN(compress_chunk_count, (size_t) ULNET_ZSTD_CHUNK_CONTEXTS); t++) {
+        if (!session->zstd_chunk_cctx[t]) {
+            session->zstd_chunk_cctx[t] = ZSTD_createCCtx();
+        }
+    }
+
+    job->save_state = save_state;
+    job->save_state_size = save_state_size;
+    job->save_state_frame = save_state_frame;
+    job->slot = slot;
+    job->payload = savestate_transfer_payload;
+    job->payload_plus_parity_bound_size = savestate_transfer_payload_plus_parity_bound_bytes;
+    job->compressed_bound_size = save_state_transfer_payload_compressed_bound_size_bytes;
+    job->baseline = baseline != -1 ? session->baseline_save_state[baseline] : NULL;
+    job->baseline_size = baseline != -1 ? session->baseline_save_state_size[baseline] : 0;
+    if (tree) {
+        job->tree = *tree;
+        job->patch = ulnet__transfer_buffer_acquire(session, patch_bitmap_size + save_state_size);
+    } else {
+        memset(&job->tree, 0, sizeof(job->tree));
+        job->patch = NULL;
+    }
+    job->hash_algorithm = ulnet_room_save_state_hash_algorithm(&session->room_we_are_in);
+    job->cctx = session->zstd_cctx;
+    job->chunk_cctx = session->zstd_chunk_cctx;
+    job->cdict = use_dictionary ? ulnet__zstd_cdict(session) : NULL;
+    job->dictionary = dictionary_size ? session->zstd_dictionary : NULL;
+    job->dictionary_size = dictionary_size;
+    job->compress_level = session->zstd_compress_level;
+    job->compress_chunk_size = compress_chunk_size;
+    job->packet_loss = packet_loss;
+    job->room = session->room_we_are_in;
+    memcpy(job->core_options, session->core_options, sizeof(job->core_options));
+    job->failed = false;
+}
+
+// Compresses the savestate and generates its parity. Runs on a worker so it only touches the job and what the job points to
+static void ulnet__save_state_encode_task(void *context, int index) {
+    ulnet_save_state_encode_job_t *job = (ulnet_save_state_encode_job_t *) context;
+    savestate_transfer_payload_t *savestate_transfer_payload = job->payload;
+    const uint8_t *save_state = job->save_state;
+    size_t save_state_size = job->save_state_size;
+    size_t dictionary_size = job->dictionary_size;
+    int packet_payload_size_bytes, n, k, packet_groups;
+    (void) index;
+
+    job->save_state_xxhash = ulnet_xxh32(save_state, save_state_size, 0);
+    savestate_transfer_payload->save_state_xxhash = job->save_state_xxhash;
+    uint64_t compress_start = ulnet__rdtsc();
+    if (job->patch) {
+        // A bitfield of the chunks that differ followed by just those chunks, the peer copies the rest from its baseline
+        const ulnet_save_state_tree_t *tree = &job->tree;
+        uint8_t *patch = job->patch;
+        size_t patch_bitmap_size = (tree->chunk_count + 7) / 8;
+        size_t patch_size = patch_bitmap_size;
+        memset(patch, 0, patch_bitmap_size);
+        job->patch_chunks_sent = 0;
+        for (int32_t i = 0; i < tree->chunk_count; i++) {
+            size_t offset = (size_t) i * tree->chunk_size;
+            size_t chunk_size = SAM2_MIN(save_state_size - offset, (size_t) tree->chunk_size);
+            if (ulnet_save_state_hash(job->hash_algorithm, save_state + offset, chunk_size) == tree->chunk_xxhash[i]) continue;
+
+            patch[i / 8] |= 1 << (i % 8);
+            memcpy(patch + patch_size, save_state + offset, chunk_size);
+            patch_size += chunk_size;
+            job->patch_chunks_sent++;
+        }
+
+        savestate_transfer_payload->patch_size = (int32_t) patch_size;
+        savestate_transfer_payload->patch_chunk_size = tree->chunk_size;
+        savestate_transfer_payload->compressed_savestate_size = ZSTD_compress2(
+            ulnet__zstd_cctx_reset(job->cctx, job->compress_level),
+            savestate_transfer_payload->compressed_data,
+            job->compressed_bound_size,
+            patch, patch_size
+        );
+    } else if (job->compress_chunk_size) {
+        savestate_transfer_payload->compressed_savestate_size = ulnet__save_state_compress_chunks(
+            job->chunk_cctx, job->cdict, job->compress_level,
+            save_state, save_state_size, job->compress_chunk_size,
+            savestate_transfer_payload->compressed_data
+        );
+    } else if (!job->baseline) {
+        ZSTD_CCtx *cctx = ulnet__zstd_cctx_reset(job->cctx, job->compress_level);
+        if (job->cdict) {
+            ZSTD_CCtx_refCDict(cctx, job->cdict);
+        }
+        savestate_transfer_payload->compressed_savestate_size = ZSTD_compress2(
+            cctx,
+            savestate_transfer_payload->compressed_data,
+            job->compressed_bound_size,
+            save_state, save_state_size
+        );
+    } else {
+        // The window has to reach back over the whole baseline for unchanged memory to turn into matches
+        int window_log = 10;
+        while (window_log < 27 /* Largest window a default decoder accepts */ && (1ULL << window_log) < job->baseline_size + save_state_size) window_log++;
+
+        ZSTD_CCtx *cctx = ulnet__zstd_cctx_reset(job->cctx, job->compress_level);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log);
+        ZSTD_CCtx_refPrefix(cctx, job->baseline, job->baseline_size);
+        savestate_transfer_payload->compressed_savestate_size = ZSTD_compress2(
+            cctx,
+            savestate_transfer_payload->compressed_data,
+            job->compressed_bound_size,
+            save_state, save_state_size
+        );
+    }
+
+    if (ZSTD_isError(savestate_transfer_payload->compressed_savestate_size)) {
+        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_savestate_size));
+        assert(0);
+    }
+
+    savestate_transfer_payload->compressed_options_size = ZSTD_compress2(
+        ulnet__zstd_cctx_reset(job->cctx, job->compress_level),
+        savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
+        job->compressed_bound_size - savestate_transfer_payload->compressed_savestate_size,
+        job->core_options, sizeof(job->core_options)
+    );
+
+    if (ZSTD_isError(savestate_transfer_payload->compressed_options_size)) {
+        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_options_size));
+        assert(0);
+    }
+    job->compress_cycles = ulnet__rdtsc() - compress_start;
+
+    if (dictionary_size > 0) {
+        memcpy(savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size,
+            job->dictionary, dictionary_size);
+    }
+
+    packet_payload_size_bytes = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
+    ulnet__save_state_partition(
+        sizeof(savestate_transfer_payload_t) /* Header */ + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size + dictionary_size,
+        job->packet_loss, &n, &k, &packet_payload_size_bytes, &packet_groups
+    );
+
+    if (packet_groups > FEC_PACKET_GROUPS_MAX) {
+        job->failed = true;
+        return;
+    }
+    assert(job->payload_plus_parity_bound_size >= packet_groups * n * packet_payload_size_bytes); // If this fails my logic calculating the bounds was just wrong
+
+    savestate_transfer_payload->frame_counter = job->save_state_frame;
+    savestate_transfer_payload->room = job->room;
+    savestate_transfer_payload->total_size_bytes = sizeof(savestate_transfer_payload_t) + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size + dictionary_size;
+
+    savestate_transfer_payload->xxhash = 0;
+    savestate_transfer_payload->xxhash = ulnet_xxh32(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
+
+    // Create parity blocks for Reed-Solomon. n - k in total for each packet group
+    // We have "packet grouping" because pretty much every implementation of Reed-Solomon doesn't support more than 255 blocks
+    // and unfragmented UDP packets over ethernet are limited to ULNET_PACKET_SIZE_BYTES_MAX
+    // This makes the code more complicated and the error correcting properties slightly worse but it's a practical tradeoff
+    ulnet__fec_job_t fec_job = { fec_get(k, n), (uint8_t *) savestate_transfer_payload, NULL, NULL, k, n, packet_payload_size_bytes, packet_groups };
+    ulnet__parallel_for(ulnet__fec_encode_group, &fec_job, packet_groups);
+    fec_free(fec_job.rs_code);
+
+    job->n = n;
+    job->k = k;
+    job->packet_groups = packet_groups;
+    job->packet_payload_size_bytes = packet_payload_size_bytes;
+}
+
+// Publishes the encoding the task finished and keeps the savestate as a baseline, returns its slot or -1 if it was too big to send
+static int ulnet__save_state_encode_finish(ulnet_session_t *session, ulnet_save_state_encode_job_t *job) {
+    savestate_transfer_payload_t *savestate_transfer_payload = job->payload;
+    bool full = !job->baseline && !job->patch;
+    job->baseline = NULL;
+
+    if (job->patch) {
+        ulnet__transfer_buffer_release(session, job->patch);
+        job->patch = NULL;
+        session->save_state_patch_chunks_sent = job->patch_chunks_sent;
+        SAM2_LOG_INFO("Sending %" PRId64 " of %" PRId32 " chunks as a patch of the peer's savestate for frame %" PRId64,
+            job->patch_chunks_sent, job->tree.chunk_count, job->tree.frame);
+    }
+
+    if (job->failed) {
+        SAM2_LOG_ERROR("Savestate for frame %" PRId64 " compressed to %" PRId64 " bytes which is more than a transfer can carry",
+            job->save_state_frame, (int64_t) savestate_transfer_payload->compressed_savestate_size);
+        return -1;
+    }
+
+    ulnet_save_state_encoding_t *encoding = &session->save_state_encoding[job->slot];
+    encoding->payload = savestate_transfer_payload;
+    encoding->frame = job->save_state_frame;
+    encoding->baseline_frame = savestate_transfer_payload->baseline_frame;
+    encoding->baseline_xxhash = savestate_transfer_payload->baseline_xxhash;
+    encoding->core_options_xxhash = ulnet_xxh32(job->core_options, sizeof(job->core_options), 0);
+    encoding->room = job->room;
+    encoding->packet_loss = job->packet_loss;
+    encoding->dictionary_id = savestate_transfer_payload->dictionary_id;
+    encoding->dictionary_embedded = job->dictionary_size > 0;
+    encoding->compress_cycles = job->compress_cycles;
+    encoding->n = job->n;
+    encoding->k = job->k;
+    encoding->packet_groups = job->packet_groups;
+    encoding->packet_payload_size_bytes = job->packet_payload_size_bytes;
+    session->save_state_encode_count++;
+
+    // A savestate we serialized for this is handed to the baseline ring as is
+    if (job->save_state == job->buffer) {
+        for (int i = 0; i < ULNET_SAVE_STATE_SNAPSHOTS; i++) {
+            if (session->save_state_snapshot[i].source == job->buffer) ulnet__pool_wait(&session->save_state_snapshot[i].pending);
+        }
+        ulnet__baseline_store_swap(session, &job->buffer, &job->capacity, job->save_state_size, job->save_state_frame, job->save_state_xxhash);
+    } else {
+        ulnet__baseline_store(session, job->save_state, job->save_state_size, job->save_state_frame, job->save_state_xxhash);
+    }
+    job->save_state = NULL;
+
+    int stored = ulnet__baseline_find(session, encoding->frame, job->save_state_xxhash);
+    if (   full
+        && stored != -1
+        && !session->zstd_dictionary_training.in_use
+        && !ulnet__zstd_dictionary_usable(session)
+        && !(session->zstd_dictionary_training.attempted && session->zstd_dictionary_training.rom_hash == session->room_we_are_in.rom_hash_xxh64)) {
+        ulnet__zstd_dictionary_train(session, session->baseline_save_state[stored], job->save_state_size, job->save_state_xxhash);
+    }
+
+    return job->slot;
+}
+
+// The header is written over the tail of the previous block (or the headroom) and put back afterwards so the block itself is never copied
+static void ulnet__save_state_send_block(ulnet_session_t *session, int port, ulnet_save_state_encoding_t *encoding, int group, int index) {
+    int n = encoding->n, k = encoding->k, packet_groups = encoding->packet_groups;
+    int packet_payload_size_bytes = encoding->packet_payload_size_bytes;
+
+    ulnet_save_state_packet_header_t header;
+    header.channel_and_flags = ULNET_CHANNEL_SAVESTATE_TRANSFER | (ULNET_SAVESTATE_TRANSFER_VERSION << ULNET_SAVESTATE_TRANSFER_VERSION_SHIFT);
+    if (n == GF_SIZE) {
+        header.channel_and_flags |= ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_MAX;
+        if (group == 0) {
+            header.channel_and_flags |= ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0;
+            header.packet_groups = packet_groups;
+        } else {
+            header.sequence_hi = group;
+        }
+    } else {
+        header.reed_solomon_k = k;
+    }
+
+    header.sequence_lo = index;
+    header.payload_version = ULNET_SAVE_STATE_PAYLOAD_VERSION;
+    header.redundant_blocks = n - k;
+    header.transfer_id = session->peer_save_state_transfer_id[port];
+    memset(header.reserved, 0, sizeof(header.reserved));
+    header.send_time_usec_le = (uint32_t) ulnet__get_unix_time_microseconds();
+
+    uint8_t *fragment = (uint8_t *) encoding->payload + ulnet__logical_partition_offset_bytes(group, index, packet_payload_size_bytes, packet_groups) - sizeof(header);
+    uint8_t overwritten[sizeof(header)];
+    memcpy(overwritten, fragment, sizeof(header));
+    memcpy(fragment, &header, sizeof(header));
+
+    int status = ulnet__transport_send(session, port, fragment, sizeof(header) + packet_payload_size_bytes);
+    assert(status == 0);
+
+    memcpy(fragment, overwritten, sizeof(header));
+}
+
+static double ulnet__bulk_burst_bytes(double rate) {
+    return SAM2_MAX(rate * ULNET_BULK_BURST_USEC / 1e6, (double) ULNET_PACKET_SIZE_BYTES_MAX);
+}
+// Round trip the congestion window is spread over, never below how often feedback arrives since we can't react faster than that
+static double ulnet__bulk_rtt_usec(ulnet_session_t *session, int port) {
+    return (double) SAM2_MAX(session->rtt_smoothed_usec[port], (int64_t) ULNET_LEDBAT_FEEDBACK_USEC) + session->bulk_queuing_delay_usec[port];
+}
+
+// Bytes per second the pacer lets through to a peer, 0 for unpaced
+static double ulnet__bulk_rate(ulnet_session_t *session, int port) {
+    if (session->bulk_send_bytes_per_second <= 0) return 0.0;
+
+    if (!(session->flags & ULNET_SESSION_FLAG_DELAY_BASED_PACING) || session->bulk_cwnd_bytes[port] <= 0.0) {
+        return (double) session->bulk_send_bytes_per_second;
+    }
+
+    // The configured rate is as fast as the window is allowed to take us
+    double rate = session->bulk_cwnd_bytes[port] * 1e6 / ulnet__bulk_rtt_usec(session, port);
+    return SAM2_MAX(SAM2_MIN(rate, (double) session->bulk_send_bytes_per_second), (double) ULNET_BULK_RATE_MIN_BYTES_PER_SECOND);
+}
+
+// LEDBAT (RFC 6817) on an emulated window, the window grows or shrinks by up to a packet per RTT (less on slow links) in proportion to how far the
+// queuing delay is from target. Dividing it by an RTT that includes the queuing delay backs off immediately as a queue builds
+// It starts out in slow start which grows it faster until the queuing delay reaches half the target
+static void ulnet__bulk_delay_feedback(ulnet_session_t *session, int port, int32_t queuing_delay_usec, int64_t current_time_usec) {
+    if (   !(session->flags & ULNET_SESSION_FLAG_DELAY_BASED_PACING)
+        || session->bulk_send_bytes_per_second <= 0
+        || session->bulk_cwnd_bytes[port] <= 0.0) return;
+
+    double rate = ulnet__bulk_rate(session, port);
+    session->bulk_queuing_delay_usec[port] = SAM2_MAX(queuing_delay_usec, 0);
+
+    int64_t elapsed_usec = SAM2_MIN(current_time_usec - session->bulk_feedback_usec[port], (int64_t) 4 * ULNET_LEDBAT_FEEDBACK_USEC);
+    session->bulk_feedback_usec[port] = current_time_usec;
+
+    bool pacer_limited = session->bulk_pending_bitfield & (1ULL << port);
+    double bytes_acked = rate * elapsed_usec / 1e6;
+    double cwnd_min = ULNET_BULK_RATE_MIN_BYTES_PER_SECOND * ulnet__bulk_rtt_usec(session, port) / 1e6;
+    double cwnd_max = session->bulk_send_bytes_per_second * ulnet__bulk_rtt_usec(session, port) / 1e6;
+    double cwnd;
+    if (session->bulk_slow_start_bitfield & (1ULL << port)) {
+        if (session->bulk_queuing_delay_usec[port] < ULNET_LEDBAT_TARGET_USEC / 2) {
+            cwnd = session->bulk_cwnd_bytes[port] + (pacer_limited ? ULNET_LEDBAT_SLOW_START_GAIN * bytes_acked : 0.0);
+        } else {
+            session->bulk_slow_start_bitfield &= ~(1ULL << port);
+            cwnd = session->bulk_cwnd_bytes[port] * ULNET_LEDBAT_SLOW_START_EXIT;
+        }
+    } else {
+        double off_target = (double) (ULNET_LEDBAT_TARGET_USEC - session->bulk_queuing_delay_usec[port]) / ULNET_LEDBAT_TARGET_USEC;
+        if (off_target > 0.0 && !pacer_limited) {
+            return; // The pacer isn't what's holding us back so there's no evidence the link can take more
+        }
+
+        double gain = off_target > 0.0 ? ULNET_LEDBAT_GAIN : 1.0; // Backing off quickly matters more
+        double per_byte = SAM2_MIN(ULNET_PACKET_SIZE_BYTES_MAX / session->bulk_cwnd_bytes[port], ULNET_LEDBAT_GROWTH_MAX);
+        cwnd = session->bulk_cwnd_bytes[port] + gain * off_target * bytes_acked * per_byte;
+    }
+
+    // The window never paces us below the minimum rate or past the configured one
+    session->bulk_cwnd_bytes[port] = SAM2_MAX(SAM2_MIN(cwnd, cwnd_max), cwnd_min);
+}
+
+// Sends whatever queued fragments each peer's token bucket allows, returns when the pacer can next send or INT64_MAX if nothing is queued
+// current_time_usec is on the ulnet__get_monotonic_time_microseconds clock like the frame pacer
+static int64_t ulnet__bulk_send(ulnet_session_t *session, int64_t current_time_usec) {
+    int64_t next_send_usec = INT64_MAX;
+
+    for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+        if (!(session->bulk_pending_bitfield & (1ULL << p))) continue;
+
+        ulnet_save_state_encoding_t *encoding = &session->save_state_encoding[session->peer_save_state_encoding[p]];
+        if (   !(session->peer_save_state_sent_bitfield & (1ULL << p))
+            || encoding->payload == NULL
+            || encoding->frame != session->peer_save_state_frame[p]) {
+            SAM2_LOG_WARN("Savestate encoding for peer %05" PRIu16 " went away before we finished sending it", session->agent_peer_ids[p]);
+            session->bulk_pending_bitfield &= ~(1ULL << p);
+            continue;
+        }
+
+        int packet_size = (int) sizeof(ulnet_save_state_packet_header_t) + encoding->packet_payload_size_bytes;
+        double rate = ulnet__bulk_rate(session, p);
+        if (rate > 0) {
+            double refill = (double) (current_time_usec - session->bulk_tokens_usec[p]) * rate / 1e6;
+            session->bulk_tokens_bytes[p] = SAM2_MIN(session->bulk_tokens_bytes[p] + refill, ulnet__bulk_burst_bytes(rate));
+            session->bulk_tokens_usec[p] = current_time_usec;
+
+            // Our input can't overtake the fragments queued ahead of it on the link so we go quiet for long enough that they drain first
+            int64_t input_in_usec = session->frame_pacer.tick_at_usec - current_time_usec;
+            int64_t quiet_usec = SAM2_MIN((int64_t) (packet_size * 1e6 / rate) + session->bulk_queuing_delay_usec[p], (int64_t) ULNET_BULK_INPUT_QUIET_USEC_MAX);
+            if (input_in_usec > -quiet_usec && input_in_usec < quiet_usec) {
+                next_send_usec = SAM2_MIN(next_send_usec, session->frame_pacer.tick_at_usec + quiet_usec);
+                continue;
+            }
+        }
+
+        int positions = encoding->n * encoding->packet_groups;
+        while (session->bulk_cursor[p] < positions && (rate <= 0 || session->bulk_tokens_bytes[p] >= packet_size)) {
+            int group = session->bulk_cursor[p] % encoding->packet_groups;
+            int index = session->bulk_cursor[p] / encoding->packet_groups;
+            session->bulk_cursor[p]++;
+
+            uint64_t *pending = &session->bulk_pending[p][group][index / 64];
+            if (!(*pending & (1ULL << (index % 64)))) continue;
+
+            *pending &= ~(1ULL << (index % 64));
+            ulnet__save_state_send_block(session, p, encoding, group, index);
+            session->bulk_tokens_bytes[p] -= packet_size;
+        }
+
+        if (session->bulk_cursor[p] >= positions) {
+            session->bulk_pending_bitfield &= ~(1ULL << p);
+        } else {
+            next_send_usec = SAM2_MIN(next_send_usec, current_time_usec + (int64_t) ((packet_size - session->bulk_tokens_bytes[p]) * 1e6 / rate) + 1);
+        }
+    }
+
+    return next_send_usec;
+}
+
+// Queues blocks of the encoding we last sent this peer, a peer without anything queued starts with a full bucket
+static void ulnet__bulk_queue(ulnet_session_t *session, int port, int group, int index) {
+    if (!(session->bulk_pending_bitfield & (1ULL << port))) {
+        session->bulk_pending_bitfield |= 1ULL << port;
+        int64_t current_time_usec = ulnet__get_monotonic_time_microseconds();
+        if ((session->flags & ULNET_SESSION_FLAG_DELAY_BASED_PACING) && session->bulk_cwnd_bytes[port] <= 0.0) {
+            session->bulk_cwnd_bytes[port] = ULNET_LEDBAT_INITIAL_WINDOW_PACKETS * ULNET_PACKET_SIZE_BYTES_MAX;
+            session->bulk_slow_start_bitfield |= 1ULL << port;
+            session->bulk_feedback_usec[port] = current_time_usec;
+        }
+
+        session->bulk_tokens_bytes[port] = ulnet__bulk_burst_bytes(ulnet__bulk_rate(session, port));
+        session->bulk_tokens_usec[port] = current_time_usec;
+        session->bulk_cursor[port] = 0;
+        memset(session->bulk_pending[port], 0, sizeof(session->bulk_pending[port]));
+    }
+
+    session->bulk_pending[port][group][index / 64] |= 1ULL << (index % 64);
+    session->bulk_cursor[port] = 0;
+}
+
+static void ulnet__save_state_send_encoding(ulnet_session_t *session, int port, ulnet_save_state_encoding_t *encoding) {
+    int n = encoding->n, k = encoding->k, packet_groups = encoding->packet_groups;
+
+    SAM2_LOG_INFO("Sending savestate for frame %" PRId64 " to port %d, %d bytes compressed in %" PRId64 " cycles against baseline frame %" PRId64 " with dictionary %08" PRIx32 "%s",
+        encoding->frame, port, encoding->payload->compressed_savestate_size, encoding->compress_cycles, encoding->baseline_frame,
+        encoding->dictionary_id, encoding->dictionary_embedded ? " sent along" : "");
+    session->save_state_sent_size = encoding->payload->compressed_savestate_size;
+    session->save_state_sent_compress_cycles = encoding->compress_cycles;
+    if (encoding->dictionary_embedded) {
+        session->peer_dictionary_id[port] = encoding->dictionary_id; // If this transfer fails the peer tells us what it has again
+    }
+    session->save_state_sent_baseline_frame = encoding->baseline_frame;
+    session->save_state_sent_redundant_blocks = n - k;
+    session->peer_save_state_transfer_id[port]++;
+    session->peer_save_state_sent_bitfield |= 1ULL << port;
+    session->peer_save_state_encoding[port] = (int) (encoding - session->save_state_encoding);
+    session->peer_save_state_frame[port] = encoding->frame;
+
+    // Send original data blocks and parity blocks, anything left over from an older transfer to this peer is dropped
+    session->bulk_pending_bitfield &= ~(1ULL << port);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < packet_groups; j++) {
+            ulnet__bulk_queue(session, port, j, i);
+        }
+    }
+
+    ulnet__bulk_send(session, ulnet__get_monotonic_time_microseconds());
+}
+
+// Sends the peers we started an encode for their savestate once the worker is done with it
+static void ulnet__save_state_encode_collect(ulnet_session_t *session) {
+    ulnet_save_state_encode_job_t *job = &session->save_state_encode_job;
+    if (!job->in_use || !ulnet__pool_finished(&job->pending)) return;
+    job->in_use = false;
+
+    int64_t frame = job->save_state_frame;
+    if (ulnet__save_state_encode_finish(session, job) == -1) {
+        job->peers = 0;
+        return;
+    }
+
+    for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+        if (!(job->peers & (1ULL << p))) continue;
+
+        // Peers whose baseline or packet loss changed while we were encoding need one of their own
+        int slot = ulnet__save_state_encoding_find(session, p, frame);
+        if (slot == -1) {
+            session->peer_needs_sync_bitfield |= 1ULL << p;
+        } else {
+            ulnet__save_state_send_encoding(session, p, &session->save_state_encoding[slot]);
+        }
+    }
+    job->peers = 0;
+}
+
+static void ulnet__save_state_encode_flush(ulnet_session_t *session) {
+    ulnet__pool_wait(&session->save_state_encode_job.pending);
+    ulnet__save_state_encode_collect(session);
+}
+
+// Where to serialize a savestate we're about to send so the worker can compress it while we keep emulating
+static uint8_t *ulnet__save_state_encode_buffer(ulnet_session_t *session, size_t save_state_size) {
+    ulnet_save_state_encode_job_t *job = &session->save_state_encode_job;
+    assert(!job->in_use);
+    if (job->capacity < save_state_size) {
+        free(job->buffer);
+        job->buffer = (uint8_t *) malloc(save_state_size);
+        job->capacity = save_state_size;
+    }
+    return job->buffer;
+}
+
+// Encodes what was serialized into ulnet__save_state_encode_buffer on a worker for the first of the peers
+// The rest are sent the same encoding if it suits them, ulnet__save_state_encode_collect sends it once it's done
+static void ulnet__save_state_encode_submit(ulnet_session_t *session, uint64_t peers, size_t save_state_size, int64_t save_state_frame) {
+    ulnet_save_state_encode_job_t *job = &session->save_state_encode_job;
+    int port = 0;
+    while (!(peers & (1ULL << port))) port++;
+
+    ulnet__save_state_encode_prepare(session, job, ulnet__peer_baseline(session, port), ulnet__peer_save_state_tree(session, port),
+        session->peer_dictionary_id[port] != session->zstd_dictionary_id,
+        ulnet__save_state_packet_loss(session, port), job->buffer, save_state_size, save_state_frame);
+    job->peers = peers;
+    job->in_use = true;
+    session->peer_needs_sync_bitfield &= ~peers;
+    ulnet__pool_submit(ulnet__save_state_encode_task, job, &job->pending);
+}
+
+// Encodes a savestate on the calling thread and returns the slot it's in, -1 if it was too big to send
+static int ulnet__save_state_encode(ulnet_session_t *session, int baseline, const ulnet_save_state_tree_t *tree, bool embed_dictionary, float packet_loss, void *save_state, size_t save_state_size, int64_t save_state_frame) {
+    ulnet_save_state_encode_job_t *job = &session->save_state_encode_job;
+    ulnet__save_state_encode_flush(session); // It shares its compression contexts with us
+
+    ulnet__save_state_encode_prepare(session, job, baseline, tree, embed_dictionary, packet_loss, (const uint8_t *) save_state, save_state_size, save_state_frame);
+    ulnet__save_state_encode_task(job, 0);
+    return ulnet__save_state_encode_finish(session, job);
+}
+
+// Resends blocks a peer is missing from the encoding we sent it, just enough for each stalled group to decode at the measured loss
+static void ulnet__save_state_repair(ulnet_session_t *session, int port, const ulnet_save_state_nack_message_t *nack) {
+    ulnet_save_state_encoding_t *encoding = &session->save_state_encoding[session->peer_save_state_encoding[port]];
+    if (   !(session->peer_save_state_sent_bitfield & (1ULL << port))
+        || encoding->payload == NULL
+        || encoding->frame != session->peer_save_state_frame[port]
+        || (nack->packet_groups != 0 && (   encoding->k != nack->k
+                                         || encoding->n != nack->n
+                                         || encoding->packet_groups != nack->packet_groups
+                                         || encoding->packet_payload_size_bytes != nack->block_size))) {
+        SAM2_LOG_WARN("Peer %05" PRIu16 " asked to repair a savestate we no longer have, sending a new one", session->agent_peer_ids[port]);
+        session->peer_save_state_sent_bitfield &= ~(1ULL << port);
+        session->peer_needs_sync_bitfield |= 1ULL << port;
+        session->peer_needs_sync_since_usec[port] = ulnet__get_unix_time_microseconds();
+        return;
+    }
+
+    // Loss means we overran a queue somewhere, LEDBAT halves its window like TCP would
+    double cwnd_min = ULNET_BULK_RATE_MIN_BYTES_PER_SECOND * ulnet__bulk_rtt_usec(session, port) / 1e6;
+    session->bulk_cwnd_bytes[port] = SAM2_MAX(session->bulk_cwnd_bytes[port] / 2, cwnd_min);
+    session->bulk_slow_start_bitfield &= ~(1ULL << port);
+
+    float packet_loss = ulnet__save_state_packet_loss(session, port);
+    if (nack->packet_groups == 0) {
+        // Any block of the first group tells the peer the layout, send enough that one gets through
+        int blocks = 1;
+        while (blocks < encoding->n && ulnet__fec_likely_to_fail(blocks, blocks - 1, packet_loss)) {
+            blocks++;
+        }
+
+        for (int i = 0; i < blocks; i++) {
+            ulnet__bulk_queue(session, port, 0, i);
+            session->save_state_repair_blocks_sent++;
+        }
+
+        SAM2_LOG_INFO("Resending %d blocks of the first packet group to peer %05" PRIu16 " so it learns the layout", blocks, session->agent_peer_ids[port]);
+        ulnet__bulk_send(session, ulnet__get_monotonic_time_microseconds());
+        return;
+    }
+
+    for (int group = 0; group < encoding->packet_groups; group++) {
+        int received = 0;
+        for (int i = 0; i < encoding->n; i++) {
+            received += (nack->received[group][i / 64] >> (i % 64)) & 1;
+        }
+
+        int needed = encoding->k - received;
+        if (needed <= 0) continue;
+
+        int redundant = 0;
+        while (needed + redundant < encoding->n - received && ulnet__fec_likely_to_fail(needed + redundant, redundant, packet_loss)) {
+            redundant++;
+        }
+
+        // Any block the peer doesn't have is as good as a new parity block, data blocks are just cheaper for it to decode
+        int to_send = needed + redundant;
+        for (int i = 0; i < encoding->n && to_send > 0; i++) {
+            if (nack->received[group][i / 64] & (1ULL << (i % 64))) continue;
+            ulnet__bulk_queue(session, port, group, i);
+            session->save_state_repair_blocks_sent++;
+            to_send--;
+        }
+
+        SAM2_LOG_INFO("Repairing packet group %d for peer %05" PRIu16 " with %d blocks, it was missing %d",
+            group, session->agent_peer_ids[port], needed + redundant, needed);
+    }
+
+    ulnet__bulk_send(session, ulnet__get_monotonic_time_microseconds());
+}
+
+// Asks the authority for what a stalled savestate transfer is missing, or for a new savestate once repairing it isn't getting anywhere
+static void ulnet__save_state_request_repair(ulnet_session_t *session) {
+    // Once we've asked give the repair a round trip to show up before asking again
+    int64_t wait_usec = session->save_state_repair_delay_microseconds;
+    if (session->remote_savestate_repair_requests > 0) {
+        wait_usec += session->rtt_smoothed_usec[SAM2_AUTHORITY_INDEX] + 4 * session->rtt_variance_usec[SAM2_AUTHORITY_INDEX];
+    }
+
+    int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+    if (current_time_usec - session->remote_savestate_last_fragment_usec < wait_usec) return;
+
+    if (session->remote_savestate_repair_requests >= ULNET_SAVE_STATE_REPAIR_REQUESTS_MAX) {
+        SAM2_LOG_WARN("Savestate transfer still stalled after %d repairs, asking the authority for a new one", session->remote_savestate_repair_requests);
+        if (session->remote_savestate_transfer_id != -1) {
+            session->remote_savestate_loaded_transfer_id = session->remote_savestate_transfer_id;
+        }
+        ulnet__baseline_advertise(session, ULNET_BASELINE_FLAG_RESYNC); // Also drops what we have of this one
+        return;
+    }
+
+    // Zeroed when we're only holding fragments, that asks for the first packet group
+    ulnet_save_state_nack_message_t nack = { ULNET_NACK_HEADER };
+    nack.k = session->remote_savestate_k;
+    nack.n = session->remote_savestate_n;
+    nack.packet_groups = session->remote_packet_groups;
+    nack.block_size = session->remote_savestate_block_size;
+    memcpy(nack.received, session->remote_savestate_received, sizeof(nack.received));
+
+    SAM2_LOG_INFO("Savestate transfer stalled, asking the authority for the %s", session->remote_savestate_transfer ? "blocks we're missing" : "first packet group");
+    ulnet_message_send(session, SAM2_AUTHORITY_INDEX, (const uint8_t *) &nack);
+    session->remote_savestate_repair_requests++;
+    session->remote_savestate_last_fragment_usec = current_time_usec;
+}
+
+ULNET_LINKAGE void ulnet_session_release_save_state_buffers(ulnet_session_t *session) {
+    ulnet__reset_save_state_bookkeeping(session); // Drops any transfer in progress
+    ulnet__save_state_encodings_free(session);
+    ulnet__save_state_snapshots_discard(session, true);
+    ulnet__zstd_free(session);
+    for (int i = 0; i < ULNET_TRANSFER_BUFFERS_MAX; i++) {
+        free(session->transfer_buffer[i]);
+        session->transfer_buffer[i] = NULL;
+        session->transfer_buffer_capacity[i] = 0;
+    }
+    session->transfer_buffer_in_use_bitfield = 0;
+
+    for (int i = 0; i < ULNET_SAVE_STATE_BASELINES_MAX; i++) {
+        free(session->baseline_save_state[i]);
+        session->baseline_save_state[i] = NULL;
+        session->baseline_save_state_size[i] = 0;
+        session->baseline_save_state_capacity[i] = 0;
+    }
+
+    for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+        free(session->peer_save_state_tree[p].chunk_xxhash);
+        memset(&session->peer_save_state_tree[p], 0, sizeof(session->peer_save_state_tree[p]));
+    }
+
+    ulnet__pool_session_reference(session, false); // This is the last thing a session is handed before it's freed
+}
+
+static void ulnet__apply_core_option(ulnet_session_t *session) {
+    ulnet_core_option_t maybe_core_option_for_this_frame = session->state[SAM2_AUTHORITY_INDEX].core_option[session->frame_counter % ulnet_delay_buffer_size(session)];
+    if (maybe_core_option_for_this_frame.key[0] != '\0') {
+        if (strcmp(maybe_core_option_for_this_frame.key, "netplay_delay_frames") == 0) {
+            session->delay_frames = atoi(maybe_core_option_for_this_frame.value);
+        }
+
+        for (int i = 0; i < SAM2_ARRAY_LENGTH(session->core_options); i++) {
+            if (strcmp(session->core_options[i].key, maybe_core_option_for_this_frame.key) == 0) {
+                session->core_options[i] = maybe_core_option_for_this_frame;
+                session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
+                break;
+            }
+        }
+    }
+}
+
+// The rings in ulnet_state_t are indexed by frame modulo the delay buffer size so when a room changes
+// the size we have to relocate whatever frames are still live otherwise we'd read stale inputs
+static void ulnet__resize_delay_buffer(ulnet_session_t *session, int64_t old_size, int64_t new_size) {
+    if (old_size == new_size) return;
+    SAM2_LOG_INFO("Delay buffer resized from %" PRId64 " to %" PRId64 " frames", old_size, new_size);
+
+    ulnet_state_t *old_state = (ulnet_state_t *) malloc(sizeof(ulnet_state_t));
+    for (int p = 0; p < SAM2_ARRAY_LENGTH(session->state); p++) {
+        ulnet_state_t *state = &session->state[p];
+        memcpy(old_state, state, sizeof(ulnet_state_t));
+
+        for (int64_t i = 0; i < SAM2_MIN(old_size, new_size); i++) {
+            int64_t frame = state->frame - i;
+            if (frame >= 0) {
+                memcpy(state->input_state[frame % new_size], old_state->input_state[frame % old_size], sizeof(state->input_state[0]));
+                state->room_xor_delta[frame % new_size] = old_state->room_xor_delta[frame % old_size];
+                state->core_option[frame % new_size] = old_state->core_option[frame % old_size];
+            }
+
+            int64_t save_state_frame = state->save_state_frame - i;
+            if (save_state_frame >= 0) {
+                state->save_state_hash[save_state_frame % new_size] = old_state->save_state_hash[save_state_frame % old_size];
+                state->input_state_hash[save_state_frame % new_size] = old_state->input_state_hash[save_state_frame % old_size];
+            }
+        }
+    }
+    free(old_state);
+}
+
+static void ulnet__apply_room_xor_delta(ulnet_session_t *session) {
+    sam2_room_t new_room_state = session->room_we_are_in;
+    ulnet__xor_delta(&new_room_state, &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[session->frame_counter % ulnet_delay_buffer_size(session)], sizeof(sam2_room_t));
+
+    if (memcmp(&new_room_state, &session->room_we_are_in, sizeof(sam2_room_t)) != 0) {
+        SAM2_LOG_INFO("Something about the room we're in was changed by the authority");
+
+        // When the room changes reuse existing peer connections if possible
+        for (int j = 0; j < SAM2_TOTAL_PEERS; j++) {
+            for (int i = 0; i < SAM2_TOTAL_PEERS; i++) {
+                if (new_room_state.peer_ids[j] == session->agent_peer_ids[i]) {
+                    if (new_room_state.peer_ids[j] <= SAM2_PORT_SENTINELS_MAX) continue;
+                    ulnet_swap_agent(session, j, i); // Note: This mutates session->agent_peer_ids
+                    break;
+                }
+            }
+        }
+
+        // Create new connections for new peers and dispose of unneeded ones
+        int our_new_port = sam2_get_port_of_peer(&new_room_state, session->our_peer_id);
+        if (our_new_port != -1 && our_new_port < SAM2_SPECTATOR_START) {
+            for (int p = 0; p < SAM2_PORT_MAX; p++) {
+                if (   new_room_state.peer_ids[p] > SAM2_PORT_SENTINELS_MAX
+                    && new_room_state.peer_ids[p] != session->our_peer_id
+                    && new_room_state.peer_ids[p] != session->agent_peer_ids[p]) {
+                    if (session->agent[p]) {
+                        ulnet_disconnect_peer(session, p);
+                    }
+
+                    // Convention: The peer with the lesser ID initiates ICE
+                    if (session->our_peer_id < new_room_state.peer_ids[p]) {
+                        ulnet_startup_ice_for_peer(session, new_room_state.peer_ids[p], p, NULL);
+                    }
+                }
+            }
+        }
+
+        for (int p = 0; p < SAM2_SPECTATOR_START; p++) {
+            if (new_room_state.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+
+            if (new_room_state.peer_ids[p] != session->room_we_are_in.peer_ids[p]) {
+                session->state[p].frame = SAM2_MAX(session->state[p].frame, session->frame_counter);
+            }
+        }
+
+        ulnet__resize_delay_buffer(session, ulnet_delay_buffer_size(session), ulnet_room_delay_buffer_size(&new_room_state));
+        session->room_we_are_in = new_room_state;
+        if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
+            SAM2_LOG_INFO("Client %05" PRId16 " abandoned the room '%s'", session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX], session->room_we_are_in.name);
+            for (int peer_port = 0; peer_port < SAM2_ARRAY_LENGTH(session->agent); peer_port++) {
+                if (session->agent[peer_port]) {
+                    ulnet_disconnect_peer(session, peer_port);
+                }
+                session->room_we_are_in.peer_ids[peer_port] = SAM2_PORT_AVAILABLE;
+            }
+            ulnet_session_init_defaulted(session);
+        }
+    }
+}
+
+// MARK: Rollback
+// Latest frame we have input from every peer for
+static int64_t ulnet__rollback_confirmed_frame(ulnet_session_t *session) {
+    int64_t confirmed_frame = INT64_MAX;
+    for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
+        if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+        confirmed_frame = SAM2_MIN(confirmed_frame, session->state[p].frame);
+    }
+
+    return confirmed_frame;
+}
+
+// Gathers the input for the frame we're about to simulate predicting any input we don't have yet by repeating the peers last known input
+static void ulnet__rollback_collect_input(ulnet_session_t *session) {
+    ulnet_input_state_t (*input_state)[ULNET_PORT_COUNT] = &session->rollback_input[session->frame_counter % ULNET_ROLLBACK_BUFFER_SIZE];
+    memset(*input_state, 0, sizeof(*input_state));
+
+    for (int peer_idx = 0; peer_idx < SAM2_PORT_MAX+1; peer_idx++) {
+        if (   session->room_we_are_in.peer_ids[peer_idx] > SAM2_PORT_SENTINELS_MAX
+            && !(session->room_we_are_in.flags & (SAM2_FLAG_PORT0_PEER_IS_INACTIVE << peer_idx))) {
+            #if defined(ULNET__DEBUG_EVERYONE_ON_PORT_0)
+            int port = 0;
+            #else
+            int port = peer_idx;
+            #endif
+            int64_t input_frame = SAM2_MIN(session->frame_counter, session->state[peer_idx].frame);
+            ulnet__memor((*input_state)[port], session->state[peer_idx].input_state[input_frame % ulnet_delay_buffer_size(session)][port], sizeof(ulnet_input_state_t));
+        }
+    }
+}
+
+static void ulnet__rollback_save_state(ulnet_session_t *session) {
+    int64_t i = session->frame_counter % ULNET_ROLLBACK_BUFFER_SIZE;
+    size_t save_state_size = session->retro_serialize_size(session->user_ptr);
+
+    if (save_state_size > session->rollback_save_state_capacity[i]) {
+        free(session->rollback_save_state[i]);
+        session->rollback_save_state[i] = (uint8_t *) malloc(save_state_size);
+        session->rollback_save_state_capacity[i] = save_state_size;
+    }
+
+    session->retro_serialize(session->user_ptr, session->rollback_save_state[i], save_state_size);
+    session->rollback_save_state_size[i] = save_state_size;
+    session->rollback_save_state_frame[i] = session->frame_counter;
+}
+
+// Called when an input packet moves a peer from previous_frame to session->state[peer_idx].frame
+// previous_input is the input we were repeating for that peer while predicting
+static void ulnet__rollback_check_prediction(ulnet_session_t *session, int peer_idx, int64_t previous_frame, const ulnet_input_state_t previous_input) {
+    int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+    if (   !ulnet__rollback_enabled(session, our_port)
+        || session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        return;
+    }
+
+    #if defined(ULNET__DEBUG_EVERYONE_ON_PORT_0)
+    int port = 0;
+    #else
+    int port = peer_idx;
+    #endif
+    ulnet_state_t *state = &session->state[peer_idx];
+    int64_t last_simulated_frame = SAM2_MIN(state->frame, session->frame_counter - 1);
+    int64_t oldest_frame_in_buffer = state->frame - (ulnet_delay_buffer_size(session) - 1);
+
+    if (previous_frame + 1 < oldest_frame_in_buffer && previous_frame + 1 <= last_simulated_frame) {
+        SAM2_LOG_ERROR("Input from peer_ids[%d] for frames %" PRId64 "-%" PRId64 " was overwritten before we could verify our prediction",
+            peer_idx, previous_frame + 1, oldest_frame_in_buffer - 1);
+    }
+
+    for (int64_t frame = SAM2_MAX(previous_frame + 1, oldest_frame_in_buffer); frame <= last_simulated_frame; frame++) {
+        int64_t frame_index = frame % ulnet_delay_buffer_size(session);
+        bool mispredicted = memcmp(state->input_state[frame_index][port], previous_input, sizeof(ulnet_input_state_t)) != 0;
+
+        if (peer_idx == SAM2_AUTHORITY_INDEX && frame >= session->authority_next_frame_to_apply) {
+            // We simulated this frame assuming the authority wouldn't change the room or any core options
+            sam2_room_t no_room_xor_delta = {0};
+            mispredicted |= state->core_option[frame_index].key[0] != '\0';
+            mispredicted |= memcmp(&state->room_xor_delta[frame_index], &no_room_xor_delta, sizeof(sam2_room_t)) != 0;
+        }
+
+        if (mispredicted) {
+            if (!(session->flags & ULNET_SESSION_FLAG_MISPREDICTED) || frame < session->rollback_mispredicted_frame) {
+                session->rollback_mispredicted_frame = frame;
+            }
+
+            session->flags |= ULNET_SESSION_FLAG_MISPREDICTED;
+            break;
+        }
+    }
+}
+
+// Everything a tick does that has to happen again when we resimulate a frame
+static void ulnet__rollback_simulate_frame(ulnet_session_t *session, bool save_state) {
+    if (save_state) {
+        ulnet__rollback_save_state(session);
+    }
+
+    bool authority_input_available =    session->frame_counter >= session->authority_next_frame_to_apply
+                                     && session->state[SAM2_AUTHORITY_INDEX].frame >= session->frame_counter;
+    if (authority_input_available) {
+        ulnet__apply_core_option(session);
+    }
+
+    ulnet__rollback_collect_input(session);
+    session->retro_run(session->user_ptr);
+
+    if (authority_input_available) {
+        session->authority_next_frame_to_apply = session->frame_counter + 1;
+        ulnet__apply_room_xor_delta(session);
+    }
+
+    session->frame_counter++;
+}
+
+static void ulnet__rollback_resimulate(ulnet_session_t *session) {
+    session->flags &= ~ULNET_SESSION_FLAG_MISPREDICTED;
+
+    int64_t frame = session->rollback_mispredicted_frame;
+    int64_t target_frame = session->frame_counter;
+    int64_t i = frame % ULNET_ROLLBACK_BUFFER_SIZE;
+    if (frame >= target_frame) {
+        return;
+    }
+
+    if (   session->rollback_save_state[i] == NULL
+        || session->rollback_save_state_frame[i] != frame) {
+        SAM2_LOG_ERROR("No save state to rollback to frame %" PRId64 " from frame %" PRId64, frame, target_frame);
+        return;
+    }
+
+    SAM2_LOG_DEBUG("Rolling back %" PRId64 " frames to frame %" PRId64, target_frame - frame, frame);
+    session->retro_unserialize(session->user_ptr, session->rollback_save_state[i], session->rollback_save_state_size[i]);
+    session->frame_counter = frame;
+
+    int64_t confirmed_frame = ulnet__rollback_confirmed_frame(session);
+    while (session->frame_counter < target_frame) {
+        // The save state for the frame we rolled back to is still good
+        bool save_state = session->frame_counter != frame && session->frame_counter > confirmed_frame;
+        ulnet__rollback_simulate_frame(session, save_state);
+
+        if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
+            return;
+        }
+    }
+
+    session->rollback_count++;
+    session->rollback_resimulated_frames += target_frame - frame;
+    session->rollback_window_resimulated_frames += target_frame - frame;
+    session->rollback_depth[target_frame % ULNET_MAX_SAMPLE_SIZE] = (int) (target_frame - frame);
+}
+
+// How far ahead of peer p we are when we tick last_ticked_frame. They send input for frame + delay_frames right after ticking a frame,
+// so the first packet we get for a new frame left them about half an RTT before it arrived and tells us when they ticked
+static int32_t ulnet__frame_advantage_usec(ulnet_session_t *session, int p, int64_t last_ticked_frame, double frame_rate) {
+    if (   session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+        || session->input_last_arrival_usec[p] == 0
+        || session->frame_pacer.last_tick_usec == 0) {
+        return 0;
+    }
+
+    int64_t their_tick_usec = session->input_last_arrival_usec[p] - session->rtt_smoothed_usec[p] / 2;
+    int64_t their_ticked_frame = session->state[p].frame - session->delay_frames;
+    double advantage_usec = (last_ticked_frame - their_ticked_frame) * 1e6 / frame_rate + (their_tick_usec - session->frame_pacer.last_tick_usec);
+    return (int32_t) SAM2_MAX(SAM2_MIN(advantage_usec, 1e6), -1e6);
+}
+
+// Like GGPO each side slews away half the difference between its advantage and the one its peer reported. Both ends agree on that
+// so they meet in the middle instead of overshooting. Asymmetric routes bias it by half the asymmetry, which we can't measure
+static void ulnet__frame_advantage_sync(ulnet_session_t *session, int our_port, double frame_rate) {
+    double sync_usec_sum = 0.0;
+    int peer_count = 0;
+    for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
+        if (p == our_port || !session->agent[p] || session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+
+        session->frame_advantage_usec[p] = ulnet__frame_advantage_usec(session, p, session->frame_counter, frame_rate);
+        if (session->peer_frame_advantage_bitfield & (1ULL << p)) {
+            sync_usec_sum += (session->frame_advantage_usec[p] - session->peer_frame_advantage_usec[p]) / 2.0;
+            peer_count++;
+        }
+    }
+
+    if (peer_count == 0) return;
+
+    session->frame_advantage_sync_usec += (sync_usec_sum / peer_count - session->frame_advantage_sync_usec) / 8;
+    session->frame_advantage_measured_sample_usec[session->frame_counter % ULNET_MAX_SAMPLE_SIZE] = (int32_t) (sync_usec_sum / peer_count);
+    session->frame_advantage_sample_usec[session->frame_counter % ULNET_MAX_SAMPLE_SIZE] = (int32_t) session->frame_advantage_sync_usec;
+
+    if (!(session->flags & ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC)) return;
+
+    double slew_max_usec = ULNET_FRAME_ADVANTAGE_SLEW_MAX * 1e6 / frame_rate;
+    int64_t slew_usec = (int64_t) SAM2_MAX(SAM2_MIN(ULNET_FRAME_ADVANTAGE_GAIN * session->frame_advantage_sync_usec, slew_max_usec), -slew_max_usec);
+    ulnet_frame_pacer_slew(&session->frame_pacer, slew_usec);
+    session->frame_advantage_slewed_usec += slew_usec;
+}
+
+// Same smoothing as ulnet__rtt_update applied to the gaps between input packets from a peer
+static void ulnet__input_arrival_update(ulnet_session_t *session, int p, int64_t now_usec) {
+    int64_t gap_usec = now_usec - session->input_last_arrival_usec[p];
+    if (session->input_last_arrival_usec[p] != 0 && gap_usec < ULNET_INPUT_ARRIVAL_GAP_MAX_USEC) {
+        if (session->input_interarrival_usec[p] == 0) {
+            session->input_interarrival_usec[p] = SAM2_MAX(gap_usec, 1);
+            session->input_jitter_usec[p] = gap_usec / 2;
+        } else {
+            session->input_jitter_usec[p] = (3 * session->input_jitter_usec[p] + SAM2_ABS(session->input_interarrival_usec[p] - gap_usec)) / 4;
+            session->input_interarrival_usec[p] = SAM2_MAX((7 * session->input_interarrival_usec[p] + gap_usec) / 8, 1);
+        }
+    }
+
+    session->input_last_arrival_usec[p] = now_usec;
+}
+
+// How long to block on the sockets when we can't tick. If it's input we're missing we wait until a little past when
+// the packet for it should show up, any packet arriving wakes us up earlier anyway
+static int64_t ulnet__input_wait_usec(ulnet_session_t *session, int our_port, int64_t now_usec) {
+    if (session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) return ULNET_INPUT_WAIT_FALLBACK_USEC;
+
+    int64_t wait_usec = 0;
+    int64_t rollback_window = ulnet__rollback_window(session, our_port);
+    for (int port = 0; port < SAM2_PORT_MAX+1; port++) {
+        if (port == our_port || session->room_we_are_in.peer_ids[port] <= SAM2_PORT_SENTINELS_MAX) continue;
+        if (session->state[port].frame >= session->frame_counter - rollback_window) continue;
+
+        // Spectators get everyone's input relayed through the authority
+        int p = our_port >= SAM2_SPECTATOR_START ? SAM2_AUTHORITY_INDEX : port;
+        int64_t port_wait_usec = ULNET_INPUT_WAIT_FALLBACK_USEC;
+        if (session->input_interarrival_usec[p] != 0) {
+            int64_t expected_at_usec = session->input_last_arrival_usec[p] + session->input_interarrival_usec[p]
+                                     + ULNET_INPUT_WAIT_JITTER_MARGIN * session->input_jitter_usec[p];
+            if (expected_at_usec > now_usec) {
+                port_wait_usec = expected_at_usec - now_usec;
+            }
+        }
+
+        // We need all of them so wait for the one furthest out
+        wait_usec = SAM2_MAX(wait_usec, port_wait_usec);
+    }
+
+    // Not waiting on the network, probably our own input still being buffered
+    return wait_usec == 0 ? ULNET_INPUT_WAIT_FALLBACK_USEC : wait_usec;
+}
+
+// Blocks until a packet arrives on any of our agents or the timeout. Packets are processed before this returns
+static void ulnet__wait_for_packets(ulnet_session_t *session, double timeout_milliseconds) {
+    juice_agent_t *agent[SAM2_ARRAY_LENGTH(session->agent)] = {0};
+    int agent_count = 0;
+    for (int p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
+        if (session->agent[p]) {
+            agent[agent_count++] = session->agent[p];
+        }
+    }
+
+    // Rounded up, waking up early just means polling again to sleep off the remainder
+    int timeout_milliseconds_rounded = (int) ceil(timeout_milliseconds);
+    if (agent_count > 0) {
+        int ret = juice_user_poll(agent, agent_count, timeout_milliseconds_rounded);
+        // This will call ulnet_receive_packet_callback in a loop
+        if (ret < 0) {
+            SAM2_LOG_FATAL("Error polling agent (%d)", ret);
+        }
+    } else if (timeout_milliseconds_rounded > 0) {
+        ulnet__sleep((unsigned int) timeout_milliseconds_rounded);
+    }
+}
+
+#define ULNET_POLL_SESSION_SAVED_STATE    0b00000001
+#define ULNET_POLL_SESSION_TICKED         0b00000010
+#define ULNET_POLL_SESSION_BUFFERED_INPUT 0b00000100
+
+// A savestate serialized into save_state is hashed on a worker until the next call, so the buffer can't be shared with another session
+ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_state_on_tick, uint8_t *save_state, size_t save_state_capacity,
+    double frame_rate, double max_sleeping_allowed_when_polling_network_seconds) {
+
+    int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+
+    IMH(ImGui::Begin("P2P UDP Netplay", NULL, ImGuiWindowFlags_AlwaysAutoResize);)
+    int status = 0;
+
+    for (int i = 0; i < ULNET_SAVE_STATE_SNAPSHOTS; i++) {
+        ulnet_save_state_snapshot_t *snapshot = &session->save_state_snapshot[i];
+        if (snapshot->in_use && snapshot->source != snapshot->buffer) {
+            ulnet__pool_wait(&snapshot->pending); // What it borrowed was only ours until now
+        }
+        ulnet__save_state_snapshot_collect(session, snapshot);
+    }
+    ulnet__save_state_encode_collect(session);
+    ulnet__zstd_dictionary_collect(session);
 
     // Poll input with buffering for netplay
     if (our_port == -1) {
         SAM2_LOG_WARN("No port associated for our peer_id=%d, skipping input polling", session->our_peer_id);
     } else if (   our_port < SAM2_SPECTATOR_START
+               && session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
                && session->state[our_port].frame < session->frame_counter + session->delay_frames) {
         status |= ULNET_POLL_SESSION_BUFFERED_INPUT;
         // @todo The preincrement does not make sense to me here, but things have been working
-        int64_t next_buffer_index = ++session->state[our_port].frame % ULNET_DELAY_BUFFER_SIZE;
+        int64_t next_buffer_index = ++session->state[our_port].frame % ulnet_delay_buffer_size(session);
 
         session->state[our_port].core_option[next_buffer_index] = session->next_core_option;
+        if (   session->flags & ULNET_SESSION_FLAG_ADAPTIVE_DELAY
+            && session->next_core_option.key[0] == '\0') {
+            ulnet__adaptive_delay_core_option(session, frame_rate, &session->state[our_port].core_option[next_buffer_index]);
+        }
 
         //if (ulnet_is_authority(session)) {
             session->state[our_port].room_xor_delta[next_buffer_index] = session->next_room_xor_delta;
@@ -918,18 +4351,23 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
         //}
 
         ulnet__memor(session->state[our_port].input_state[next_buffer_index], session->next_input_state, sizeof(ulnet_input_state_t[SAM2_PORT_MAX]));
-        // Only send every 8th packet reliably... frame 7, 15, 23, etc.
-        if ((session->state[our_port].frame + 1) % ULNET_DELAY_BUFFER_SIZE == 0) {
+        // Only send one packet per delay buffer reliably... frame 7, 15, 23, etc. with the default size
+        if ((session->state[our_port].frame + 1) % ulnet_delay_buffer_size(session) == 0) {
             uint8_t packet[ULNET_PACKET_SIZE_BYTES_MAX];
             int64_t packet_size;
             packet[0] = ULNET_CHANNEL_INPUT | our_port;
-            packet_size = sizeof(ulnet_state_packet_t) + rle8_encode_capped(
-                (uint8_t *) &session->state[our_port],
-                sizeof(session->state[0]),
+            packet_size = sizeof(ulnet_state_packet_t) + ulnet__encode_state(
+                session,
+                &session->state[our_port],
+                ulnet__input_format(session),
                 &packet[sizeof(ulnet_state_packet_t)],
                 sizeof(packet) - sizeof(ulnet_state_packet_t)
             );
 
+            if (packet_size <= (int64_t) sizeof(ulnet_state_packet_t)) {
+                SAM2_LOG_FATAL("Input packet too large to send");
+            }
+
             // Store the packet in the history for debugging and retransmission purposes
             arena_ref_t packet_ref = arena_alloc(&session->arena, packet_size);
             memcpy(arena_deref(&session->arena, packet_ref), packet, packet_size);
@@ -937,7 +4375,7 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
 
             for (int p = 0; p < SAM2_PORT_MAX; p++) {
                 if (!session->agent[p]) continue;
-                if (juice_get_state(session->agent[p]) != JUICE_STATE_COMPLETED) continue;
+                if (ulnet__get_peer_state(session, p) != JUICE_STATE_COMPLETED) continue;
                 ulnet_reliable_send(session, p, packet, packet_size);
             }
         }
@@ -949,6 +4387,12 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
     if (our_port != -1) {
         uint8_t packet[ULNET_PACKET_SIZE_BYTES_MAX];
         int64_t packet_size;
+        // Our advantage is only sent while we're syncing on it so both ends need ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC for it to do anything
+        uint8_t format = ulnet__input_format(session);
+        if (   session->flags & ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC
+            && ulnet_room_protocol_version(&session->room_we_are_in) >= ULNET_PROTOCOL_VERSION_TIMED_INPUT) {
+            format = ULNET_INPUT_FORMAT_COMPACT_TIMED;
+        }
 
         if (our_port >= SAM2_SPECTATOR_START) {
             packet[0] = ULNET_CHANNEL_SPECTATOR_INPUT;
@@ -960,24 +4404,29 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
             );
         } else {
             packet[0] = ULNET_CHANNEL_INPUT | our_port;
-            packet_size = sizeof(ulnet_state_packet_t) + rle8_encode_capped(
-                (uint8_t *) &session->state[our_port],
-                sizeof(session->state[0]),
+            packet_size = sizeof(ulnet_state_packet_t) + ulnet__encode_state(
+                session,
+                &session->state[our_port],
+                format,
                 &packet[sizeof(ulnet_state_packet_t)],
                 sizeof(packet) - sizeof(ulnet_state_packet_t)
             );
         }
 
-        if (packet_size > ULNET_PACKET_SIZE_BYTES_MAX) {
+        if (packet_size <= (int64_t) sizeof(ulnet_state_packet_t)) {
             SAM2_LOG_FATAL("Input packet too large to send");
         }
 
         for (int p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
             if (!session->agent[p]) continue;
-            juice_state_t state = juice_get_state(session->agent[p]);
+            juice_state_t state = ulnet__get_peer_state(session, p);
 
             // Wait until we can send netplay messages to everyone without fail
             if (state == JUICE_STATE_CONNECTED || state == JUICE_STATE_COMPLETED) {
+                if (our_port < SAM2_SPECTATOR_START && format == ULNET_INPUT_FORMAT_COMPACT_TIMED) {
+                    ulnet__set_frame_advantage_in_packet(packet, ulnet__frame_advantage_usec(session, p, session->frame_counter - 1, frame_rate));
+                }
+
                 ulnet_reliable_send_with_acks_only(session, p, packet, packet_size);
 
                 if (our_port < SAM2_SPECTATOR_START) {
@@ -1008,15 +4457,23 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
                 buf = &session->inproc[p]->buf1;
             }
 
-            for (int i = 0; i < buf->count; i++) {
-                ulnet_receive_packet_callback((juice_agent_t *)session->inproc[p], (char*)buf->msg[i], buf->msg_size[i], session);
+            // Messages still crossing the simulated bottleneck stay queued, it's a FIFO so they're all at the end
+            int64_t current_time_usec = ulnet__get_unix_time_microseconds();
+            int delivered = 0;
+            while (delivered < buf->count && buf->deliver_at_usec[delivered] <= current_time_usec) {
+                ulnet_receive_packet_callback((juice_agent_t *)session->inproc[p], (char*)buf->msg[delivered], buf->msg_size[delivered], session);
+                delivered++;
             }
-            buf->count = 0;  // Mark all messages as delivered
+
+            buf->count -= delivered;
+            memmove(buf->msg, buf->msg[delivered], buf->count * sizeof(buf->msg[0]));
+            memmove(buf->msg_size, &buf->msg_size[delivered], buf->count * sizeof(buf->msg_size[0]));
+            memmove(buf->deliver_at_usec, &buf->deliver_at_usec[delivered], buf->count * sizeof(buf->deliver_at_usec[0]));
         }
+
+        ulnet__bulk_send(session, ulnet__get_monotonic_time_microseconds());
     } else {
         // Get rid of dead agents first
-        juice_agent_t *agent[SAM2_ARRAY_LENGTH(session->agent)] = {0};
-        int agent_count = 0;
         for (int p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
             if (session->agent[p]) {
                 if (   juice_get_state(session->agent[p]) == JUICE_STATE_FAILED
@@ -1028,25 +4485,24 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
                     }
 
                     ulnet_disconnect_peer(session, p);
-                } else {
-                    agent[agent_count++] = session->agent[p];
                 }
             }
         }
 
-        int debug_loop_count = 0;
+        int debug_idle_wakeups = 0;
         do {
+            int64_t bulk_next_send_usec = ulnet__bulk_send(session, ulnet__get_monotonic_time_microseconds());
+
             if (ulnet_is_spectator(session, session->our_peer_id)) {
                 int64_t authority_frame = -1;
 
-                // The number of packets we check here is reasonable, since if we miss ULNET_DELAY_BUFFER_SIZE consecutive packets our connection is irrecoverable anyway
-                for (int i = 0; i < ULNET_DELAY_BUFFER_SIZE; i++) {
+                // The number of packets we check here is reasonable, since if we miss a delay buffer worth of consecutive packets our connection is irrecoverable anyway
+                for (int i = 0; i < ulnet_delay_buffer_size(session); i++) {
                     int64_t frame = -1;
                     arena_ref_t state_packet_ref = session->state_packet_history[SAM2_AUTHORITY_INDEX][(session->frame_counter + i) % ULNET_STATE_PACKET_HISTORY_SIZE];
                     uint8_t *state_packet = (uint8_t *) arena_deref(&session->arena, state_packet_ref);
 
-                    if (state_packet) {
-                        rle8_decode(&state_packet[sizeof(ulnet_state_packet_t)], state_packet_ref.size - sizeof(ulnet_state_packet_t), (uint8_t *) &frame, sizeof(frame));
+                    if (state_packet && ulnet__get_frame_from_packet(session, state_packet, state_packet_ref.size, &frame) == 0) {
                         authority_frame = SAM2_MAX(authority_frame, frame);
                     }
                 }
@@ -1054,7 +4510,7 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
                 ignore_frame_pacing_so_we_can_catch_up = false; // authority_frame - session->frame_counter > 1;
             }
 
-            double timeout_milliseconds = 1e3 * core_wants_tick_in_seconds(session->core_wants_tick_at_unix_usec);
+            double timeout_milliseconds = 1e3 * core_wants_tick_in_seconds(session->frame_pacer.tick_at_usec);
 
             if (timeout_milliseconds < 0.0 || ignore_frame_pacing_so_we_can_catch_up) {
                 timeout_milliseconds = 0.0; // No blocking
@@ -1062,37 +4518,49 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
                 timeout_milliseconds = 1.0; // Preempt ourselves otherwise we'll be busy waiting when 0 < timeout < 1 due to truncation
             }
 
+            if (bulk_next_send_usec != INT64_MAX) {
+                // Wake up for the pacer, not rounding down to 0 so we don't busy wait
+                timeout_milliseconds = SAM2_MIN(timeout_milliseconds, SAM2_MAX(1.0, (bulk_next_send_usec - ulnet__get_monotonic_time_microseconds()) / 1e3));
+            }
+
             timeout_milliseconds = SAM2_MIN(timeout_milliseconds, 1000.0 * max_sleeping_allowed_when_polling_network_seconds);
 
-            if (agent_count > 0) {
-                int ret = juice_user_poll(agent, agent_count, (int) timeout_milliseconds);
-                // This will call ulnet_receive_packet_callback in a loop
-                if (ret < 0) {
-                    SAM2_LOG_FATAL("Error polling agent (%d)", ret);
-                }
-            } else {
-                if (timeout_milliseconds > 0.0) {
-                    ulnet__sleep((unsigned int) timeout_milliseconds);
-                }
-            }
+            int64_t received_packet_count = session->received_packet_count;
+            ulnet__wait_for_packets(session, timeout_milliseconds);
 
-            debug_loop_count++;
-        } while (   core_wants_tick_in_seconds(session->core_wants_tick_at_unix_usec) > 0.0
+            // Every packet that arrives wakes us up so only the wakeups where nothing did are wasted
+            debug_idle_wakeups += session->received_packet_count == received_packet_count;
+        } while (   core_wants_tick_in_seconds(session->frame_pacer.tick_at_usec) > 0.0
                  && ulnet__get_unix_time_microseconds() - poll_entry_time_usec < 1e6 * max_sleeping_allowed_when_polling_network_seconds
                  && !ignore_frame_pacing_so_we_can_catch_up);
 
-        if (debug_loop_count > 20) {
-            SAM2_LOG_WARN("juice_user_poll was called %d times. This is inefficent", debug_loop_count);
+        if (debug_idle_wakeups > 20) {
+            SAM2_LOG_WARN("juice_user_poll woke up %d times without receiving anything. This is inefficent", debug_idle_wakeups);
         }
     }
 
     ulnet__reliable_retransmit(session, current_time_seconds);
 
+    if (   session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+        && !(session->flags & ULNET_SESSION_FLAG_BASELINE_ADVERTISED)
+        && !ulnet_is_authority(session)
+        && session->agent[SAM2_AUTHORITY_INDEX]) {
+        juice_state_t authority_state = ulnet__get_peer_state(session, SAM2_AUTHORITY_INDEX);
+        if (authority_state == JUICE_STATE_CONNECTED || authority_state == JUICE_STATE_COMPLETED) {
+            ulnet__baseline_advertise(session, 0);
+        }
+    }
+
+    if (   (session->remote_savestate_transfer || session->remote_savestate_held_count > 0)
+        && !ulnet_is_authority(session)) {
+        ulnet__save_state_request_repair(session);
+    }
+
     // Reconstruct input required for next tick if we're spectating
     if (ulnet_is_spectator(session, session->our_peer_id)) {
         for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
             if (session->room_we_are_in.peer_ids[p] > SAM2_PORT_SENTINELS_MAX) {
-                int history_index_for_frame = (session->frame_counter / ULNET_DELAY_BUFFER_SIZE) % ULNET_STATE_PACKET_HISTORY_SIZE;
+                int history_index_for_frame = (session->frame_counter / ulnet_delay_buffer_size(session)) % ULNET_STATE_PACKET_HISTORY_SIZE;
                 arena_ref_t ref = session->state_packet_history[p][history_index_for_frame];
                 uint8_t *packet_data = (uint8_t *) arena_deref(&session->arena, ref);
 
@@ -1103,23 +4571,28 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
                 ulnet_state_packet_t *maybe_state_packet_for_frame = (ulnet_state_packet_t *) packet_data;
 
                 int64_t frame = -1;
-                rle8_decode(maybe_state_packet_for_frame->coded_state, ref.size - sizeof(ulnet_state_packet_t),
-                           (uint8_t *) &frame, sizeof(frame));
+                ulnet__get_frame_from_packet(session, packet_data, ref.size, &frame);
 
-                if (SAM2_ABS(frame - session->frame_counter) < ULNET_DELAY_BUFFER_SIZE) {
-                    rle8_decode(
+                if (SAM2_ABS(frame - session->frame_counter) < ulnet_delay_buffer_size(session)) {
+                    ulnet__decode_state(
+                        session,
                         maybe_state_packet_for_frame->coded_state, ref.size - sizeof(ulnet_state_packet_t),
-                        (uint8_t *) &session->state[p], sizeof(session->state[p])
+                        &session->state[p]
                     );
                 }
 
-                if (session->state[p].frame - session->frame_counter > ULNET_STATE_PACKET_HISTORY_SIZE * ULNET_DELAY_BUFFER_SIZE) {
+                if (session->state[p].frame - session->frame_counter > ULNET_STATE_PACKET_HISTORY_SIZE * ulnet_delay_buffer_size(session)) {
                     SAM2_LOG_ERROR("We are too far behind to catch up we should resync");
                 }
             }
         }
     }
 
+    if (session->flags & ULNET_SESSION_FLAG_MISPREDICTED) {
+        ulnet__rollback_resimulate(session);
+        our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+    }
+
 IMH(ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);)
 
 IMH(ulnet_imgui_show_session(session);)
@@ -1128,70 +4601,128 @@ IMH(ulnet_imgui_plot_history(session);)
 IMH(ImGui::SeparatorText("Things We are Waiting on Before we can Tick");)
 IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) { ImGui::Text("Waiting for savestate"); })
     bool netplay_ready_to_tick = !(session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL);
+    int64_t rollback_window = ulnet__rollback_window(session, our_port);
     for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
         if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
-    IMH(if                      (session->state[p].frame <  session->frame_counter) { ImGui::Text("Input state on port %d is too old", p); })
-        netplay_ready_to_tick &= session->state[p].frame >= session->frame_counter;
-    IMH(if                      (session->state[p].frame >= session->frame_counter + ULNET_DELAY_BUFFER_SIZE) { ImGui::Text("Input state on port %d is too new (ahead by %" PRId64 " frames)", p, session->state[p].frame - (session->frame_counter + ULNET_DELAY_BUFFER_SIZE)); })
-        netplay_ready_to_tick &= session->state[p].frame <  session->frame_counter + ULNET_DELAY_BUFFER_SIZE; // This is needed for spectators only. By protocol it should always true for non-spectators unless we have a bug or someone is misbehaving
+        int64_t oldest_frame_allowed = p == our_port ? session->frame_counter : session->frame_counter - rollback_window;
+    IMH(if                      (session->state[p].frame <  oldest_frame_allowed) { ImGui::Text("Input state on port %d is too old", p); })
+        netplay_ready_to_tick &= session->state[p].frame >= oldest_frame_allowed;
+    IMH(if                      (session->state[p].frame >= session->frame_counter + ulnet_delay_buffer_size(session)) { ImGui::Text("Input state on port %d is too new (ahead by %" PRId64 " frames)", p, session->state[p].frame - (session->frame_counter + ulnet_delay_buffer_size(session))); })
+        netplay_ready_to_tick &= session->state[p].frame <  session->frame_counter + ulnet_delay_buffer_size(session); // This is needed for spectators only. By protocol it should always true for non-spectators unless we have a bug or someone is misbehaving
     }
 
     if (!(session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) && our_port != -1 && our_port < SAM2_SPECTATOR_START) {
         int64_t frames_buffered = session->state[our_port].frame - session->frame_counter + 1;
-        assert(frames_buffered <= ULNET_DELAY_BUFFER_SIZE);
+        assert(frames_buffered <= ulnet_delay_buffer_size(session));
         assert(frames_buffered >= 0);
     IMH(if                      (frames_buffered <  session->delay_frames) { ImGui::Text("We have not buffered enough frames still need %" PRId64, session->delay_frames - frames_buffered); })
         netplay_ready_to_tick &= frames_buffered >= session->delay_frames;
     }
 
     IMH(ImGui::End();)
+
+    // A peer resyncing stops sending input until it loads the savestate so we might never tick to send it one. The frame we're stuck on works just as well
+    uint64_t peers_ready_to_sync = netplay_ready_to_tick ? 0 : ulnet__peers_ready_to_sync(session);
+    if (   peers_ready_to_sync
+        && !session->save_state_encode_job.in_use
+        && session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+        && (!ulnet__rollback_enabled(session, our_port) || ulnet__rollback_confirmed_frame(session) >= session->frame_counter - 1)) {
+        size_t save_state_size = session->retro_serialize_size(session->user_ptr);
+        session->retro_serialize(session->user_ptr, ulnet__save_state_encode_buffer(session, save_state_size), save_state_size);
+        ulnet__save_state_encode_submit(session, peers_ready_to_sync, save_state_size, session->frame_counter);
+    }
+
     if (!netplay_ready_to_tick) {
-        // @todo You should pick a time here that is a reasonable guess about when we'll receive the next packet instead of this
-        //       My initial thought was doing a cfar, but making this equal to median jitter is probably good enough
         // This avoids busy waiting
-        int sleep_milliseconds_upper_bound = (ulnet__get_unix_time_microseconds() - poll_entry_time_usec) / 1000;
-        int sleep_milliseconds = SAM2_MIN(3, sleep_milliseconds_upper_bound);
-        if (sleep_milliseconds > 0) {
-            ulnet__sleep(sleep_milliseconds);
+        int64_t wait_start_usec = ulnet__get_monotonic_time_microseconds();
+        int64_t wait_usec = ulnet__input_wait_usec(session, our_port, wait_start_usec);
+        int64_t elapsed_usec = ulnet__get_unix_time_microseconds() - poll_entry_time_usec;
+        if (session->use_inproc_transport) {
+            // Nothing can arrive while we sleep since the other end is polled by the same thread
+            int sleep_milliseconds = (int) (SAM2_MIN(wait_usec, elapsed_usec) / 1000);
+            if (sleep_milliseconds > 0) {
+                ulnet__sleep(sleep_milliseconds);
+            }
+        } else {
+            wait_usec = SAM2_MIN(wait_usec, (int64_t) (1e6 * max_sleeping_allowed_when_polling_network_seconds) - elapsed_usec);
+
+            int64_t bulk_next_send_usec = ulnet__bulk_send(session, ulnet__get_monotonic_time_microseconds());
+            if (bulk_next_send_usec != INT64_MAX) {
+                wait_usec = SAM2_MIN(wait_usec, SAM2_MAX(1000, bulk_next_send_usec - ulnet__get_monotonic_time_microseconds()));
+            }
+
+            if (wait_usec > 0) {
+                ulnet__wait_for_packets(session, wait_usec / 1e3);
+                session->input_wait_count++;
+                session->input_wait_usec += ulnet__get_monotonic_time_microseconds() - wait_start_usec;
+            }
         }
     }
 
     if (   netplay_ready_to_tick
-        && (core_wants_tick_in_seconds(session->core_wants_tick_at_unix_usec) <= 0.0
+        && (core_wants_tick_in_seconds(session->frame_pacer.tick_at_usec) <= 0.0
         || ignore_frame_pacing_so_we_can_catch_up)) {
         status |= ULNET_POLL_SESSION_TICKED;
 
-        int64_t target_frame_time_usec = 1000000 / frame_rate - 1000; // @todo There is a leftover millisecond bias here for some reason
+        ulnet_frame_pacer_tick(&session->frame_pacer, ulnet__get_monotonic_time_microseconds(), frame_rate);
+        if (our_port != -1 && our_port < SAM2_SPECTATOR_START) {
+            ulnet__frame_advantage_sync(session, our_port, frame_rate);
+        }
         int64_t current_time_unix_usec = ulnet__get_unix_time_microseconds();
-        session->core_wants_tick_at_unix_usec = SAM2_MAX(session->core_wants_tick_at_unix_usec, current_time_unix_usec - target_frame_time_usec);
-        session->core_wants_tick_at_unix_usec = SAM2_MIN(session->core_wants_tick_at_unix_usec, current_time_unix_usec + target_frame_time_usec);
 
-        ulnet_core_option_t maybe_core_option_for_this_frame = session->state[SAM2_AUTHORITY_INDEX].core_option[session->frame_counter % ULNET_DELAY_BUFFER_SIZE];
-        if (maybe_core_option_for_this_frame.key[0] != '\0') {
-            if (strcmp(maybe_core_option_for_this_frame.key, "netplay_delay_frames") == 0) {
-                session->delay_frames = atoi(maybe_core_option_for_this_frame.value);
-            }
+        bool rollback_enabled = ulnet__rollback_enabled(session, our_port);
+        bool authority_input_available =    session->frame_counter >= session->authority_next_frame_to_apply
+                                         && session->state[SAM2_AUTHORITY_INDEX].frame >= session->frame_counter;
+        // When rolling back the state we start this frame with is only final once we have everyones input for the previous frames
+        bool frame_is_confirmed = !rollback_enabled || ulnet__rollback_confirmed_frame(session) >= session->frame_counter - 1;
 
-            for (int i = 0; i < SAM2_ARRAY_LENGTH(session->core_options); i++) {
-                if (strcmp(session->core_options[i].key, maybe_core_option_for_this_frame.key) == 0) {
-                    session->core_options[i] = maybe_core_option_for_this_frame;
-                    session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
-                    break;
-                }
-            }
+        if (authority_input_available) {
+            ulnet__apply_core_option(session);
         }
 
         session->flags &= ~ULNET_SESSION_FLAG_TICKED;
         bool save_state_allocated = false;
         size_t  save_state_size;
         int64_t save_state_frame = session->frame_counter;
-        if (force_save_state_on_tick || session->peer_needs_sync_bitfield) {
+        uint64_t peers_ready_to_sync = ulnet__peers_ready_to_sync(session);
+        for (int p = 0; p < SAM2_TOTAL_PEERS; p++) {
+            if (!(peers_ready_to_sync & (1ULL << p))) continue;
+
+            // Joining a few frames behind is fine, the peer replays the input it missed from its delay buffer
+            int slot = ulnet__save_state_encoding_find(session, p, save_state_frame - ulnet__save_state_reuse_frames(session));
+            if (slot != -1) {
+                ulnet__save_state_send_encoding(session, p, &session->save_state_encoding[slot]);
+                session->peer_needs_sync_bitfield &= ~(1ULL << p);
+                peers_ready_to_sync &= ~(1ULL << p);
+            }
+        }
+
+        bool sync_peers = peers_ready_to_sync && frame_is_confirmed && !session->save_state_encode_job.in_use;
+        bool resync = session->flags & ULNET_SESSION_FLAG_RESYNC_PENDING && frame_is_confirmed && !ulnet_is_authority(session);
+        // A hash of 0 is never compared so there's nothing to hash for state we may rollback
+        bool hash_save_state =    session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED
+                               && frame_is_confirmed
+                               && our_port != -1
+                               && our_port < SAM2_SPECTATOR_START;
+        ulnet_save_state_snapshot_t *snapshot = NULL;
+        if (force_save_state_on_tick || sync_peers || resync) {
             uint64_t start = ulnet__rdtsc();
             save_state_size = session->retro_serialize_size(session->user_ptr);
-            if (save_state_size > save_state_capacity) {
-                SAM2_LOG_WARN("Save state size %zu is larger than buffer size %zu", save_state_size, save_state_capacity);
-                save_state = (uint8_t *) malloc(save_state_size);
-                save_state_allocated = true;
+            if (hash_save_state) {
+                snapshot = ulnet__save_state_snapshot_acquire(session, save_state_size);
+            }
+
+            // A savestate we send is compressed on a worker while we keep emulating so it goes in a buffer we own and the caller doesn't get it
+            if (sync_peers) {
+                save_state = ulnet__save_state_encode_buffer(session, save_state_size);
+            } else if (save_state_size > save_state_capacity) {
+                if (snapshot) {
+                    save_state = snapshot->buffer;
+                } else {
+                    SAM2_LOG_WARN("Save state size %zu is larger than buffer size %zu", save_state_size, save_state_capacity);
+                    save_state = ulnet__transfer_buffer_acquire(session, save_state_size);
+                    save_state_allocated = true;
+                }
             }
             session->retro_serialize(session->user_ptr, save_state, save_state_size);
             session->save_state_execution_time_cycles[session->frame_counter % ULNET_MAX_SAMPLE_SIZE] = ulnet__rdtsc() - start;
@@ -1201,78 +4732,43 @@ IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_S
                 SAM2_LOG_DEBUG("We ticked while saving state on frame %" PRId64, session->frame_counter);
                 save_state_frame++; // @todo I think this is right I really need to write some kind of test though
             }
-        }
 
-        if (session->peer_needs_sync_bitfield) {
-            for (uint64_t p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
-                if (session->peer_needs_sync_bitfield & (1ULL << p)) {
-                    ulnet_send_save_state(session, p, save_state, save_state_size, save_state_frame);
-                    session->peer_needs_sync_bitfield &= ~(1ULL << p);
-                }
+            if (snapshot) {
+                // A worker hashes it while we keep emulating, copying it first only if it might become a baseline
+                snapshot->source = save_state;
+                snapshot->frame = save_state_frame;
+                snapshot->port = our_port;
+                snapshot->algorithm = ulnet_room_save_state_hash_algorithm(&session->room_we_are_in);
+                snapshot->baseline_candidate = save_state_frame % ULNET_SAVE_STATE_BASELINE_INTERVAL_FRAMES == 0;
+                snapshot->in_use = true;
+                ulnet__pool_submit(ulnet__save_state_snapshot_hash, snapshot, &snapshot->pending);
             }
         }
 
-        if (!(session->flags & ULNET_SESSION_FLAG_TICKED)) {
-            session->retro_run(session->user_ptr);
+        if (sync_peers) {
+            ulnet__save_state_encode_submit(session, peers_ready_to_sync, save_state_size, save_state_frame);
         }
 
-        session->core_wants_tick_at_unix_usec += 1000000 / frame_rate;
-
-        sam2_room_t new_room_state = session->room_we_are_in;
-        ulnet__xor_delta(&new_room_state, &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[session->frame_counter % ULNET_DELAY_BUFFER_SIZE], sizeof(sam2_room_t));
-
-        if (memcmp(&new_room_state, &session->room_we_are_in, sizeof(sam2_room_t)) != 0) {
-            SAM2_LOG_INFO("Something about the room we're in was changed by the authority");
-
-            // When the room changes reuse existing peer connections if possible
-            for (int j = 0; j < SAM2_TOTAL_PEERS; j++) {
-                for (int i = 0; i < SAM2_TOTAL_PEERS; i++) {
-                    if (new_room_state.peer_ids[j] == session->agent_peer_ids[i]) {
-                        if (new_room_state.peer_ids[j] <= SAM2_PORT_SENTINELS_MAX) continue;
-                        ulnet_swap_agent(session, j, i); // Note: This mutates session->agent_peer_ids
-                        break;
-                    }
-                }
-            }
-
-            // Create new connections for new peers and dispose of unneeded ones
-            int our_new_port = sam2_get_port_of_peer(&new_room_state, session->our_peer_id);
-            if (our_new_port != -1 && our_new_port < SAM2_SPECTATOR_START) {
-                for (int p = 0; p < SAM2_PORT_MAX; p++) {
-                    if (   new_room_state.peer_ids[p] > SAM2_PORT_SENTINELS_MAX
-                        && new_room_state.peer_ids[p] != session->our_peer_id
-                        && new_room_state.peer_ids[p] != session->agent_peer_ids[p]) {
-                        if (session->agent[p]) {
-                            ulnet_disconnect_peer(session, p);
-                        }
+        if (resync) {
+            ulnet__save_state_request_patch(session, save_state, save_state_size, save_state_frame);
+            session->flags &= ~ULNET_SESSION_FLAG_RESYNC_PENDING;
+        }
 
-                        // Convention: The peer with the lesser ID initiates ICE
-                        if (session->our_peer_id < new_room_state.peer_ids[p]) {
-                            ulnet_startup_ice_for_peer(session, new_room_state.peer_ids[p], p, NULL);
-                        }
-                    }
-                }
+        if (rollback_enabled) {
+            if (ulnet__rollback_confirmed_frame(session) < session->frame_counter) {
+                ulnet__rollback_save_state(session); // We're predicting someones input so we might have to come back to this frame
             }
 
-            for (int p = 0; p < SAM2_SPECTATOR_START; p++) {
-                if (new_room_state.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+            ulnet__rollback_collect_input(session);
+        }
 
-                if (new_room_state.peer_ids[p] != session->room_we_are_in.peer_ids[p]) {
-                    session->state[p].frame = SAM2_MAX(session->state[p].frame, session->frame_counter);
-                }
-            }
+        if (!(session->flags & ULNET_SESSION_FLAG_TICKED)) {
+            session->retro_run(session->user_ptr);
+        }
 
-            session->room_we_are_in = new_room_state;
-            if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
-                SAM2_LOG_INFO("Client %05" PRId16 " abandoned the room '%s'", session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX], session->room_we_are_in.name);
-                for (int peer_port = 0; peer_port < SAM2_ARRAY_LENGTH(session->agent); peer_port++) {
-                    if (session->agent[peer_port]) {
-                        ulnet_disconnect_peer(session, peer_port);
-                    }
-                    session->room_we_are_in.peer_ids[peer_port] = SAM2_PORT_AVAILABLE;
-                }
-                ulnet_session_init_defaulted(session);
-            }
+        if (authority_input_available) {
+            session->authority_next_frame_to_apply = session->frame_counter + 1;
+            ulnet__apply_room_xor_delta(session);
         }
 
         // Room could have changed at this point so recompute our_port
@@ -1283,17 +4779,30 @@ IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_S
             && our_port != -1
             && our_port < SAM2_SPECTATOR_START) {
             session->state[our_port].save_state_frame = save_state_frame;
-            session->state[our_port].save_state_hash[save_state_frame % ULNET_DELAY_BUFFER_SIZE] = ulnet_xxh32(save_state, save_state_size, 0);
-            //session->state[our_port].input_state_hash[save_state_frame % ULNET_DELAY_BUFFER_SIZE] = ulnet_xxh32(session->state[our_port].input_state, sizeof(session->state[our_port].input_state), 0);
+            // Filled in from the snapshot once a worker hashes it, a frame or two from now
+            session->state[our_port].save_state_hash[save_state_frame % ulnet_delay_buffer_size(session)] = 0;
+            //session->state[our_port].input_state_hash[save_state_frame % ulnet_delay_buffer_size(session)] = ulnet_xxh32(session->state[our_port].input_state, sizeof(session->state[our_port].input_state), 0);
         }
 
         if (save_state_allocated) {
-            free(save_state);
+            ulnet__transfer_buffer_release(session, save_state);
             save_state = NULL;
         }
 
         // Ideally I'd place this right after ticking the core, but we need to update the room state first
         session->frame_counter++;
+        session->rollback_depth[session->frame_counter % ULNET_MAX_SAMPLE_SIZE] = 0;
+
+        if (current_time_unix_usec - session->rollback_window_start_usec >= 1000000) {
+            session->rollback_resimulated_frames_per_second = session->rollback_window_start_usec == 0 ? 0.0
+                : session->rollback_window_resimulated_frames * 1e6 / (current_time_unix_usec - session->rollback_window_start_usec);
+            session->rollback_window_start_usec = current_time_unix_usec;
+            session->rollback_window_resimulated_frames = 0;
+        }
+
+        if (resync) {
+            session->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL; // Until the authority sends back the chunks we got wrong
+        }
     }
 
     return status;
@@ -1308,6 +4817,66 @@ ULNET_LINKAGE void ulnet_swap_agent(ulnet_session_t *session, int peer_existing_
     ULNET__SWAP(session->reliable_tx_head[peer_existing_port], session->reliable_tx_head[peer_new_port], uint16_t);
     ULNET__SWAP(session->reliable_rx_head[peer_existing_port], session->reliable_rx_head[peer_new_port], uint16_t);
     ULNET__SWAP(session->agent_peer_ids[peer_existing_port], session->agent_peer_ids[peer_new_port], int64_t);
+    ULNET__SWAP(session->rtt_sample_usec[peer_existing_port], session->rtt_sample_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->rtt_smoothed_usec[peer_existing_port], session->rtt_smoothed_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->rtt_variance_usec[peer_existing_port], session->rtt_variance_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->peer_baseline_frame[peer_existing_port], session->peer_baseline_frame[peer_new_port], int64_t);
+    ULNET__SWAP(session->peer_baseline_xxhash[peer_existing_port], session->peer_baseline_xxhash[peer_new_port], uint32_t);
+    ULNET__SWAP(session->peer_needs_sync_since_usec[peer_existing_port], session->peer_needs_sync_since_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->peer_save_state_tree[peer_existing_port], session->peer_save_state_tree[peer_new_port], ulnet_save_state_tree_t);
+    ULNET__SWAP(session->peer_dictionary_id[peer_existing_port], session->peer_dictionary_id[peer_new_port], uint32_t);
+    ULNET__SWAP(session->input_last_arrival_usec[peer_existing_port], session->input_last_arrival_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->input_interarrival_usec[peer_existing_port], session->input_interarrival_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->input_jitter_usec[peer_existing_port], session->input_jitter_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->frame_advantage_usec[peer_existing_port], session->frame_advantage_usec[peer_new_port], int32_t);
+    ULNET__SWAP(session->peer_frame_advantage_usec[peer_existing_port], session->peer_frame_advantage_usec[peer_new_port], int32_t);
+    ULNET__SWAP(session->peer_frame_advantage_frame[peer_existing_port], session->peer_frame_advantage_frame[peer_new_port], int64_t);
+    ULNET__SWAP(session->reliable_rto_started_usec[peer_existing_port], session->reliable_rto_started_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->reliable_rto_backoff[peer_existing_port], session->reliable_rto_backoff[peer_new_port], int);
+    ULNET__SWAP(session->reliable_tx_delivered_send_usec[peer_existing_port], session->reliable_tx_delivered_send_usec[peer_new_port], int64_t);
+    for (int i = 0; i < ULNET_RELIABLE_ACK_BUFFER_SIZE / 64; i++) {
+        ULNET__SWAP(session->reliable_tx_sacked[peer_existing_port][i], session->reliable_tx_sacked[peer_new_port][i], uint64_t);
+        ULNET__SWAP(session->reliable_rx_held[peer_existing_port][i], session->reliable_rx_held[peer_new_port][i], uint64_t);
+    }
+    ULNET__SWAP(session->unreliable_tx_next_seq[peer_existing_port], session->unreliable_tx_next_seq[peer_new_port], uint16_t);
+    ULNET__SWAP(session->unreliable_rx_seq[peer_existing_port], session->unreliable_rx_seq[peer_new_port], uint16_t);
+    ULNET__SWAP(session->unreliable_rx_expected[peer_existing_port], session->unreliable_rx_expected[peer_new_port], int);
+    ULNET__SWAP(session->unreliable_rx_received[peer_existing_port], session->unreliable_rx_received[peer_new_port], int);
+    ULNET__SWAP(session->packet_loss[peer_existing_port], session->packet_loss[peer_new_port], float);
+    ULNET__SWAP(session->peer_packet_loss[peer_existing_port], session->peer_packet_loss[peer_new_port], float);
+    ULNET__SWAP(session->peer_save_state_transfer_id[peer_existing_port], session->peer_save_state_transfer_id[peer_new_port], uint8_t);
+    for (int i = 0; i < ULNET_RELIABLE_ACK_BUFFER_SIZE; i++) {
+        ULNET__SWAP(session->reliable_tx_send_time_usec[peer_existing_port][i], session->reliable_tx_send_time_usec[peer_new_port][i], int64_t);
+        ULNET__SWAP(session->reliable_tx_last_send_usec[peer_existing_port][i], session->reliable_tx_last_send_usec[peer_new_port][i], int64_t);
+        ULNET__SWAP(session->reliable_tx_packet_history[peer_existing_port][i], session->reliable_tx_packet_history[peer_new_port][i], arena_ref_t);
+        ULNET__SWAP(session->reliable_rx_packet_history[peer_existing_port][i], session->reliable_rx_packet_history[peer_new_port][i], arena_ref_t);
+    }
+    ULNET__SWAP(session->peer_save_state_encoding[peer_existing_port], session->peer_save_state_encoding[peer_new_port], int);
+    ULNET__SWAP(session->peer_save_state_frame[peer_existing_port], session->peer_save_state_frame[peer_new_port], int64_t);
+    ULNET__SWAP(session->bulk_cursor[peer_existing_port], session->bulk_cursor[peer_new_port], int);
+    ULNET__SWAP(session->bulk_tokens_bytes[peer_existing_port], session->bulk_tokens_bytes[peer_new_port], double);
+    ULNET__SWAP(session->bulk_tokens_usec[peer_existing_port], session->bulk_tokens_usec[peer_new_port], int64_t);
+    ULNET__SWAP(session->bulk_cwnd_bytes[peer_existing_port], session->bulk_cwnd_bytes[peer_new_port], double);
+    ULNET__SWAP(session->bulk_queuing_delay_usec[peer_existing_port], session->bulk_queuing_delay_usec[peer_new_port], int32_t);
+    ULNET__SWAP(session->bulk_feedback_usec[peer_existing_port], session->bulk_feedback_usec[peer_new_port], int64_t);
+    uint64_t bulk_pending[FEC_PACKET_GROUPS_MAX][4];
+    memcpy(bulk_pending, session->bulk_pending[peer_existing_port], sizeof(bulk_pending));
+    memcpy(session->bulk_pending[peer_existing_port], session->bulk_pending[peer_new_port], sizeof(bulk_pending));
+    memcpy(session->bulk_pending[peer_new_port], bulk_pending, sizeof(bulk_pending));
+
+    #define ULNET__SWAP_BIT(bitfield) do { \
+        uint64_t differ = (((bitfield) >> peer_existing_port) ^ ((bitfield) >> peer_new_port)) & 1; \
+        (bitfield) ^= (differ << peer_existing_port) | (differ << peer_new_port); \
+    } while(0)
+    ULNET__SWAP_BIT(session->peer_baseline_advertised_bitfield);
+    ULNET__SWAP_BIT(session->peer_needs_sync_bitfield);
+    ULNET__SWAP_BIT(session->packet_loss_measured_bitfield);
+    ULNET__SWAP_BIT(session->peer_packet_loss_reported_bitfield);
+    ULNET__SWAP_BIT(session->peer_save_state_sent_bitfield);
+    ULNET__SWAP_BIT(session->bulk_pending_bitfield);
+    ULNET__SWAP_BIT(session->save_state_encode_job.peers);
+    ULNET__SWAP_BIT(session->bulk_slow_start_bitfield);
+    ULNET__SWAP_BIT(session->peer_frame_advantage_bitfield);
 }
 
 static void ulnet_peer_init_defaulted(ulnet_session_t *session, int peer_port) {
@@ -1315,6 +4884,40 @@ static void ulnet_peer_init_defaulted(ulnet_session_t *session, int peer_port) {
     session->reliable_tx_next_seq [peer_port] = 0;
     session->reliable_tx_head[peer_port] = 0;
     session->reliable_rx_head[peer_port] = 0;
+    memset(session->reliable_tx_send_time_usec[peer_port], 0, sizeof(session->reliable_tx_send_time_usec[peer_port])); // Stale ones would turn into bogus RTT samples
+    session->reliable_rto_backoff[peer_port] = 0;
+    session->reliable_tx_delivered_send_usec[peer_port] = 0;
+    memset(session->reliable_tx_sacked[peer_port], 0, sizeof(session->reliable_tx_sacked[peer_port]));
+    memset(session->reliable_rx_held[peer_port], 0, sizeof(session->reliable_rx_held[peer_port]));
+    session->peer_baseline_advertised_bitfield &= ~(1ULL << peer_port);
+    session->peer_needs_sync_since_usec[peer_port] = 0;
+    session->peer_dictionary_id[peer_port] = 0;
+    session->peer_save_state_tree[peer_port].chunk_count = 0; // The hashes buffer is kept for the next peer on this port
+    session->rtt_sample_usec[peer_port] = 0;
+    session->rtt_smoothed_usec[peer_port] = 0;
+    session->rtt_variance_usec[peer_port] = 0;
+    session->input_last_arrival_usec[peer_port] = 0;
+    session->input_interarrival_usec[peer_port] = 0;
+    session->input_jitter_usec[peer_port] = 0;
+    session->frame_advantage_usec[peer_port] = 0;
+    session->peer_frame_advantage_frame[peer_port] = 0;
+    session->peer_frame_advantage_bitfield &= ~(1ULL << peer_port);
+    session->unreliable_tx_next_seq[peer_port] = 0;
+    session->unreliable_rx_seq[peer_port] = 0;
+    session->unreliable_rx_expected[peer_port] = 0;
+    session->unreliable_rx_received[peer_port] = 0;
+    session->packet_loss_measured_bitfield &= ~(1ULL << peer_port);
+    session->peer_packet_loss_reported_bitfield &= ~(1ULL << peer_port);
+    session->peer_save_state_transfer_id[peer_port] = 0;
+    session->peer_save_state_sent_bitfield &= ~(1ULL << peer_port);
+    session->bulk_pending_bitfield &= ~(1ULL << peer_port);
+    session->save_state_encode_job.peers &= ~(1ULL << peer_port);
+    session->bulk_cwnd_bytes[peer_port] = 0.0;
+    session->bulk_slow_start_bitfield &= ~(1ULL << peer_port);
+    session->bulk_queuing_delay_usec[peer_port] = 0;
+    if (peer_port == SAM2_AUTHORITY_INDEX) {
+        session->remote_savestate_loaded_transfer_id = -1; // A new authority counts from scratch
+    }
 }
 
 ULNET_LINKAGE void ulnet_disconnect_peer(ulnet_session_t *session, int peer_port) {
@@ -1341,7 +4944,7 @@ static sam2_room_t ulnet__infer_future_room_we_are_in(ulnet_session_t *session)
         for (int64_t frame = session->frame_counter+1LL; frame < session->state[SAM2_AUTHORITY_INDEX].frame; frame++) {
             ulnet__xor_delta(
                 &future_room_we_are_in,
-                &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[frame % ULNET_DELAY_BUFFER_SIZE],
+                &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[frame % ulnet_delay_buffer_size(session)],
                 sizeof(session->room_we_are_in)
             );
         }
@@ -1350,12 +4953,6 @@ static sam2_room_t ulnet__infer_future_room_we_are_in(ulnet_session_t *session)
     return future_room_we_are_in;
 }
 
-static inline void ulnet__reset_save_state_bookkeeping(ulnet_session_t *session) {
-    session->remote_packet_groups = FEC_PACKET_GROUPS_MAX;
-    session->remote_savestate_transfer_offset = 0;
-    memset(session->fec_index_counter, 0, sizeof(session->fec_index_counter));
-}
-
 ULNET_LINKAGE void ulnet_session_tear_down(ulnet_session_t *session) {
     if (session->agent[SAM2_AUTHORITY_INDEX]) {
         ulnet_message_send(session, SAM2_AUTHORITY_INDEX, (const uint8_t *) ulnet_exit_header);
@@ -1370,7 +4967,19 @@ ULNET_LINKAGE void ulnet_session_tear_down(ulnet_session_t *session) {
     session->room_we_are_in.flags &= ~SAM2_FLAG_ROOM_IS_NETWORK_HOSTED;
     session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = session->our_peer_id;
     session->frame_counter = 0;
+    session->authority_next_frame_to_apply = 0;
     session->state[SAM2_AUTHORITY_INDEX].frame = 0;
+    session->flags &= ~(ULNET_SESSION_FLAG_MISPREDICTED | ULNET_SESSION_FLAG_BASELINE_ADVERTISED
+                        | ULNET_SESSION_FLAG_RESYNC_PENDING | ULNET_SESSION_FLAG_RESYNC_REQUESTED);
+
+    // Baselines are deliberately kept, rejoining the same game can then be a delta
+    ulnet__save_state_encodings_free(session);
+    ulnet__save_state_snapshots_discard(session, true);
+    for (int i = 0; i < ULNET_ROLLBACK_BUFFER_SIZE; i++) {
+        free(session->rollback_save_state[i]);
+        session->rollback_save_state[i] = NULL;
+        session->rollback_save_state_capacity[i] = 0;
+    }
 }
 
 ULNET_LINKAGE void ulnet_session_init_defaulted(ulnet_session_t *session) {
@@ -1381,14 +4990,24 @@ ULNET_LINKAGE void ulnet_session_init_defaulted(ulnet_session_t *session) {
     }
 
     memset(&session->state, 0, sizeof(session->state));
+    memset(&session->frame_pacer, 0, sizeof(session->frame_pacer));
 
     memset(session->state_packet_history, 0, sizeof(session->state_packet_history));
 
     session->frame_counter = 0;
+    session->authority_next_frame_to_apply = 0;
+    session->flags &= ~(ULNET_SESSION_FLAG_MISPREDICTED | ULNET_SESSION_FLAG_BASELINE_ADVERTISED
+                        | ULNET_SESSION_FLAG_RESYNC_PENDING | ULNET_SESSION_FLAG_RESYNC_REQUESTED);
     session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = session->our_peer_id;
-    session->reliable_retransmit_delay_microseconds = 50000; // 50 milliseconds
+    session->reliable_retransmit_delay_microseconds = 20000; // Acks ride on the packets we get every frame so RTT samples can't resolve much below this
+    session->remote_savestate_loaded_transfer_id = -1;
+    session->save_state_repair_delay_microseconds = 20000; // 20 milliseconds
+    session->bulk_send_bytes_per_second = 4000000; // 32 Mbit/s, the most ULNET_SESSION_FLAG_DELAY_BASED_PACING ramps up to
+    session->ledbat_base_delay_minute = 0; // The clock offset is baked into the base delay so it doesn't carry over to another authority
+    session->ledbat_current_delay_count = 0;
 
     ulnet__reset_save_state_bookkeeping(session);
+    ulnet__pool_session_reference(session, true);
 }
 
 // MARK: libjuice callbacks
@@ -1406,6 +5025,7 @@ static void ulnet__on_state_changed(juice_agent_t *agent, juice_state_t state, v
         && session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]) {
         SAM2_LOG_INFO("Setting peer needs sync bit for peer %05" PRId16, session->our_peer_id);
         session->peer_needs_sync_bitfield |= (1ULL << p);
+        session->peer_needs_sync_since_usec[p] = ulnet__get_unix_time_microseconds();
     } else if (state == JUICE_STATE_FAILED) {
         //ulnet_disconnect_peer(session, p); // This is called from within juice_user_poll()... So freeing the agent here isn't safe
         session->peer_pending_disconnect_bitfield |= (1ULL << p);
@@ -1422,66 +5042,542 @@ static void ulnet__on_candidate(juice_agent_t *agent, const char *sdp, void *use
         return;
     }
 
-    sam2_signal_message_t response = { SAM2_SIGN_HEADER };
+    sam2_signal_message_t response = { SAM2_SIGN_HEADER };
+
+    response.peer_id = session->agent_peer_ids[p];
+    if (strlen(sdp) < sizeof(response.ice_sdp)) {
+        strcpy(response.ice_sdp, sdp);
+        session->sam2_send_callback(session->user_ptr, (char *) &response);
+    } else {
+        SAM2_LOG_ERROR("Candidate too large");
+        return;
+    }
+}
+
+static void ulnet__on_gathering_done(juice_agent_t *agent, void *user_ptr) {
+    ulnet_session_t *session = (ulnet_session_t *) user_ptr;
+
+    int p;
+    SAM2_LOCATE(session->agent, agent, p);
+    if (p == -1) {
+        SAM2_LOG_ERROR("No agent found");
+        return;
+    }
+
+    sam2_signal_message_t response = { SAM2_SIGN_HEADER };
+
+    response.peer_id = session->agent_peer_ids[p];
+    session->sam2_send_callback(session->user_ptr, (char *) &response);
+}
+
+// Rebuilds a savestate from our copy of the baseline and the chunks that differ, returns its size or -1 if the patch doesn't fit
+static int64_t ulnet__save_state_patch_apply(uint8_t *save_state, int64_t save_state_size, const uint8_t *baseline, size_t baseline_size,
+    const uint8_t *patch, size_t patch_size, int64_t chunk_size) {
+    if (chunk_size <= 0 || save_state_size < 0 || (size_t) save_state_size != baseline_size) return -1;
+
+    int64_t chunk_count = (save_state_size + chunk_size - 1) / chunk_size;
+    size_t offset_in_patch = (size_t) (chunk_count + 7) / 8;
+    if (offset_in_patch > patch_size) return -1;
+
+    memcpy(save_state, baseline, save_state_size);
+    for (int64_t i = 0; i < chunk_count; i++) {
+        if (!(patch[i / 8] & (1 << (i % 8)))) continue;
+
+        size_t offset = (size_t) (i * chunk_size);
+        size_t size = SAM2_MIN((size_t) save_state_size - offset, (size_t) chunk_size);
+        if (patch_size - offset_in_patch < size) return -1;
+
+        memcpy(save_state + offset, patch + offset_in_patch, size);
+        offset_in_patch += size;
+    }
+
+    return offset_in_patch == patch_size ? save_state_size : -1;
+}
+
+static void ulnet__check_for_desync(ulnet_state_t *our_state, ulnet_state_t *their_state, int64_t delay_buffer_size, int64_t *our_desync_frame) {
+    int64_t desync_frame = 0;
+    int64_t latest_common_frame = SAM2_MIN(our_state->save_state_frame, their_state->save_state_frame);
+    int64_t frame_difference = SAM2_ABS(our_state->save_state_frame - their_state->save_state_frame);
+    int64_t total_frames_to_compare = delay_buffer_size - frame_difference;
+
+    for (int f = total_frames_to_compare-1; f >= 0 ; f--) { // Start from the oldest frame
+        int64_t frame = latest_common_frame - f;
+        int64_t frame_index = frame % delay_buffer_size;
+        if (frame < 0) continue; // Nothing was hashed before the session started
+
+        if (our_state->input_state_hash[frame_index] != their_state->input_state_hash[frame_index]) {
+            SAM2_LOG_ERROR("Input state hash mismatch for frame %" PRId64 " Our hash: %" PRIx32 " Their hash: %" PRIx32 "",
+                frame, our_state->input_state_hash[frame_index], their_state->input_state_hash[frame_index]);
+        } else if (   our_state->save_state_hash[frame_index] != 0
+                   && their_state->save_state_hash[frame_index] != 0
+                   && our_state->save_state_hash[frame_index] != their_state->save_state_hash[frame_index]) {
+            SAM2_LOG_ERROR("Save state hash mismatch for frame %" PRId64 " Our hash: %08" PRIx32 " Their hash: %08" PRIx32,
+                frame, our_state->save_state_hash[frame_index], their_state->save_state_hash[frame_index]);
+            desync_frame = frame;
+            break;
+        }
+    }
+
+    if (desync_frame == 0 && *our_desync_frame != 0) {
+        SAM2_LOG_INFO("Peer resynced on frame %" PRId64, total_frames_to_compare-1);
+    }
+
+    *our_desync_frame = desync_frame;
+}
+
+// Where compressed_data starts in each payload version
+static const size_t ulnet__save_state_payload_header_size[ULNET_SAVE_STATE_PAYLOAD_VERSION + 1] = {
+    offsetof(savestate_transfer_payload_t, baseline_frame),
+    offsetof(savestate_transfer_payload_t, patch_size),
+    offsetof(savestate_transfer_payload_t, dictionary_id),
+    sizeof(savestate_transfer_payload_t),
+};
+
+// Rewrites a payload from an older version in place into the current layout, the fields it predates are zeroed
+// There must be room for sizeof(savestate_transfer_payload_t) more bytes than it takes up
+static void ulnet__save_state_payload_upgrade(savestate_transfer_payload_t *payload, int payload_version) {
+    size_t header_size = ulnet__save_state_payload_header_size[payload_version];
+    if (header_size == sizeof(*payload)) return;
+
+    memmove(payload->compressed_data, (uint8_t *) payload + header_size, (size_t) payload->total_size_bytes - header_size);
+    memset((uint8_t *) payload + header_size, 0, sizeof(*payload) - header_size);
+    payload->total_size_bytes += sizeof(*payload) - header_size;
+    if (payload_version < 1) {
+        payload->baseline_frame = -1;
+    }
+}
+
+// Tracks how much longer than the best case the authority's fragments take to reach us and reports it back every so often
+static void ulnet__ledbat_sample(ulnet_session_t *session, uint32_t send_time_usec, int64_t current_time_usec) {
+    int32_t delay_usec = (int32_t) ((uint32_t) current_time_usec - send_time_usec); // Peers' clocks are within half an hour of each other
+    int64_t minute = current_time_usec / 60000000;
+
+    if (session->ledbat_base_delay_minute == 0) {
+        for (int i = 0; i < ULNET_LEDBAT_BASE_HISTORY; i++) session->ledbat_base_delay_usec[i] = INT32_MAX;
+        session->ledbat_base_delay_minute = minute;
+    } else if (session->ledbat_base_delay_minute != minute) {
+        memmove(&session->ledbat_base_delay_usec[1], &session->ledbat_base_delay_usec[0], (ULNET_LEDBAT_BASE_HISTORY - 1) * sizeof(int32_t));
+        session->ledbat_base_delay_usec[0] = INT32_MAX;
+        session->ledbat_base_delay_minute = minute;
+    }
+
+    session->ledbat_base_delay_usec[0] = SAM2_MIN(session->ledbat_base_delay_usec[0], delay_usec);
+    session->ledbat_current_delay_usec[session->ledbat_current_delay_count++ % ULNET_LEDBAT_CURRENT_FILTER] = delay_usec;
+
+    int32_t base_delay_usec = INT32_MAX, current_delay_usec = INT32_MAX;
+    for (int i = 0; i < ULNET_LEDBAT_BASE_HISTORY; i++) base_delay_usec = SAM2_MIN(base_delay_usec, session->ledbat_base_delay_usec[i]);
+    for (int i = 0; i < SAM2_MIN(session->ledbat_current_delay_count, ULNET_LEDBAT_CURRENT_FILTER); i++) {
+        current_delay_usec = SAM2_MIN(current_delay_usec, session->ledbat_current_delay_usec[i]);
+    }
+    session->ledbat_queuing_delay_usec = current_delay_usec - base_delay_usec;
+
+    if (current_time_usec - session->ledbat_feedback_sent_usec >= ULNET_LEDBAT_FEEDBACK_USEC) {
+        // Stale feedback is useless so it isn't worth retransmitting
+        ulnet_delay_message_t message = { ULNET_DLAY_HEADER };
+        message.queuing_delay_usec = session->ledbat_queuing_delay_usec;
+        ulnet_reliable_send_with_acks_only(session, SAM2_AUTHORITY_INDEX, (const uint8_t *) &message, sizeof(message));
+        session->ledbat_feedback_sent_usec = current_time_usec;
+    }
+}
+
+// Data blocks go out front to back so frames of a full savestate are decompressed as soon as the blocks they span have all arrived
+// The payload hash isn't checked until the end, but that only decides whether we load what we decompressed
+static void ulnet__save_state_stream(ulnet_session_t *session) {
+    int packet_groups = session->remote_packet_groups;
+    int64_t data_blocks = (int64_t) session->remote_savestate_k * packet_groups;
+    while (session->remote_savestate_stream_blocks < data_blocks) {
+        int group = (int) (session->remote_savestate_stream_blocks % packet_groups);
+        int index = (int) (session->remote_savestate_stream_blocks / packet_groups);
+        if (!(session->remote_savestate_received[group][index / 64] & (1ULL << (index % 64)))) break;
+        session->remote_savestate_stream_blocks++;
+    }
+
+    const savestate_transfer_payload_t *payload = (const savestate_transfer_payload_t *) session->remote_savestate_transfer;
+    int64_t available = session->remote_savestate_stream_blocks * session->remote_savestate_block_size;
+    if (   available < (int64_t) sizeof(savestate_transfer_payload_t)
+        || session->remote_savestate_payload_version != ULNET_SAVE_STATE_PAYLOAD_VERSION) return;
+
+    int64_t compressed_end = (int64_t) sizeof(savestate_transfer_payload_t) + payload->compressed_savestate_size;
+    if (   payload->baseline_frame != -1
+        || (payload->dictionary_id != 0 && payload->dictionary_id != session->zstd_dictionary_id)
+        || payload->decompressed_savestate_size <= 0
+        || payload->compressed_savestate_size <= 0
+        || compressed_end > data_blocks * session->remote_savestate_block_size) {
+        return; // Decompressed once all of it is here
+    }
+
+    if (session->remote_savestate_stream == NULL) {
+        session->remote_savestate_stream = ulnet__transfer_buffer_acquire(session, payload->decompressed_savestate_size);
+    }
+
+    available = SAM2_MIN(available, compressed_end) - (int64_t) sizeof(savestate_transfer_payload_t);
+    while (   session->remote_savestate_stream_offset < available
+           && session->remote_savestate_stream_chunks < ULNET_SAVE_STATE_COMPRESS_CHUNKS_MAX) {
+        const uint8_t *frame = payload->compressed_data + session->remote_savestate_stream_offset;
+        size_t frame_size, content_size;
+        if (!ulnet__zstd_frame_extent(frame, (size_t) (available - session->remote_savestate_stream_offset), false,
+                                      (size_t) (payload->decompressed_savestate_size - session->remote_savestate_stream_size), &frame_size, &content_size)) {
+            break; // Not all here yet or something we leave to the final decompress to report
+        }
+
+        size_t ret = ulnet__zstd_decompress_frame(ulnet__zstd_dctx(session), payload->dictionary_id ? session->zstd_ddict : NULL,
+            session->remote_savestate_stream + session->remote_savestate_stream_size, content_size, frame, frame_size);
+        if (ZSTD_isError(ret)) break;
+
+        session->remote_savestate_stream_offset += frame_size;
+        session->remote_savestate_stream_size += content_size;
+        session->remote_savestate_stream_chunks++;
+    }
+}
+
+static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref_t packet_ref);
+// MARK: UDP Packet Processing
+// Savestate fragments skip the arena, each one is copied once straight to its final offset in the reassembly buffer
+static void ulnet__receive_save_state_fragment(ulnet_session_t *session, int p, const uint8_t *data, size_t size, bool held) {
+    uint8_t channel_and_flags = data[0];
+
+    if (p != SAM2_AUTHORITY_INDEX) {
+        printf("Received savestate transfer packet from non-authority agent\n");
+        return;
+    }
+
+    int version = (channel_and_flags & ULNET_SAVESTATE_TRANSFER_VERSION_MASK) >> ULNET_SAVESTATE_TRANSFER_VERSION_SHIFT;
+    if (version > ULNET_SAVESTATE_TRANSFER_VERSION) {
+        SAM2_LOG_WARN("Recv savestate transfer packet from a newer protocol version %d", version);
+        return;
+    }
+
+    size_t header_size = version == 0 ? ULNET_SAVESTATE_TRANSFER_V0_HEADER_SIZE
+                       : version == 1 ? ULNET_SAVESTATE_TRANSFER_V1_HEADER_SIZE
+                       : version == 2 ? ULNET_SAVESTATE_TRANSFER_V2_HEADER_SIZE
+                       : sizeof(ulnet_save_state_packet_header_t);
+    if (size <= header_size) {
+        SAM2_LOG_WARN("Recv savestate transfer packet with size smaller than header");
+        return;
+    }
+
+    if (size > ULNET_PACKET_SIZE_BYTES_MAX) {
+        SAM2_LOG_WARN("Recv savestate transfer packet potentially larger than MTU");
+        return;
+    }
+
+    ulnet_save_state_packet_header_t savestate_transfer_header;
+    savestate_transfer_header.redundant_blocks = FEC_REDUNDANT_BLOCKS; // Older versions don't send it
+    memcpy(&savestate_transfer_header, data, header_size); // Strict-aliasing
+
+    if (version >= 3 && !held) {
+        ulnet__ledbat_sample(session, savestate_transfer_header.send_time_usec_le, ulnet__get_unix_time_microseconds());
+    }
+
+    int payload_version = version >= 1 ? savestate_transfer_header.payload_version : 0;
+    if (payload_version > ULNET_SAVE_STATE_PAYLOAD_VERSION) {
+        SAM2_LOG_WARN("Recv savestate transfer packet with a newer payload version %d", payload_version);
+        return;
+    }
+
+    // Parity we didn't need from a transfer we already loaded, it would otherwise start a new one
+    int transfer_id = version >= 2 ? savestate_transfer_header.transfer_id : -1;
+    if (transfer_id == -1 ? session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+                          : transfer_id == session->remote_savestate_loaded_transfer_id) {
+        return;
+    }
+
+    int redundant_blocks = savestate_transfer_header.redundant_blocks;
+    if (redundant_blocks > ULNET_FEC_REDUNDANT_BLOCKS_MAX) {
+        SAM2_LOG_WARN("Received savestate transfer packet with too many redundant blocks %d", redundant_blocks);
+        return;
+    }
+
+    uint8_t sequence_hi = 0;
+    int k = GF_SIZE - redundant_blocks;
+    int packet_groups = -1;
+    if (channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_MAX) {
+        if (channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0) {
+            packet_groups = savestate_transfer_header.packet_groups;
+        } else {
+            sequence_hi = savestate_transfer_header.sequence_hi;
+        }
+    } else {
+        k = savestate_transfer_header.reed_solomon_k;
+        packet_groups = 1; // k != 239 => 1 packet group
+    }
+
+    int n = version < 2 ? k + k * FEC_REDUNDANT_BLOCKS / (GF_SIZE - FEC_REDUNDANT_BLOCKS) : k + redundant_blocks;
+    int block_size = (int) (size - header_size);
+    uint8_t sequence_lo = savestate_transfer_header.sequence_lo;
+
+    if (sequence_hi >= FEC_PACKET_GROUPS_MAX) {
+        SAM2_LOG_WARN("Received savestate transfer packet with sequence_hi >= FEC_PACKET_GROUPS_MAX");
+        return;
+    }
+
+    if (k == 0 || n > GF_SIZE || sequence_lo >= n || packet_groups == 0 || packet_groups > FEC_PACKET_GROUPS_MAX) {
+        SAM2_LOG_WARN("Received savestate transfer packet with an invalid layout k=%d sequence_lo=%hhu", k, sequence_lo);
+        return;
+    }
+
+    if (session->remote_savestate_transfer == NULL) {
+        if (packet_groups == -1) {
+            // Every packet from the first group tells us the group count. Until one arrives we can't know where this goes so hold on to it
+            if (session->remote_savestate_held == NULL) {
+                session->remote_savestate_held = ulnet__transfer_buffer_acquire(session, ULNET_SAVE_STATE_HELD_FRAGMENTS_MAX * ULNET_PACKET_SIZE_BYTES_MAX);
+            }
+
+            if (session->remote_savestate_held_count < ULNET_SAVE_STATE_HELD_FRAGMENTS_MAX) {
+                int i = session->remote_savestate_held_count++;
+                memcpy(session->remote_savestate_held + (size_t) i * ULNET_PACKET_SIZE_BYTES_MAX, data, size);
+                session->remote_savestate_held_size[i] = (uint16_t) size;
+            }
+            session->remote_savestate_last_fragment_usec = ulnet__get_unix_time_microseconds();
+            return;
+        }
+
+        session->remote_packet_groups = packet_groups;
+        session->remote_savestate_payload_version = payload_version;
+        session->remote_savestate_block_size = block_size;
+        session->remote_savestate_k = k;
+        session->remote_savestate_n = n;
+        session->remote_savestate_transfer_id = transfer_id;
+        // With a whole payload header to spare so older payload versions can be upgraded in place
+        session->remote_savestate_transfer = ulnet__transfer_buffer_acquire(session, (size_t) packet_groups * n * block_size + sizeof(savestate_transfer_payload_t));
+
+        // Held fragments are never from the first group so none of them can finish the transfer out from under us
+        int held_count = session->remote_savestate_held_count;
+        session->remote_savestate_held_count = 0;
+        for (int i = 0; i < held_count; i++) {
+            ulnet__receive_save_state_fragment(session, p, session->remote_savestate_held + (size_t) i * ULNET_PACKET_SIZE_BYTES_MAX,
+                session->remote_savestate_held_size[i], true);
+        }
+    }
+
+    if (   block_size != session->remote_savestate_block_size
+        || k != session->remote_savestate_k
+        || n != session->remote_savestate_n
+        || (packet_groups != -1 && packet_groups != session->remote_packet_groups)
+        || sequence_hi >= session->remote_packet_groups
+        || payload_version != session->remote_savestate_payload_version
+        || transfer_id != session->remote_savestate_transfer_id) {
+        // Without transfer ids all we can go on is that the authority stops sending the old transfer once it gives up repairing it
+        bool new_transfer = transfer_id == -1 ? session->remote_savestate_repair_requests > 0
+                                              : (int8_t) (transfer_id - session->remote_savestate_transfer_id) > 0;
+        if (!new_transfer || packet_groups == -1 || held) {
+            SAM2_LOG_WARN("Received savestate transfer packet that doesn't match the transfer in progress");
+            return;
+        }
+
+        // The authority couldn't repair the old transfer or had a newer savestate for us and started a new one
+        SAM2_LOG_INFO("Dropping the savestate transfer in progress for a new one");
+        ulnet__reset_save_state_bookkeeping(session);
+        ulnet__receive_save_state_fragment(session, p, data, size, true);
+        return;
+    }
+
+    if (session->fec_index_counter[sequence_hi] == k) {
+        // We already have received enough Reed-Solomon blocks to decode the payload; we can ignore this packet
+        return;
+    }
+
+    uint64_t *received = &session->remote_savestate_received[sequence_hi][sequence_lo / 64];
+    if (*received & (1ULL << (sequence_lo % 64))) {
+        return; // Duplicate
+    }
+    *received |= 1ULL << (sequence_lo % 64);
+
+    SAM2_LOG_DEBUG("Received savestate packet sequence_hi: %hhu sequence_lo: %hhu", sequence_hi, sequence_lo);
+    session->remote_savestate_last_fragment_usec = ulnet__get_unix_time_microseconds();
+
+    uint8_t *transfer = session->remote_savestate_transfer;
+    memcpy(transfer + ulnet__logical_partition_offset_bytes(sequence_hi, sequence_lo, block_size, session->remote_packet_groups),
+        data + header_size, block_size);
+
+    session->remote_savestate_transfer_offset += size;
+    session->fec_index[sequence_hi][session->fec_index_counter[sequence_hi]++] = sequence_lo;
+
+    ulnet__fec_job_t fec_job = {
+        fec_get(k, n), transfer, session->fec_index, session->remote_savestate_received,
+        k, n, block_size, session->remote_packet_groups
+    };
+    ulnet__fec_fold_block(&fec_job, sequence_hi, sequence_lo, session->fec_index_counter[sequence_hi]);
+
+    if (sequence_lo < k) {
+        ulnet__save_state_stream(session);
+    }
+
+    if (session->fec_index_counter[sequence_hi] < k) {
+        fec_free(fec_job.rs_code);
+        return;
+    }
+
+    SAM2_LOG_DEBUG("Received all the savestate data for packet group: %hhu", sequence_hi);
+
+    bool all_data_received = true;
+    for (int i = 0; i < session->remote_packet_groups; i++) {
+        all_data_received &= session->fec_index_counter[i] >= k;
+    }
+
+    if (!all_data_received) {
+        fec_free(fec_job.rs_code);
+        return;
+    }
+
+    // Folding did almost all of the work already, what's left is solving a small system per group
+    ulnet__parallel_for(ulnet__fec_decode_group, &fec_job, session->remote_packet_groups);
+    fec_free(fec_job.rs_code);
+
+    uint32_t their_savestate_transfer_payload_xxhash = 0;
+    uint32_t   our_savestate_transfer_payload_xxhash = 0;
+    size_t ret = 0;
+    uint64_t decompress_start = 0;
+    unsigned char *save_state_data = NULL;
+    savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) transfer;
+    session->remote_savestate_loaded_transfer_id = session->remote_savestate_transfer_id;
+
+    SAM2_LOG_INFO("Received savestate transfer payload for frame %" PRId64 "", savestate_transfer_payload->frame_counter);
+
+    if (   savestate_transfer_payload->total_size_bytes > (int64_t) k * block_size * session->remote_packet_groups
+        || savestate_transfer_payload->total_size_bytes < (int64_t) ulnet__save_state_payload_header_size[session->remote_savestate_payload_version]) {
+        SAM2_LOG_ERROR("Savestate transfer payload total size would out-of-bounds when computing hash: %" PRId64 "", savestate_transfer_payload->total_size_bytes);
+        goto cleanup;
+    }
+
+    their_savestate_transfer_payload_xxhash = savestate_transfer_payload->xxhash;
+    savestate_transfer_payload->xxhash = 0; // Needed to recompute the hash correctly
+    our_savestate_transfer_payload_xxhash = ulnet_xxh32(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
 
-    response.peer_id = session->agent_peer_ids[p];
-    if (strlen(sdp) < sizeof(response.ice_sdp)) {
-        strcpy(response.ice_sdp, sdp);
-        session->sam2_send_callback(session->user_ptr, (char *) &response);
-    } else {
-        SAM2_LOG_ERROR("Candidate too large");
-        return;
+    if (their_savestate_transfer_payload_xxhash != our_savestate_transfer_payload_xxhash) {
+        SAM2_LOG_ERROR("Savestate transfer payload hash mismatch: %" PRIx32 " != %" PRIx32 "", their_savestate_transfer_payload_xxhash, our_savestate_transfer_payload_xxhash);
+        goto cleanup;
     }
-}
 
-static void ulnet__on_gathering_done(juice_agent_t *agent, void *user_ptr) {
-    ulnet_session_t *session = (ulnet_session_t *) user_ptr;
+    ulnet__save_state_payload_upgrade(savestate_transfer_payload, session->remote_savestate_payload_version);
 
-    int p;
-    SAM2_LOCATE(session->agent, agent, p);
-    if (p == -1) {
-        SAM2_LOG_ERROR("No agent found");
-        return;
+    if (   savestate_transfer_payload->compressed_savestate_size < 0
+        || savestate_transfer_payload->compressed_options_size < 0
+        || savestate_transfer_payload->dictionary_size < 0
+        || (int64_t) sizeof(savestate_transfer_payload_t) + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size
+         + savestate_transfer_payload->dictionary_size > savestate_transfer_payload->total_size_bytes) {
+        SAM2_LOG_ERROR("Savestate transfer payload sections don't fit in its total size: %" PRId64 "", savestate_transfer_payload->total_size_bytes);
+        goto cleanup;
     }
 
-    sam2_signal_message_t response = { SAM2_SIGN_HEADER };
+    decompress_start = ulnet__rdtsc();
+    ret = ZSTD_decompressDCtx(
+        ulnet__zstd_dctx(session),
+        session->core_options, sizeof(session->core_options),
+        savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
+        savestate_transfer_payload->compressed_options_size
+    );
 
-    response.peer_id = session->agent_peer_ids[p];
-    session->sam2_send_callback(session->user_ptr, (char *) &response);
-}
+    if (ZSTD_isError(ret)) {
+        SAM2_LOG_ERROR("Error decompressing core options: %s", ZSTD_getErrorName(ret));
+    } else {
+        session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
+        //session.retro_run(); // Apply options before loading savestate; Lets hope this isn't necessary
+
+        // Streaming only ever starts on full savestates so whatever it already decompressed is kept
+        save_state_data = session->remote_savestate_stream ? session->remote_savestate_stream
+                        : ulnet__transfer_buffer_acquire(session, savestate_transfer_payload->decompressed_savestate_size);
+        session->remote_savestate_stream = NULL;
+        session->save_state_received_streamed_chunks = session->remote_savestate_stream_chunks;
+
+        int64_t save_state_size;
+        int baseline = -1;
+        if (savestate_transfer_payload->baseline_frame == -1) {
+            if (savestate_transfer_payload->dictionary_size > 0) {
+                ulnet__zstd_dictionary_set(session,
+                    savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size,
+                    savestate_transfer_payload->dictionary_size, savestate_transfer_payload->room.rom_hash_xxh64);
+            }
 
-static void ulnet__check_for_desync(ulnet_state_t *our_state, ulnet_state_t *their_state, int64_t *our_desync_frame) {
-    int64_t desync_frame = 0;
-    int64_t latest_common_frame = SAM2_MIN(our_state->save_state_frame, their_state->save_state_frame);
-    int64_t frame_difference = SAM2_ABS(our_state->save_state_frame - their_state->save_state_frame);
-    int64_t total_frames_to_compare = ULNET_DELAY_BUFFER_SIZE - frame_difference;
+            if (savestate_transfer_payload->dictionary_id != 0 && savestate_transfer_payload->dictionary_id != session->zstd_dictionary_id) {
+                SAM2_LOG_ERROR("Savestate was compressed with dictionary %08" PRIx32 " which we don't have", savestate_transfer_payload->dictionary_id);
+                ulnet__baseline_advertise(session, ULNET_BASELINE_FLAG_RESYNC);
+                goto cleanup;
+            }
 
-    for (int f = total_frames_to_compare-1; f >= 0 ; f--) { // Start from the oldest frame
-        int64_t frame = latest_common_frame - f;
-        int64_t frame_index = frame % ULNET_DELAY_BUFFER_SIZE;
+            save_state_size = ulnet__save_state_decompress_chunks(session, savestate_transfer_payload, save_state_data);
+            if (session->save_state_received_streamed_chunks > 0) {
+                SAM2_LOG_INFO("Decompressed %d savestate chunks before the transfer finished", session->save_state_received_streamed_chunks);
+            }
+        } else if ((baseline = ulnet__baseline_find(session, savestate_transfer_payload->baseline_frame, savestate_transfer_payload->baseline_xxhash)) == -1) {
+            SAM2_LOG_ERROR("Savestate is a delta against frame %" PRId64 " which we don't have", savestate_transfer_payload->baseline_frame);
+            ulnet__baseline_advertise(session, ULNET_BASELINE_FLAG_RESYNC);
+            goto cleanup;
+        } else if (savestate_transfer_payload->patch_size > 0) {
+            uint8_t *patch = ulnet__transfer_buffer_acquire(session, savestate_transfer_payload->patch_size);
+            size_t patch_size = ZSTD_decompressDCtx(
+                ulnet__zstd_dctx(session),
+                patch,
+                savestate_transfer_payload->patch_size,
+                savestate_transfer_payload->compressed_data,
+                savestate_transfer_payload->compressed_savestate_size
+            );
 
-        if (our_state->input_state_hash[frame_index] != their_state->input_state_hash[frame_index]) {
-            SAM2_LOG_ERROR("Input state hash mismatch for frame %" PRId64 " Our hash: %" PRIx32 " Their hash: %" PRIx32 "",
-                frame, our_state->input_state_hash[frame_index], their_state->input_state_hash[frame_index]);
-        } else if (   our_state->save_state_hash[frame_index] != 0
-                   && their_state->save_state_hash[frame_index] != 0
-                   && our_state->save_state_hash[frame_index] != their_state->save_state_hash[frame_index]) {
-            SAM2_LOG_ERROR("Save state hash mismatch for frame %" PRId64 " Our hash: %08" PRIx32 " Their hash: %08" PRIx32,
-                frame, our_state->save_state_hash[frame_index], their_state->save_state_hash[frame_index]);
-            desync_frame = frame;
-            break;
+            save_state_size = ZSTD_isError(patch_size) ? -1 : ulnet__save_state_patch_apply(
+                save_state_data, savestate_transfer_payload->decompressed_savestate_size,
+                session->baseline_save_state[baseline], session->baseline_save_state_size[baseline],
+                patch, patch_size, savestate_transfer_payload->patch_chunk_size
+            );
+            ulnet__transfer_buffer_release(session, patch);
+
+            if (save_state_size == -1) {
+                SAM2_LOG_ERROR("Savestate patch against frame %" PRId64 " is malformed", savestate_transfer_payload->baseline_frame);
+                ulnet__baseline_advertise(session, ULNET_BASELINE_FLAG_RESYNC);
+                goto cleanup;
+            }
+        } else {
+            ZSTD_DCtx *dctx = ulnet__zstd_dctx(session);
+            ZSTD_DCtx_refPrefix(dctx, session->baseline_save_state[baseline], session->baseline_save_state_size[baseline]);
+            save_state_size = ZSTD_decompressDCtx(
+                dctx,
+                save_state_data,
+                savestate_transfer_payload->decompressed_savestate_size,
+                savestate_transfer_payload->compressed_data,
+                savestate_transfer_payload->compressed_savestate_size
+            );
         }
-    }
+        session->save_state_received_decompress_cycles = ulnet__rdtsc() - decompress_start;
 
-    if (desync_frame == 0 && *our_desync_frame != 0) {
-        SAM2_LOG_INFO("Peer resynced on frame %" PRId64, total_frames_to_compare-1);
+        if (session->remote_savestate_payload_version < 1 && !ZSTD_isError(save_state_size)) {
+            savestate_transfer_payload->save_state_xxhash = ulnet_xxh32(save_state_data, save_state_size, 0); // Version 0 doesn't send it
+        }
+
+        if (ZSTD_isError(save_state_size)) {
+            SAM2_LOG_ERROR("Error decompressing savestate: %s", ZSTD_getErrorName(save_state_size));
+        } else if (ulnet_xxh32(save_state_data, save_state_size, 0) != savestate_transfer_payload->save_state_xxhash) {
+            SAM2_LOG_ERROR("Decompressed savestate hash mismatch against baseline frame %" PRId64, savestate_transfer_payload->baseline_frame);
+            if (baseline != -1) {
+                ulnet__baseline_advertise(session, ULNET_BASELINE_FLAG_RESYNC);
+            }
+        } else {
+            if (!session->retro_unserialize(session->user_ptr, save_state_data, save_state_size)) {
+                SAM2_LOG_ERROR("Failed to load savestate");
+            } else {
+                SAM2_LOG_DEBUG("Save state loaded");
+                session->frame_counter = savestate_transfer_payload->frame_counter;
+                session->authority_next_frame_to_apply = session->frame_counter;
+                session->flags &= ~ULNET_SESSION_FLAG_MISPREDICTED;
+                ulnet__resize_delay_buffer(session, ulnet_delay_buffer_size(session), ulnet_room_delay_buffer_size(&savestate_transfer_payload->room));
+                session->room_we_are_in = savestate_transfer_payload->room;
+                ulnet__baseline_store(session, save_state_data, save_state_size, session->frame_counter, savestate_transfer_payload->save_state_xxhash);
+
+                // What we hashed before loading would just report the desync we're recovering from again
+                ulnet__save_state_snapshots_discard(session, false);
+                int our_port = sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id);
+                if (our_port != -1 && our_port < SAM2_SPECTATOR_START) {
+                    memset(session->state[our_port].save_state_hash, 0, sizeof(session->state[our_port].save_state_hash));
+                    session->peer_desynced_frame[our_port] = 0;
+                }
+                session->flags &= ~(ULNET_SESSION_FLAG_RESYNC_PENDING | ULNET_SESSION_FLAG_RESYNC_REQUESTED);
+            }
+        }
     }
 
-    *our_desync_frame = desync_frame;
+cleanup:
+    ulnet__transfer_buffer_release(session, save_state_data);
+    ulnet__reset_save_state_bookkeeping(session); // Also returns the reassembly buffer to the pool
 }
 
-static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref_t packet_ref);
-// MARK: UDP Packet Processing
 ULNET_LINKAGE void ulnet_receive_packet_callback(juice_agent_t *agent, const char *packet, size_t size, void *user_ptr) {
     ulnet_session_t *session = (ulnet_session_t *) user_ptr;
 
@@ -1492,18 +5588,30 @@ ULNET_LINKAGE void ulnet_receive_packet_callback(juice_agent_t *agent, const cha
         return;
     }
 
+    session->received_packet_count++;
+
     if (rand() / ((float) RAND_MAX) < session->debug_udp_recv_drop_rate) {
         SAM2_LOG_DEBUG("Intentionally dropped a received UDP packet");
         return;
     }
 
+    if ((packet[0] & ULNET_CHANNEL_MASK) == ULNET_CHANNEL_SAVESTATE_TRANSFER) {
+        // Bulk transfers would evict everything else from the arena
+        ulnet__receive_save_state_fragment(session, p, (const uint8_t *) packet, size, false);
+        return;
+    }
+
     arena_ref_t packet_ref = arena_alloc(&session->arena, size);
     memcpy(arena_deref(&session->arena, packet_ref), packet, size);
     session->packet_history[p][session->packet_history_next[p]++] = packet_ref;
 
-    if ((packet[0] & ULNET_CHANNEL_MASK) == ULNET_CHANNEL_RELIABLE) {
+    if (   (packet[0] & ULNET_CHANNEL_MASK) == ULNET_CHANNEL_RELIABLE
+        && !(packet[0] & ULNET_RELIABLE_FLAG_ACK_ONLY)) {
         uint16_t sequence = ((uint16_t)packet[2] << 8) | packet[1];
-        session->reliable_rx_packet_history[p][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE] = packet_ref;
+        // An old duplicate could otherwise replace a packet we're holding for later
+        if ((uint16_t) (sequence - session->reliable_rx_head[p]) < ULNET_RELIABLE_ACK_BUFFER_SIZE) {
+            session->reliable_rx_packet_history[p][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE] = packet_ref;
+        }
     }
 
     if (session->flags & ULNET_SESSION_FLAG_READY_TO_TICK_SET) {
@@ -1513,6 +5621,26 @@ ULNET_LINKAGE void ulnet_receive_packet_callback(juice_agent_t *agent, const cha
     ulnet__process_udp_packet(session, p, packet_ref); // Fallthrough to the next function
 }
 
+// Processes the packets we held because they arrived ahead of one that was lost, now that it has shown up
+static void ulnet__reliable_deliver_held(ulnet_session_t *session, int p) {
+    for (;;) {
+        uint16_t sequence = session->reliable_rx_head[p];
+        int index = sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE;
+        if (!(session->reliable_rx_held[p][index / 64] & (1ULL << (index % 64)))) break;
+
+        session->reliable_rx_held[p][index / 64] &= ~(1ULL << (index % 64));
+        arena_ref_t packet_ref = session->reliable_rx_packet_history[p][index];
+        uint8_t *packet = (uint8_t *) arena_deref(&session->arena, packet_ref);
+        if (!packet) {
+            SAM2_LOG_WARN("Held reliable packet seq=%d was evicted, waiting on a retransmission", sequence);
+            break; // We stop SACKing it so the peer will resend it
+        }
+
+        session->reliable_rx_head[p]++;
+        ulnet__process_udp_packet(session, p, arena_reref(packet_ref, ulnet__reliable_header_size(packet[0])));
+    }
+}
+
 static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref_t packet_ref) {
     const char *data = (const char *) arena_deref(&session->arena, packet_ref);
     size_t size = packet_ref.size;
@@ -1553,6 +5681,60 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
                 session->sam2_send_callback(session->user_ptr, (char *) &error);
                 // @todo Resync broadcast
             }
+        } else if (sam2_header_matches(data, ulnet_base_header)) {
+            ulnet_baseline_message_t baseline_message;
+            baseline_message.packet_loss = -1.0f;
+            baseline_message.dictionary_id = 0;
+            if (size < offsetof(ulnet_baseline_message_t, packet_loss)) {
+                SAM2_LOG_WARN("Baseline message too small: %zu bytes", size);
+                break;
+            }
+            memcpy(&baseline_message, data, SAM2_MIN(size, sizeof(baseline_message)));
+
+            if (baseline_message.packet_loss >= 0.0f) {
+                session->peer_packet_loss[p] = SAM2_MIN(baseline_message.packet_loss, 1.0f);
+                session->peer_packet_loss_reported_bitfield |= 1ULL << p;
+            }
+
+            SAM2_LOG_INFO("Peer %05" PRIu16 " has a baseline savestate for frame %" PRId64, session->agent_peer_ids[p], baseline_message.frame);
+            session->peer_baseline_frame[p] = baseline_message.frame;
+            session->peer_baseline_xxhash[p] = baseline_message.xxhash;
+            session->peer_dictionary_id[p] = baseline_message.dictionary_id;
+            session->peer_baseline_advertised_bitfield |= 1ULL << p;
+            if (baseline_message.flags & ULNET_BASELINE_FLAG_RESYNC && ulnet_is_authority(session)) {
+                session->peer_needs_sync_bitfield |= 1ULL << p;
+            }
+        } else if (sam2_header_matches(data, ulnet_nack_header)) {
+            ulnet_save_state_nack_message_t nack;
+            if (size < sizeof(nack)) {
+                SAM2_LOG_WARN("Savestate NACK too small: %zu bytes", size);
+                break;
+            }
+            memcpy(&nack, data, sizeof(nack));
+
+            if (ulnet_is_authority(session)) {
+                ulnet__save_state_repair(session, p, &nack);
+            }
+        } else if (sam2_header_matches(data, ulnet_dlay_header)) {
+            ulnet_delay_message_t delay_message;
+            if (size < sizeof(delay_message)) {
+                SAM2_LOG_WARN("Delay feedback too small: %zu bytes", size);
+                break;
+            }
+            memcpy(&delay_message, data, sizeof(delay_message));
+
+            ulnet__bulk_delay_feedback(session, p, delay_message.queuing_delay_usec, ulnet__get_monotonic_time_microseconds());
+        } else if (sam2_header_matches(data, ulnet_tree_header)) {
+            ulnet_save_state_tree_message_t tree_message;
+            if (size < sizeof(tree_message)) {
+                SAM2_LOG_WARN("Savestate chunk hashes too small: %zu bytes", size);
+                break;
+            }
+            memcpy(&tree_message, data, sizeof(tree_message));
+
+            if (ulnet_is_authority(session)) {
+                ulnet__save_state_tree_receive(session, p, &tree_message);
+            }
         } else if (sam2_header_matches(data, sam2_join_header)) {
             // @todo This can be much simpler
             sam2_room_join_message_t join_message;
@@ -1572,10 +5754,43 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
         }
 
         ulnet_reliable_packet_t *reliable_packet = (ulnet_reliable_packet_t *) data;
+        int header_size = ulnet__reliable_header_size(channel_and_flags);
+        if (size < header_size) {
+            SAM2_LOG_WARN("Reliable packet missing SACK");
+            break;
+        }
 
+        int64_t current_time_usec = ulnet__get_unix_time_microseconds();
         uint16_t ack_sequence = (reliable_packet->ack_sequence_le[1] << 8) | reliable_packet->ack_sequence_le[0];
         if (ulnet__sequence_greater_than(ack_sequence, session->reliable_tx_head[p])) {
+            int64_t send_time_usec = session->reliable_tx_send_time_usec[p][(uint16_t) (ack_sequence - 1) % ULNET_RELIABLE_ACK_BUFFER_SIZE];
+            if (send_time_usec > 0) {
+                ulnet__rtt_update(session, p, current_time_usec - send_time_usec);
+                session->reliable_rto_backoff[p] = 0;
+            }
+
+            for (uint16_t sequence = session->reliable_tx_head[p]; ulnet__sequence_less_than(sequence, ack_sequence); sequence++) {
+                session->reliable_tx_delivered_send_usec[p] = SAM2_MAX(session->reliable_tx_delivered_send_usec[p],
+                    session->reliable_tx_last_send_usec[p][sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE]);
+            }
+
             session->reliable_tx_head[p] = ack_sequence;
+            session->reliable_rto_started_usec[p] = current_time_usec;
+        }
+
+        // A reordered packet with an older ack carries an older SACK too
+        if (ack_sequence == session->reliable_tx_head[p]) {
+            memset(session->reliable_tx_sacked[p], 0, sizeof(session->reliable_tx_sacked[p]));
+            for (int i = 1; (channel_and_flags & ULNET_RELIABLE_FLAG_SACK) && i < ULNET_RELIABLE_ACK_BUFFER_SIZE; i++) {
+                uint16_t sequence = ack_sequence + i;
+                if (   !(data[sizeof(ulnet_reliable_packet_t) + i / 8] & (1 << (i % 8)))
+                    || !ulnet__sequence_less_than(sequence, session->reliable_tx_next_seq[p])) continue;
+
+                int index = sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE;
+                session->reliable_tx_sacked[p][index / 64] |= 1ULL << (index % 64);
+                session->reliable_tx_delivered_send_usec[p] = SAM2_MAX(session->reliable_tx_delivered_send_usec[p],
+                    session->reliable_tx_last_send_usec[p][index]);
+            }
         }
 
         uint16_t rx_sequence;
@@ -1584,17 +5799,28 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
 
             if (rx_sequence == session->reliable_rx_head[p]) {
                 session->reliable_rx_head[p]++;
+            } else if ((uint16_t) (rx_sequence - session->reliable_rx_head[p]) < ULNET_RELIABLE_ACK_BUFFER_SIZE) {
+                // Hold it until the gap before it fills, our SACKs tell the peer not to resend it
+                int index = rx_sequence % ULNET_RELIABLE_ACK_BUFFER_SIZE;
+                session->reliable_rx_held[p][index / 64] |= 1ULL << (index % 64);
+                break;
             } else if (ulnet__sequence_greater_than(rx_sequence, session->reliable_rx_head[p])) {
-                SAM2_LOG_ERROR("Received out-of-order reliable packet seq=%d, expecting %d",
+                SAM2_LOG_ERROR("Received reliable packet seq=%d past the receive window starting at %d",
                     rx_sequence, session->reliable_rx_head[p]); // @todo This is a protocol violation, we should disconnect the peer
                 break;
             } else {
                 SAM2_LOG_DEBUG("Received old reliable packet seq=%d, already processed", rx_sequence);
                 break;
             }
+        } else {
+            memcpy(&rx_sequence, &reliable_packet->sequence_le, sizeof(rx_sequence));
+            ulnet__packet_loss_sample(session, p, rx_sequence);
         }
 
-        ulnet__process_udp_packet(session, p, arena_reref(packet_ref, sizeof(ulnet_reliable_packet_t)));
+        ulnet__process_udp_packet(session, p, arena_reref(packet_ref, header_size));
+        if (!(channel_and_flags & ULNET_RELIABLE_FLAG_ACK_ONLY)) {
+            ulnet__reliable_deliver_held(session, p);
+        }
         break;
     }
     case ULNET_CHANNEL_INPUT: {
@@ -1621,7 +5847,10 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
         int64_t coded_state_size = size - ULNET_HEADER_SIZE;
 
         int64_t frame;
-        rle8_decode(input_packet->coded_state, coded_state_size, (uint8_t *) &frame, sizeof(frame));
+        if (ulnet__get_frame_from_packet(session, (const uint8_t *) data, size, &frame) < 0) {
+            SAM2_LOG_WARN("Received input packet with an unknown format 0x%" PRIx8, coded_state_size > 0 ? input_packet->coded_state[0] : 0);
+            break;
+        }
 
         SAM2_LOG_DEBUG("Recv input packet for frame %" PRId64 " from peer_ids[%d]=%05" PRId16 "",
             frame, original_sender_port, session->room_we_are_in.peer_ids[original_sender_port]);
@@ -1631,25 +5860,48 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
             SAM2_LOG_DEBUG("Received outdated input packet for frame %" PRId64 ". We are already on frame %" PRId64 ". Dropping it",
                 frame, session->state[original_sender_port].frame);
         } else {
-            int64_t input_consumed = 0;
-            int64_t output_produced = rle8_decode_extra(
+            #if defined(ULNET__DEBUG_EVERYONE_ON_PORT_0)
+            int prediction_port = 0;
+            #else
+            int prediction_port = original_sender_port;
+            #endif
+            int64_t previous_frame = session->state[original_sender_port].frame;
+            ulnet_input_state_t previous_input;
+            memcpy(previous_input, session->state[original_sender_port].input_state[previous_frame % ulnet_delay_buffer_size(session)][prediction_port], sizeof(previous_input));
+
+            int decode_result = ulnet__decode_state(
+                session,
                 input_packet->coded_state, coded_state_size,
-                &input_consumed,
-                (uint8_t *) &session->state[original_sender_port],
-                sizeof(ulnet_state_t)
+                &session->state[original_sender_port]
             );
 
-            if (input_consumed != coded_state_size) {
-                SAM2_LOG_WARN("Received input packet with oversize payload %" PRId64 " bytes left to decode", input_consumed - coded_state_size);
-            } else if (output_produced != sizeof(ulnet_state_t)) {
-                SAM2_LOG_WARN("Received input packet with insuffcient size %" PRId64 " bytes produced", output_produced);
+            if (decode_result < 0) {
+                SAM2_LOG_WARN("Received malformed input packet for frame %" PRId64 " (error %d)", frame, decode_result);
+                break;
             }
 
             ulnet_update_state_history(session, packet_ref);
+            ulnet__rollback_check_prediction(session, original_sender_port, previous_frame, previous_input);
+
+            if (frame > previous_frame) {
+                ulnet__input_arrival_update(session, p, ulnet__get_monotonic_time_microseconds());
+            }
+
+            // Relayed input carries the sender's advantage over whoever relayed it. Packets that show up
+            // after a newer frame's would roll the reported advantage back to when they were sent
+            int32_t frame_advantage_usec;
+            if (   p == original_sender_port
+                && frame > session->peer_frame_advantage_frame[p]
+                && ulnet__get_frame_advantage_from_packet(session, (const uint8_t *) data, size, &frame_advantage_usec) == 0) {
+                session->peer_frame_advantage_usec[p] = frame_advantage_usec;
+                session->peer_frame_advantage_frame[p] = frame;
+                session->peer_frame_advantage_bitfield |= 1ULL << p;
+            }
 
             // Broadcast the input packet to spectators
             if (ulnet_is_authority(session)) {
                 for (int s = SAM2_SPECTATOR_START; s < SAM2_TOTAL_PEERS; s++) {
+                    if (!session->agent[s]) continue;
                     ulnet_reliable_send_with_acks_only(session, s, (const uint8_t *)data, size);
                 }
             }
@@ -1661,8 +5913,25 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
             ulnet__check_for_desync(
                 &session->state[our_port],
                 &session->state[original_sender_port],
+                ulnet_delay_buffer_size(session),
                 &session->peer_desynced_frame[our_port]
             );
+
+            // The authority's savestate is the one that counts so only a mismatch with it is worth resyncing over.
+            // We ask again only if the patch we asked for hasn't shown up after a delay buffer's worth of frames
+            if (   session->peer_desynced_frame[our_port]
+                && original_sender_port == SAM2_AUTHORITY_INDEX
+                && !ulnet_is_authority(session)
+                && session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+                && (   !(session->flags & ULNET_SESSION_FLAG_RESYNC_REQUESTED)
+                    || session->frame_counter - session->save_state_resync_frame >= ulnet_delay_buffer_size(session))) {
+                session->flags |= ULNET_SESSION_FLAG_RESYNC_PENDING;
+            }
+
+            // The authority only syncs from its own baselines so those are the only matches a peer should keep
+            if (ulnet_is_authority(session) || original_sender_port == SAM2_AUTHORITY_INDEX) {
+                ulnet__baseline_candidate_confirm(session, &session->state[original_sender_port]);
+            }
         }
 
         break;
@@ -1676,165 +5945,7 @@ static void ulnet__process_udp_packet(ulnet_session_t *session, int p, arena_ref
         break;
     }
     case ULNET_CHANNEL_SAVESTATE_TRANSFER: {
-        if (session->remote_packet_groups == 0) {
-            // This is kind of a hack. Since every field in ulnet_session can just be zero-inited
-            // besides this one. I just use this check here to set it to it's correct initial value
-            session->remote_packet_groups = FEC_PACKET_GROUPS_MAX;
-        }
-
-        if (p != SAM2_AUTHORITY_INDEX) {
-            printf("Received savestate transfer packet from non-authority agent\n");
-            break;
-        }
-
-        if (size < sizeof(ulnet_save_state_packet_header_t)) {
-            SAM2_LOG_WARN("Recv savestate transfer packet with size smaller than header");
-            break;
-        }
-
-        if (size > ULNET_PACKET_SIZE_BYTES_MAX) {
-            SAM2_LOG_WARN("Recv savestate transfer packet potentially larger than MTU");
-        }
-
-        ulnet_save_state_packet_header_t savestate_transfer_header;
-        memcpy(&savestate_transfer_header, data, sizeof(ulnet_save_state_packet_header_t)); // Strict-aliasing
-
-        uint8_t sequence_hi = 0;
-        int k = 239;
-        if (channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239) {
-            if (channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0) {
-                session->remote_packet_groups = savestate_transfer_header.packet_groups;
-            } else {
-                sequence_hi = savestate_transfer_header.sequence_hi;
-            }
-        } else {
-            k = savestate_transfer_header.reed_solomon_k;
-            session->remote_packet_groups = 1; // k != 239 => 1 packet group
-        }
-
-        if (sequence_hi >= FEC_PACKET_GROUPS_MAX) {
-            SAM2_LOG_WARN("Received savestate transfer packet with sequence_hi >= FEC_PACKET_GROUPS_MAX");
-            break;
-        }
-
-        if (session->fec_index_counter[sequence_hi] == k) {
-            // We already have received enough Reed-Solomon blocks to decode the payload; we can ignore this packet
-            break;
-        }
-
-        uint8_t sequence_lo = savestate_transfer_header.sequence_lo;
-
-        SAM2_LOG_DEBUG("Received savestate packet sequence_hi: %hhu sequence_lo: %hhu", sequence_hi, sequence_lo);
-
-        size_t payload_size = size - sizeof(ulnet_save_state_packet_header_t);
-        arena_ref_t ref = arena_alloc(&session->arena, payload_size);
-        memcpy(arena_deref(&session->arena, ref), data + sizeof(ulnet_save_state_packet_header_t), payload_size);
-
-        session->remote_savestate_transfer_offset += size;
-
-        session->packet_reference[sequence_hi][session->fec_index_counter[sequence_hi]] = ref;
-        session->fec_index [sequence_hi][session->fec_index_counter[sequence_hi]++] = sequence_lo;
-
-        if (session->fec_index_counter[sequence_hi] == k) {
-            SAM2_LOG_DEBUG("Received all the savestate data for packet group: %hhu", sequence_hi);
-            void *fec_packet[GF_SIZE - FEC_REDUNDANT_BLOCKS];
-            for (int i = 0; i < k; i++) {
-                fec_packet[i] = arena_deref(&session->arena, session->packet_reference[sequence_hi][k]);
-            }
-
-            int redudant_blocks_sent = k * FEC_REDUNDANT_BLOCKS / (GF_SIZE - FEC_REDUNDANT_BLOCKS);
-            void *rs_code = fec_new(k, k + redudant_blocks_sent);
-            int rs_block_size = (int) (size - sizeof(ulnet_save_state_packet_header_t));
-            int status = fec_decode(rs_code, fec_packet, session->fec_index[sequence_hi], rs_block_size);
-            assert(status == 0);
-            fec_free(rs_code);
-
-            bool all_data_decoded = true;
-            for (int i = 0; i < session->remote_packet_groups; i++) {
-                all_data_decoded &= session->fec_index_counter[i] >= k;
-            }
-
-            if (all_data_decoded) {
-                size_t ret = 0;
-                uint32_t their_savestate_transfer_payload_xxhash = 0;
-                uint32_t   our_savestate_transfer_payload_xxhash = 0;
-                unsigned char *save_state_data = NULL;
-                savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) malloc(sizeof(savestate_transfer_payload_t) /* Fixed size header */ + k * session->remote_packet_groups * rs_block_size);
-
-                int32_t remote_payload_size = 0;
-                for (int i = 0; i < k; i++) {
-                    for (int j = 0; j < session->remote_packet_groups; j++) {
-                        void *decoded_packet = arena_deref(&session->arena, session->packet_reference[j][i]);
-                        if (decoded_packet == NULL) {
-                            SAM2_LOG_ERROR("Savestate transfer packet already overwritten");
-                            goto cleanup;
-                        }
-                        memcpy(((uint8_t *) savestate_transfer_payload) + remote_payload_size, decoded_packet, rs_block_size);
-                        remote_payload_size += rs_block_size;
-                    }
-                }
-
-                SAM2_LOG_INFO("Received savestate transfer payload for frame %" PRId64 "", savestate_transfer_payload->frame_counter);
-
-                if (   savestate_transfer_payload->total_size_bytes > k * (int) rs_block_size * session->remote_packet_groups
-                    || savestate_transfer_payload->total_size_bytes < 0) {
-                    SAM2_LOG_ERROR("Savestate transfer payload total size would out-of-bounds when computing hash: %" PRId64 "", savestate_transfer_payload->total_size_bytes);
-                    goto cleanup;
-                }
-
-                their_savestate_transfer_payload_xxhash = savestate_transfer_payload->xxhash;
-                savestate_transfer_payload->xxhash = 0; // Needed to recompute the hash correctly
-                our_savestate_transfer_payload_xxhash = ulnet_xxh32(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
-
-                if (their_savestate_transfer_payload_xxhash != our_savestate_transfer_payload_xxhash) {
-                    SAM2_LOG_ERROR("Savestate transfer payload hash mismatch: %" PRIx32 " != %" PRIx32 "", savestate_transfer_payload->xxhash, our_savestate_transfer_payload_xxhash);
-                    goto cleanup;
-                }
-
-                ret = ZSTD_decompress(
-                    session->core_options, sizeof(session->core_options),
-                    savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
-                    savestate_transfer_payload->compressed_options_size
-                );
-
-                if (ZSTD_isError(ret)) {
-                    SAM2_LOG_ERROR("Error decompressing core options: %s", ZSTD_getErrorName(ret));
-                } else {
-                    session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
-                    //session.retro_run(); // Apply options before loading savestate; Lets hope this isn't necessary
-
-                    save_state_data = (unsigned char *) malloc(savestate_transfer_payload->decompressed_savestate_size);
-
-                    int64_t save_state_size = ZSTD_decompress(
-                        save_state_data,
-                        savestate_transfer_payload->decompressed_savestate_size,
-                        savestate_transfer_payload->compressed_data,
-                        savestate_transfer_payload->compressed_savestate_size
-                    );
-
-                    if (ZSTD_isError(save_state_size)) {
-                        SAM2_LOG_ERROR("Error decompressing savestate: %s", ZSTD_getErrorName(save_state_size));
-                    } else {
-                        if (!session->retro_unserialize(session->user_ptr, save_state_data, save_state_size)) {
-                            SAM2_LOG_ERROR("Failed to load savestate");
-                        } else {
-                            SAM2_LOG_DEBUG("Save state loaded");
-                            session->frame_counter = savestate_transfer_payload->frame_counter;
-                            session->room_we_are_in = savestate_transfer_payload->room;
-                        }
-                    }
-                }
-
-cleanup:
-                if (save_state_data != NULL) {
-                    free(save_state_data);
-                }
-
-                free(savestate_transfer_payload);
-
-                ulnet__reset_save_state_bookkeeping(session);
-            }
-        }
+        ulnet__receive_save_state_fragment(session, p, (const uint8_t *) data, size, false);
         break;
     }
     default:
@@ -1910,6 +6021,7 @@ int ulnet_process_message(ulnet_session_t *session, const char *response) {
         sam2_room_make_message_t *room_make = (sam2_room_make_message_t *) response;
 
         if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
+            ulnet__resize_delay_buffer(session, ulnet_delay_buffer_size(session), ulnet_room_delay_buffer_size(&room_make->room));
             session->room_we_are_in = room_make->room;
         }
     } else if (sam2_header_matches(response, sam2_join_header)) {
@@ -1959,8 +6071,22 @@ int ulnet_process_message(ulnet_session_t *session, const char *response) {
                 session->sam2_send_callback(session->user_ptr, (char *) &error);
             }
         } else {
+            // The minor version in the header is the newest protocol the peer speaks
+            int peer_protocol_version = room_join->header[6] - '0';
+
             if (current_port != desired_port) {
-                if (future_room_we_are_in.peer_ids[desired_port] != SAM2_PORT_AVAILABLE) {
+                if (peer_protocol_version < ulnet_room_protocol_version(&future_room_we_are_in)) {
+                    SAM2_LOG_INFO("Peer %05" PRId16 " speaks protocol version %d but the room needs %d", (uint16_t) room_join->peer_id,
+                        peer_protocol_version, ulnet_room_protocol_version(&future_room_we_are_in));
+                    sam2_error_message_t error = {
+                        SAM2_FAIL_HEADER,
+                        (uint16_t) room_join->peer_id,
+                        "Peer is running an older version than the room",
+                        SAM2_RESPONSE_VERSION_MISMATCH
+                    };
+
+                    session->sam2_send_callback(session->user_ptr, (char *) &error);
+                } else if (future_room_we_are_in.peer_ids[desired_port] != SAM2_PORT_AVAILABLE) {
                     SAM2_LOG_INFO("Peer %05" PRId16 " tried to join on unavailable port", room_join->room.peer_ids[current_port]);
                     sam2_error_message_t error = {
                         SAM2_FAIL_HEADER,
@@ -2072,103 +6198,20 @@ int ulnet_process_message(ulnet_session_t *session, const char *response) {
 }
 
 // Pass in save state since often retro_serialize can tick the core
+// It's copied so the caller can reuse its buffer right away, then compressed on a worker and sent from a later ulnet_poll_session
 ULNET_LINKAGE void ulnet_send_save_state(ulnet_session_t *session, int port, void *save_state, size_t save_state_size, int64_t save_state_frame) {
     assert(save_state);
 
-    int packet_payload_size_bytes = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
-    int n, k, packet_groups;
-
-    int64_t save_state_transfer_payload_compressed_bound_size_bytes = ZSTD_COMPRESSBOUND(save_state_size) + ZSTD_COMPRESSBOUND(sizeof(session->core_options));
-    ulnet__logical_partition(sizeof(savestate_transfer_payload_t) /* Header */ + save_state_transfer_payload_compressed_bound_size_bytes,
-                      FEC_REDUNDANT_BLOCKS, &n, &k, &packet_payload_size_bytes, &packet_groups);
-
-    size_t savestate_transfer_payload_plus_parity_bound_bytes = packet_groups * n * packet_payload_size_bytes;
-
-    // This points to the savestate transfer payload, but also the remaining bytes at the end hold our parity blocks
-    // Having this data in a single contiguous buffer makes indexing easier
-    savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) malloc(savestate_transfer_payload_plus_parity_bound_bytes);
-
-    savestate_transfer_payload->decompressed_savestate_size = save_state_size;
-    savestate_transfer_payload->compressed_savestate_size = ZSTD_compress(
-        savestate_transfer_payload->compressed_data,
-        save_state_transfer_payload_compressed_bound_size_bytes,
-        save_state, save_state_size, session->zstd_compress_level
-    );
-
-    if (ZSTD_isError(savestate_transfer_payload->compressed_savestate_size)) {
-        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_savestate_size));
-        assert(0);
-    }
-
-    savestate_transfer_payload->compressed_options_size = ZSTD_compress(
-        savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
-        save_state_transfer_payload_compressed_bound_size_bytes - savestate_transfer_payload->compressed_savestate_size,
-        session->core_options, sizeof(session->core_options), session->zstd_compress_level
-    );
-
-    if (ZSTD_isError(savestate_transfer_payload->compressed_options_size)) {
-        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_options_size));
-        assert(0);
-    }
-
-    ulnet__logical_partition(
-        sizeof(savestate_transfer_payload_t) /* Header */ + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size,
-        FEC_REDUNDANT_BLOCKS, &n, &k, &packet_payload_size_bytes, &packet_groups
-    );
-    assert(savestate_transfer_payload_plus_parity_bound_bytes >= packet_groups * n * packet_payload_size_bytes); // If this fails my logic calculating the bounds was just wrong
-
-    savestate_transfer_payload->frame_counter = save_state_frame;
-    savestate_transfer_payload->room = session->room_we_are_in;
-    savestate_transfer_payload->total_size_bytes = sizeof(savestate_transfer_payload_t) + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size;
-
-    savestate_transfer_payload->xxhash = 0;
-    savestate_transfer_payload->xxhash = ulnet_xxh32(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
-    // Create parity blocks for Reed-Solomon. n - k in total for each packet group
-    // We have "packet grouping" because pretty much every implementation of Reed-Solomon doesn't support more than 255 blocks
-    // and unfragmented UDP packets over ethernet are limited to ULNET_PACKET_SIZE_BYTES_MAX
-    // This makes the code more complicated and the error correcting properties slightly worse but it's a practical tradeoff
-    void *rs_code = fec_new(k, n);
-    for (int j = 0; j < packet_groups; j++) {
-        void *data[255];
-
-        for (int i = 0; i < n; i++) {
-            data[i] = (unsigned char *) savestate_transfer_payload + ulnet__logical_partition_offset_bytes(j, i, packet_payload_size_bytes, packet_groups);
-        }
-
-        for (int i = k; i < n; i++) {
-            fec_encode(rs_code, (void **)data, data[i], i, packet_payload_size_bytes);
-        }
-    }
-    fec_free(rs_code);
-
-    // Send original data blocks and parity blocks
-    // @todo I wrote this in such a way that you can do a zero-copy when creating the packets to send
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < packet_groups; j++) {
-            ulnet_save_state_packet_fragment2_t packet;
-            packet.channel_and_flags = ULNET_CHANNEL_SAVESTATE_TRANSFER;
-            if (k == 239) {
-                packet.channel_and_flags |= ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239;
-                if (j == 0) {
-                    packet.channel_and_flags |= ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0;
-                    packet.packet_groups = packet_groups;
-                } else {
-                    packet.sequence_hi = j;
-                }
-            } else {
-                packet.reed_solomon_k = k;
-            }
-
-            packet.sequence_lo = i;
-
-            memcpy(packet.payload, (unsigned char *) savestate_transfer_payload + ulnet__logical_partition_offset_bytes(j, i, packet_payload_size_bytes, packet_groups), packet_payload_size_bytes);
-
-            int status = ulnet_udp_send(session, port, (const uint8_t *) &packet, sizeof(ulnet_save_state_packet_header_t) + packet_payload_size_bytes);
-            assert(status == 0);
-        }
+    // Peers syncing on the same frame against the same baseline share one encode
+    int slot = ulnet__save_state_encoding_find(session, port, save_state_frame);
+    if (slot != -1 && session->save_state_encoding[slot].frame == save_state_frame) {
+        ulnet__save_state_send_encoding(session, port, &session->save_state_encoding[slot]);
+        return;
     }
 
-    free(savestate_transfer_payload);
+    ulnet__save_state_encode_flush(session);
+    memcpy(ulnet__save_state_encode_buffer(session, save_state_size), save_state, save_state_size);
+    ulnet__save_state_encode_submit(session, 1ULL << port, save_state_size, save_state_frame);
 }
 
 #if defined(ULNET_IMGUI)
@@ -2239,12 +6282,7 @@ ULNET_LINKAGE void ulnet_imgui_plot_history(ulnet_session_t *session) {
                     ImGui::TextDisabled("---");
                 } else {
                     int64_t frame;
-                    int decode_result = rle8_decode(
-                        state_packet->coded_state,
-                        packet_ref.size - sizeof(ulnet_state_packet_t),
-                        (uint8_t *)&frame,
-                        sizeof(frame)
-                    );
+                    int decode_result = ulnet__get_frame_from_packet(session, (const uint8_t *) state_packet, packet_ref.size, &frame);
 
                     if (decode_result < 0) {
                         ImGui::TextColored(ImVec4(1.0f, 0.0f, 0.0f, 1.0f), "ERROR");
@@ -2315,6 +6353,73 @@ ULNET_LINKAGE void ulnet_imgui_show_session(ulnet_session_t *session) {
 
     ImGui::SliderFloat("UDP Induced Receive Drop Rate", &session->debug_udp_recv_drop_rate, 0.0f, 1.0f);
     ImGui::SliderFloat("UDP Induced Transmit Drop Rate", &session->debug_udp_send_drop_rate, 0.0f, 1.0f);
+    int64_t bulk_rate_min = 0, bulk_rate_max = 100000000;
+    ImGui::SliderScalar("Savestate Pacing (bytes/s, 0 unpaced)", ImGuiDataType_S64, &session->bulk_send_bytes_per_second, &bulk_rate_min, &bulk_rate_max, "%" PRId64);
+    bool delay_based_pacing = session->flags & ULNET_SESSION_FLAG_DELAY_BASED_PACING;
+    if (ImGui::Checkbox("Delay-Based Pacing", &delay_based_pacing)) {
+        session->flags = delay_based_pacing ? session->flags | ULNET_SESSION_FLAG_DELAY_BASED_PACING : session->flags & ~ULNET_SESSION_FLAG_DELAY_BASED_PACING;
+    }
+    ImGui::SameLine();
+    ImGui::Text("Queuing delay we see: %.1f ms", session->ledbat_queuing_delay_usec / 1e3);
+
+    bool adaptive_delay = session->flags & ULNET_SESSION_FLAG_ADAPTIVE_DELAY;
+    if (ImGui::Checkbox("Adaptive Delay", &adaptive_delay)) {
+        session->flags = adaptive_delay ? session->flags | ULNET_SESSION_FLAG_ADAPTIVE_DELAY : session->flags & ~ULNET_SESSION_FLAG_ADAPTIVE_DELAY;
+    }
+    ImGui::SameLine();
+    ImGui::Text("Delay: %" PRId64 " frames", session->delay_frames);
+
+    double frame_time_mean_usec, frame_time_variance_usec2;
+    ulnet_frame_pacer_frame_time_stats(&session->frame_pacer, &frame_time_mean_usec, &frame_time_variance_usec2);
+    ImGui::Text("Frame Time: %.3f ms (stddev %.3f ms), Phase Correction: %.3f ms, Resyncs: %" PRId64, frame_time_mean_usec / 1e3,
+        sqrt(frame_time_variance_usec2) / 1e3, session->frame_pacer.phase_correction_usec / 1e3, session->frame_pacer.resync_count);
+    ImGui::Text("Waited on Input: %" PRId64 " times, %.3f ms on average", session->input_wait_count,
+        session->input_wait_count ? session->input_wait_usec / 1e3 / session->input_wait_count : 0.0);
+
+    bool frame_advantage_sync = session->flags & ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC;
+    if (ImGui::Checkbox("Frame Advantage Sync", &frame_advantage_sync)) {
+        session->flags = frame_advantage_sync ? session->flags | ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC : session->flags & ~ULNET_SESSION_FLAG_FRAME_ADVANTAGE_SYNC;
+    }
+    ImGui::SameLine();
+    ImGui::Text("Ahead by %.3f ms, Slewed %.1f ms", session->frame_advantage_sync_usec / 1e3, session->frame_advantage_slewed_usec / 1e3);
+
+    if (ImGui::CollapsingHeader("Frame Advantage")) {
+        ImPlot::SetNextAxisLimits(ImAxis_X1, session->frame_counter - ULNET_MAX_SAMPLE_SIZE, session->frame_counter, ImGuiCond_Always);
+        if (ImPlot::BeginPlot("Frame Advantage vs. Frame")) {
+            ImPlot::SetupAxis(ImAxis_Y1, "usec", ImPlotAxisFlags_AutoFit);
+            int xs[ULNET_MAX_SAMPLE_SIZE], ys[ULNET_MAX_SAMPLE_SIZE];
+            for (int j = 0, frame = SAM2_MAX(0, session->frame_counter - ULNET_MAX_SAMPLE_SIZE + 1); j < ULNET_MAX_SAMPLE_SIZE; j++, frame++) {
+                xs[j] = frame;
+                ys[j] = session->frame_advantage_sample_usec[frame % ULNET_MAX_SAMPLE_SIZE];
+            }
+            ImPlot::PlotLine("Ahead by", xs, ys, ULNET_MAX_SAMPLE_SIZE);
+            for (int j = 0, frame = SAM2_MAX(0, session->frame_counter - ULNET_MAX_SAMPLE_SIZE + 1); j < ULNET_MAX_SAMPLE_SIZE; j++, frame++) {
+                ys[j] = session->frame_advantage_measured_sample_usec[frame % ULNET_MAX_SAMPLE_SIZE];
+            }
+            ImPlot::PlotLine("Measured", xs, ys, ULNET_MAX_SAMPLE_SIZE);
+            ImPlot::EndPlot();
+        }
+    }
+
+    if (ImGui::CollapsingHeader("Rollback")) {
+        int64_t rollback_frames_min = 0, rollback_frames_max = ULNET_ROLLBACK_FRAMES_MAX;
+        ImGui::SliderScalar("Rollback Frames Max", ImGuiDataType_S64, &session->rollback_frames_max, &rollback_frames_min, &rollback_frames_max, "%" PRId64);
+        ImGui::Text("Effective Window: %" PRId64 " frames", ulnet__rollback_window(session, sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id)));
+        ImGui::Text("Rollbacks: %" PRId64 " Resimulated Frames: %" PRId64, session->rollback_count, session->rollback_resimulated_frames);
+        ImGui::Text("Resimulated Frames per Second: %.1f", session->rollback_resimulated_frames_per_second);
+
+        ImPlot::SetNextAxisLimits(ImAxis_X1, session->frame_counter - ULNET_MAX_SAMPLE_SIZE, session->frame_counter, ImGuiCond_Always);
+        ImPlot::SetNextAxisLimits(ImAxis_Y1, 0.0f, ULNET_ROLLBACK_FRAMES_MAX + 1, ImGuiCond_Always);
+        if (ImPlot::BeginPlot("Rollback Depth vs. Frame")) {
+            int xs[ULNET_MAX_SAMPLE_SIZE], ys[ULNET_MAX_SAMPLE_SIZE];
+            for (int j = 0, frame = SAM2_MAX(0, session->frame_counter - ULNET_MAX_SAMPLE_SIZE + 1); j < ULNET_MAX_SAMPLE_SIZE; j++, frame++) {
+                xs[j] = frame;
+                ys[j] = session->rollback_depth[frame % ULNET_MAX_SAMPLE_SIZE];
+            }
+            ImPlot::PlotBars("Depth", xs, ys, ULNET_MAX_SAMPLE_SIZE, 0.67);
+            ImPlot::EndPlot();
+        }
+    }
 
     int active_connections = 0;
     for (int p = 0; p < SAM2_TOTAL_PEERS; p++)
@@ -2333,6 +6438,14 @@ ULNET_LINKAGE void ulnet_imgui_show_session(ulnet_session_t *session) {
                 if (ImGui::CollapsingHeader("Reliable Protocol State", ImGuiTreeNodeFlags_DefaultOpen)) {
                     ImGui::Text("Transmit: Next Seq=%u, Greatest Acked=%u", session->reliable_tx_next_seq[p], session->reliable_tx_head[p]);
                     ImGui::Text("Receive: Greatest Seq=%u", session->reliable_rx_head[p]);
+                    ImGui::Text("RTT: Last=%.1f ms, Smoothed=%.1f ms, Variance=%.1f ms", session->rtt_sample_usec[p] / 1000.0,
+                        session->rtt_smoothed_usec[p] / 1000.0, session->rtt_variance_usec[p] / 1000.0);
+                    ImGui::Text("RTO: %.1f ms (backoff %d), Retransmits=%" PRId64, ulnet__reliable_rto_usec(session, p) / 1000.0,
+                        session->reliable_rto_backoff[p], session->reliable_retransmit_count);
+                    ImGui::Text("Input Inter-arrival: %.2f ms, Jitter=%.2f ms", session->input_interarrival_usec[p] / 1000.0,
+                        session->input_jitter_usec[p] / 1000.0);
+                    ImGui::Text("Frame Advantage: Ours=%.2f ms, Theirs=%.2f ms", session->frame_advantage_usec[p] / 1000.0,
+                        session->peer_frame_advantage_usec[p] / 1000.0);
                 }
 
                 if (ImGui::CollapsingHeader("Recent Packets", ImGuiTreeNodeFlags_DefaultOpen)) {
@@ -2395,7 +6508,8 @@ void ulnet_imgui_show_recent_packets_table(ulnet_session_t *session, int p) {
         bool is_reliable = (packet_data[0] & ULNET_CHANNEL_MASK) == ULNET_CHANNEL_RELIABLE;
         bool is_reliable_ack = is_reliable && (packet_data[0] & ULNET_RELIABLE_FLAG_ACK_ONLY);
 
-        uint8_t *payload_start = ((ulnet_reliable_packet_t *)packet_data)->payload;
+        int header_size = ulnet__reliable_header_size(packet_data[0]);
+        uint8_t *payload_start = packet_data + header_size;
         uint8_t channel = payload_start[0] & ULNET_CHANNEL_MASK;
 
         const struct { uint8_t ch; const char *name; ImVec4 color; } channels[] = {
@@ -2425,8 +6539,10 @@ void ulnet_imgui_show_recent_packets_table(ulnet_session_t *session, int p) {
             memcpy(&seq, &packet_data[1], sizeof(seq));
             uint16_t diff = (session->reliable_tx_head[p] - seq) & 0xFFFF;
 
-            const char *status = ulnet__sequence_greater_than(seq, session->reliable_tx_head[p]) ? "Unacked" : "Acked";
-            ImVec4 statusColor = strcmp(status, "Acked") == 0 ? ImVec4(0.3f, 1.0f, 0.3f, 1.0f) :
+            int index = seq % ULNET_RELIABLE_ACK_BUFFER_SIZE;
+            const char *status = !ulnet__sequence_greater_than(seq, session->reliable_tx_head[p]) ? "Acked" :
+                                 (session->reliable_tx_sacked[p][index / 64] & (1ULL << (index % 64))) ? "SACKed" : "Unacked";
+            ImVec4 statusColor = strcmp(status, "Unacked") != 0 ? ImVec4(0.3f, 1.0f, 0.3f, 1.0f) :
                                 ImVec4(1.0f, 0.3f, 0.3f, 1.0f);
             ImGui::TextColored(statusColor, "%s", status);
         } else if (is_reliable_ack) {
@@ -2454,18 +6570,17 @@ void ulnet_imgui_show_recent_packets_table(ulnet_session_t *session, int p) {
         }
 
         // Channel-specific details
-        size_t payload_size = packet_size - sizeof(ulnet_reliable_packet_t);
+        size_t payload_size = packet_size - header_size;
         if (pos > 0) pos += snprintf(details + pos, sizeof(details) - pos, " | ");
 
         if (channel == ULNET_CHANNEL_INPUT && payload_size > sizeof(ulnet_state_packet_t)) {
             int64_t frame = 0;
-            rle8_decode(&payload_start[sizeof(ulnet_state_packet_t)],
-                        payload_size - sizeof(ulnet_state_packet_t), (uint8_t *)&frame, sizeof(frame));
+            ulnet__get_frame_from_packet(session, payload_start, payload_size, &frame);
             pos += snprintf(details + pos, sizeof(details) - pos, "Frame %" PRId64, frame);
         } else if (channel == ULNET_CHANNEL_SAVESTATE_TRANSFER && payload_size >= sizeof(ulnet_save_state_packet_header_t)) {
             ulnet_save_state_packet_header_t header;
             memcpy(&header, payload_start, sizeof(header));
-            if (header.channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239) {
+            if (header.channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_MAX) {
                 pos += snprintf(details + pos, sizeof(details) - pos,
                                 (header.channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0) ?
                                 "Init: %d groups" : "Group %d, Block %d",